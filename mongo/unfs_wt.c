@@ -294,6 +294,8 @@ static int unfs_wt_fs_open(WT_FILE_SYSTEM* fs, WT_SESSION *ses,
         ERROR("%s (%s)", path, strerror(fd.error));
         return fd.error;
     }
+    if (type == WT_FS_OPEN_FILE_TYPE_LOG)
+        fd.ioprio = UNFS_IOPRIO_LOG;
 
     unfs_wt_file_handle_t* uwfh = calloc(1, sizeof(unfs_wt_file_handle_t));
     (void) pthread_spin_init(&uwfh->lock, PTHREAD_PROCESS_SHARED);
@@ -519,6 +521,40 @@ int unfs_wt_init(WT_CONNECTION *conn, WT_CONFIG_ARG *config)
             setenv("UNFS_QCOUNT", val.str, 1);
         } else if (strncmp("qdepth", key.str, key.len) == 0) {
             setenv("UNFS_QDEPTH", val.str, 1);
+        } else if (strncmp("temp", key.str, key.len) == 0) {
+            char* temp = strndup(val.str, val.len);
+            setenv("UNFS_TEMP", temp, 1);
+            free(temp);
+        } else if (strncmp("tempmem", key.str, key.len) == 0) {
+            char* tempmem = strndup(val.str, val.len);
+            setenv("UNFS_TEMPMEM", tempmem, 1);
+            free(tempmem);
+        } else if (strncmp("offload", key.str, key.len) == 0) {
+            char* offload = strndup(val.str, val.len);
+            setenv("UNFS_OFFLOAD", offload, 1);
+            free(offload);
+        } else if (strncmp("sched", key.str, key.len) == 0) {
+            char* sched = strndup(val.str, val.len);
+            setenv("UNFS_SCHED", sched, 1);
+            free(sched);
+        } else if (strncmp("volume", key.str, key.len) == 0) {
+            char* volume = strndup(val.str, val.len);
+            setenv("UNFS_VOLUME", volume, 1);
+            free(volume);
+        } else if (strncmp("shards", key.str, key.len) == 0) {
+            char* shards = strndup(val.str, val.len);
+            setenv("UNFS_SHARDS", shards, 1);
+            free(shards);
+        } else if (strncmp("replica", key.str, key.len) == 0) {
+            char* replica = strndup(val.str, val.len);
+            setenv("UNFS_REPLICA", replica, 1);
+            free(replica);
+        } else if (strncmp("prewarm", key.str, key.len) == 0) {
+            char* prewarm = strndup(val.str, val.len);
+            setenv("UNFS_PREWARM", prewarm, 1);
+            free(prewarm);
+        } else if (strncmp("bulk", key.str, key.len) == 0) {
+            setenv("UNFS_BULK", val.val ? "1" : "0", 1);
         } else {
             ERROR("unknown config: %s", key.str);
             return EINVAL;
@@ -549,8 +585,9 @@ int unfs_wt_init(WT_CONNECTION *conn, WT_CONFIG_ARG *config)
     char homedir[UNFS_MAXPATH] = "/";
     unfs_wt_path(homedir, sizeof(homedir), "/", "", home);
 
-    // open the UNFS filesystem
-    unfs_fs_t fs = unfs_open(device);
+    // open the UNFS filesystem (or sub-volume)
+    char* volume = getenv("UNFS_VOLUME");
+    unfs_fs_t fs = volume ? unfs_open_vol(device, volume) : unfs_open(device);
     if (!fs) {
         ERROR("unfs_open %s failed", device);
         return ENODEV;
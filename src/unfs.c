@@ -39,11 +39,15 @@
 #include <stddef.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
 #include <search.h>
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "unfs.h"
 #include "unfs_log.h"
@@ -52,9 +56,92 @@
 /// Convert byte length into page count
 #define PAGECOUNT(len)      (((len) + UNFS_PAGESIZE - 1) >> UNFS_PAGESHIFT)
 
+/// In-memory node size (excluding name)
+#define NODESIZE(isdir)     ((isdir) ? sizeof(unfs_node_t) : \
+                             sizeof(unfs_node_t) + UNFS_MAXDS * sizeof(unfs_ds_t))
+
+/// Temporary file data is in memory
+#define TEMP_MEM            1
+
+/// Temporary file data is on unpersisted device pages
+#define TEMP_SPILL          2
+
+/// Temporary file initial memory allocation size
+#define TEMP_MEMMIN         (64 * 1024)
+
+/// Default temporary files memory limit
+#define TEMP_MEMMAX         (256UL << 20)
+
+/// Default number of offload/recall streaming threads
+#define OFFLOAD_THREADS     4
+
+/// Offload/recall streaming chunk page count
+#define OFFLOAD_CHUNKPC     256
+
+/// Default max size of the ranges to prewarm (in MB)
+#define PREWARM_MAXMB       1024
+
+/// Default number of prewarm threads
+#define PREWARM_THREADS     8
+
+/// Initial file change chunk size shift (1MB)
+#define CHG_SHIFT           20
+
+/// Deleted stack max size of an UNFS-1.0 header
+#define DELMAX0 ((sizeof(unfs_header_t) - offsetof(unfs_header_t, delstack)) / sizeof(u64))
+
+/// Deleted stack max size (up to the header extension)
+#define DELMAX  ((offsetof(unfs_header_t, tierpage) - offsetof(unfs_header_t, delstack)) / sizeof(u64))
+
+/// Default number of format bitmap write threads
+#define FORMAT_THREADS      8
+
+/// Format bitmap write chunk size in pages
+#define FORMAT_CHUNKPC      1024
+
 /// Check for filesystem context error
 #define FS_CHECK(fs)        ((fs >> 16) != (unfs.fsid >> 16))
 
+/// Sub-volume id of a filesystem handle (0 for the whole filesystem)
+#define FS_VOL(fs)          (((fs) >> 8) & 0xff)
+
+/// Sub-volume root directories parent
+#define VOL_DIR             "/.unfsvol"
+
+/// Max number of sub-volumes open
+#define VOL_MAX             255
+
+#ifdef UNFS_NOLOCK
+/*
+ * Single-threaded build: the application calls UNFS from one thread only,
+ * so the filesystem, file and transaction locks are compiled out and the
+ * hot path counters are updated without atomic instructions.
+ */
+#define FS_WRLOCK()         ((void)0)
+#define FS_RDLOCK()         ((void)0)
+#define FS_TRYLOCK()        ({ 0; })
+#define FS_UNLOCK()         ((void)0)
+#define FILE_WRLOCK(fp)     ((void)0)
+#define FILE_TRYLOCK(fp)    ({ 0; })
+#define FILE_RDLOCK(fp)     ((void)0)
+#define FILE_UNLOCK(fp)     ((void)0)
+#define TXN_RDLOCK()        ((void)0)
+#define TXN_WRLOCK()        ((void)0)
+#define TXN_UNLOCK()        ((void)0)
+#define TXN_JLOCK()         ((void)0)
+#define TXN_JUNLOCK()       ((void)0)
+#define VOL_WRLOCK(v)       ((void)0)
+#define VOL_RDLOCK(v)       ((void)0)
+#define VOL_UNLOCK(v)       ((void)0)
+#define META_LOCK()         ((void)0)
+#define META_UNLOCK()       ((void)0)
+#define ATOMIC_ADD(p, v)    (*(p) += (v))
+#define ATOMIC_SUB(p, v)    (*(p) -= (v))
+#define NOLOCK              1
+#else
+/// Single-threaded build flag
+#define NOLOCK              0
+
 /// Filesystem write lock
 #define FS_WRLOCK()         pthread_rwlock_wrlock(&unfs.lock)
 
@@ -68,13 +155,143 @@
 #define FS_UNLOCK()         pthread_rwlock_unlock(&unfs.lock)
 
 /// File write lock
-#define FILE_WRLOCK(fp)     pthread_rwlock_wrlock(&fp->lock)
+#define FILE_WRLOCK(fp)     unfs_file_wrlock(fp)
+
+/// File try write lock
+#define FILE_TRYLOCK(fp)    unfs_file_trylock(fp)
 
 /// File read lock
-#define FILE_RDLOCK(fp)     pthread_rwlock_rdlock(&fp->lock)
+#define FILE_RDLOCK(fp)     unfs_file_rdlock(fp)
 
 /// File unlock
-#define FILE_UNLOCK(fp)     pthread_rwlock_unlock(&fp->lock)
+#define FILE_UNLOCK(fp)     unfs_file_unlock(fp)
+
+/// Transaction state read lock
+#define TXN_RDLOCK()        pthread_rwlock_rdlock(&unfs.txnlock)
+
+/// Transaction state write lock
+#define TXN_WRLOCK()        pthread_rwlock_wrlock(&unfs.txnlock)
+
+/// Transaction state unlock
+#define TXN_UNLOCK()        pthread_rwlock_unlock(&unfs.txnlock)
+
+/// Transaction entry list lock
+#define TXN_JLOCK()         pthread_mutex_lock(&unfs.txnjlock)
+
+/// Transaction entry list unlock
+#define TXN_JUNLOCK()       pthread_mutex_unlock(&unfs.txnjlock)
+
+/// Sub-volume namespace write lock (see unfs_ns_lock)
+#define VOL_WRLOCK(v)       pthread_rwlock_wrlock(&unfs.vollock[v])
+
+/// Sub-volume namespace read lock
+#define VOL_RDLOCK(v)       pthread_rwlock_rdlock(&unfs.vollock[v])
+
+/// Sub-volume namespace unlock
+#define VOL_UNLOCK(v)       pthread_rwlock_unlock(&unfs.vollock[v])
+
+/// Header and bitmap lock (for namespace updates with FS_RDLOCK held)
+#define META_LOCK()         pthread_mutex_lock(&unfs.metalock)
+
+/// Header and bitmap unlock
+#define META_UNLOCK()       pthread_mutex_unlock(&unfs.metalock)
+
+/// Atomic add and fetch
+#define ATOMIC_ADD(p, v)    __sync_add_and_fetch(p, v)
+
+/// Atomic subtract and fetch
+#define ATOMIC_SUB(p, v)    __sync_sub_and_fetch(p, v)
+#endif
+
+/// Number of reader slots of the biased file locks (power of 2)
+#define BRLOCK_SLOTS        1024
+
+/// Reader bias inhibit time as a multiple of the last revocation time
+#define BRLOCK_INHIBIT      9
+
+#ifdef UNFS_NOLOCK
+#define FILE_SEQ_BEGIN(fp)  ((void)0)
+#define FILE_SEQ_END(fp)    ((void)0)
+#define FILE_SEQ_READ(fp)   0
+#define FILE_SEQ_RETRY(fp, s) ((void)(s), 0)
+#define FILE_WSEQ_BEGIN(fp) ((void)0)
+#define FILE_WSEQ_END(fp)   ((void)0)
+#else
+/// Begin updating a file size and segment map (with file write lock held)
+#define FILE_SEQ_BEGIN(fp)  do { \
+                                __atomic_store_n(&(fp)->seq, (fp)->seq + 1, __ATOMIC_RELAXED); \
+                                __atomic_thread_fence(__ATOMIC_RELEASE); \
+                            } while (0)
+
+/// End updating a file size and segment map
+#define FILE_SEQ_END(fp)    __atomic_store_n(&(fp)->seq, (fp)->seq + 1, __ATOMIC_RELEASE)
+
+/// Get the file sequence number to begin an optimistic read (odd if updating)
+#define FILE_SEQ_READ(fp)   __atomic_load_n(&(fp)->seq, __ATOMIC_ACQUIRE)
+
+/// Check if an optimistic read (since sequence number s) must be retried
+#define FILE_SEQ_RETRY(fp, s) (__atomic_thread_fence(__ATOMIC_ACQUIRE), \
+                               __atomic_load_n(&(fp)->seq, __ATOMIC_RELAXED) != (s))
+
+/// Begin writing file data in place (with file write lock held), so a data
+/// mover copying the file pages without the file lock can detect the write
+#define FILE_WSEQ_BEGIN(fp) do { \
+                                __atomic_store_n(&(fp)->wseq, (fp)->wseq + 1, __ATOMIC_RELAXED); \
+                                __atomic_thread_fence(__ATOMIC_RELEASE); \
+                            } while (0)
+
+/// End writing file data in place
+#define FILE_WSEQ_END(fp)   __atomic_store_n(&(fp)->wseq, (fp)->wseq + 1, __ATOMIC_RELEASE)
+#endif
+
+/// Max number of optimistic read attempts before taking the file lock
+#define FILE_SEQ_TRIES      4
+
+/// Max number of data segments read by an optimistic read
+#define FILE_SEQ_MAXDS      16
+
+/// Max number of shards
+#define SHARD_MAX           256
+
+/// Tree id of a shard (the trees of the sub-volumes come first)
+#define SHARD_TREE(s)       (VOL_MAX + 1 + (s))
+
+/// Number of tree ids (main tree, sub-volumes and shards)
+#define TREE_MAX            SHARD_TREE(SHARD_MAX)
+
+/// Last tree id in use
+#define TREE_LAST           (unfs.shards ? SHARD_TREE(unfs.shards - 1) : unfs.volcount)
+
+/// Next tree id in use after tree t
+#define TREE_NEXT(t)        ((t) == unfs.volcount ? SHARD_TREE(0) : (t) + 1)
+
+/// Max number of pages preallocated for a growing file in bulk mode
+#define BULK_MAXPC          8192
+
+/// Write flag of unfs_node_rw for a bulk write extending the file (the
+/// rest of its partial last page is beyond the file size so it is not read)
+#define RW_EXTEND           2
+
+/// Set the thread I/O priority class for a scope (if specified)
+#define IOPRIO_ENTER(p)     int ioprio = (p) ? unfs_sched_class(p) : -1
+
+/// Restore the thread I/O priority class upon leaving the scope
+#define IOPRIO_LEAVE()      if (ioprio >= 0) unfs_sched_class(ioprio)
+
+#ifdef UNFS_STATIC
+/// Device operation statically bound to the compiled in backend
+#define DEV(op)             unfs_dev_##op
+#else
+/// Device operation dispatched through the device function table
+#define DEV(op)             unfs.dev.op
+#endif
+
+/// Check for device direct load/store support
+#if defined(UNFS_STATIC_PMEM)
+#define DEV_DIRECT()        1
+#elif !defined(UNFS_STATIC)
+#define DEV_DIRECT()        (unfs.dev.store != NULL)
+#endif
 
 
 /// Tree node as defined in tsearch.c (for custom tree walk function)
@@ -85,24 +302,183 @@ struct tnode {
     unsigned int            red:1;          ///< tsearch red/black flag
 };
 
+/// Tree node left child (newer glibc keeps the red flag in the pointer bit 0)
+#define TNODE_LEFT(n)       ((struct tnode*)((uintptr_t)(n)->left & ~1UL))
+
+/// Tree node right child
+#define TNODE_RIGHT(n)      ((struct tnode*)((uintptr_t)(n)->right & ~1UL))
+
+/// Path name hash initial value (FNV-1a)
+#define PATH_HASH_INIT      2166136261U
+
+/// Path name hash update with the next character
+#define PATH_HASH(h, c)     (((h) ^ (u8)(c)) * 16777619U)
+
+/// Parsed path name (the name is not copied and may not be terminated)
+typedef struct {
+    const char*             name;           ///< path name
+    u32                     len;            ///< path name length
+    u32                     hash;           ///< path name hash
+    u32                     plen;           ///< parent path name length
+    u32                     phash;          ///< parent path name hash
+} unfs_path_t;
+
+/// Transaction file entry image
+typedef struct {
+    u64                     pageid;         ///< entry page address
+    void*                   image;          ///< entry page image
+} unfs_txn_entry_t;
+
 /// Filesystem management structure
 typedef struct {
     unfs_header_t*          header;         ///< filesystem header
     u64                     mapnext;        ///< next bitmap free index
+    u64                     mapnextfast;    ///< next fast tier free index
+    int                     shards;         ///< number of shards
+    u64                     shardnext[SHARD_MAX]; ///< next shard free index
     u64                     mapsynclo;      ///< map sync low page address
     u64                     mapsynchi;      ///< map sync high page address
     u64                     mapsyncfdlo;    ///< map sync low fd address
     u64                     mapsyncfdhi;    ///< map sync high fd address
     u64                     fsid;           ///< filesystem id to check
     int                     open;           ///< filesystem open count
-    void*                   root;           ///< filesystem tree
+    void*                   root[TREE_MAX]; ///< filesystem trees by sub-volume
+                                            ///  or shard id (0 for the rest)
     pthread_rwlock_t        lock;           ///< filesystem tree access lock
+    pthread_mutex_t         metalock;       ///< header and bitmap lock
     unfs_device_io_t        dev;            ///< device implmentation
+    unfs_node_t*            templist;       ///< temporary file list
+    u64                     tempmem;        ///< temporary files memory size
+    u64                     tempspill;      ///< temporary files device pages
+    pthread_t               tierthread;     ///< tier migrator thread
+    int                     tierstop;       ///< tier migrator stop flag
+    pthread_mutex_t         tierlock;       ///< tier migrator wait lock
+    pthread_cond_t          tiercond;       ///< tier migrator wait condition
+    pthread_t               prewarmthread;  ///< prewarm job thread
+    int                     prewarmstop;    ///< prewarm job stop flag
+    u64                     offloadid;      ///< last offloaded object id
+    pthread_rwlock_t        txnlock;        ///< transaction state lock
+    pthread_mutex_t         txnjlock;       ///< transaction entry list lock
+    int                     txn;            ///< transaction nesting count
+    unfs_txn_entry_t*       txnentry;       ///< transaction entry images
+    u32                     txnentrycount;  ///< number of entry images
+    u32                     txnentrymax;    ///< entry image array size
+    unfs_ds_t*              txnfree;        ///< pages freed in transaction
+                                            ///  (page count 0 for an entry)
+    u32                     txnfreecount;   ///< number of freed ranges
+    u32                     txnfreemax;     ///< freed range array size
+    u64                     txnpage;        ///< committing journal page
+    u64                     txnpc;          ///< committing journal page count
+    u64*                    delover;        ///< UNFS-1.0 deleted stack entries
+                                            ///  overlaid by the header extension
+    u32                     delovercount;   ///< number of overlaid entries
+    u64                     mapgen;         ///< last segment map generation
+    int                     rdonly;         ///< read-only mount
+    int                     entrysync;      ///< entry written since header sync
+    int                     bulk;           ///< bulk load mode
+    u64                     bulkresv;       ///< bulk preallocated page count
+    int                     brlock;         ///< reader biased file locks
+    char*                   vol[VOL_MAX + 1]; ///< sub-volume roots by id
+    u32                     vollen[VOL_MAX + 1]; ///< sub-volume root lengths
+    pthread_rwlock_t        vollock[TREE_MAX]; ///< sub-volume and shard
+                                            ///  namespace locks
+    u32                     volcount;       ///< number of sub-volume ids
+    u32                     chgactive[2];   ///< file updates in progress by
+                                            ///  change generation parity
+    pthread_mutex_t         chglock;        ///< change generation lock
+    int                     replcopy;       ///< replica needs a full copy
+    pthread_t               replthread;     ///< replica copy thread
+    int                     replstop;       ///< replica copy stop flag
 } unfs_filesystem_t;
 
+/// Biased file lock reader slot (one per cache line)
+typedef struct {
+    unfs_node_t*            nodep;          ///< read locked file node
+    u8                      pad[64 - sizeof(void*)];
+} unfs_brslot_t;
+
+/// Temporary file configuration
+typedef struct {
+    char**                  patterns;       ///< file name patterns
+    int                     count;          ///< number of patterns
+    u64                     memmax;         ///< max memory size
+} unfs_temp_t;
+
+/// Offload configuration
+typedef struct {
+    char*                   dir;            ///< host object directory
+    int                     threads;        ///< streaming thread count
+} unfs_offload_t;
+
+/// Offload/recall streaming context
+typedef struct {
+    unfs_node_t*            nodep;          ///< file node
+    int                     hostfd;         ///< host object file descriptor
+    int                     wflag;          ///< device to host flag
+    int                     ioprio;         ///< I/O priority class
+    u64                     pagecount;      ///< file page count
+    u64                     next;           ///< next file page to stream
+    int                     error;          ///< error code
+    unfs_export_fn          fn;             ///< export function (if no hostfd)
+    void*                   arg;            ///< export function argument
+} unfs_stream_t;
+
+/// Prewarm configuration
+typedef struct {
+    char*                   name;           ///< access profile file name
+    u64                     maxsize;        ///< max size of ranges to prewarm
+    int                     threads;        ///< prewarm thread count
+} unfs_prewarm_t;
+
+/// Prewarm file range
+typedef struct {
+    char*                   name;           ///< file name
+    u64                     offset;         ///< range offset
+    u64                     len;            ///< range length
+    u32                     heat;           ///< range heat count
+} unfs_prewarm_range_t;
+
+/// Prewarm job context
+typedef struct {
+    unfs_fs_t               fs;             ///< filesystem handle
+    unfs_prewarm_range_t*   list;           ///< ranges to prewarm
+    u64                     count;          ///< number of ranges
+    u64                     next;           ///< next range to prewarm
+} unfs_prewarm_job_t;
+
+/// Format bitmap write job context
+typedef struct {
+    u64                     next;           ///< next bitmap page to write
+    u64                     end;            ///< end bitmap page
+    int                     skipzero;       ///< skip all zero chunks
+    u64                     written;        ///< number of pages written
+} unfs_format_job_t;
+
 /// UNFS static data object
 static unfs_filesystem_t    unfs;
 
+/// UNFS temporary file configuration
+static unfs_temp_t          unfstemp = { .memmax = TEMP_MEMMAX };
+
+/// UNFS offload configuration
+static unfs_offload_t       unfsoffload = { .threads = OFFLOAD_THREADS };
+
+/// UNFS prewarm configuration
+static unfs_prewarm_t       unfsprewarm = { .maxsize = (u64)PREWARM_MAXMB << 20,
+                                            .threads = PREWARM_THREADS };
+
+/// UNFS biased file lock reader slots
+static unfs_brslot_t        unfsbrslot[BRLOCK_SLOTS];
+
+/// Biased file lock reader slot held by this thread (index + 1)
+static __thread u32         unfsbrheld;
+
+/// Biased file lock reader slot hash seed of this thread
+static __thread u32         unfsbrseed;
+
+/// Last biased file lock reader slot hash seed assigned
+static u32                  unfsbrseeds;
+
 /// UNFS initialize/cleanup lock
 static pthread_mutex_t      unfslock = PTHREAD_MUTEX_INITIALIZER;
 
@@ -127,6 +503,10 @@ void unfs_print_header(unfs_header_t* hp)
     printf("Del count:   %#x\n",  hp->delcount);
     printf("Del max:     %#x\n",  hp->delmax);
     printf("Map size:    %#lx\n", hp->mapsize);
+    if (hp->tierpage)
+        printf("Tier page:   %#lx\n", hp->tierpage);
+    if (hp->txnpage)
+        printf("Journal:     %#lx (%#lx pages)\n", hp->txnpage, hp->txncount);
 }
 
 /**
@@ -139,12 +519,12 @@ void unfs_print_tree(struct tnode* root)
     unfs_node_t* nodep = (unfs_node_t*)(root->key);
     char* type = nodep->isdir ? "DIR" : "FILE";
 
-    if (root->left == NULL && root->right == NULL) {
+    if (TNODE_LEFT(root) == NULL && TNODE_RIGHT(root) == NULL) {
         printf("%s: %s %#lx\n", type, nodep->name, nodep->pageid);
     } else {
-        if (root->left != NULL) unfs_print_tree(root->left);
+        if (TNODE_LEFT(root) != NULL) unfs_print_tree(TNODE_LEFT(root));
         printf("%s: %s %#lx\n", type, nodep->name, nodep->pageid);
-        if (root->right != NULL) unfs_print_tree(root->right);
+        if (TNODE_RIGHT(root) != NULL) unfs_print_tree(TNODE_RIGHT(root));
     }
 }
 
@@ -183,20 +563,20 @@ static int unfs_map_check(u64 pageid, u32 pagecount)
 }
 
 /**
- * Allocate a contiguous number of free disk pages.
+ * Allocate a contiguous number of free disk pages within a bitmap range.
  * @param   pagecount   number of pages
+ * @param   i           start bitmap word index
+ * @param   mapend      end bitmap word index
  * @return  the page address or 0 if out of disk space.
  */
-static u64 unfs_map_alloc(u32 pagecount)
+static u64 unfs_map_scan(u32 pagecount, u64 i, u64 mapend)
 {
-    DEBUG_FN("%u", pagecount);
+    DEBUG_FN("%u %#lx-%#lx", pagecount, i, mapend);
 
     u64 mapidx, pageid;
     int mapbit;
 
-    u64 i = unfs.mapnext;
     u64* map = (u64*)unfs.header->map + i;
-    u64 mapend = unfs.header->mapsize - (unfs.header->fdcount >> 5) - 1;
 
     if (pagecount < 64) {
         // check for contiguous free bits within a word
@@ -265,6 +645,156 @@ found:
     return pageid;
 }
 
+/**
+ * Get the bitmap word range of an allocation shard, where the shards
+ * divide the map range evenly.
+ * @param   shard       shard index
+ * @param   lo          map range start word index
+ * @param   hi          map range end word index
+ * @param   rlo         shard start word index
+ * @param   rhi         shard end word index
+ */
+static void unfs_shard_range(int shard, u64 lo, u64 hi, u64* rlo, u64* rhi)
+{
+    u64 size = (hi - lo) / unfs.shards;
+    *rlo = lo + size * shard;
+    *rhi = (shard == unfs.shards - 1) ? hi : *rlo + size;
+}
+
+/**
+ * Allocate a contiguous number of free disk pages within an allocation
+ * shard, starting from its first non-full bitmap word.
+ * @param   pagecount   number of pages
+ * @param   shard       shard index
+ * @param   lo          map range start word index
+ * @param   hi          map range end word index
+ * @return  the page address or 0 if out of shard space.
+ */
+static u64 unfs_shard_scan(u32 pagecount, int shard, u64 lo, u64 hi)
+{
+    u64 rlo, rhi;
+    unfs_shard_range(shard, lo, hi, &rlo, &rhi);
+    u64* map = (u64*)unfs.header->map;
+    u64 i = unfs.shardnext[shard];
+    if (i < rlo) i = rlo;
+    while (i < rhi && map[i] == -1L) i++;
+    unfs.shardnext[shard] = i;
+    return unfs_map_scan(pagecount, i, rhi);
+}
+
+/**
+ * Allocate a contiguous number of free disk pages from the specified tier.
+ * With allocation shards (UNFS_SHARDS), the pages are allocated from the
+ * specified shard of the (fast tier) map range if it has room.
+ * @param   pagecount   number of pages
+ * @param   fast        fast tier flag (ignored if not tiered)
+ * @param   shard       shard index (-1 if none)
+ * @return  the page address or 0 if out of tier space.
+ */
+static u64 unfs_map_alloc_tier(u32 pagecount, int fast, int shard)
+{
+    u64 mapend = unfs.header->mapsize - (unfs.header->fdcount >> 5) - 1;
+    u64 tierw = 0;
+    if (unfs.header->tierpage)
+        tierw = (unfs.header->tierpage - unfs.header->datapage) >> 6;
+    if (shard >= 0 && fast && tierw < mapend) {
+        u64 pageid = unfs_shard_scan(pagecount, shard, tierw, mapend);
+        if (pageid) return pageid;
+    }
+    if (!unfs.header->tierpage)
+        return unfs_map_scan(pagecount, unfs.mapnext, mapend);
+    if (fast) return unfs_map_scan(pagecount, unfs.mapnextfast, mapend);
+    return unfs_map_scan(pagecount, unfs.mapnext, tierw);
+}
+
+static void unfs_map_release(u64 pageid, u32 pagecount);
+
+/**
+ * Get the device relative page address (of the tier device on a tiered
+ * device as laid out by the raw device implementation).
+ * @param   pageid      page address
+ * @return  the device page address.
+ */
+static u64 unfs_map_devpage(u64 pageid)
+{
+    u64 datapage = unfs.header->datapage;
+    u64 tierpage = unfs.header->tierpage;
+    if (!tierpage || pageid < datapage) return pageid;
+    if (pageid < tierpage) return pageid - datapage;
+    return pageid - tierpage + datapage;
+}
+
+/**
+ * Allocate a contiguous number of free disk pages from the specified tier
+ * aligned to the device geometry if the extent is large enough.  An aligned
+ * extent is carved out of a larger allocation with the excess released.
+ * @param   pagecount   number of pages
+ * @param   fast        fast tier flag (ignored if not tiered)
+ * @param   shard       shard index (-1 if none)
+ * @return  the page address or 0 if out of tier space.
+ */
+static u64 unfs_map_alloc_aligned(u32 pagecount, int fast, int shard)
+{
+    u32 align = 0;
+    if (unfs.dev.iostripe > 1 && pagecount >= unfs.dev.iostripe)
+        align = unfs.dev.iostripe;
+    else if (unfs.dev.ioalign > 1 && pagecount >= unfs.dev.ioalign)
+        align = unfs.dev.ioalign;
+
+    if (align) {
+        u32 pc = pagecount + align - 1;
+        u64 pageid = unfs_map_alloc_tier(pc, fast, shard);
+        if (pageid) {
+            u32 head = (align - unfs_map_devpage(pageid) % align) % align;
+            if (head) unfs_map_release(pageid, head);
+            if (pc - head > pagecount)
+                unfs_map_release(pageid + head + pagecount, pc - head - pagecount);
+            return pageid + head;
+        }
+    }
+    return unfs_map_alloc_tier(pagecount, fast, shard);
+}
+
+static int unfs_shard_of(const char* name, u32 len);
+
+/**
+ * Allocate a contiguous number of free disk pages, preferably from the
+ * fast tier on a tiered device, and from the allocation region of the file
+ * shard (or of its directory if not sharded, i.e. in a sub-volume) so files
+ * of different shards or directories grow in separate regions.
+ * @param   pagecount   number of pages
+ * @param   nodep       file node to allocate for (NULL if none)
+ * @return  the page address or 0 if out of disk space.
+ */
+static u64 unfs_map_alloc(u32 pagecount, unfs_node_t* nodep)
+{
+    int shard = -1;
+    if (unfs.shards && nodep && nodep->parent) {
+        shard = unfs_shard_of(nodep->name, nodep->namelen);
+        if (shard) shard -= SHARD_TREE(0);
+        else shard = nodep->parent->namehash % unfs.shards;
+    }
+    u64 pageid = unfs_map_alloc_aligned(pagecount, 1, shard);
+    if (!pageid && unfs.header->tierpage)
+        pageid = unfs_map_alloc_aligned(pagecount, 0, -1);
+    return pageid;
+}
+
+/**
+ * Record pages freed within a transaction to be released upon commit.
+ * @param   pageid      page address
+ * @param   pagecount   number of pages (0 for a file entry)
+ */
+static void unfs_txn_free(u64 pageid, u32 pagecount)
+{
+    if (unfs.txnfreecount == unfs.txnfreemax) {
+        unfs.txnfreemax = unfs.txnfreemax ? unfs.txnfreemax * 2 : 64;
+        unfs.txnfree = realloc(unfs.txnfree, unfs.txnfreemax * sizeof(unfs_ds_t));
+    }
+    unfs.txnfree[unfs.txnfreecount].pageid = pageid;
+    unfs.txnfree[unfs.txnfreecount++].pagecount = pagecount;
+}
+
 /**
  * Free up a contiguous number of disk pages.
  * @param   pageid      page address
@@ -273,10 +803,40 @@ found:
 static void unfs_map_free(u64 pageid, u32 pagecount)
 {
     DEBUG_FN("%#lx %u", pageid, pagecount);
+
+    // pages freed within a transaction are not reused until committed
+    if (unfs.txn) {
+        unfs_txn_free(pageid, pagecount);
+        return;
+    }
+    unfs_map_release(pageid, pagecount);
+}
+
+/**
+ * Clear the map bits of a contiguous number of disk pages.
+ * @param   pageid      page address
+ * @param   pagecount   number of pages
+ */
+static void unfs_map_release(u64 pageid, u32 pagecount)
+{
     u64 pa = pageid - unfs.header->datapage;
     u64 i = pa >> 6;
     u64* map = (u64*)unfs.header->map + i;
-    if (unfs.mapnext > i) unfs.mapnext = i;
+    if (pageid >= unfs.header->tierpage && unfs.header->tierpage) {
+        if (unfs.mapnextfast > i) unfs.mapnextfast = i;
+    } else if (unfs.mapnext > i) {
+        unfs.mapnext = i;
+    }
+    if (unfs.shards && pageid >= unfs.header->tierpage) {
+        u64 lo = 0;
+        u64 hi = unfs.header->mapsize - (unfs.header->fdcount >> 5) - 1;
+        if (unfs.header->tierpage)
+            lo = (unfs.header->tierpage - unfs.header->datapage) >> 6;
+        u64 size = (hi - lo) / unfs.shards;
+        u64 shard = size ? (i - lo) / size : unfs.shards - 1;
+        if (shard >= unfs.shards) shard = unfs.shards - 1;
+        if (unfs.shardnext[shard] > i) unfs.shardnext[shard] = i;
+    }
 
     // a file segment may be allocated contiguously by multiple unfs_map_alloc
     // so the free scheme is not exactly the same as allocation
@@ -318,1238 +878,4291 @@ static void unfs_map_free(u64 pageid, u32 pagecount)
     if (unfs.mapsynchi < pageid) unfs.mapsynchi = pageid;
 }
 
+/**
+ * Validate, hash and split a canonical path name in one pass.
+ * The hash of the parent path is taken as the name is scanned, so the
+ * parent can be looked up without copying its name.
+ * @param   name        canonical name
+ * @param   pp          parsed path
+ * @return  0 if ok else EINVAL.
+ */
+static int unfs_path_parse(const char* name, unfs_path_t* pp)
+{
+    if (name[0] != '/') return EINVAL;
+    u32 hash = PATH_HASH(PATH_HASH_INIT, '/');
+    pp->plen = 1;
+    pp->phash = hash;
+
+    const char* s;
+    for (s = name + 1; *s; s++) {
+        if (!isprint(*s)) return EINVAL;
+        if (*s == '/') {
+            pp->plen = s - name;
+            pp->phash = hash;
+        }
+        hash = PATH_HASH(hash, *s);
+    }
+    u32 len = s - name;
+    if (len >= UNFS_MAXPATH || (len > 1 && s[-1] == '/')) return EINVAL;
+    if (len == 1) pp->plen = 0;
+    pp->name = name;
+    pp->len = len;
+    pp->hash = hash;
+    return 0;
+}
+
 /**
  * Check if the first path name is the child of the second path name.
  * @param   child       child path name
+ * @param   clen        child path name length
  * @param   parent      parent path name
+ * @param   plen        parent path name length
  * @return  1 if ok else 0.
  */
-static int unfs_child_of(const char* child, const char* parent)
+static int unfs_child_of(const char* child, u32 clen, const char* parent, u32 plen)
 {
-    int clen = strlen(child);
-    int plen = strlen(parent);
     if (clen <= plen) return 0;
-    if (plen == 1) return (strchr(child + 1, '/') == 0);
+    if (plen == 1) return (memchr(child + 1, '/', clen - 1) == 0);
     const char* s = child + plen;
-    return (*s == '/' && !strncmp(child, parent, plen) && !strchr(s + 1, '/'));
+    return (*s == '/' && !memcmp(child, parent, plen) &&
+            !memchr(s + 1, '/', clen - plen - 1));
 }
 
 /**
- * Tree function to compare two file nodes by name.
+ * Check if a node name is a descendant of a directory name.
+ * @param   child       child name
+ * @param   clen        child name length
+ * @param   parent      parent name
+ * @param   plen        parent name length
+ * @return  1 if descendant else 0.
+ */
+static int unfs_descendant_of(const char* child, u32 clen, const char* parent, u32 plen)
+{
+    if (clen <= plen) return 0;
+    if (plen == 1) return 1;
+    return (child[plen] == '/' && !memcmp(child, parent, plen));
+}
+
+/**
+ * Tree function to compare two file nodes by name hash, length, and name.
  * @param   f1          file 1
  * @param   f2          file 2
- * @return  strcmp of filenames result.
+ * @return  comparison result.
  */
 static int unfs_node_cmp_fn(const void* f1, const void* f2)
 {
-    return strcmp(((unfs_node_t*)f1)->name, ((unfs_node_t*)f2)->name);
+    const unfs_node_t* n1 = f1;
+    const unfs_node_t* n2 = f2;
+    if (n1->namehash != n2->namehash) return n1->namehash < n2->namehash ? -1 : 1;
+    if (n1->namelen != n2->namelen) return n1->namelen < n2->namelen ? -1 : 1;
+    return memcmp(n1->name, n2->name, n1->namelen);
 }
 
 /**
- * Allocate a new disk file entry.
- * @param   dir         directory flag
- * @return  page address for the new node or 0 if failed.
+ * Get the sub-volume whose tree holds a name, i.e. the registered
+ * sub-volume whose root is the name or its ancestor.
+ * @param   name        canonical name (not necessarily terminated)
+ * @param   len         name length
+ * @return  the sub-volume id or 0 if none.
  */
-static u64 unfs_node_alloc(int dir)
+static int unfs_vol_of(const char* name, u32 len)
 {
-    u64 fdpage;
-
-    // if deleted stack has entry then use it
-    // otherwise use the next fdpage entry
-    if (unfs.header->delcount) {
-        fdpage = unfs.header->delstack[--unfs.header->delcount];
-    } else {
-        // mark the page bits
-        fdpage = unfs.header->fdnextpage;
-        u64 pa = fdpage - unfs.header->datapage;
-        u64* map = (u64*)unfs.header->map + (pa >> 6);
-        u64 mask = (u64)(-1L << (64 - UNFS_FILEPC)) >> (pa & 63);
-        if ((*map & mask) != 0) {
-            ERROR("cannot allocate space for a new file/dir entry");
-            return 0;
-        }
-        *map |= mask;
-
-        unfs.header->pagefree -= UNFS_FILEPC;
-        unfs.header->fdnextpage -= UNFS_FILEPC;
-
-        if (unfs.mapsyncfdlo > fdpage) unfs.mapsyncfdlo = fdpage;
-        u64 fdhi = fdpage + UNFS_FILEPC;
-        if (unfs.mapsyncfdhi < fdhi) unfs.mapsyncfdhi = fdhi;
+    u32 count = __atomic_load_n(&unfs.volcount, __ATOMIC_ACQUIRE);
+    if (!count || len <= sizeof(VOL_DIR) || memcmp(name, VOL_DIR "/", sizeof(VOL_DIR)))
+        return 0;
+    u32 v;
+    for (v = 1; v <= count; v++) {
+        u32 n = unfs.vollen[v];
+        if (len >= n && (len == n || name[n] == '/') && !memcmp(name, unfs.vol[v], n))
+            return v;
     }
-
-    unfs.header->fdcount++;
-    if (dir) unfs.header->dircount++;
-
-    return fdpage;
+    return 0;
 }
 
 /**
- * Free a disk file entry.
- * @param   nodep       file node
- * @return  0 if done, else 1 indicates slot is vacant and pending.
+ * Get the shard whose tree holds a name (with UNFS_SHARDS), i.e. the shard
+ * of the name hash of its top-level directory (or the name itself if at
+ * the top level).  The sub-volume directory is not sharded.
+ * @param   name        canonical name (not necessarily terminated)
+ * @param   len         name length
+ * @return  the shard tree id or 0 if none.
  */
-static int unfs_node_free(unfs_node_t* nodep)
+static int unfs_shard_of(const char* name, u32 len)
 {
-    int pending = 0;
-
-    // if deleted stack is not full then put the node page on it
-    // otherwise move fdpage forward and let the caller move the file entry
-    if (unfs.header->delcount < unfs.header->delmax) {
-        unfs.header->delstack[unfs.header->delcount++] = nodep->pageid;
-    } else {
-        unfs.header->fdnextpage += UNFS_FILEPC;
-        unfs.header->pagefree += UNFS_FILEPC;
-
-        u64 fdpage = unfs.header->fdnextpage;
-        if (nodep->pageid != fdpage) pending = 1;
-
-        // clear the page bits
-        u64 pa = fdpage - unfs.header->datapage;
-        u64* map = (u64*)unfs.header->map + (pa >> 6);
-        u64 mask = (u64)(-1L << (64 - UNFS_FILEPC)) >> (pa & 63);
-        if ((*map & mask) != mask)
-            FATAL("%s page %#lx bits not set", nodep->name, nodep->pageid);
-        *map &= ~mask;
-
-        if (unfs.mapsyncfdlo > fdpage) unfs.mapsyncfdlo = fdpage;
-        fdpage += UNFS_FILEPC;
-        if (unfs.mapsyncfdhi < fdpage) unfs.mapsyncfdhi = fdpage;
-    }
-
-    unfs.header->fdcount--;
-    if (nodep->isdir) unfs.header->dircount--;
-    return pending;
+    if (!unfs.shards || len < 2) return 0;
+    u32 n = sizeof(VOL_DIR) - 1;
+    if (len >= n && (len == n || name[n] == '/') && !memcmp(name, VOL_DIR, n))
+        return 0;
+    u32 hash = PATH_HASH(PATH_HASH_INIT, '/');
+    u32 i;
+    for (i = 1; i < len && name[i] != '/'; i++) hash = PATH_HASH(hash, name[i]);
+    return SHARD_TREE(hash % unfs.shards);
 }
 
 /**
- * Sync a node to device.
- * @param   ioc         io context
- * @param   nodep       file node
+ * Get the tree that holds a name, i.e. of its sub-volume or shard.
+ * @param   name        canonical name (not necessarily terminated)
+ * @param   len         name length
+ * @return  the tree id (0 for the main tree).
  */
-static void unfs_node_sync(unfs_ioc_t ioc, unfs_node_t* nodep)
+static int unfs_tree_of(const char* name, u32 len)
 {
-    DEBUG_FN("%s page=%#lx size=%#lx dsc=%u",
-             nodep->name, nodep->pageid, nodep->size, nodep->dscount);
-
-    u32 iopc = UNFS_FILEPC;
-    unfs_node_io_t* niop = unfs.dev.page_alloc(ioc, &iopc);
-    if (iopc != UNFS_FILEPC)
-        FATAL("cannot allocate %d pages", UNFS_FILEPC);
-    memset(&niop->node, 0, sizeof(unfs_node_t));
-    niop->node.pageid = nodep->pageid;
-    niop->node.parentid = nodep->parentid;
-    niop->node.size = nodep->size;
-    niop->node.isdir = nodep->isdir;
-    niop->node.dscount = nodep->dscount;
-    if (!nodep->isdir)
-        memcpy(niop->node.ds, nodep->ds, nodep->dscount * sizeof(unfs_ds_t));
-    strcpy(niop->name, nodep->name);
-    unfs.dev.write(ioc, niop, nodep->pageid, UNFS_FILEPC);
-    unfs.dev.page_free(ioc, niop, iopc);
+    int v = unfs_vol_of(name, len);
+    return v ? v : unfs_shard_of(name, len);
 }
 
 /**
- * Find a node by its canonical name starting at the specified root node.
- * @param   name        canonical name to search
- * @return  node pointer or NULL if not found.
+ * Check if a name is a registered sub-volume root, which cannot be removed
+ * or renamed.
+ * @param   name        canonical name
+ * @return  1 if a sub-volume root else 0.
  */
-static unfs_node_t* unfs_node_find(const char* name)
+static int unfs_vol_root(const char* name)
 {
-    unfs_node_t key = { .name = (char*)name };
-    unfs_node_t** pp = tfind(&key, &unfs.root, unfs_node_cmp_fn);
-    DEBUG_FN("%s %#lx", name, pp ? (*pp)->pageid : 0);
-    return pp ? *pp : NULL;
+    u32 len = strlen(name);
+    int v = unfs_vol_of(name, len);
+    return v && len == unfs.vollen[v];
 }
 
 /**
- * Find the parent of the specified node by its canonical name.
- * @param   name        canonical name to search
- * @return  parent node pointer or NULL if not found.
+ * Lock the namespace of a name to look it up or update it.  A name within
+ * a sub-volume or shard is locked by its tree lock with FS_RDLOCK, so that
+ * namespace operations in different sub-volumes or shards (which have
+ * separate trees) run concurrently and only serialize their header and
+ * bitmap updates with META_LOCK.  Other names, and the update of a
+ * top-level name (which updates the root directory), are locked by
+ * FS_WRLOCK (or FS_RDLOCK to look up).
+ * @param   name        canonical name
+ * @param   wflag       update flag
+ * @return  the tree id to be passed to unfs_ns_unlock.
  */
-static unfs_node_t* unfs_node_find_parent(const char* name)
+static int unfs_ns_lock(const char* name, int wflag)
 {
-    DEBUG_FN("%s", name);
-    const char* s = strrchr(name, '/');
-    if (!s) return NULL;
-    char path[UNFS_MAXPATH];
-    size_t len = (s == name) ? 1 : s - name;
-    strncpy(path, name, sizeof(path));
-    path[len] = 0;
-    return unfs_node_find(path);
+    u32 len = strlen(name);
+    for (;;) {
+        int v = unfs_tree_of(name, len);
+        if (v > VOL_MAX && wflag && !memchr(name + 1, '/', len - 1)) v = 0;
+        if (v) {
+            // a registered sub-volume root is kept until the last close
+            if (wflag) VOL_WRLOCK(v);
+            else VOL_RDLOCK(v);
+            FS_RDLOCK();
+            return v;
+        }
+        if (wflag) FS_WRLOCK();
+        else FS_RDLOCK();
+        // the name may be in a sub-volume registered before the lock is taken
+        if (!unfs_vol_of(name, len)) return 0;
+        FS_UNLOCK();
+    }
 }
 
 /**
- * Walk the tree to update the parent id of all the children of the specified
- * parent node.
- * @param   root        root node
- * @param   parent      parent node
- * @param   ioc         io context
+ * Unlock the namespace locked by unfs_ns_lock.
+ * @param   v           sub-volume id
  */
-static void unfs_node_update_children(unfs_ioc_t ioc,
-                                      struct tnode* root, unfs_node_t* parent)
+static void unfs_ns_unlock(int v)
 {
-    if (!root) return;
-    unfs_node_t* nodep = (unfs_node_t*)(root->key);
+    FS_UNLOCK();
+    if (v) VOL_UNLOCK(v);
+}
 
-    if (root->left == NULL && root->right == NULL) {
-        if (nodep->parent == parent) {
-            FILE_WRLOCK(nodep);
-            nodep->parentid = parent->pageid;
-            unfs_node_sync(ioc, nodep);
-            FILE_UNLOCK(nodep);
-        }
-    } else {
-        if (root->left != NULL) {
-            unfs_node_update_children(ioc, root->left, parent);
-        }
+/**
+ * Lock to walk all the trees, i.e. FS_RDLOCK if there is no sub-volume or
+ * shard, or else FS_WRLOCK to exclude the namespace updates within them.
+ */
+static void unfs_walk_lock()
+{
+    if (!unfs.shards && !__atomic_load_n(&unfs.volcount, __ATOMIC_ACQUIRE)) {
+        FS_RDLOCK();
+        if (!unfs.volcount) return;
+        FS_UNLOCK();
+    }
+    FS_WRLOCK();
+}
 
-        if (nodep->parent == parent) {
-            FILE_WRLOCK(nodep);
-            nodep->parentid = parent->pageid;
-            unfs_node_sync(ioc, nodep);
-            FILE_UNLOCK(nodep);
-        }
+/**
+ * Get the monotonic time in nanoseconds.
+ * @return  time in ns.
+ */
+static inline u64 unfs_brlock_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
 
-        if (root->right != NULL) {
-            unfs_node_update_children(ioc, root->right, parent);
-        }
+/**
+ * Revoke the reader bias of a file lock (with the file write lock held) by
+ * waiting for the readers in the slots to leave, and inhibit the bias for
+ * a multiple of the time it took.
+ * @param   nodep       file node
+ */
+static void unfs_brlock_revoke(unfs_node_t* nodep)
+{
+    __atomic_store_n(&nodep->rbias, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    u64 t0 = unfs_brlock_now();
+    int i;
+    for (i = 0; i < BRLOCK_SLOTS; i++) {
+        while (__atomic_load_n(&unfsbrslot[i].nodep, __ATOMIC_ACQUIRE) == nodep)
+            sched_yield();
     }
+    u64 t1 = unfs_brlock_now();
+    nodep->rinhibit = t1 + (t1 - t0) * BRLOCK_INHIBIT;
 }
 
 /**
- * Remove and free a disk file entry with its associated data pages.
- * @param   ioc         io context
- * @param   nodep       node file pointer
+ * Read lock a file.  With biased file locks (UNFS_BRLOCK), a reader of a
+ * file in reader bias mode only claims a slot (hashed by file and thread)
+ * in a global cache-line padded table, so readers on different cores do
+ * not share the lock word.  Otherwise (or if the slot is taken or this
+ * thread already holds a slot) it takes the read lock, and sets the reader
+ * bias unless inhibited after a recent revocation.
+ * @param   nodep       file node
  */
-static void unfs_node_remove(unfs_ioc_t ioc, unfs_node_t* nodep)
+static inline void unfs_file_rdlock(unfs_node_t* nodep)
 {
-    DEBUG_FN("%s %#lx", nodep->name, nodep->pageid);
-    // delete the node from the tree and update the parent size
-    tdelete(nodep, &unfs.root, unfs_node_cmp_fn);
-    nodep->parent->size--;
-    unfs_node_sync(ioc, nodep->parent);
-
-    // free up file data segments
-    if (!nodep->isdir) {
-        int i;
-        for (i = 0; i < nodep->dscount; i++) {
-            unfs_map_free(nodep->ds[i].pageid, nodep->ds[i].pagecount);
+    if (!unfs.brlock) {
+        pthread_rwlock_rdlock(&nodep->lock);
+        return;
+    }
+    if (__atomic_load_n(&nodep->rbias, __ATOMIC_RELAXED) && !unfsbrheld) {
+        if (!unfsbrseed) unfsbrseed = __sync_add_and_fetch(&unfsbrseeds, 1);
+        u32 i = ((u32)((uintptr_t)nodep >> 6) * 2654435761U + unfsbrseed * 40503U)
+                & (BRLOCK_SLOTS - 1);
+        unfs_node_t* empty = NULL;
+        if (__atomic_compare_exchange_n(&unfsbrslot[i].nodep, &empty, nodep, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            if (__atomic_load_n(&nodep->rbias, __ATOMIC_SEQ_CST)) {
+                unfsbrheld = i + 1;
+                return;
+            }
+            __atomic_store_n(&unfsbrslot[i].nodep, NULL, __ATOMIC_RELEASE);
         }
     }
-
-    // if free up the node is still pending, this requires moving the last
-    // file entry into the deleted slot and if it's a directory then 
-    // all its children nodes have to be updated.
-    if (unfs_node_free(nodep) != 0) {
-        INFO("WARN: delete stack is full, %s location is moved", nodep->name);
-        u32 iopc = UNFS_FILEPC;
-        unfs_node_io_t* niop = unfs.dev.page_alloc(ioc, &iopc);
-        unfs.dev.read(ioc, niop, unfs.header->fdnextpage, UNFS_FILEPC);
-        unfs_node_t* lastnode = unfs_node_find(niop->name);
-        lastnode->pageid = nodep->pageid;
-        niop->node.pageid = nodep->pageid;
-        unfs.dev.write(ioc, niop, nodep->pageid, UNFS_FILEPC);
-        if (nodep->isdir)
-            unfs_node_update_children(ioc, unfs.root, lastnode);
-        unfs.dev.page_free(ioc, niop, iopc);
+    pthread_rwlock_rdlock(&nodep->lock);
+    if (!__atomic_load_n(&nodep->rbias, __ATOMIC_RELAXED) &&
+        unfs_brlock_now() >= nodep->rinhibit) {
+        // release so a slot reader seeing the bias also sees the last write
+        __atomic_store_n(&nodep->rbias, 1, __ATOMIC_RELEASE);
     }
-    free(nodep);
 }
 
 /**
- * Add a new node under the specified parent node in the tree.
- * @param   parent   parent node
- * @param   nodep    node to add
- * @return  pointer to the newly added node.
+ * Write lock a file (revoking its reader bias).
+ * @param   nodep       file node
  */
-static unfs_node_t* unfs_node_add(unfs_node_t* parent, const unfs_node_t* nodep)
+static inline void unfs_file_wrlock(unfs_node_t* nodep)
 {
-    DEBUG_FN("%s %#lx %#lx", nodep->name, nodep->pageid, nodep->parentid);
-    size_t len = strlen(nodep->name);
+    pthread_rwlock_wrlock(&nodep->lock);
+    if (nodep->rbias) unfs_brlock_revoke(nodep);
+}
 
-    // validate a filename
-    char* s;
-    for (s = nodep->name + 1; isprint(*s); s++);
-    if (*s || nodep->name[0] != '/' || (len > 1 && nodep->name[len-1] == '/')) {
-        ERROR("invalid name %s", nodep->name);
-        return NULL;
+/**
+ * Try to write lock a file (revoking its reader bias).
+ * @param   nodep       file node
+ * @return  0 if locked else error code.
+ */
+static inline int unfs_file_trylock(unfs_node_t* nodep)
+{
+    int err = pthread_rwlock_trywrlock(&nodep->lock);
+    if (!err && nodep->rbias) unfs_brlock_revoke(nodep);
+    return err;
+}
+
+/**
+ * Unlock a file, i.e. release the reader slot if held for the file.
+ * @param   nodep       file node
+ */
+static inline void unfs_file_unlock(unfs_node_t* nodep)
+{
+    if (unfsbrheld && unfsbrslot[unfsbrheld - 1].nodep == nodep) {
+        __atomic_store_n(&unfsbrslot[unfsbrheld - 1].nodep, NULL, __ATOMIC_RELEASE);
+        unfsbrheld = 0;
+        return;
     }
+    pthread_rwlock_unlock(&nodep->lock);
+}
 
-    // validate parent
-    if (parent) {
-        if (!unfs_child_of(nodep->name, parent->name))
-            FATAL("%s is not the parent of %s", parent->name, nodep->name);
-        if (nodep->pageid && parent->pageid && nodep->parentid != parent->pageid)
-            FATAL("%s %#lx not matched parent %s %#lx", nodep->name,
-                            nodep->parentid, parent->name, parent->pageid);
+/**
+ * Free an in-memory node (for tree destroy).
+ * @param   p           node pointer
+ */
+static void unfs_node_destroy(void* p)
+{
+    free(((unfs_node_t*)p)->mem);
+    free(((unfs_node_t*)p)->heat);
+    free(((unfs_node_t*)p)->chg);
+    free(p);
+}
+
+/**
+ * Destroy the trees of all the sub-volumes and their nodes.
+ */
+static void unfs_tree_destroy()
+{
+    u32 v;
+    for (v = 0; v < TREE_MAX; v++) {
+        tdestroy(unfs.root[v], unfs_node_destroy);
+        unfs.root[v] = NULL;
     }
+}
 
-    size_t nsize = nodep->isdir ? sizeof(unfs_node_t) : UNFS_PAGESIZE;
-    size_t memsize = nsize + len + 1;
-    unfs_node_t* newnodep = malloc(memsize);
-    pthread_rwlock_init(&newnodep->lock, NULL);
-    newnodep->name = (char*)newnodep + nsize;
-    strcpy(newnodep->name, nodep->name);
-    newnodep->parent = parent;
-    newnodep->memsize = memsize;
-    newnodep->open = 0;
-    newnodep->pageid = nodep->pageid;
-    newnodep->parentid = nodep->parentid;
-    newnodep->size = nodep->size;
-    newnodep->isdir = nodep->isdir;
-    newnodep->dscount = nodep->dscount;
-    if (!nodep->isdir) {
-        memcpy(newnodep->ds, nodep->ds, newnodep->dscount * sizeof(unfs_ds_t));
+/**
+ * Check if a file name matches the temporary file patterns.
+ * @param   name        canonical name
+ * @return  1 if matched else 0.
+ */
+static int unfs_temp_match(const char* name)
+{
+    int i;
+    for (i = 0; i < unfstemp.count; i++) {
+        if (fnmatch(unfstemp.patterns[i], name, 0) == 0) return 1;
     }
-    tsearch(newnodep, &unfs.root, unfs_node_cmp_fn);
+    return 0;
+}
 
-    return newnodep;
+/**
+ * Add a node to the temporary file list.
+ * @param   nodep       file node
+ */
+static void unfs_temp_link(unfs_node_t* nodep)
+{
+    nodep->tempprev = NULL;
+    nodep->tempnext = unfs.templist;
+    if (unfs.templist) unfs.templist->tempprev = nodep;
+    unfs.templist = nodep;
 }
 
 /**
- * Add all the parent directories (if not exists) of the specified node name.
- * This function allows setting nodes upon initialization where file entries
- * are read from disk that are layed out in random order.  Parent nodes
- * that are created in advance will be uninitialized.
- * @param   name        canonical name
- * @return  the last created/existed parent node.
+ * Remove a node from the temporary file list and release its memory.
+ * @param   nodep       file node
  */
-static unfs_node_t* unfs_node_add_parents(const char* name)
+static void unfs_temp_unlink(unfs_node_t* nodep)
 {
-    DEBUG_FN("%s", name);
-    char path[UNFS_MAXPATH] = "";
-    unfs_node_t node = { .name = path, .isdir = 1, 0 };
-
-    unfs_node_t* parent = NULL;
-    name++;
-    char* next;
-    while ((next = strchr(name, '/')) != NULL) {
-        if (next[1] == 0) break;
-        int len = next - name + 1;
-        strncat(path, name - 1, len);
-        name = next + 1;
-
-        unfs_node_t* found = unfs_node_find(path);
-        if (found) parent = found;
-        else parent = unfs_node_add(parent, &node);
-    }
-    if (!parent) parent = unfs_node_find("/");
-    return parent;
+    if (nodep->tempprev) nodep->tempprev->tempnext = nodep->tempnext;
+    else unfs.templist = nodep->tempnext;
+    if (nodep->tempnext) nodep->tempnext->tempprev = nodep->tempprev;
+    nodep->tempnext = nodep->tempprev = NULL;
+    free(nodep->mem);
+    unfs.tempmem -= nodep->memcap;
+    nodep->mem = NULL;
+    nodep->memcap = 0;
 }
 
 /**
- * Read/Write file data to/from device (all data pages have been allocated).
- * @param   ioc         io context
- * @param   nodep       file node pointer
- * @param   buf         data buffer
- * @param   offset      file offset position
- * @param   len         number of bytes
- * @param   wflag       write flag
- * @return  0 if ok else error code.
+ * Get the host path name of an offloaded object.
+ * @param   path        path name buffer of UNFS_MAXPATH size
+ * @param   id          object id
+ * @return  the path name.
  */
-static int unfs_node_rw(unfs_ioc_t ioc, unfs_node_t* nodep,
-                        void* buf, u64 offset, u64 len, int wflag)
+static char* unfs_offload_path(char* path, u64 id)
 {
-    if (len == 0) return 0;
+    snprintf(path, UNFS_MAXPATH, "%s/%016lx", unfsoffload.dir, id);
+    return path;
+}
 
-    // skip to the first offset page
-    unfs_ds_t* ds = nodep->ds;
-    u64 pageoff = offset >> UNFS_PAGESHIFT;
-    while (pageoff >= ds->pagecount) {
-        pageoff -= ds->pagecount;
-        ds++;
+/**
+ * Write the filesystem header to device with the next generation (for the
+ * read-only mounts to detect metadata updates).  Pages of spilled temporary
+ * files and of the committing transaction journal are accounted as free in
+ * the persisted header.
+ * @param   ioc         io context
+ */
+static void unfs_header_write(unfs_ioc_t ioc)
+{
+    unfs.header->gen++;
+    unfs.entrysync = 0;
+    if (!unfs.tempspill && !unfs.txnpc && !unfs.bulkresv) {
+        DEV(write)(ioc, unfs.header, UNFS_HEADPA, UNFS_HEADPC);
+        return;
     }
-    u64 dspc = ds->pagecount - pageoff;
-    u64 pa = ds->pageid + pageoff;
-    u64 byteoff = offset & (UNFS_PAGESIZE - 1);
-    u64 pagecount = PAGECOUNT(byteoff + len);
-    u64 endlen = (byteoff + len) & (UNFS_PAGESIZE - 1);
 
-    // perform read write
-    u32 iopc = (len << UNFS_PAGESHIFT) + 1;
-    void* iop = unfs.dev.page_alloc(ioc, &iopc);
-    for (;;) {
-        u64 pc = pagecount;
-        if (pc > dspc) pc = dspc;
-        if (pc > iopc) pc = iopc;
-        u64 iolen = (pc << UNFS_PAGESHIFT) - byteoff;
-        if (iolen > len) iolen = len;
-        if (wflag) {
-            void* miop = iop;
-            void* mbuf = buf;
-            u64 mlen = iolen;
+    u32 iopc = UNFS_HEADPC;
+    unfs_header_t* hp = DEV(page_alloc)(ioc, &iopc);
+    if (iopc != UNFS_HEADPC)
+        FATAL("cannot allocate %d pages", UNFS_HEADPC);
+    memcpy(hp, unfs.header, UNFS_HEADPC * UNFS_PAGESIZE);
+    hp->pagefree += unfs.tempspill + unfs.txnpc + unfs.bulkresv;
+    DEV(write)(ioc, hp, UNFS_HEADPA, UNFS_HEADPC);
+    DEV(page_free)(ioc, hp, iopc);
+}
 
-            // check for offset in the first page
-            if (byteoff) {
-                unfs.dev.read(ioc, iop, pa, 1);
-                u64 n = UNFS_PAGESIZE - byteoff;
-                if (endlen && pagecount == 1) {
-                    n = len;
-                    endlen = 0;
-                }
-                memcpy(iop + byteoff, buf, n);
-                miop += UNFS_PAGESIZE;
-                mbuf += n;
-                mlen -= n;
-            }
+/**
+ * Clear the bits of a page range within a bitmap copy.
+ * @param   map         bitmap copy
+ * @param   bitlo       first bit of the copy
+ * @param   bithi       end bit of the copy
+ * @param   pageid      page address
+ * @param   pagecount   number of pages
+ */
+static void unfs_map_clear(u64* map, u64 bitlo, u64 bithi, u64 pageid, u64 pagecount)
+{
+    u64 b = pageid - unfs.header->datapage;
+    u64 e = b + pagecount;
+    if (b < bitlo) b = bitlo;
+    if (e > bithi) e = bithi;
+    for (; b < e; b++) {
+        u64 i = b - bitlo;
+        map[i >> 6] &= ~(1L << (63 - (i & 63)));
+    }
+}
 
-            // check for partial length in the last page
-            if (endlen && pc == pagecount) {
-                u64 n = (pc - 1) << UNFS_PAGESHIFT;
-                unfs.dev.read(ioc, iop + n, pa + pc - 1, 1);
-                memcpy(iop + n, buf + len - endlen, endlen);
-                mlen -= endlen;
-            }
+/**
+ * Walk the tree to clear the bulk preallocated pages within a bitmap copy.
+ * @param   root        root node
+ * @param   map         bitmap copy
+ * @param   bitlo       first bit of the copy
+ * @param   bithi       end bit of the copy
+ */
+static void unfs_map_clear_resv(struct tnode* root, u64* map, u64 bitlo, u64 bithi)
+{
+    if (!root) return;
+    unfs_node_t* nodep = (unfs_node_t*)(root->key);
+    if (nodep->resvpc)
+        unfs_map_clear(map, bitlo, bithi, nodep->resvpage, nodep->resvpc);
+    unfs_map_clear_resv(TNODE_LEFT(root), map, bitlo, bithi);
+    unfs_map_clear_resv(TNODE_RIGHT(root), map, bitlo, bithi);
+}
 
-            if (mlen) memcpy(miop, mbuf, mlen);
-            unfs.dev.write(ioc, iop, pa, pc);
-        } else {
-            // read and copy out
-            unfs.dev.read(ioc, iop, pa, pc);
-            memcpy(buf, iop + byteoff, iolen);
-        }
+/**
+ * Copy a range of bitmap pages as to be persisted, where the bits of pages
+ * of spilled temporary files, of the committing transaction journal, and
+ * preallocated in bulk mode are cleared.
+ * @param   buf         buffer
+ * @param   pa          bitmap page index
+ * @param   pc          number of bitmap pages
+ */
+static void unfs_map_copy(void* buf, u64 pa, u32 pc)
+{
+    memcpy(buf, unfs.header->map + pa, pc * UNFS_PAGESIZE);
 
-        len -= iolen;
-        if (len == 0) break;
-        pagecount -= pc;
-        byteoff = 0;
-        buf += iolen;
-        if (pc < dspc) {
-            pa += pc;
-            dspc -= pc;
-        } else {
-            ds++;
-            pa = ds->pageid;
-            dspc = ds->pagecount;
+    u64 bitlo = pa << (UNFS_PAGESHIFT + 3);
+    u64 bithi = (pa + pc) << (UNFS_PAGESHIFT + 3);
+    unfs_node_t* nodep;
+    for (nodep = unfs.templist; nodep; nodep = nodep->tempnext) {
+        int d;
+        for (d = 0; d < nodep->dscount; d++) {
+            unfs_map_clear(buf, bitlo, bithi,
+                           nodep->ds[d].pageid, nodep->ds[d].pagecount);
         }
     }
-    unfs.dev.page_free(ioc, iop, iopc);
-
-    return 0;
+    if (unfs.txnpc) unfs_map_clear(buf, bitlo, bithi, unfs.txnpage, unfs.txnpc);
+    if (unfs.bulkresv) {
+        u32 v;
+        for (v = 0; v <= TREE_LAST; v = TREE_NEXT(v))
+            unfs_map_clear_resv(unfs.root[v], buf, bitlo, bithi);
+    }
 }
 
 /**
- * Merge all data segments of a file into a newly allocated one.
- * This needs to be done when number of file segments reached its max limit.
+ * Write a range of bitmap pages to device.  Bits of pages of spilled
+ * temporary files are cleared in the persisted bitmap.
  * @param   ioc         io context
- * @param   nodep       file pointer
- * @param   newsize     file new size in byte count
- * @return  0 if ok else error code.
+ * @param   pa          bitmap page index
+ * @param   pc          number of bitmap pages
  */
-static int unfs_node_merge_ds(unfs_ioc_t ioc, unfs_node_t* nodep, u64 newsize)
+static void unfs_map_write(unfs_ioc_t ioc, u64 pa, u32 pc)
 {
-    DEBUG_FN("merge %s dsc=%u size=%#lx", nodep->name, nodep->dscount, newsize);
-    u64 pagecount = PAGECOUNT(newsize);
-
-    u64 pageid = unfs_map_alloc(pagecount);
-    if (pageid == 0) return ENOSPC;
-    u64 pa = pageid;
-    u32 iopc = (newsize << UNFS_PAGESHIFT) + 1;
-    void* iop = unfs.dev.page_alloc(ioc, &iopc);
-    int i;
-    for (i = 0; i < nodep->dscount; i++) {
-        unfs_ds_t* ds = &nodep->ds[i];
-        u64 dspa = ds->pageid;
-        u64 dspc = ds->pagecount;
-        while (dspc) {
-            u64 pc = dspc;
-            if (pc > iopc) pc = iopc;
-            unfs.dev.read(ioc, iop, dspa, pc);
-            unfs.dev.write(ioc, iop, pa, pc);
-            pa += pc;
-            dspa += pc;
-            dspc -= pc;
-        }
-        unfs_map_free(ds->pageid, ds->pagecount);
-        ds->pageid = 0;
-        ds->pagecount = 0;
+    if (!unfs.tempspill && !unfs.txnpc) {
+        DEV(write)(ioc, unfs.header->map + pa, UNFS_MAPPA + pa, pc);
+        return;
     }
-    unfs.dev.page_free(ioc, iop, iopc);
 
-    nodep->ds[0].pageid = pageid;
-    nodep->ds[0].pagecount = pagecount;
-    nodep->dscount = 1;
-    nodep->updated = 1;
-    return 0;
+    u32 iopc = pc;
+    void* iop = DEV(page_alloc)(ioc, &iopc);
+    while (pc) {
+        u32 n = pc < iopc ? pc : iopc;
+        unfs_map_copy(iop, pa, n);
+        DEV(write)(ioc, iop, UNFS_MAPPA + pa, n);
+        pa += n;
+        pc -= n;
+    }
+    DEV(page_free)(ioc, iop, iopc);
 }
 
 /**
- * Resize a file node.
+ * Reuse a file entry page freed within the current transaction.
+ * @param   fdpage      file entry page address
+ * @return  1 if reused else 0.
+ */
+static int unfs_txn_reuse(u64 fdpage)
+{
+    u32 i;
+    for (i = 0; i < unfs.txnfreecount; i++) {
+        if (unfs.txnfree[i].pagecount == 0 && unfs.txnfree[i].pageid == fdpage) {
+            unfs.txnfree[i] = unfs.txnfree[--unfs.txnfreecount];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Clear the bitmap bits of a released file entry page at the end of the
+ * file entry area.
+ * @param   fdpage      file entry page address
+ */
+static void unfs_fd_unmap(u64 fdpage)
+{
+    u64 pa = fdpage - unfs.header->datapage;
+    u64* map = (u64*)unfs.header->map + (pa >> 6);
+    u64 mask = (u64)(-1L << (64 - UNFS_FILEPC)) >> (pa & 63);
+    if ((*map & mask) != mask)
+        FATAL("entry page %#lx bits not set", fdpage);
+    *map &= ~mask;
+
+    if (unfs.mapsyncfdlo > fdpage) unfs.mapsyncfdlo = fdpage;
+    fdpage += UNFS_FILEPC;
+    if (unfs.mapsyncfdhi < fdpage) unfs.mapsyncfdhi = fdpage;
+}
+
+/**
+ * Allocate a new disk file entry.
+ * @param   dir         directory flag
+ * @return  page address for the new node or 0 if failed.
+ */
+static u64 unfs_node_alloc(int dir)
+{
+    u64 fdpage;
+
+    // if deleted stack has entry then use it
+    // otherwise use the next fdpage entry
+    if (unfs.header->delcount) {
+        fdpage = unfs.header->delstack[--unfs.header->delcount];
+    } else {
+        // mark the page bits
+        fdpage = unfs.header->fdnextpage;
+        u64 pa = fdpage - unfs.header->datapage;
+        u64* map = (u64*)unfs.header->map + (pa >> 6);
+        u64 mask = (u64)(-1L << (64 - UNFS_FILEPC)) >> (pa & 63);
+        if ((*map & mask) == 0) {
+            *map |= mask;
+        } else if (!unfs_txn_reuse(fdpage)) {
+            ERROR("cannot allocate space for a new file/dir entry");
+            return 0;
+        }
+
+        unfs.header->pagefree -= UNFS_FILEPC;
+        unfs.header->fdnextpage -= UNFS_FILEPC;
+
+        if (unfs.mapsyncfdlo > fdpage) unfs.mapsyncfdlo = fdpage;
+        u64 fdhi = fdpage + UNFS_FILEPC;
+        if (unfs.mapsyncfdhi < fdhi) unfs.mapsyncfdhi = fdhi;
+    }
+
+    unfs.header->fdcount++;
+    if (dir) unfs.header->dircount++;
+
+    return fdpage;
+}
+
+/**
+ * Free a disk file entry.
+ * @param   nodep       file node
+ * @return  0 if done, else 1 indicates slot is vacant and pending.
+ */
+static int unfs_node_free(unfs_node_t* nodep)
+{
+    int pending = 0;
+
+    // if deleted stack is not full then put the node page on it
+    // otherwise move fdpage forward and let the caller move the file entry
+    if (unfs.header->delcount < unfs.header->delmax) {
+        unfs.header->delstack[unfs.header->delcount++] = nodep->pageid;
+    } else {
+        unfs.header->fdnextpage += UNFS_FILEPC;
+        unfs.header->pagefree += UNFS_FILEPC;
+
+        u64 fdpage = unfs.header->fdnextpage;
+        if (nodep->pageid != fdpage) pending = 1;
+
+        // clear the page bits (upon commit if within a transaction)
+        if (unfs.txn) unfs_txn_free(fdpage, 0);
+        else unfs_fd_unmap(fdpage);
+    }
+
+    unfs.header->fdcount--;
+    if (nodep->isdir) unfs.header->dircount--;
+    return pending;
+}
+
+/**
+ * Read a file entry (from the current transaction if updated within).
+ * @param   ioc         io context
+ * @param   niop        entry pages buffer
+ * @param   pageid      entry page address
+ */
+static void unfs_entry_read(unfs_ioc_t ioc, unfs_node_io_t* niop, u64 pageid)
+{
+    u32 i;
+    TXN_JLOCK();
+    for (i = 0; i < unfs.txnentrycount; i++) {
+        if (unfs.txnentry[i].pageid == pageid) {
+            memcpy(niop, unfs.txnentry[i].image, UNFS_FILEPC * UNFS_PAGESIZE);
+            TXN_JUNLOCK();
+            return;
+        }
+    }
+    TXN_JUNLOCK();
+    DEV(read)(ioc, niop, pageid, UNFS_FILEPC);
+}
+
+/**
+ * Write a file entry (or keep its image in memory within a transaction).
+ * @param   ioc         io context
+ * @param   niop        entry pages buffer
+ * @param   pageid      entry page address
+ */
+static void unfs_entry_write(unfs_ioc_t ioc, unfs_node_io_t* niop, u64 pageid)
+{
+    TXN_RDLOCK();
+    if (!unfs.txn) {
+        DEV(write)(ioc, niop, pageid, UNFS_FILEPC);
+        TXN_UNLOCK();
+        return;
+    }
+
+    TXN_JLOCK();
+    u32 i;
+    for (i = 0; i < unfs.txnentrycount; i++) {
+        if (unfs.txnentry[i].pageid == pageid) break;
+    }
+    if (i == unfs.txnentrycount) {
+        if (i == unfs.txnentrymax) {
+            unfs.txnentrymax = unfs.txnentrymax ? unfs.txnentrymax * 2 : 64;
+            unfs.txnentry = realloc(unfs.txnentry,
+                                    unfs.txnentrymax * sizeof(unfs_txn_entry_t));
+        }
+        unfs.txnentry[i].pageid = pageid;
+        unfs.txnentry[i].image = malloc(UNFS_FILEPC * UNFS_PAGESIZE);
+        unfs.txnentrycount++;
+    }
+    memcpy(unfs.txnentry[i].image, niop, UNFS_FILEPC * UNFS_PAGESIZE);
+    TXN_JUNLOCK();
+    TXN_UNLOCK();
+}
+
+/**
+ * Write the filesystem header to device unless within a transaction.
+ * @param   ioc         io context
+ */
+static void unfs_header_sync(unfs_ioc_t ioc)
+{
+    TXN_RDLOCK();
+    if (!unfs.txn && !unfs.bulk) {
+        META_LOCK();
+        unfs_header_write(ioc);
+        META_UNLOCK();
+    }
+    TXN_UNLOCK();
+}
+
+/**
+ * Sync a node to device.
+ * @param   ioc         io context
+ * @param   nodep       file node
+ */
+static void unfs_node_sync(unfs_ioc_t ioc, unfs_node_t* nodep)
+{
+    DEBUG_FN("%s page=%#lx size=%#lx dsc=%u",
+             nodep->name, nodep->pageid, nodep->size, nodep->dscount);
+    if (nodep->temp) return;
+
+    u32 iopc = UNFS_FILEPC;
+    unfs_node_io_t* niop = DEV(page_alloc)(ioc, &iopc);
+    if (iopc != UNFS_FILEPC)
+        FATAL("cannot allocate %d pages", UNFS_FILEPC);
+    memset(&niop->node, 0, sizeof(unfs_entry_t));
+    niop->node.magic = UNFS_ENTRYMAGIC;
+    niop->node.chgpage = nodep->chgpage;
+    niop->node.offload = nodep->offload;
+    niop->node.pageid = nodep->pageid;
+    niop->node.parentid = nodep->parentid;
+    niop->node.size = nodep->size - nodep->tempcount;
+    niop->node.isdir = nodep->isdir;
+    niop->node.dscount = nodep->dscount;
+    if (!nodep->isdir)
+        memcpy(niop->node.ds, nodep->ds, nodep->dscount * sizeof(unfs_ds_t));
+    strcpy(niop->name, nodep->name);
+    IOPRIO_ENTER(UNFS_IOPRIO_META);
+    unfs_entry_write(ioc, niop, nodep->pageid);
+    IOPRIO_LEAVE();
+    META_LOCK();
+    unfs.entrysync = 1;
+    META_UNLOCK();
+    DEV(page_free)(ioc, niop, iopc);
+}
+
+/**
+ * Look up a node by its name (not necessarily terminated), length and hash.
+ * @param   name        canonical name to search
+ * @param   len         name length
+ * @param   hash        name hash
+ * @return  node pointer or NULL if not found.
+ */
+static unfs_node_t* unfs_node_lookup(const char* name, u32 len, u32 hash)
+{
+    unfs_node_t key = { .name = (char*)name, .namelen = len, .namehash = hash };
+    unfs_node_t** pp = tfind(&key, &unfs.root[unfs_tree_of(name, len)], unfs_node_cmp_fn);
+    DEBUG_FN("%.*s %#lx", len, name, pp ? (*pp)->pageid : 0);
+    return pp ? *pp : NULL;
+}
+
+/**
+ * Find a node by its canonical name.
+ * @param   name        canonical name to search
+ * @return  node pointer or NULL if not found.
+ */
+static unfs_node_t* unfs_node_find(const char* name)
+{
+    unfs_path_t path;
+    if (unfs_path_parse(name, &path)) return NULL;
+    return unfs_node_lookup(name, path.len, path.hash);
+}
+
+/**
+ * Find the parent of the specified node by its parsed path.
+ * @param   pp          parsed path
+ * @return  parent node pointer or NULL if not found.
+ */
+static unfs_node_t* unfs_node_find_parent(const unfs_path_t* pp)
+{
+    DEBUG_FN("%s", pp->name);
+    if (!pp->plen) return NULL;
+    return unfs_node_lookup(pp->name, pp->plen, pp->phash);
+}
+
+/**
+ * Walk the tree to update the parent id of all the children of the specified
+ * parent node.
+ * @param   root        root node
+ * @param   parent      parent node
+ * @param   ioc         io context
+ */
+static void unfs_node_update_children(unfs_ioc_t ioc,
+                                      struct tnode* root, unfs_node_t* parent)
+{
+    if (!root) return;
+    unfs_node_t* nodep = (unfs_node_t*)(root->key);
+
+    if (TNODE_LEFT(root) == NULL && TNODE_RIGHT(root) == NULL) {
+        if (nodep->parent == parent) {
+            FILE_WRLOCK(nodep);
+            nodep->parentid = parent->pageid;
+            unfs_node_sync(ioc, nodep);
+            FILE_UNLOCK(nodep);
+        }
+    } else {
+        if (TNODE_LEFT(root) != NULL) {
+            unfs_node_update_children(ioc, TNODE_LEFT(root), parent);
+        }
+
+        if (nodep->parent == parent) {
+            FILE_WRLOCK(nodep);
+            nodep->parentid = parent->pageid;
+            unfs_node_sync(ioc, nodep);
+            FILE_UNLOCK(nodep);
+        }
+
+        if (TNODE_RIGHT(root) != NULL) {
+            unfs_node_update_children(ioc, TNODE_RIGHT(root), parent);
+        }
+    }
+}
+
+/**
+ * Release the bulk preallocated pages of a file (with FS_WRLOCK held).
+ * @param   nodep       file node
+ */
+static void unfs_bulk_release(unfs_node_t* nodep)
+{
+    if (!nodep->resvpc) return;
+    DEBUG_FN("%s %#lx %#x", nodep->name, nodep->resvpage, nodep->resvpc);
+    unfs_map_release(nodep->resvpage, nodep->resvpc);
+    unfs.bulkresv -= nodep->resvpc;
+    nodep->resvpage = 0;
+    nodep->resvpc = 0;
+}
+
+/**
+ * Allocate pages to extend a file in bulk mode (with FS_WRLOCK held).
+ * The pages are taken from the file preallocation that follows its last
+ * data segment, or a new extent is allocated with additional pages (up to
+ * the file size or BULK_MAXPC) preallocated right after it, so the file
+ * keeps growing contiguously in its last segment.
+ * @param   nodep       file node
+ * @param   pagecount   number of pages
+ * @return  the page address or 0 if not in bulk mode or out of space.
+ */
+static u64 unfs_bulk_alloc(unfs_node_t* nodep, u64 pagecount)
+{
+    if (!unfs.bulk || nodep->temp) return 0;
+
+    u64 end = 0;
+    if (nodep->dscount) {
+        unfs_ds_t* ds = &nodep->ds[nodep->dscount - 1];
+        end = ds->pageid + ds->pagecount;
+    }
+    if (nodep->resvpc >= pagecount && nodep->resvpage == end) {
+        nodep->resvpage += pagecount;
+        nodep->resvpc -= pagecount;
+        unfs.bulkresv -= pagecount;
+        return end;
+    }
+    unfs_bulk_release(nodep);
+
+    u64 resvpc = PAGECOUNT(nodep->size);
+    if (resvpc > BULK_MAXPC) resvpc = BULK_MAXPC;
+    if (resvpc < pagecount) resvpc = pagecount;
+    u64 pageid = unfs_map_alloc(pagecount + resvpc, nodep);
+    if (!pageid) return 0;
+    nodep->resvpage = pageid + pagecount;
+    nodep->resvpc = resvpc;
+    unfs.bulkresv += resvpc;
+    return pageid;
+}
+
+/**
+ * Remove and free a disk file entry with its associated data pages.
+ * @param   ioc         io context
+ * @param   nodep       node file pointer
+ */
+static void unfs_node_remove(unfs_ioc_t ioc, unfs_node_t* nodep)
+{
+    DEBUG_FN("%s %#lx", nodep->name, nodep->pageid);
+    unfs_bulk_release(nodep);
+
+    // delete the node from the tree and update the parent size
+    tdelete(nodep, &unfs.root[unfs_tree_of(nodep->name, nodep->namelen)], unfs_node_cmp_fn);
+    nodep->parent->size--;
+
+    // temporary file has nothing on disk except unpersisted data pages
+    if (nodep->temp) {
+        nodep->parent->tempcount--;
+        if (nodep->temp == TEMP_SPILL) {
+            int i;
+            for (i = 0; i < nodep->dscount; i++) {
+                unfs_map_free(nodep->ds[i].pageid, nodep->ds[i].pagecount);
+            }
+            unfs.tempspill -= PAGECOUNT(nodep->size);
+        }
+        unfs_temp_unlink(nodep);
+        unfs_node_destroy(nodep);
+        return;
+    }
+    unfs_node_sync(ioc, nodep->parent);
+
+    // free up file data segments (or the offloaded object)
+    if (!nodep->isdir) {
+        int i;
+        for (i = 0; i < nodep->dscount; i++) {
+            unfs_map_free(nodep->ds[i].pageid, nodep->ds[i].pagecount);
+        }
+        if (nodep->chgpage) unfs_map_free(nodep->chgpage, 1);
+        if (nodep->offload) {
+            char path[UNFS_MAXPATH];
+            if (!unfsoffload.dir || unlink(unfs_offload_path(path, nodep->offload)))
+                INFO("WARN: cannot remove %s object %#lx", nodep->name, nodep->offload);
+        }
+    }
+
+    // if free up the node is still pending, this requires moving the last
+    // file entry into the deleted slot and if it's a directory then 
+    // all its children nodes have to be updated.
+    if (unfs_node_free(nodep) != 0) {
+        INFO("WARN: delete stack is full, %s location is moved", nodep->name);
+        IOPRIO_ENTER(UNFS_IOPRIO_META);
+        u32 iopc = UNFS_FILEPC;
+        unfs_node_io_t* niop = DEV(page_alloc)(ioc, &iopc);
+        unfs_entry_read(ioc, niop, unfs.header->fdnextpage);
+        unfs_node_t* lastnode = unfs_node_find(niop->name);
+        lastnode->pageid = nodep->pageid;
+        niop->node.pageid = nodep->pageid;
+        unfs_entry_write(ioc, niop, nodep->pageid);
+        if (nodep->isdir) {
+            u32 v;
+            for (v = 0; v <= TREE_LAST; v = TREE_NEXT(v))
+                unfs_node_update_children(ioc, unfs.root[v], lastnode);
+        }
+        DEV(page_free)(ioc, niop, iopc);
+        IOPRIO_LEAVE();
+    }
+    unfs_node_destroy(nodep);
+}
+
+/**
+ * Add a new node under the specified parent node in the tree.
+ * @param   parent   parent node
+ * @param   pp       parsed path
+ * @param   nodep    node entry to add
+ * @return  pointer to the newly added node.
+ */
+static unfs_node_t* unfs_node_add(unfs_node_t* parent, const unfs_path_t* pp,
+                                  const unfs_entry_t* nodep)
+{
+    const char* name = pp->name;
+    size_t len = pp->len;
+    DEBUG_FN("%.*s %#lx %#lx", (int)len, name, nodep->pageid, nodep->parentid);
+
+    // validate parent
+    if (parent) {
+        if (parent->namelen != pp->plen || memcmp(parent->name, name, pp->plen))
+            FATAL("%s is not the parent of %.*s", parent->name, (int)len, name);
+        if (nodep->pageid && parent->pageid && nodep->parentid != parent->pageid)
+            FATAL("%s %#lx not matched parent %s %#lx", name,
+                            nodep->parentid, parent->name, parent->pageid);
+    }
+
+    size_t nsize = NODESIZE(nodep->isdir);
+    size_t memsize = nsize + len + 1;
+    unfs_node_t* newnodep = calloc(1, memsize);
+    if (unfs.brlock) {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&newnodep->lock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+    } else {
+        pthread_rwlock_init(&newnodep->lock, NULL);
+    }
+    newnodep->name = (char*)newnodep + nsize;
+    memcpy(newnodep->name, name, len);
+    newnodep->name[len] = 0;
+    newnodep->namelen = len;
+    newnodep->namehash = pp->hash;
+    newnodep->parent = parent;
+    newnodep->memsize = memsize;
+    newnodep->chgpage = nodep->chgpage;
+    newnodep->offload = nodep->offload;
+    newnodep->pageid = nodep->pageid;
+    newnodep->parentid = nodep->parentid;
+    newnodep->size = nodep->size;
+    newnodep->isdir = nodep->isdir;
+    newnodep->dscount = nodep->dscount;
+    newnodep->mapgen = ATOMIC_ADD(&unfs.mapgen, 1);
+    if (!nodep->isdir) {
+        memcpy(newnodep->ds, nodep->ds, newnodep->dscount * sizeof(unfs_ds_t));
+        if (unfs.header->tierpage || unfsprewarm.name)
+            newnodep->heat = calloc(UNFS_MAXDS, sizeof(u32));
+    }
+    tsearch(newnodep, &unfs.root[unfs_tree_of(name, len)], unfs_node_cmp_fn);
+
+    return newnodep;
+}
+
+/**
+ * Add all the parent directories (if not exists) of the specified node name.
+ * This function allows setting nodes upon initialization where file entries
+ * are read from disk that are layed out in random order.  Parent nodes
+ * that are created in advance will be uninitialized.
+ * @param   pp          parsed path
+ * @return  the last created/existed parent node.
+ */
+static unfs_node_t* unfs_node_add_parents(const unfs_path_t* pp)
+{
+    DEBUG_FN("%s", pp->name);
+    unfs_entry_t node = { .isdir = 1 };
+    unfs_path_t dir = { .name = pp->name, .len = 1,
+                        .hash = PATH_HASH(PATH_HASH_INIT, '/') };
+    unfs_node_t* parent = unfs_node_lookup(dir.name, dir.len, dir.hash);
+
+    // walk the parent path components by extending the name hash
+    u32 hash = dir.hash;
+    u32 i;
+    for (i = 1; i < pp->plen; i++) {
+        if (pp->name[i] == '/') {
+            dir.plen = dir.len;
+            dir.phash = dir.hash;
+            dir.len = i;
+            dir.hash = hash;
+            unfs_node_t* found = unfs_node_lookup(dir.name, dir.len, dir.hash);
+            parent = found ? found : unfs_node_add(parent, &dir, &node);
+        }
+        hash = PATH_HASH(hash, pp->name[i]);
+    }
+    if (pp->plen > 1) {
+        dir.plen = dir.len;
+        dir.phash = dir.hash;
+        dir.len = pp->plen;
+        dir.hash = pp->phash;
+        unfs_node_t* found = unfs_node_lookup(dir.name, dir.len, dir.hash);
+        parent = found ? found : unfs_node_add(parent, &dir, &node);
+    }
+    return parent;
+}
+
+#ifdef DEV_DIRECT
+/**
+ * Read/Write file data directly to/from a byte-addressable device.
+ * No page buffer is used and partial page write requires no read.
+ * @param   ioc         io context
+ * @param   nodep       file node pointer
+ * @param   buf         data buffer
+ * @param   offset      file offset position
+ * @param   len         number of bytes
+ * @param   wflag       write flag
+ * @return  0 if ok else error code.
+ */
+static int unfs_node_rw_direct(unfs_ioc_t ioc, unfs_node_t* nodep,
+                               void* buf, u64 offset, u64 len, int wflag)
+{
+    // skip to the first offset page
+    unfs_ds_t* ds = nodep->ds;
+    u64 pageoff = offset >> UNFS_PAGESHIFT;
+    while (pageoff >= ds->pagecount) {
+        pageoff -= ds->pagecount;
+        ds++;
+    }
+    u64 byteoff = (pageoff << UNFS_PAGESHIFT) + (offset & (UNFS_PAGESIZE - 1));
+
+    while (len) {
+        if (nodep->heat) nodep->heat[ds - nodep->ds]++;
+        u64 addr = (ds->pageid << UNFS_PAGESHIFT) + byteoff;
+        u64 n = (ds->pagecount << UNFS_PAGESHIFT) - byteoff;
+        if (n > len) n = len;
+        if (wflag) DEV(store)(ioc, buf, addr, n);
+        else DEV(load)(ioc, buf, addr, n);
+        buf += n;
+        len -= n;
+        byteoff = 0;
+        ds++;
+    }
+
+    return 0;
+}
+#endif  // DEV_DIRECT
+
+/**
+ * Read/Write file data to/from device (all data pages have been allocated).
+ * @param   ioc         io context
+ * @param   nodep       file node pointer
+ * @param   buf         data buffer
+ * @param   offset      file offset position
+ * @param   len         number of bytes
+ * @param   wflag       write flag
+ * @return  0 if ok else error code.
+ */
+static int unfs_node_rw(unfs_ioc_t ioc, unfs_node_t* nodep,
+                        void* buf, u64 offset, u64 len, int wflag)
+{
+    if (len == 0) return 0;
+    if (nodep->temp == TEMP_MEM) {
+        if (wflag) memcpy(nodep->mem + offset, buf, len);
+        else memcpy(buf, nodep->mem + offset, len);
+        return 0;
+    }
+#ifdef DEV_DIRECT
+    if (DEV_DIRECT())
+        return unfs_node_rw_direct(ioc, nodep, buf, offset, len, wflag);
+#endif
+
+    // skip to the first offset page
+    unfs_ds_t* ds = nodep->ds;
+    u64 pageoff = offset >> UNFS_PAGESHIFT;
+    while (pageoff >= ds->pagecount) {
+        pageoff -= ds->pagecount;
+        ds++;
+    }
+    u64 dspc = ds->pagecount - pageoff;
+    u64 pa = ds->pageid + pageoff;
+    u64 byteoff = offset & (UNFS_PAGESIZE - 1);
+    u64 pagecount = PAGECOUNT(byteoff + len);
+    u64 endlen = (byteoff + len) & (UNFS_PAGESIZE - 1);
+
+    // perform read write
+    u32 iopc = (len << UNFS_PAGESHIFT) + 1;
+    void* iop = DEV(page_alloc)(ioc, &iopc);
+    if (nodep->heat) nodep->heat[ds - nodep->ds]++;
+    for (;;) {
+        u64 pc = pagecount;
+        if (pc > dspc) pc = dspc;
+        if (pc > iopc) pc = iopc;
+        u64 iolen = (pc << UNFS_PAGESHIFT) - byteoff;
+        if (iolen > len) iolen = len;
+        if (wflag) {
+            void* miop = iop;
+            void* mbuf = buf;
+            u64 mlen = iolen;
+
+            // check for offset in the first page
+            if (byteoff) {
+                DEV(read)(ioc, iop, pa, 1);
+                u64 n = UNFS_PAGESIZE - byteoff;
+                if (endlen && pagecount == 1) {
+                    n = len;
+                    endlen = 0;
+                }
+                memcpy(iop + byteoff, buf, n);
+                miop += UNFS_PAGESIZE;
+                mbuf += n;
+                mlen -= n;
+            }
+
+            // check for partial length in the last page (the rest is beyond
+            // the file size for a bulk extending write so it is zero filled)
+            if (endlen && pc == pagecount) {
+                u64 n = (pc - 1) << UNFS_PAGESHIFT;
+                if (wflag == RW_EXTEND)
+                    memset(iop + n + endlen, 0, UNFS_PAGESIZE - endlen);
+                else
+                    DEV(read)(ioc, iop + n, pa + pc - 1, 1);
+                memcpy(iop + n, buf + len - endlen, endlen);
+                mlen -= endlen;
+            }
+
+            if (mlen) memcpy(miop, mbuf, mlen);
+            DEV(write)(ioc, iop, pa, pc);
+        } else {
+            // read and copy out
+            DEV(read)(ioc, iop, pa, pc);
+            memcpy(buf, iop + byteoff, iolen);
+        }
+
+        len -= iolen;
+        if (len == 0) break;
+        pagecount -= pc;
+        byteoff = 0;
+        buf += iolen;
+        if (pc < dspc) {
+            pa += pc;
+            dspc -= pc;
+        } else {
+            ds++;
+            pa = ds->pageid;
+            dspc = ds->pagecount;
+            if (nodep->heat) nodep->heat[ds - nodep->ds]++;
+        }
+    }
+    DEV(page_free)(ioc, iop, iopc);
+
+    return 0;
+}
+
+/**
+ * Merge all data segments of a file into a newly allocated one.
+ * This needs to be done when number of file segments reached its max limit.
+ * @param   ioc         io context
+ * @param   nodep       file pointer
+ * @param   newsize     file new size in byte count
+ * @return  0 if ok else error code.
+ */
+static int unfs_node_merge_ds(unfs_ioc_t ioc, unfs_node_t* nodep, u64 newsize)
+{
+    DEBUG_FN("merge %s dsc=%u size=%#lx", nodep->name, nodep->dscount, newsize);
+    u64 pagecount = PAGECOUNT(newsize);
+
+    u64 pageid = unfs_map_alloc(pagecount, nodep);
+    if (pageid == 0) return ENOSPC;
+    u64 pa = pageid;
+    u32 iopc = (newsize << UNFS_PAGESHIFT) + 1;
+    void* iop = DEV(page_alloc)(ioc, &iopc);
+    int i;
+    for (i = 0; i < nodep->dscount; i++) {
+        unfs_ds_t* ds = &nodep->ds[i];
+        u64 dspa = ds->pageid;
+        u64 dspc = ds->pagecount;
+        while (dspc) {
+            u64 pc = dspc;
+            if (pc > iopc) pc = iopc;
+            DEV(read)(ioc, iop, dspa, pc);
+            DEV(write)(ioc, iop, pa, pc);
+            pa += pc;
+            dspa += pc;
+            dspc -= pc;
+        }
+        unfs_map_free(ds->pageid, ds->pagecount);
+        ds->pageid = 0;
+        ds->pagecount = 0;
+    }
+    DEV(page_free)(ioc, iop, iopc);
+
+    nodep->ds[0].pageid = pageid;
+    nodep->ds[0].pagecount = pagecount;
+    nodep->dscount = 1;
+    if (nodep->heat) nodep->heat[0] = 0;
+    nodep->updated = 1;
+    return 0;
+}
+
+/**
+ * Load the change table of a file node upon its first use.
+ * @param   ioc         io context
+ * @param   nodep       file node
+ */
+static void unfs_chg_load(unfs_ioc_t ioc, unfs_node_t* nodep)
+{
+    if (nodep->chg) return;
+    nodep->chg = calloc(1, sizeof(unfs_chg_t));
+    nodep->chg->shift = CHG_SHIFT;
+    if (!nodep->chgpage) return;
+    u32 iopc = 1;
+    void* iop = DEV(page_alloc)(ioc, &iopc);
+    IOPRIO_ENTER(UNFS_IOPRIO_META);
+    DEV(read)(ioc, iop, nodep->chgpage, 1);
+    IOPRIO_LEAVE();
+    memcpy(nodep->chg, iop, sizeof(unfs_chg_t));
+    DEV(page_free)(ioc, iop, iopc);
+}
+
+/**
+ * Record a file byte range as written in the current change generation.
+ * When the range goes beyond the change table, the chunk size is doubled
+ * by merging the generations of each chunk pair.  Upon the first write to
+ * a chunk in a new generation, the table page is written before returning,
+ * i.e. before the caller writes the data, so the recorded generation of a
+ * chunk on device is never older than its data.
+ * A file without a table page (new, or from an UNFS-1.0 volume) is given
+ * one with every chunk in the current generation, which is recorded in the
+ * file entry upon the next node sync.  Until then a crash leaves the file
+ * without a table, and unfs_file_changes reports it as wholly changed.
+ * @param   ioc         io context
+ * @param   nodep       file node (write locked, FS lock not held)
+ * @param   offset      file offset position
+ * @param   len         number of bytes
+ */
+static void unfs_node_changed(unfs_ioc_t ioc, unfs_node_t* nodep, u64 offset, u64 len)
+{
+    if (!len) return;
+    unfs_chg_load(ioc, nodep);
+    unfs_chg_t* chg = nodep->chg;
+    u32 gen = unfs.header->chgen;
+    int changed = 0;
+    u64 c;
+    if (!nodep->chgpage && !nodep->temp) {
+        FS_WRLOCK();
+        nodep->chgpage = unfs_map_alloc(1, nodep);
+        FS_UNLOCK();
+        if (!nodep->chgpage) return;
+        for (c = 0; c < UNFS_CHGCOUNT; c++) chg->gen[c] = gen;
+        nodep->updated = 1;
+        changed = 1;
+    }
+    u64 last = offset + len - 1;
+    while ((last >> chg->shift) >= UNFS_CHGCOUNT) {
+        for (c = 0; c < UNFS_CHGCOUNT; c++) {
+            u32 a = (2 * c) < UNFS_CHGCOUNT ? chg->gen[2 * c] : 0;
+            u32 b = (2 * c + 1) < UNFS_CHGCOUNT ? chg->gen[2 * c + 1] : 0;
+            chg->gen[c] = a > b ? a : b;
+        }
+        chg->shift++;
+        changed = 1;
+    }
+    for (c = offset >> chg->shift; c <= (last >> chg->shift); c++) {
+        if (chg->gen[c] != gen) {
+            chg->gen[c] = gen;
+            changed = 1;
+        }
+    }
+    if (changed && nodep->chgpage) {
+        u32 iopc = 1;
+        void* iop = DEV(page_alloc)(ioc, &iopc);
+        memcpy(iop, chg, sizeof(unfs_chg_t));
+        IOPRIO_ENTER(UNFS_IOPRIO_META);
+        DEV(write)(ioc, iop, nodep->chgpage, 1);
+        IOPRIO_LEAVE();
+        DEV(page_free)(ioc, iop, iopc);
+    }
+}
+
+/**
+ * Enter a file data update, counted against the current change generation
+ * so unfs_change_gen can wait for the updates of the generation it ends.
+ * @return  the change generation entered.
+ */
+static u64 unfs_chg_enter()
+{
+#ifdef UNFS_NOLOCK
+    return unfs.header->chgen;
+#endif
+    for (;;) {
+        u64 gen = __atomic_load_n(&unfs.header->chgen, __ATOMIC_ACQUIRE);
+        __sync_fetch_and_add(&unfs.chgactive[gen & 1], 1);
+        if (__atomic_load_n(&unfs.header->chgen, __ATOMIC_SEQ_CST) == gen)
+            return gen;
+        __sync_fetch_and_sub(&unfs.chgactive[gen & 1], 1);
+    }
+}
+
+/**
+ * Leave a file data update.
+ * @param   gen         the change generation entered
+ */
+static void unfs_chg_leave(u64 gen)
+{
+#ifndef UNFS_NOLOCK
+    __sync_fetch_and_sub(&unfs.chgactive[gen & 1], 1);
+#endif
+}
+
+static int unfs_temp_resize(unfs_ioc_t ioc, unfs_node_t* nodep, u64 newsize, int* fill);
+
+/**
+ * Resize a file node.
+ * @param   ioc         io context
+ * @param   nodep       file pointer
+ * @param   newsize     file new size in byte count
+ * @param   fill        pointer to a pattern to fill the newly added portion
+ * @return  0 if ok else error code.
+ */
+static int unfs_node_resize(unfs_ioc_t ioc, unfs_node_t* nodep, u64 newsize, int* fill)
+{
+    u64 oldsize = nodep->size;
+    DEBUG_FN("%s from %#lx to %#lx", nodep->name, oldsize, newsize);
+    if (oldsize == newsize) return 0;
+    if (nodep->temp == TEMP_MEM)
+        return unfs_temp_resize(ioc, nodep, newsize, fill);
+
+    // size increase may require adding segments
+    if (newsize > oldsize) {
+        // zero filled the uninit portion of the last page of the last segment
+        u64 zlen =  oldsize & (UNFS_PAGESIZE - 1);
+        if (fill && zlen) {
+            u32 iopc = 1;
+            void* iop = DEV(page_alloc)(ioc, &iopc);
+            if (iopc != 1)
+                FATAL("cannot allocate 1 page");
+            unfs_ds_t* ds = &nodep->ds[nodep->dscount - 1];
+            u64 pa = ds->pageid + ds->pagecount - 1;
+            DEV(read)(ioc, iop, pa, 1);
+            memset(iop + zlen, *fill, UNFS_PAGESIZE - zlen);
+            DEV(write)(ioc, iop, pa, 1);
+            DEV(page_free)(ioc, iop, iopc);
+        }
+
+        // check to add new segment for additional page(s)
+        u64 addpc = PAGECOUNT(newsize) - PAGECOUNT(oldsize);
+        if (addpc > 0) {
+            u64 pageid = 0;
+            if (nodep->dscount < UNFS_MAXDS) {
+                // if segment is available then check to add one
+                pageid = unfs_bulk_alloc(nodep, addpc);
+                if (pageid == 0) pageid = unfs_map_alloc(addpc, nodep);
+                if (pageid == 0) return ENOSPC;
+                int i = nodep->dscount - 1;
+                unfs_ds_t* dsp = nodep->ds + i;
+                // if contiguous then modify last segment else add new segment
+                if (i >= 0 && pageid == (dsp->pageid + dsp->pagecount)) {
+                    dsp->pagecount += addpc;
+                    DEBUG_FN("%s mod ds[%d]=(%#lx %#lx) page=%#lx",
+                          nodep->name, i, dsp->pageid, dsp->pagecount, pageid);
+                } else {
+                    i++;
+                    dsp++;
+                    nodep->dscount++;
+                    dsp->pageid = pageid;
+                    dsp->pagecount = addpc;
+                    if (nodep->heat) nodep->heat[i] = 0;
+                    DEBUG_FN("%s add ds[%d]=(%#lx %#lx)",
+                                    nodep->name, i, pageid, addpc);
+                }
+            } else {
+                // if no segment is available then merge all into one
+                int err = unfs_node_merge_ds(ioc, nodep, newsize);
+                if (err) return err;
+                pageid = nodep->ds[0].pageid + PAGECOUNT(oldsize);
+            }
+
+            if (fill) {
+                u64 pc = addpc;
+                u32 iopc = addpc;
+                void* iop = DEV(page_alloc)(ioc, &iopc);
+                if (pc > iopc) pc = iopc;
+                memset(iop, *fill, pc << UNFS_PAGESHIFT);
+
+                while (addpc) {
+                    if (pc > addpc) pc = addpc;
+                    DEV(write)(ioc, iop, pageid, pc);
+                    pageid += pc;
+                    addpc -= pc;
+                }
+                DEV(page_free)(ioc, iop, iopc);
+            }
+        }
+
+    // size decrease may require deleting segments
+    } else {
+        u64 delpc = PAGECOUNT(oldsize) - PAGECOUNT(newsize);
+        unfs_ds_t* ds = &nodep->ds[nodep->dscount-1];
+        while (delpc) {
+            if (ds->pagecount > delpc) {
+                ds->pagecount -= delpc;
+                unfs_map_free(ds->pageid + ds->pagecount, delpc);
+                break;
+            }
+            unfs_map_free(ds->pageid, ds->pagecount);
+            delpc -= ds->pagecount;
+            nodep->dscount--;
+            ds--;
+        }
+    }
+
+    if (nodep->temp) unfs.tempspill += PAGECOUNT(newsize) - PAGECOUNT(oldsize);
+    nodep->size = newsize;
+    nodep->mapgen = ATOMIC_ADD(&unfs.mapgen, 1);
+    nodep->updated = 1;
+    return 0;
+}
+
+/**
+ * Move a temporary file data from memory onto (unpersisted) device pages
+ * and resize it.
+ * @param   ioc         io context
+ * @param   nodep       file pointer
+ * @param   newsize     file new size in byte count
+ * @param   fill        pointer to a pattern to fill the newly added portion
+ * @return  0 if ok else error code.
+ */
+static int unfs_temp_spill(unfs_ioc_t ioc, unfs_node_t* nodep, u64 newsize, int* fill)
+{
+    DEBUG_FN("%s size=%#lx mem=%#lx", nodep->name, nodep->size, unfs.tempmem);
+    void* mem = nodep->mem;
+    u64 size = nodep->size;
+    nodep->temp = TEMP_SPILL;
+    nodep->size = 0;
+    int err = unfs_node_resize(ioc, nodep, size, NULL);
+    if (err) {
+        nodep->temp = TEMP_MEM;
+        nodep->size = size;
+        return err;
+    }
+    unfs_node_rw(ioc, nodep, mem, 0, size, 1);
+    free(mem);
+    unfs.tempmem -= nodep->memcap;
+    nodep->mem = NULL;
+    nodep->memcap = 0;
+    return unfs_node_resize(ioc, nodep, newsize, fill);
+}
+
+/**
+ * Resize an in-memory temporary file.  If the temporary memory limit is
+ * reached, the file will be moved onto device pages.
  * @param   ioc         io context
  * @param   nodep       file pointer
  * @param   newsize     file new size in byte count
  * @param   fill        pointer to a pattern to fill the newly added portion
  * @return  0 if ok else error code.
  */
-static int unfs_node_resize(unfs_ioc_t ioc, unfs_node_t* nodep, u64 newsize, int* fill)
+static int unfs_temp_resize(unfs_ioc_t ioc, unfs_node_t* nodep, u64 newsize, int* fill)
+{
+    if (newsize > nodep->memcap) {
+        u64 memcap = nodep->memcap ? nodep->memcap : TEMP_MEMMIN;
+        while (memcap < newsize) memcap <<= 1;
+        if ((unfs.tempmem + memcap - nodep->memcap) > unfstemp.memmax)
+            return unfs_temp_spill(ioc, nodep, newsize, fill);
+        void* mem = realloc(nodep->mem, memcap);
+        if (!mem) return ENOMEM;
+        unfs.tempmem += memcap - nodep->memcap;
+        nodep->mem = mem;
+        nodep->memcap = memcap;
+    }
+    if (newsize > nodep->size)
+        memset(nodep->mem + nodep->size, fill ? *fill : 0, newsize - nodep->size);
+    nodep->size = newsize;
+    return 0;
+}
+
+/**
+ * Make a temporary file persistent by moving its data onto device pages
+ * and allocating a file entry.
+ * @param   ioc         io context
+ * @param   nodep       file pointer
+ * @return  0 if ok else error code.
+ */
+static int unfs_temp_persist(unfs_ioc_t ioc, unfs_node_t* nodep)
+{
+    DEBUG_FN("%s", nodep->name);
+    if (nodep->temp == TEMP_MEM) {
+        int err = unfs_temp_spill(ioc, nodep, nodep->size, NULL);
+        if (err) return err;
+    }
+    u64 pageid = unfs_node_alloc(0);
+    if (pageid == 0) return ENOSPC;
+
+    // mark the data pages to be synced in the bitmap
+    int i;
+    for (i = 0; i < nodep->dscount; i++) {
+        u64 pa = nodep->ds[i].pageid;
+        if (unfs.mapsynclo > pa) unfs.mapsynclo = pa;
+        pa += nodep->ds[i].pagecount;
+        if (unfs.mapsynchi < pa) unfs.mapsynchi = pa;
+    }
+    unfs.tempspill -= PAGECOUNT(nodep->size);
+    unfs_temp_unlink(nodep);
+    nodep->temp = 0;
+    nodep->pageid = pageid;
+    nodep->parent->tempcount--;
+    unfs_node_sync(ioc, nodep->parent);
+    return 0;
+}
+
+/**
+ * Create a file/directory.
+ * @param   pp          parsed path
+ * @param   isdir       directory flag
+ * @return  node pointer or NULL if error.
+ */
+static unfs_node_t* unfs_node_create(const unfs_path_t* pp, int isdir)
+{
+    DEBUG_FN("%.*s", pp->len, pp->name);
+    unfs_node_t* parent = unfs_node_find_parent(pp);
+    if (!parent) {
+        ERROR("Parent directory of %.*s does not exist", pp->len, pp->name);
+        return NULL;
+    }
+
+    // temporary file is only added in memory (file name is terminated)
+    int temp = !isdir && unfs_temp_match(pp->name);
+    unfs_entry_t node = { .isdir = isdir };
+    if (!temp) {
+        META_LOCK();
+        node.pageid = unfs_node_alloc(isdir);
+        META_UNLOCK();
+        if (node.pageid == 0) return NULL;
+    }
+    node.parentid = parent->pageid;
+
+    unfs_node_t* newnodep = unfs_node_add(parent, pp, &node);
+    parent->size++;
+    if (temp) {
+        newnodep->temp = TEMP_MEM;
+        parent->tempcount++;
+        META_LOCK();
+        unfs_temp_link(newnodep);
+        META_UNLOCK();
+        return newnodep;
+    }
+    unfs_ioc_t ioc = DEV(ioc_alloc)();
+    unfs_node_sync(ioc, parent);
+    unfs_node_sync(ioc, newnodep);
+    DEV(ioc_free)(ioc);
+    return newnodep;
+}
+
+/**
+ * Wait for the data movement (i.e. tier migration or offload) of the named
+ * nodes to finish (with the namespace write locked, see unfs_ns_lock).
+ * @param   v           locked tree id
+ * @param   name        node name
+ * @param   name2       second node name or NULL
+ */
+static void unfs_pin_wait(int v, const char* name, const char* name2)
+{
+    for (;;) {
+        unfs_node_t* nodep = unfs_node_find(name);
+        unfs_node_t* nodep2 = name2 ? unfs_node_find(name2) : NULL;
+        if (!(nodep && nodep->pin) && !(nodep2 && nodep2->pin)) break;
+        unfs_ns_unlock(v);
+        sched_yield();
+        if (v) {
+            VOL_WRLOCK(v);
+            FS_RDLOCK();
+        } else {
+            FS_WRLOCK();
+        }
+    }
+}
+
+static void unfs_sync();
+static void unfs_txn_flush(unfs_ioc_t ioc);
+
+/**
+ * Get the device page address of a file page.
+ * @param   nodep       file node
+ * @param   fpage       file page index
+ * @param   pcp         page count (to be truncated to the segment end)
+ * @return  the device page address.
+ */
+static u64 unfs_node_page(unfs_node_t* nodep, u64 fpage, u64* pcp)
+{
+    unfs_ds_t* ds = nodep->ds;
+    while (fpage >= ds->pagecount) {
+        fpage -= ds->pagecount;
+        ds++;
+    }
+    if (*pcp > (ds->pagecount - fpage)) *pcp = ds->pagecount - fpage;
+    return ds->pageid + fpage;
+}
+
+/**
+ * Offload/recall streaming thread.  Each thread takes the next file chunk
+ * and copies it between the device and the host object (or passes it to
+ * the export function).
+ * @param   arg         streaming context
+ * @return  NULL.
+ */
+static void* unfs_stream_thread(void* arg)
+{
+    unfs_stream_t* sp = arg;
+    unfs_node_t* nodep = sp->nodep;
+    unfs_sched_class(sp->ioprio);
+    unfs_ioc_t ioc = DEV(ioc_alloc)();
+    u32 iopc = OFFLOAD_CHUNKPC;
+    void* iop = DEV(page_alloc)(ioc, &iopc);
+
+    for (;;) {
+        u64 chunk = __sync_fetch_and_add(&sp->next, OFFLOAD_CHUNKPC);
+        if (chunk >= sp->pagecount || sp->error) break;
+        u64 chunkend = chunk + OFFLOAD_CHUNKPC;
+        if (chunkend > sp->pagecount) chunkend = sp->pagecount;
+
+        u64 fpage, p, pc;
+        for (fpage = chunk; fpage < chunkend; fpage += pc) {
+            pc = chunkend - fpage;
+            if (pc > iopc) pc = iopc;
+            off_t off = fpage << UNFS_PAGESHIFT;
+            ssize_t len = pc << UNFS_PAGESHIFT;
+            if ((off + len) > nodep->size) len = nodep->size - off;
+
+            if (!sp->wflag && pread(sp->hostfd, iop, len, off) != len) {
+                sp->error = EIO;
+                break;
+            }
+            u64 n;
+            for (p = 0; p < pc; p += n) {
+                n = pc - p;
+                u64 pa = unfs_node_page(nodep, fpage + p, &n);
+                if (sp->wflag)
+                    DEV(read)(ioc, iop + (p << UNFS_PAGESHIFT), pa, n);
+                else
+                    DEV(write)(ioc, iop + (p << UNFS_PAGESHIFT), pa, n);
+            }
+            if (sp->fn) {
+                int err = sp->fn(sp->arg, iop, off, len);
+                if (err) {
+                    sp->error = err;
+                    break;
+                }
+            } else if (sp->wflag && pwrite(sp->hostfd, iop, len, off) != len) {
+                sp->error = EIO;
+                break;
+            }
+        }
+    }
+
+    DEV(page_free)(ioc, iop, iopc);
+    DEV(ioc_free)(ioc);
+    return NULL;
+}
+
+/**
+ * Run a file data streaming context with parallel streaming threads.
+ * @param   sp          streaming context
+ * @param   threads     max number of threads
+ * @return  0 if ok else error code.
+ */
+static int unfs_stream_run(unfs_stream_t* sp, int threads)
+{
+    u64 chunks = (sp->pagecount + OFFLOAD_CHUNKPC - 1) / OFFLOAD_CHUNKPC;
+    int i, n = threads;
+    if (n > chunks) n = chunks;
+    if (n < 1 || NOLOCK) n = 1;
+
+    pthread_t* tids = alloca(n * sizeof(pthread_t));
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&tids[i], NULL, unfs_stream_thread, sp))
+            FATAL("cannot create streaming thread");
+    }
+    for (i = 0; i < n; i++) pthread_join(tids[i], NULL);
+    return sp->error;
+}
+
+/**
+ * Copy file data between the device and a host object using parallel
+ * streaming threads.
+ * @param   nodep       file node (with file lock held)
+ * @param   hostfd      host object file descriptor
+ * @param   wflag       device to host flag
+ * @param   ioprio      I/O priority class
+ * @return  0 if ok else error code.
+ */
+static int unfs_offload_stream(unfs_node_t* nodep, int hostfd, int wflag, int ioprio)
+{
+    unfs_stream_t st = { .nodep = nodep, .hostfd = hostfd, .wflag = wflag,
+                         .ioprio = ioprio, .pagecount = PAGECOUNT(nodep->size) };
+    return unfs_stream_run(&st, unfsoffload.threads);
+}
+
+/**
+ * Recall an offloaded file data onto newly allocated pages (with file
+ * write lock held).  The object is removed after the entry is updated.
+ * @param   nodep       file node
+ * @return  0 if ok else error code.
+ */
+static int unfs_node_recall(unfs_node_t* nodep)
+{
+    if (!nodep->offload) return 0;
+    if (unfs.rdonly) return EROFS;
+    DEBUG_FN("%s %#lx size=%#lx", nodep->name, nodep->offload, nodep->size);
+    if (!unfsoffload.dir) {
+        ERROR("%s is offloaded but no offload directory", nodep->name);
+        return ENOENT;
+    }
+    char path[UNFS_MAXPATH];
+    int hostfd = open(unfs_offload_path(path, nodep->offload), O_RDONLY);
+    if (hostfd < 0) {
+        ERROR("open %s (%s)", path, strerror(errno));
+        return errno;
+    }
+
+    // allocate the data pages and copy the data in
+    u64 size = nodep->size;
+    FS_WRLOCK();
+    unfs_ioc_t ioc = DEV(ioc_alloc)();
+    FILE_SEQ_BEGIN(nodep);
+    nodep->size = 0;
+    int err = unfs_node_resize(ioc, nodep, size, NULL);
+    FS_UNLOCK();
+    if (!err) err = unfs_offload_stream(nodep, hostfd, 0, UNFS_IOPRIO_FG);
+    close(hostfd);
+
+    FS_WRLOCK();
+    if (err) {
+        ERROR("%s recall failed (%s)", nodep->name, strerror(err));
+        unfs_node_resize(ioc, nodep, 0, NULL);
+        nodep->size = size;
+    } else {
+        nodep->offload = 0;
+        unfs_node_sync(ioc, nodep);
+        unfs_sync();
+        nodep->updated = 0;
+    }
+    FILE_SEQ_END(nodep);
+    FS_UNLOCK();
+    DEV(ioc_free)(ioc);
+    if (!err) unlink(path);
+    return err;
+}
+
+#ifndef UNFS_NOLOCK
+/**
+ * Read file data without the file lock.  The data segments covering the
+ * read range are copied while the file sequence number is unchanged, and
+ * the data is read through the copy.  The read is retried if the size or
+ * segment map has changed meanwhile (e.g. by a resize or tier move which
+ * may have released the pages read).
+ * @param   ioc         io context
+ * @param   nodep       file node
+ * @param   buf         data buffer
+ * @param   offset      file offset position
+ * @param   len         number of bytes
+ * @return  0 if ok, EAGAIN if to be read with the file lock, else error code.
+ */
+static int unfs_node_read_seq(unfs_ioc_t ioc, unfs_node_t* nodep,
+                              void* buf, u64 offset, u64 len)
+{
+    unfs_node_t* snap = alloca(sizeof(unfs_node_t) + FILE_SEQ_MAXDS * sizeof(unfs_ds_t));
+    memset(snap, 0, sizeof(unfs_node_t));
+    u64 endpage = (offset + len - 1) >> UNFS_PAGESHIFT;
+    int t;
+
+    for (t = 0; t < FILE_SEQ_TRIES; t++) {
+        u32 seq = FILE_SEQ_READ(nodep);
+        if (seq & 1) continue;
+        int open = nodep->open;
+        u64 size = nodep->size;
+        u32 dscount = nodep->dscount;
+        if (!open || nodep->offload || nodep->temp || dscount > UNFS_MAXDS) {
+            if (FILE_SEQ_RETRY(nodep, seq)) continue;
+            return EAGAIN;
+        }
+        if ((offset + len) > size) {
+            if (FILE_SEQ_RETRY(nodep, seq)) continue;
+            ERROR("%s off=%#lx len=%#lx size=%#lx", nodep->name, offset, len, size);
+            return EINVAL;
+        }
+
+        // copy the segments from the one with the offset page
+        u64 fpage = 0;
+        u32 d = 0, n = 0;
+        while (d < dscount && (fpage + nodep->ds[d].pagecount) <= (offset >> UNFS_PAGESHIFT))
+            fpage += nodep->ds[d++].pagecount;
+        u32 d0 = d;
+        u64 p = fpage;
+        while (d < dscount && p <= endpage && n < FILE_SEQ_MAXDS) {
+            snap->ds[n] = nodep->ds[d++];
+            p += snap->ds[n++].pagecount;
+        }
+        if (FILE_SEQ_RETRY(nodep, seq)) continue;
+        if (p <= endpage) return EAGAIN;
+
+        snap->dscount = n;
+        int err = unfs_node_rw(ioc, snap, buf, offset - (fpage << UNFS_PAGESHIFT), len, 0);
+        if (FILE_SEQ_RETRY(nodep, seq)) continue;
+        if (nodep->heat) {
+            for (d = 0; d < n; d++) nodep->heat[d0 + d]++;
+        }
+        return err;
+    }
+    return EAGAIN;
+}
+#endif
+
+/**
+ * Resolve a name given to a sub-volume handle to its name on the device,
+ * i.e. the name under the sub-volume root (see unfs_open_vol).
+ * @param   fs          filesystem reference
+ * @param   name        canonical name in the sub-volume
+ * @param   path        buffer for the resolved name
+ * @return  the resolved name (or an invalid name if too long).
+ */
+static const char* unfs_vol_path(unfs_fs_t fs, const char* name, char* path)
+{
+    int v = FS_VOL(fs);
+    if (!v || !unfs.vol[v] || name[0] != '/') return name;
+    if (snprintf(path, UNFS_MAXPATH, "%s%s", unfs.vol[v], name[1] ? name : "")
+        >= UNFS_MAXPATH)
+        return "";
+    return path;
+}
+
+/**
+ * Strip the sub-volume root from a name (in place).
+ * @param   v           sub-volume id
+ * @param   name        name on the device
+ */
+static void unfs_vol_strip(int v, char* name)
+{
+    if (!v || !unfs.vol[v]) return;
+    size_t n = strlen(unfs.vol[v]);
+    if (strncmp(name, unfs.vol[v], n)) return;
+    if (name[n]) memmove(name, name + n, strlen(name + n) + 1);
+    else strcpy(name, "/");
+}
+
+/**
+ * Open/Create a file.
+ * @param   fs          filesystem reference
+ * @param   name        canonical name
+ * @param   mode        open mode
+ * @return  file descriptor reference or NULL if error.
+ */
+unfs_fd_t unfs_file_open(unfs_fs_t fs, const char *name, unfs_mode_t mode)
+{
+    DEBUG_FN("%s", name);
+    unfs_fd_t fd = { .error = 0, .mode = mode, .id = NULL, .vol = FS_VOL(fs) };
+    unfs_path_t path;
+    char vpath[UNFS_MAXPATH];
+
+    if (FS_CHECK(fs) || unfs_path_parse(name = unfs_vol_path(fs, name, vpath), &path)) {
+        fd.error = EINVAL;
+        return fd;
+    }
+
+    int v = unfs_ns_lock(name, 1);
+    unfs_pin_wait(v, name, NULL);
+    unfs_node_t* nodep = unfs_node_lookup(name, path.len, path.hash);
+    if (nodep) {
+        FILE_WRLOCK(nodep);
+        if ((mode & UNFS_OPEN_EXCLUSIVE) && nodep->open) {
+            FILE_UNLOCK(nodep);
+            fd.error = EBUSY;
+            goto done;
+        }
+        nodep->open++;
+        FILE_UNLOCK(nodep);
+    } else {
+        if (!(mode & UNFS_OPEN_CREATE)) {
+            fd.error = ENOENT;
+            goto done;
+        }
+        if (unfs.rdonly) {
+            fd.error = EROFS;
+            goto done;
+        }
+        nodep = unfs_node_create(&path, 0);
+        if (!nodep) {
+            fd.error = ENOENT;
+            goto done;
+        }
+        nodep->open++;
+        unfs_sync();
+    }
+    fd.id = nodep;
+
+done:
+    unfs_ns_unlock(v);
+    return fd;
+}
+
+/**
+ * Close a file.
+ * @param   fd          file descriptor reference
+ * @return  0 if ok else error code.
+ */
+int unfs_file_close(unfs_fd_t fd)
+{
+    int err = EINVAL;
+    unfs_node_t* nodep = fd.id;
+
+    FILE_WRLOCK(nodep);
+    DEBUG_FN("%s %d", nodep->name, nodep->open);
+    if (nodep->open) {
+        nodep->open--;
+        if (nodep->updated && !nodep->temp && !unfs.bulk) {
+            IOPRIO_ENTER(UNFS_IOPRIO_META);
+            unfs_ioc_t ioc = DEV(ioc_alloc)();
+            // read lock the filesystem so a remove cannot relocate the
+            // entry, and no other header update is seen half done
+            FS_RDLOCK();
+            unfs_node_sync(ioc, nodep);
+            unfs_header_sync(ioc);
+            FS_UNLOCK();
+            DEV(ioc_free)(ioc);
+            IOPRIO_LEAVE();
+            nodep->updated = 0;
+        }
+        err = 0;
+    }
+    FILE_UNLOCK(nodep);
+    return err;
+}
+
+/**
+ * Sync file state to device.
+ * @param   fd          file descriptor reference
+ * @return  0 if ok else error code.
+ */
+int unfs_file_sync(unfs_fd_t fd)
+{
+    int err = EINVAL;
+    unfs_node_t* nodep = fd.id;
+
+    FILE_WRLOCK(nodep);
+    DEBUG_FN("%s", nodep->name);
+    if (nodep->open) {
+        if (nodep->updated && !nodep->temp && !unfs.bulk) {
+            IOPRIO_ENTER(UNFS_IOPRIO_META);
+            unfs_ioc_t ioc = DEV(ioc_alloc)();
+            // read lock the filesystem so a remove cannot relocate the
+            // entry, and no other header update is seen half done
+            FS_RDLOCK();
+            unfs_node_sync(ioc, nodep);
+            unfs_header_sync(ioc);
+            FS_UNLOCK();
+            DEV(ioc_free)(ioc);
+            IOPRIO_LEAVE();
+            nodep->updated = 0;
+        }
+        err = 0;
+    }
+    FILE_UNLOCK(nodep);
+    return err;
+}
+
+/**
+ * Return the file name.
+ * @param   fd          file descriptor reference
+ * @param   name        returned name buffer
+ * @param   len         name buffer length
+ * @return  the name buffer if specified or allocated string or NULL if error.
+ */
+char* unfs_file_name(unfs_fd_t fd, char* name, int len)
+{
+    unfs_node_t* nodep = fd.id;
+
+    FILE_RDLOCK(nodep);
+    char* s = NULL;
+    if (nodep->open) {
+        s = name ? strncpy(name, nodep->name, len) : strdup(nodep->name);
+        unfs_vol_strip(fd.vol, s);
+    }
+    FILE_UNLOCK(nodep);
+    return s;
+}
+
+/**
+ * Return the file status including size and data segment info.
+ * If dslp is not NULL, a ds segment array will be allocated and
+ * caller must free it when done.
+ * @param   fd          file descriptor reference
+ * @param   sizep       file size pointer
+ * @param   dscp        number of ds entry count pointer
+ * @param   dslp        ds entry list pointer
+ * @return  an allocated array of file data segments.
+ */
+int unfs_file_stat(unfs_fd_t fd, u64* sizep, u32* dscp, unfs_ds_t** dslp)
+{
+    int err = EINVAL;
+    unfs_node_t* nodep = fd.id;
+
+    // get the size and segment count without the file lock if possible
+    if (!dslp) {
+        int t;
+        for (t = 0; t < FILE_SEQ_TRIES; t++) {
+            u32 seq = FILE_SEQ_READ(nodep);
+            if (seq & 1) continue;
+            int open = nodep->open;
+            u64 size = nodep->size;
+            u32 dscount = nodep->dscount;
+            if (FILE_SEQ_RETRY(nodep, seq)) continue;
+            if (!open) return EINVAL;
+            if (sizep) *sizep = size;
+            if (dscp) *dscp = dscount;
+            return 0;
+        }
+    }
+
+    FILE_RDLOCK(nodep);
+    DEBUG_FN("%s", nodep->name);
+    if (nodep->open) {
+        if (sizep) *sizep = nodep->size;
+        if (dscp) *dscp = nodep->dscount;
+        if (dslp) {
+            *dslp = NULL;
+            if (nodep->dscount) {
+                size_t n = nodep->dscount * sizeof(unfs_ds_t);
+                *dslp = malloc(n);
+                memcpy(*dslp, nodep->ds, n);
+            }
+        }
+        err = 0;
+    }
+    FILE_UNLOCK(nodep);
+    return err;
+}
+
+/**
+ * Get the file extent map, i.e. the file byte ranges and their device page
+ * addresses, along with the map generation which changes whenever the file
+ * data is moved, added or removed.  The extent list should be freed by
+ * the caller.
+ * @param   fd          file descriptor reference
+ * @param   extp        extent list pointer
+ * @param   countp      extent count pointer
+ * @param   genp        map generation pointer
+ * @return  0 if ok else error code.
+ */
+int unfs_file_extents(unfs_fd_t fd, unfs_extent_t** extp, u32* countp, u64* genp)
+{
+    int err = EINVAL;
+    unfs_node_t* nodep = fd.id;
+
+    FILE_RDLOCK(nodep);
+    DEBUG_FN("%s", nodep->name);
+    if (nodep->open) {
+        if (nodep->offload || nodep->temp == TEMP_MEM) {
+            err = ENODATA;
+        } else {
+            unfs_extent_t* ext = malloc((nodep->dscount + 1) * sizeof(unfs_extent_t));
+            u64 offset = 0;
+            int i;
+            for (i = 0; i < nodep->dscount; i++) {
+                ext[i].offset = offset;
+                ext[i].pageid = nodep->ds[i].pageid;
+                ext[i].length = nodep->ds[i].pagecount << UNFS_PAGESHIFT;
+                if ((offset + ext[i].length) > nodep->size)
+                    ext[i].length = nodep->size - offset;
+                offset += ext[i].length;
+            }
+            *extp = ext;
+            *countp = nodep->dscount;
+            if (genp) *genp = nodep->mapgen;
+            err = 0;
+        }
+    }
+    FILE_UNLOCK(nodep);
+    return err;
+}
+
+/**
+ * Export the file data by streaming its extents with concurrent device
+ * reads while the file is held stable (i.e. no write, resize or data
+ * move).  The export function is called from the streaming threads with
+ * each chunk of data, and a nonzero return aborts the export.
+ * @param   fd          file descriptor reference
+ * @param   fn          export function
+ * @param   arg         export function argument
+ * @param   threads     number of streaming threads (0 for default)
+ * @param   genp        pointer to return the exported map generation
+ * @return  0 if ok else error code.
+ */
+int unfs_file_export(unfs_fd_t fd, unfs_export_fn fn, void* arg, int threads, u64* genp)
+{
+    int err = EINVAL;
+    unfs_node_t* nodep = fd.id;
+
+    if (nodep->offload) {
+        FILE_WRLOCK(nodep);
+        int rerr = unfs_node_recall(nodep);
+        FILE_UNLOCK(nodep);
+        if (rerr) return rerr;
+    }
+
+    FILE_RDLOCK(nodep);
+    DEBUG_FN("%s size=%#lx threads=%d", nodep->name, nodep->size, threads);
+    if (nodep->open) {
+        if (genp) *genp = nodep->mapgen;
+        if (nodep->temp == TEMP_MEM) {
+            err = nodep->size ? fn(arg, nodep->mem, 0, nodep->size) : 0;
+        } else {
+            unfs_stream_t st = { .nodep = nodep, .hostfd = -1, .wflag = 1,
+                                 .ioprio = fd.ioprio, .fn = fn, .arg = arg,
+                                 .pagecount = PAGECOUNT(nodep->size) };
+            err = unfs_stream_run(&st, threads ? threads : unfsoffload.threads);
+        }
+    }
+    FILE_UNLOCK(nodep);
+    return err;
+}
+
+/**
+ * Get the file byte ranges written after a change generation (see
+ * unfs_change_gen), at the file change chunk granularity, e.g. to read only
+ * the modified data for an incremental backup.  A file without a change
+ * table (i.e. not written since it was created on an UNFS-1.0 volume, or
+ * whose table was not yet recorded in its entry upon a crash) is reported
+ * as wholly changed.  The returned ranges have no page address, and the
+ * list should be freed by the caller.
+ * @param   fd          file descriptor reference
+ * @param   gen         change generation (0 for all written ranges)
+ * @param   extp        range list pointer
+ * @param   countp      range count pointer
+ * @return  0 if ok else error code.
+ */
+int unfs_file_changes(unfs_fd_t fd, u64 gen, unfs_extent_t** extp, u32* countp)
+{
+    int err = EINVAL;
+    unfs_node_t* nodep = fd.id;
+
+    FILE_WRLOCK(nodep);
+    DEBUG_FN("%s gen=%#lx", nodep->name, gen);
+    if (nodep->open && !nodep->isdir) {
+        unfs_ioc_t ioc = DEV(ioc_alloc)();
+        unfs_chg_load(ioc, nodep);
+        DEV(ioc_free)(ioc);
+        unfs_chg_t* chg = nodep->chg;
+
+        // a file without a table is a single chunk changed in all generations
+        int all = !nodep->chgpage && !nodep->temp;
+        u64 csize = all ? nodep->size : 1UL << chg->shift;
+        u64 cmax = all ? 1 : UNFS_CHGCOUNT;
+        u32 count = 0;
+        unfs_extent_t* ext = malloc(((UNFS_CHGCOUNT + 1) / 2) * sizeof(unfs_extent_t));
+        u64 c;
+        for (c = 0; c < cmax && (c * csize) < nodep->size; c++) {
+            if (!all && chg->gen[c] <= gen) continue;
+            u64 offset = c * csize;
+            u64 end = offset + csize < nodep->size ? offset + csize : nodep->size;
+            if (count && (ext[count - 1].offset + ext[count - 1].length) == offset) {
+                ext[count - 1].length = end - ext[count - 1].offset;
+            } else {
+                ext[count].offset = offset;
+                ext[count].pageid = 0;
+                ext[count++].length = end - offset;
+            }
+        }
+        *extp = ext;
+        *countp = count;
+        err = 0;
+    }
+    FILE_UNLOCK(nodep);
+    return err;
+}
+
+/**
+ * Resize a file.
+ * @param   fd          file descriptor reference
+ * @param   newsize     new size
+ * @param   fill        pointer to a pattern to fill the newly added portion
+ * @return  0 if ok else error code.
+ */
+int unfs_file_resize(unfs_fd_t fd, u64 newsize, int* fill)
+{
+    int err = EINVAL;
+    unfs_node_t* nodep = fd.id;
+
+    if (unfs.rdonly) return EROFS;
+
+    FILE_WRLOCK(nodep);
+    DEBUG_FN("%s %#lx", nodep->name, newsize);
+    if (nodep->open && !(err = unfs_node_recall(nodep))) {
+        IOPRIO_ENTER(fd.ioprio);
+        u64 gen = unfs_chg_enter();
+        unfs_ioc_t ioc = DEV(ioc_alloc)();
+        if (newsize > nodep->size)
+            unfs_node_changed(ioc, nodep, nodep->size, newsize - nodep->size);
+        FS_WRLOCK();
+        FILE_SEQ_BEGIN(nodep);
+        unfs_node_resize(ioc, nodep, newsize, fill);
+        FILE_SEQ_END(nodep);
+        DEV(ioc_free)(ioc);
+        FS_UNLOCK();
+        unfs_chg_leave(gen);
+        IOPRIO_LEAVE();
+    }
+    FILE_UNLOCK(nodep);
+    return err;
+}
+
+/**
+ * Read data from a file into a user buffer.
+ * @param   fd          file descriptor reference
+ * @param   buf         data buffer
+ * @param   offset      file offset position
+ * @param   len         number of bytes to read
+ * @return  0 if ok else error code.
+ */
+int unfs_file_read(unfs_fd_t fd, void *buf, u64 offset, u64 len)
+{
+    int err = EINVAL;
+    unfs_node_t* nodep = fd.id;
+
+    if (nodep->offload) {
+        FILE_WRLOCK(nodep);
+        int rerr = unfs_node_recall(nodep);
+        FILE_UNLOCK(nodep);
+        if (rerr) return rerr;
+    }
+
+#ifndef UNFS_NOLOCK
+    // read without the file lock if possible
+    if (len && !nodep->temp) {
+        IOPRIO_ENTER(fd.ioprio);
+        unfs_ioc_t ioc = DEV(ioc_alloc)();
+        err = unfs_node_read_seq(ioc, nodep, buf, offset, len);
+        DEV(ioc_free)(ioc);
+        IOPRIO_LEAVE();
+        if (err != EAGAIN) return err;
+        err = EINVAL;
+    }
+#endif
+
+    FILE_RDLOCK(nodep);
+    DEBUG_FN("%s off=%#lx len=%#lx size=%#lx", nodep->name, offset, len, nodep->size);
+    if (nodep->open) {
+        if ((offset + len) <= nodep->size) {
+            IOPRIO_ENTER(fd.ioprio);
+            unfs_ioc_t ioc = DEV(ioc_alloc)();
+            err = unfs_node_rw(ioc, nodep, buf, offset, len, 0);
+            DEV(ioc_free)(ioc);
+            IOPRIO_LEAVE();
+        } else {
+            ERROR("%s off=%#lx len=%#lx size=%#lx", nodep->name, offset, len, nodep->size);
+        }
+    }
+    FILE_UNLOCK(nodep);
+    return err;
+}
+
+/**
+ * Write data into a file.
+ * @param   fd          file descriptor reference
+ * @param   buf         data buffer
+ * @param   offset      file offset position
+ * @param   len         number of bytes to read
+ * @return  0 if ok else error code.
+ */
+int unfs_file_write(unfs_fd_t fd, const void *buf, u64 offset, u64 len)
+{
+    int err = EINVAL;
+    unfs_node_t* nodep = fd.id;
+
+    if (unfs.rdonly) return EROFS;
+
+    DEBUG_FN("%s off=%#lx len=%#lx size=%#lx", nodep->name, offset, len, nodep->size);
+#if 0
+    // file offset should not exceed file size
+    if (offset > nodep->size) {
+        ERROR("%s off=%#lx len=%#lx size=%#lx", nodep->name, offset, len, nodep->size);
+        return err;
+    }
+#endif
+
+    FILE_WRLOCK(nodep);
+    if (nodep->open && !(err = unfs_node_recall(nodep))) {
+        IOPRIO_ENTER(fd.ioprio);
+        u64 gen = unfs_chg_enter();
+        unfs_ioc_t ioc = DEV(ioc_alloc)();
+        unfs_node_changed(ioc, nodep, offset, len);
+        u64 size = offset + len;
+        int wflag = 1;
+        if (size > nodep->size) {
+            FS_WRLOCK();
+            if (unfs.bulk) wflag = RW_EXTEND;
+            FILE_SEQ_BEGIN(nodep);
+            err = unfs_node_resize(ioc, nodep, size, NULL);
+            FILE_SEQ_END(nodep);
+            FS_UNLOCK();
+        }
+        if (!err) {
+            FILE_WSEQ_BEGIN(nodep);
+            err = unfs_node_rw(ioc, nodep, (void*)buf, offset, len, wflag);
+            FILE_WSEQ_END(nodep);
+        }
+        DEV(ioc_free)(ioc);
+        unfs_chg_leave(gen);
+        IOPRIO_LEAVE();
+    }
+    FILE_UNLOCK(nodep);
+    return err;
+}
+
+/**
+ * Read a range of file pages into a page buffer.
+ * @param   ioc         io context
+ * @param   nodep       file node
+ * @param   iop         page buffer
+ * @param   fpage       file page index
+ * @param   pc          page count
+ */
+static void unfs_node_read_pages(unfs_ioc_t ioc, unfs_node_t* nodep,
+                                 void* iop, u64 fpage, u64 pc)
+{
+    while (pc) {
+        u64 n = pc;
+        u64 pa = unfs_node_page(nodep, fpage, &n);
+        DEV(read)(ioc, iop, pa, n);
+        iop += n << UNFS_PAGESHIFT;
+        fpage += n;
+        pc -= n;
+    }
+}
+
+/**
+ * Write data into a file out of place.  The written pages (merged with the
+ * unchanged portion of the first and last page) are written to a newly
+ * allocated segment, which then replaces the old pages in the segment list
+ * and the file entry is updated within a transaction.  The pages past the
+ * old end of file are zero filled where not written.  If the replacement
+ * would exceed the max number of segments, the whole file is rewritten
+ * into the new segment.
+ * @param   ioc         io context
+ * @param   nodep       file node
+ * @param   buf         data buffer
+ * @param   offset      file offset position
+ * @param   len         number of bytes
+ * @return  0 if ok else error code.
+ */
+static int unfs_node_write_atomic(unfs_ioc_t ioc, unfs_node_t* nodep,
+                                  const void* buf, u64 offset, u64 len)
+{
+    u64 end = offset + len;
+    u64 oldpc = PAGECOUNT(nodep->size);
+    u64 fp = offset >> UNFS_PAGESHIFT;
+    u64 ep = PAGECOUNT(end);
+    u64 lo = fp < oldpc ? fp : oldpc;
+    u64 hi = ep;
+
+    // count the segments before and after the replaced pages
+    int d, before = 0, after = 0;
+    u64 dsoff = 0;
+    for (d = 0; d < nodep->dscount; d++) {
+        if (dsoff < lo) before++;
+        dsoff += nodep->ds[d].pagecount;
+        if (dsoff > hi) after++;
+    }
+    if ((before + after + 1) > UNFS_MAXDS) {
+        lo = 0;
+        if (hi < oldpc) hi = oldpc;
+    }
+    DEBUG_FN("%s off=%#lx len=%#lx pages=%#lx-%#lx",
+             nodep->name, offset, len, lo, hi);
+
+    FS_WRLOCK();
+    u64 newpage = unfs_map_alloc(hi - lo, nodep);
+    FS_UNLOCK();
+    if (newpage == 0) return ENOSPC;
+
+    // build and write the new pages (fully overwritten pages are not read)
+    u64 cfp = PAGECOUNT(offset);
+    u64 cep = end >> UNFS_PAGESHIFT;
+    u32 iopc = hi - lo;
+    void* iop = DEV(page_alloc)(ioc, &iopc);
+    u64 p;
+    for (p = lo; p < hi; p += iopc) {
+        u64 pe = hi - p > iopc ? p + iopc : hi;
+        u64 re = pe < cfp ? pe : cfp;
+        if (re > oldpc) re = oldpc;
+        if (p < re) unfs_node_read_pages(ioc, nodep, iop, p, re - p);
+        u64 rp = p > cep ? p : cep;
+        re = pe < oldpc ? pe : oldpc;
+        if (rp < re)
+            unfs_node_read_pages(ioc, nodep, iop + ((rp - p) << UNFS_PAGESHIFT),
+                                 rp, re - rp);
+        u64 b = p << UNFS_PAGESHIFT;
+        u64 e = pe << UNFS_PAGESHIFT;
+        // zero fill past the old end of file (i.e. the gap to an append)
+        u64 zb = b > nodep->size ? b : nodep->size;
+        if (zb < e) memset(iop + zb - b, 0, e - zb);
+        if (b < offset) b = offset;
+        if (e > end) e = end;
+        if (b < e)
+            memcpy(iop + b - (p << UNFS_PAGESHIFT), buf + b - offset, e - b);
+        DEV(write)(ioc, iop, newpage + p - lo, pe - p);
+    }
+    DEV(page_free)(ioc, iop, iopc);
+
+    // replace the old pages with the new segment within a transaction
+    FS_WRLOCK();
+    TXN_WRLOCK();
+    unfs.txn++;
+    TXN_UNLOCK();
+
+    unfs_ds_t ds[UNFS_MAXDS];
+    u32 heat[UNFS_MAXDS];
+    int dscount = 0, added = 0;
+    dsoff = 0;
+    for (d = 0; d < nodep->dscount; d++) {
+        unfs_ds_t* dsp = &nodep->ds[d];
+        u64 b = dsoff;
+        u64 e = dsoff + dsp->pagecount;
+        dsoff = e;
+        if (b < lo) {
+            u64 n = (e < lo ? e : lo) - b;
+            heat[dscount] = nodep->heat ? nodep->heat[d] : 0;
+            ds[dscount].pageid = dsp->pageid;
+            ds[dscount++].pagecount = n;
+            b += n;
+        }
+        if (b == lo && !added) {
+            added = 1;
+            heat[dscount] = 0;
+            ds[dscount].pageid = newpage;
+            ds[dscount++].pagecount = hi - lo;
+        }
+        u64 fe = e < hi ? e : hi;
+        if (b < fe) {
+            unfs_map_free(dsp->pageid + b - (e - dsp->pagecount), fe - b);
+            b = fe;
+        }
+        if (b < e) {
+            heat[dscount] = nodep->heat ? nodep->heat[d] : 0;
+            ds[dscount].pageid = dsp->pageid + b - (e - dsp->pagecount);
+            ds[dscount++].pagecount = e - b;
+        }
+    }
+    if (!added) {
+        heat[dscount] = 0;
+        ds[dscount].pageid = newpage;
+        ds[dscount++].pagecount = hi - lo;
+    }
+    FILE_SEQ_BEGIN(nodep);
+    memcpy(nodep->ds, ds, dscount * sizeof(unfs_ds_t));
+    if (nodep->heat) memcpy(nodep->heat, heat, dscount * sizeof(u32));
+    nodep->dscount = dscount;
+    nodep->mapgen = ATOMIC_ADD(&unfs.mapgen, 1);
+    if (end > nodep->size) nodep->size = end;
+    FILE_SEQ_END(nodep);
+    unfs_node_sync(ioc, nodep);
+    nodep->updated = 0;
+
+    TXN_WRLOCK();
+    if (--unfs.txn == 0) {
+        IOPRIO_ENTER(UNFS_IOPRIO_META);
+        unfs_txn_flush(ioc);
+        IOPRIO_LEAVE();
+    }
+    TXN_UNLOCK();
+    FS_UNLOCK();
+    return 0;
+}
+
+/**
+ * Write data into a file atomically, i.e. after a crash either all or
+ * none of the data is seen (see unfs_node_write_atomic).  Temporary files
+ * are written in place.
+ * @param   fd          file descriptor reference
+ * @param   buf         data buffer
+ * @param   offset      file offset position
+ * @param   len         number of bytes to write
+ * @return  0 if ok else error code.
+ */
+int unfs_file_write_atomic(unfs_fd_t fd, const void *buf, u64 offset, u64 len)
+{
+    int err = EINVAL;
+    unfs_node_t* nodep = fd.id;
+
+    if (unfs.rdonly) return EROFS;
+
+    DEBUG_FN("%s off=%#lx len=%#lx size=%#lx", nodep->name, offset, len, nodep->size);
+    FILE_WRLOCK(nodep);
+    if (nodep->open && !(err = unfs_node_recall(nodep)) && len) {
+        IOPRIO_ENTER(fd.ioprio);
+        u64 gen = unfs_chg_enter();
+        unfs_ioc_t ioc = DEV(ioc_alloc)();
+        unfs_node_changed(ioc, nodep, offset, len);
+        if (nodep->temp) {
+            u64 size = offset + len;
+            if (size > nodep->size) {
+                FS_WRLOCK();
+                FILE_SEQ_BEGIN(nodep);
+                err = unfs_node_resize(ioc, nodep, size, NULL);
+                FILE_SEQ_END(nodep);
+                FS_UNLOCK();
+            }
+            if (!err) {
+                FILE_WSEQ_BEGIN(nodep);
+                err = unfs_node_rw(ioc, nodep, (void*)buf, offset, len, 1);
+                FILE_WSEQ_END(nodep);
+            }
+        } else {
+            err = unfs_node_write_atomic(ioc, nodep, buf, offset, len);
+        }
+        DEV(ioc_free)(ioc);
+        unfs_chg_leave(gen);
+        IOPRIO_LEAVE();
+    }
+    FILE_UNLOCK(nodep);
+    return err;
+}
+
+/**
+ * Calculate a 64-bit file checksum.  Checksum may not be content unique.
+ * @param   fd          file descriptor reference
+ * @return  the checksum or -1 if error.
+ */
+u64 unfs_file_checksum(unfs_fd_t fd)
 {
-    u64 oldsize = nodep->size;
-    DEBUG_FN("%s from %#lx to %#lx", nodep->name, oldsize, newsize);
-    if (oldsize == newsize) return 0;
+    u64 sum = 0;
+    unfs_node_t* nodep = fd.id;
 
-    // size increase may require adding segments
-    if (newsize > oldsize) {
-        // zero filled the uninit portion of the last page of the last segment
-        u64 zlen =  oldsize & (UNFS_PAGESIZE - 1);
-        if (fill && zlen) {
-            u32 iopc = 1;
-            void* iop = unfs.dev.page_alloc(ioc, &iopc);
-            if (iopc != 1)
-                FATAL("cannot allocate 1 page");
-            unfs_ds_t* ds = &nodep->ds[nodep->dscount - 1];
-            u64 pa = ds->pageid + ds->pagecount - 1;
-            unfs.dev.read(ioc, iop, pa, 1);
-            memset(iop + zlen, *fill, UNFS_PAGESIZE - zlen);
-            unfs.dev.write(ioc, iop, pa, 1);
-            unfs.dev.page_free(ioc, iop, iopc);
+    if (nodep->offload) {
+        FILE_WRLOCK(nodep);
+        int err = unfs_node_recall(nodep);
+        FILE_UNLOCK(nodep);
+        if (err) return -1L;
+    }
+
+    FILE_RDLOCK(nodep);
+    DEBUG_FN("%s", nodep->name);
+    if (nodep->open && nodep->temp == TEMP_MEM) {
+        u8* bp = nodep->mem;
+        u64 size;
+        for (size = nodep->size; size; size--) sum += (size << 32) | *bp++;
+    } else if (nodep->open) {
+        IOPRIO_ENTER(fd.ioprio);
+        int d, p, i;
+        u32 iopc = 1;
+        unfs_ioc_t ioc = DEV(ioc_alloc)();
+        void* iop = DEV(page_alloc)(ioc, &iopc);
+        if (iopc != 1)
+            FATAL("cannot allocate 1 page");
+        u64 size = nodep->size;
+        for (d = 0; d < nodep->dscount; d++) {
+            u64 pa = nodep->ds[d].pageid;
+            for (p = 0; p < nodep->ds[d].pagecount; p++) {
+                DEV(read)(ioc, iop, pa, 1);
+                u8* bp = iop;
+                for (i = 0; i < UNFS_PAGESIZE; i++) {
+                    sum += (size << 32) | *bp++;
+                    if (--size == 0) break;
+                }
+                pa++;
+            }
         }
+        DEV(page_free)(ioc, iop, iopc);
+        DEV(ioc_free)(ioc);
+        IOPRIO_LEAVE();
+    }
+    FILE_UNLOCK(nodep);
+    return sum;
+}
 
-        // check to add new segment for additional page(s)
-        u64 addpc = PAGECOUNT(newsize) - PAGECOUNT(oldsize);
-        if (addpc > 0) {
-            u64 pageid = 0;
-            if (nodep->dscount < UNFS_MAXDS) {
-                // if segment is available then check to add one
-                pageid = unfs_map_alloc(addpc);
-                if (pageid == 0) return ENOSPC;
-                int i = nodep->dscount - 1;
-                unfs_ds_t* dsp = nodep->ds + i;
-                // if contiguous then modify last segment else add new segment
-                if (i >= 0 && pageid == (dsp->pageid + dsp->pagecount)) {
-                    dsp->pagecount += addpc;
-                    DEBUG_FN("%s mod ds[%d]=(%#lx %#lx) page=%#lx",
-                          nodep->name, i, dsp->pageid, dsp->pagecount, pageid);
-                } else {
-                    i++;
-                    dsp++;
-                    nodep->dscount++;
-                    dsp->pageid = pageid;
-                    dsp->pagecount = addpc;
-                    DEBUG_FN("%s add ds[%d]=(%#lx %#lx)",
-                                    nodep->name, i, pageid, addpc);
+/**
+ * Check if a node is to be in a directory listing.
+ * @param   nodep       node pointer
+ * @param   dirp        directory node
+ * @param   recursive   include all descendants flag
+ * @return  1 if listed else 0.
+ */
+static inline int unfs_dir_member(const unfs_node_t* nodep, const unfs_node_t* dirp,
+                                  int recursive)
+{
+    return recursive ?
+           unfs_descendant_of(nodep->name, nodep->namelen, dirp->name, dirp->namelen) :
+           unfs_child_of(nodep->name, nodep->namelen, dirp->name, dirp->namelen);
+}
+
+/**
+ * Walk the tree to count the descendants of a directory.
+ * @param   root        root node
+ * @param   dirp        directory node
+ * @return  the number of descendants.
+ */
+static u64 unfs_dir_count(struct tnode* root, const unfs_node_t* dirp)
+{
+    if (!root) return 0;
+    return unfs_dir_member((unfs_node_t*)(root->key), dirp, 1) +
+           unfs_dir_count(TNODE_LEFT(root), dirp) +
+           unfs_dir_count(TNODE_RIGHT(root), dirp);
+}
+
+/**
+ * Check if name matched and add to directory listing.
+ * @param   nodep       node pointer
+ * @param   dlp         directory list pointer
+ * @param   dirp        directory node
+ * @param   recursive   include all descendants flag
+ */
+static void unfs_dir_match(unfs_node_t* nodep, unfs_dir_list_t* dlp,
+                           const unfs_node_t* dirp, int recursive)
+{
+    if (unfs_dir_member(nodep, dirp, recursive)) {
+        if (dlp->size == 0)
+            FATAL("bad directory size");
+        int n = --dlp->size;
+        dlp->list[n].name = strdup(nodep->name);
+        dlp->list[n].size = nodep->size;
+        dlp->list[n].isdir = nodep->isdir;
+    }
+}
+
+/**
+ * Walk the tree to get a directory listing.
+ * @param   root        root node
+ * @param   dlp         directory list pointer
+ * @param   dirp        directory node
+ * @param   recursive   include all descendants flag
+ */
+static void unfs_dir_walk(struct tnode* root, unfs_dir_list_t* dlp,
+                          const unfs_node_t* dirp, int recursive)
+{
+    if (!root) return;
+
+    if (TNODE_LEFT(root) == NULL && TNODE_RIGHT(root) == NULL) {
+        unfs_dir_match((unfs_node_t*)(root->key), dlp, dirp, recursive);
+    } else {
+        if (TNODE_LEFT(root) != NULL) unfs_dir_walk(TNODE_LEFT(root), dlp, dirp, recursive);
+        unfs_dir_match((unfs_node_t*)(root->key), dlp, dirp, recursive);
+        if (TNODE_RIGHT(root) != NULL) unfs_dir_walk(TNODE_RIGHT(root), dlp, dirp, recursive);
+    }
+}
+
+/**
+ * Get a directory listing of the children or all the descendants.
+ * @param   fs          filesystem reference
+ * @param   name        canonical name
+ * @param   recursive   include all descendants flag
+ * @return  an allocated directory list structure.
+ */
+static unfs_dir_list_t* unfs_dir_list_get(unfs_fs_t fs, const char *name, int recursive)
+{
+    unfs_dir_list_t* dlp = NULL;
+    char vpath[UNFS_MAXPATH];
+    DEBUG_FN("%s %d", name, recursive);
+    if (FS_CHECK(fs) || strlen(name) >= UNFS_MAXPATH) return dlp;
+    name = unfs_vol_path(fs, name, vpath);
+
+    // a listing above the sub-volume roots (or of the root directory with
+    // shards) walks all the trees
+    u32 v = 0, vhi = 0;
+    if (!strcmp(name, VOL_DIR) || ((recursive || unfs.shards) && !strcmp(name, "/"))) {
+        unfs_walk_lock();
+        vhi = TREE_LAST;
+    } else {
+        v = vhi = unfs_ns_lock(name, 0);
+    }
+    unfs_node_t* nodep = unfs_node_find(name);
+    if (nodep && nodep->isdir) {
+        u64 nodesize = nodep->size;
+        u32 t;
+        if (recursive) {
+            nodesize = 0;
+            for (t = v; t <= vhi; t = TREE_NEXT(t))
+                nodesize += unfs_dir_count(unfs.root[t], nodep);
+        }
+        dlp = malloc(sizeof(*dlp) + (nodesize * sizeof(unfs_dir_entry_t)));
+        dlp->name = strdup(nodep->name);
+        dlp->size = nodesize;
+        for (t = v; t <= vhi; t = TREE_NEXT(t))
+            unfs_dir_walk(unfs.root[t], dlp, nodep, recursive);
+        if (dlp->size != 0)
+            FATAL("size=%#lx found=%#lx", nodesize, nodesize - dlp->size);
+        dlp->size = nodesize;
+    }
+    unfs_ns_unlock(v);
+    if (dlp && FS_VOL(fs)) {
+        u32 i;
+        unfs_vol_strip(FS_VOL(fs), dlp->name);
+        for (i = 0; i < dlp->size; i++) unfs_vol_strip(FS_VOL(fs), dlp->list[i].name);
+    }
+    return dlp;
+}
+
+/**
+ * Get a directory listing.
+ * @param   fs          filesystem reference
+ * @param   name        canonical name
+ * @return  an allocated directory list structure.
+ */
+unfs_dir_list_t* unfs_dir_list(unfs_fs_t fs, const char *name)
+{
+    return unfs_dir_list_get(fs, name, 0);
+}
+
+/**
+ * Get a recursive directory listing, i.e. all the files and directories
+ * under a directory (in no particular order) with one tree walk.
+ * @param   fs          filesystem reference
+ * @param   name        canonical name
+ * @return  an allocated directory list structure.
+ */
+unfs_dir_list_t* unfs_dir_list_all(unfs_fs_t fs, const char *name)
+{
+    return unfs_dir_list_get(fs, name, 1);
+}
+
+/**
+ * Free a directory_list structure.
+ * @param   dlp         directory list pointer
+ */
+void unfs_dir_list_free(unfs_dir_list_t* dlp)
+{
+    DEBUG_FN("%s", dlp->name);
+    int count = dlp->size;
+    while (count) free(dlp->list[--count].name);
+    free(dlp->name);
+    free(dlp);
+}
+
+/**
+ * Create a file or directory if it doesn't exist.
+ * If pflag is set, then create the parent directories as needed.
+ * @param   fs          filesystem reference
+ * @param   name        canonical name
+ * @param   isdir       is directory flag
+ * @param   pflag       make parent directories as needed
+ * @return  0 if ok, else error code.
+ */
+int unfs_create(unfs_fs_t fs, const char *name, int isdir, int pflag)
+{
+    DEBUG_FN("%s", name);
+    unfs_path_t path;
+    char vpath[UNFS_MAXPATH];
+    if (FS_CHECK(fs) || unfs_path_parse(name = unfs_vol_path(fs, name, vpath), &path))
+        return EINVAL;
+    if (unfs.rdonly) return EROFS;
+
+    int err = 0;
+    int v = unfs_ns_lock(name, 1);
+relock:
+    if (pflag) {
+        // create each path component by extending the name hash
+        unfs_path_t dir = { .name = name, .plen = 1,
+                            .phash = PATH_HASH(PATH_HASH_INIT, '/') };
+        u32 hash = dir.phash;
+        u32 i;
+        for (i = 1; i <= path.len; i++) {
+            if (i == path.len || name[i] == '/') {
+                dir.len = i;
+                dir.hash = hash;
+                unfs_node_t* nodep = unfs_node_lookup(name, dir.len, dir.hash);
+                if (!nodep && v > VOL_MAX && dir.plen == 1) {
+                    // a top-level directory updates the root directory
+                    unfs_ns_unlock(v);
+                    FS_WRLOCK();
+                    v = 0;
+                    goto relock;
                 }
-            } else {
-                // if no segment is available then merge all into one
-                int err = unfs_node_merge_ds(ioc, nodep, newsize);
-                if (err) return err;
-                pageid = nodep->ds[0].pageid + PAGECOUNT(oldsize);
+                if (!nodep) nodep = unfs_node_create(&dir, i == path.len ? isdir : 1);
+                if (!nodep) {
+                    err = ENOMEM;
+                    break;
+                }
+                dir.plen = dir.len;
+                dir.phash = dir.hash;
+            }
+            hash = PATH_HASH(hash, name[i]);
+        }
+    } else {
+        unfs_node_t* nodep = unfs_node_lookup(name, path.len, path.hash);
+        if (!nodep) {
+            nodep = unfs_node_create(&path, isdir);
+            if (!nodep) err = ENOMEM;
+        }
+    }
+    unfs_sync();
+    unfs_ns_unlock(v);
+    return err;
+}
+
+/**
+ * Remove a file or directory.  If node is directory, it must be empty.
+ * @param   fs          filesystem reference
+ * @param   name        canonical name
+ * @param   isdir       is directory flag
+ * @return  0 if ok else error code.
+ */
+int unfs_remove(unfs_fs_t fs, const char *name, int isdir)
+{
+    DEBUG_FN("%s", name);
+    char vpath[UNFS_MAXPATH];
+    if (FS_CHECK(fs) || name[1] == 0 || strlen(name) >= UNFS_MAXPATH)
+        return EINVAL;
+    if (unfs.rdonly) return EROFS;
+    name = unfs_vol_path(fs, name, vpath);
+
+    // a freed entry may take the place of another sub-volume entry
+    // (see unfs_node_remove), so removal locks the whole filesystem
+    int err = 0;
+    FS_WRLOCK();
+    unfs_pin_wait(0, name, NULL);
+    unfs_node_t* nodep = unfs_node_find(name);
+    if (!nodep || nodep->isdir != isdir) {
+        err = ENOENT;
+    } else if (nodep->open || (isdir && nodep->size != 0) || unfs_vol_root(name)) {
+        err = EBUSY;
+    } else {
+        unfs_ioc_t ioc = DEV(ioc_alloc)();
+        unfs_node_remove(ioc, nodep);
+        DEV(ioc_free)(ioc);
+        unfs_sync();
+    }
+    FS_UNLOCK();
+    return err;
+}
+
+/**
+ * Rename/Move a directory or file.  If node is directory, it must be empty.
+ * @param   fs          filesystem reference
+ * @param   src         source canonical name
+ * @param   dst         destination canonical name
+ * @param   override    delete to if to exists
+ * @return  0 if ok else error code.
+ */
+int unfs_rename(unfs_fs_t fs, const char *src, const char *dst, int override)
+{
+    DEBUG_FN("%s to %s", src, dst);
+    unfs_path_t path;
+    char vsrc[UNFS_MAXPATH], vdst[UNFS_MAXPATH];
+    if (FS_CHECK(fs) || src[1] == 0 || strlen(src) >= UNFS_MAXPATH ||
+        !strcmp(dst, "/") || unfs_path_parse(dst = unfs_vol_path(fs, dst, vdst), &path))
+        return EINVAL;
+    src = unfs_vol_path(fs, src, vsrc);
+    if (unfs.rdonly) return EROFS;
+
+    // a rename within a sub-volume or shard takes its namespace lock, unless
+    // it moves to the top level, removes the destination or persists a
+    // temporary file
+    int err = 0;
+    unfs_ioc_t ioc = DEV(ioc_alloc)();
+    int v = unfs_ns_lock(src, 1);
+    if (v && (unfs_tree_of(dst, path.len) != v || path.plen == 1)) goto excl;
+relock:
+    unfs_pin_wait(v, src, dst);
+
+    // src-node must exist
+    unfs_node_t* srcnode = unfs_node_find(src);
+    if (!srcnode) {
+        err = ENOENT;
+        goto done;
+    }
+    unfs_node_t* srcparent = srcnode->parent;
+
+    // src-node must not be opened and if isdir then must be empty
+    if (srcnode->open || (srcnode->isdir && srcnode->size) ||
+        unfs_vol_root(src) || unfs_vol_root(dst)) {
+        err = EBUSY;
+        goto done;
+    }
+
+    // dst-parent must exist
+    unfs_node_t* dstparent = unfs_node_find_parent(&path);
+    if (!dstparent) {
+        err = EINVAL;
+        goto done;
+    }
+
+    // if override flag set then dst-node must not exist of will be deleted
+    unfs_node_t* dstnode = unfs_node_lookup(dst, path.len, path.hash);
+    if (v && ((dstnode && override) || srcnode->temp)) goto excl;
+    if (dstnode) {
+        if (override) {
+            if (dstnode->open ||
+                (dstnode->isdir && dstnode->size != 0)) {
+                err = EBUSY;
+                goto done;
             }
+            unfs_node_remove(ioc, dstnode);
+        } else {
+            err = EEXIST;
+            goto done;
+        }
+    }
 
-            if (fill) {
-                u64 pc = addpc;
-                u32 iopc = addpc;
-                void* iop = unfs.dev.page_alloc(ioc, &iopc);
-                if (pc > iopc) pc = iopc;
-                memset(iop, *fill, pc << UNFS_PAGESHIFT);
+    // temporary file renamed to a non-temporary name becomes persistent
+    if (srcnode->temp && !unfs_temp_match(dst)) {
+        err = unfs_temp_persist(ioc, srcnode);
+        if (err) goto done;
+    }
 
-                while (addpc) {
-                    if (pc > addpc) pc = addpc;
-                    unfs.dev.write(ioc, iop, pageid, pc);
-                    pageid += pc;
-                    addpc -= pc;
-                }
-                unfs.dev.page_free(ioc, iop, iopc);
-            }
+    // remove the node, change its name, and put back in tree
+    tdelete(srcnode, &unfs.root[unfs_tree_of(src, srcnode->namelen)], unfs_node_cmp_fn);
+    int namelen = path.len;
+    size_t nsize = NODESIZE(srcnode->isdir);
+    size_t memsize = nsize + namelen + 1;
+    if (srcnode->memsize < memsize) {
+        srcnode = realloc(srcnode, memsize);
+        if (srcnode->temp) {
+            if (srcnode->tempprev) srcnode->tempprev->tempnext = srcnode;
+            else unfs.templist = srcnode;
+            if (srcnode->tempnext) srcnode->tempnext->tempprev = srcnode;
         }
+    }
+    srcnode->memsize = memsize;
+    srcnode->name = (char*)srcnode + nsize;
+    strcpy(srcnode->name, dst);
+    srcnode->namelen = path.len;
+    srcnode->namehash = path.hash;
+    srcnode->parent = dstparent;
+    srcnode->parentid = dstparent->pageid;
+    tsearch(srcnode, &unfs.root[unfs_tree_of(dst, path.len)], unfs_node_cmp_fn);
 
-    // size decrease may require deleting segments
-    } else {
-        u64 delpc = PAGECOUNT(oldsize) - PAGECOUNT(newsize);
-        unfs_ds_t* ds = &nodep->ds[nodep->dscount-1];
-        while (delpc) {
-            if (ds->pagecount > delpc) {
-                ds->pagecount -= delpc;
-                unfs_map_free(ds->pageid + ds->pagecount, delpc);
-                break;
-            }
-            unfs_map_free(ds->pageid, ds->pagecount);
-            delpc -= ds->pagecount;
-            nodep->dscount--;
-            ds--;
+    // sync node and parents
+    unfs_node_sync(ioc, srcnode);
+    if (srcparent != dstparent) {
+        if (srcnode->temp) {
+            srcparent->tempcount--;
+            dstparent->tempcount++;
         }
+        FILE_WRLOCK(srcparent);
+        srcparent->size--;
+        unfs_node_sync(ioc, srcparent);
+        FILE_UNLOCK(srcparent);
+
+        FILE_WRLOCK(dstparent);
+        dstparent->size++;
+        unfs_node_sync(ioc, dstparent);
+        FILE_UNLOCK(dstparent);
     }
+    unfs_sync();
 
-    nodep->size = newsize;
-    nodep->updated = 1;
-    return 0;
+done:
+    DEV(ioc_free)(ioc);
+    unfs_ns_unlock(v);
+    return err;
+
+excl:
+    unfs_ns_unlock(v);
+    FS_WRLOCK();
+    v = 0;
+    goto relock;
 }
 
 /**
- * Create a file/directory.
- * @param   name        canonical name
- * @param   isdir       directory flag
- * @return  node pointer or NULL if error.
+ * Offload a file to an object in the configured host directory and release
+ * its data pages.  The file entry keeps its name and size, and the data will
+ * be recalled upon the first read, write or resize (or unfs_recall).
+ * @param   fs          filesystem reference
+ * @param   name        canonical file name
+ * @return  0 if ok else error code.
  */
-static unfs_node_t* unfs_node_create(const char *name, int isdir)
+int unfs_offload(unfs_fs_t fs, const char* name)
 {
     DEBUG_FN("%s", name);
-    unfs_node_t* parent = unfs_node_find_parent(name);
-    if (!parent) {
-        ERROR("Parent directory of %s does not exist", name);
-        return NULL;
+    char vpath[UNFS_MAXPATH];
+    if (FS_CHECK(fs) || strlen(name) >= UNFS_MAXPATH) return EINVAL;
+    if (unfs.rdonly) return EROFS;
+    if (!unfsoffload.dir) return ENOTSUP;
+    name = unfs_vol_path(fs, name, vpath);
+
+    // pin the file so it cannot be opened while its data is moved
+    int err = 0;
+    FS_WRLOCK();
+    unfs_pin_wait(0, name, NULL);
+    unfs_node_t* nodep = unfs_node_find(name);
+    if (!nodep) err = ENOENT;
+    else if (nodep->isdir) err = EISDIR;
+    else if (nodep->open || nodep->temp) err = EBUSY;
+    if (err || nodep->offload) {
+        FS_UNLOCK();
+        return err;
     }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    u64 id = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+    if (id <= unfs.offloadid) id = unfs.offloadid + 1;
+    unfs.offloadid = id;
+    ATOMIC_ADD(&nodep->pin, 1);
+    FS_UNLOCK();
 
-    unfs_node_t node;
-    node.pageid = unfs_node_alloc(isdir);
-    if (node.pageid == 0) return NULL;
-    node.name = (char*)name;
-    node.parent = parent;
-    node.parentid = parent->pageid;
-    node.size = 0;
-    node.isdir = isdir;
-    node.open = 0;
-    node.dscount = 0;
+    // write the object
+    FILE_WRLOCK(nodep);
+    char path[UNFS_MAXPATH];
+    int hostfd = open(unfs_offload_path(path, id), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (hostfd < 0) {
+        err = errno;
+        ERROR("open %s (%s)", path, strerror(err));
+    } else {
+        if (ftruncate(hostfd, nodep->size)) err = errno;
+        if (!err) err = unfs_offload_stream(nodep, hostfd, 1, UNFS_IOPRIO_BG);
+        if (!err && fsync(hostfd)) err = errno;
+        close(hostfd);
+        if (err) unlink(path);
+    }
 
-    unfs_node_t* newnodep = unfs_node_add(parent, &node);
-    parent->size++;
-    unfs_ioc_t ioc = unfs.dev.ioc_alloc();
-    unfs_node_sync(ioc, parent);
-    unfs_node_sync(ioc, newnodep);
-    unfs.dev.ioc_free(ioc);
-    return newnodep;
+    // release the data pages and persist the entry
+    FS_WRLOCK();
+    if (!err) {
+        int i;
+        for (i = 0; i < nodep->dscount; i++) {
+            unfs_map_free(nodep->ds[i].pageid, nodep->ds[i].pagecount);
+        }
+        FILE_SEQ_BEGIN(nodep);
+        nodep->dscount = 0;
+        nodep->mapgen = ATOMIC_ADD(&unfs.mapgen, 1);
+        nodep->offload = id;
+        FILE_SEQ_END(nodep);
+        unfs_ioc_t ioc = DEV(ioc_alloc)();
+        unfs_node_sync(ioc, nodep);
+        DEV(ioc_free)(ioc);
+        unfs_sync();
+    }
+    ATOMIC_SUB(&nodep->pin, 1);
+    FS_UNLOCK();
+    FILE_UNLOCK(nodep);
+    return err;
 }
 
 /**
- * Open/Create a file.
+ * Recall an offloaded file.
  * @param   fs          filesystem reference
- * @param   name        canonical name
- * @param   mode        open mode
- * @return  file descriptor reference or NULL if error.
+ * @param   name        canonical file name
+ * @return  0 if ok else error code.
  */
-unfs_fd_t unfs_file_open(unfs_fs_t fs, const char *name, unfs_mode_t mode)
+int unfs_recall(unfs_fs_t fs, const char* name)
 {
     DEBUG_FN("%s", name);
-    unfs_fd_t fd = { .error = 0, .mode = mode, .id = NULL };
+    char vpath[UNFS_MAXPATH];
+    if (FS_CHECK(fs) || strlen(name) >= UNFS_MAXPATH) return EINVAL;
+    if (unfs.rdonly) return EROFS;
+    name = unfs_vol_path(fs, name, vpath);
 
-    if (FS_CHECK(fs) || strlen(name) >= UNFS_MAXPATH) {
-        fd.error = EINVAL;
-        return fd;
+    FS_WRLOCK();
+    unfs_pin_wait(0, name, NULL);
+    unfs_node_t* nodep = unfs_node_find(name);
+    if (!nodep || nodep->isdir) {
+        FS_UNLOCK();
+        return nodep ? EISDIR : ENOENT;
     }
+    ATOMIC_ADD(&nodep->pin, 1);
+    FS_UNLOCK();
 
-    FS_WRLOCK();
+    FILE_WRLOCK(nodep);
+    int err = unfs_node_recall(nodep);
+    ATOMIC_SUB(&nodep->pin, 1);
+    FILE_UNLOCK(nodep);
+    return err;
+}
+
+/**
+ * Check if a node name exists and return its size.
+ * @param   fs          filesystem reference
+ * @param   name        canonical name
+ * @param   isdir       is directory flag pointer
+ * @param   sizep       size pointer if node exist
+ * @return  1 if exist else 0.
+ */
+int unfs_exist(unfs_fs_t fs, const char *name, int* isdir, u64* sizep)
+{
+    DEBUG_FN("%s", name);
+    int exist = 0;
+    char vpath[UNFS_MAXPATH];
+    if (FS_CHECK(fs)) return exist;
+    name = unfs_vol_path(fs, name, vpath);
+
+    int v = unfs_ns_lock(name, 0);
     unfs_node_t* nodep = unfs_node_find(name);
     if (nodep) {
-        FILE_WRLOCK(nodep);
-        if ((mode & UNFS_OPEN_EXCLUSIVE) && nodep->open) {
-            FILE_UNLOCK(nodep);
-            fd.error = EBUSY;
-            goto done;
-        }
-        nodep->open++;
-        FILE_UNLOCK(nodep);
+        if (isdir) *isdir = nodep->isdir;
+        if (sizep) *sizep = nodep->size;
+        exist = 1;
+    }
+    unfs_ns_unlock(v);
+    return exist;
+}
+
+/**
+ * Get a copy of the UNFS header info.
+ * @param   fs          filesystem reference
+ * @param   statp       header statistics pointer
+ * @param   print       print header flag
+ * @return  0 if ok else error code.
+ */
+int unfs_stat(unfs_fs_t fs, unfs_header_t* statp, int print)
+{
+    DEBUG_FN();
+    if (FS_CHECK(fs)) return EINVAL;
+
+    FS_RDLOCK();
+    META_LOCK();
+    memcpy(statp, unfs.header, sizeof(*unfs.header));
+    META_UNLOCK();
+    FS_UNLOCK();
+
+    if (print) unfs_print_header(statp);
+    return 0;
+}
+
+/**
+ * Apply the device I/O geometry overrides (in KB) from the environment:
+ * UNFS_IOALIGN (preferred write alignment), UNFS_IOSTRIPE (optimal I/O or
+ * stripe size), and UNFS_IOMAX (max transfer size).
+ * @param   devfp       device function pointer
+ */
+static void unfs_dev_geometry(unfs_device_io_t* devfp)
+{
+    char* env = getenv("UNFS_IOALIGN");
+    if (env) devfp->ioalign = atol(env) >> (UNFS_PAGESHIFT - 10);
+    env = getenv("UNFS_IOSTRIPE");
+    if (env) devfp->iostripe = atol(env) >> (UNFS_PAGESHIFT - 10);
+    env = getenv("UNFS_IOMAX");
+    if (env) devfp->iomax = atol(env) >> (UNFS_PAGESHIFT - 10);
+    INFO_FN("align=%u stripe=%u max=%u pages",
+            devfp->ioalign, devfp->iostripe, devfp->iomax);
+}
+
+/**
+ * Open the appropriate driver implementation based on the given device name.
+ * @param   device      device name
+ * @return  allocated header or NULL if device name is not supported.
+ */
+static unfs_header_t* unfs_open_dev(const char* device)
+{
+    if (unfs.header) {
+        if (strcmp(unfs.dev.name, device) != 0)
+            FATAL("device %s is in use", unfs.dev.name);
     } else {
-        if (!(mode & UNFS_OPEN_CREATE)) {
-            fd.error = ENOENT;
-            goto done;
+#ifdef UNFS_STATIC
+        unfs.header = UNFS_STATIC_OPEN(&unfs.dev, device);
+        if (!unfs.header)
+            FATAL("cannot open device %s", device);
+        unfs_dev_geometry(&unfs.dev);
+#else
+        int n;
+        struct stat st;
+        if (sscanf(device, "%x:%x.%x", &n, &n, &n) == 3) {
+            unfs_header_t* unfs_unvme_open(unfs_device_io_t*, const char*);
+            unfs.header = unfs_unvme_open(&unfs.dev, device);
+        } else if (strchr(device, ',')) {
+            // tiered fast,capacity device pair
+            unfs_header_t* unfs_raw_open(unfs_device_io_t*, const char*);
+            unfs.header = unfs_raw_open(&unfs.dev, device);
+        } else if (stat(device, &st) == 0 &&
+                   (S_ISREG(st.st_mode) || S_ISCHR(st.st_mode))) {
+            // a regular file or device DAX (other char devices are rejected)
+            unfs_header_t* unfs_pmem_open(unfs_device_io_t*, const char*);
+            unfs.header = unfs_pmem_open(&unfs.dev, device);
+        } else if (strncmp(device, "/dev/", 5) == 0) {
+            unfs_header_t* unfs_raw_open(unfs_device_io_t*, const char*);
+            unfs.header = unfs_raw_open(&unfs.dev, device);
+        } else {
+            FATAL("unknown device %s", device);
         }
-        nodep = unfs_node_create(name, 0);
-        nodep->open++;
+        unfs_dev_geometry(&unfs.dev);
+
+        // layer the I/O scheduler on top of the device
+        void unfs_sched_open(unfs_device_io_t*);
+        unfs_sched_open(&unfs.dev);
+#endif
+        unfs.dev.name = strdup(device);
     }
-    fd.id = nodep;
+    return unfs.header;
+}
 
-done:
-    FS_UNLOCK();
-    return fd;
+/**
+ * Set the temporary file patterns and memory limit (with unfslock held).
+ * @param   patterns    comma separated list of file name patterns
+ * @param   memsize     max memory size for temporary files (0 for default)
+ */
+static void unfs_temp_set(const char* patterns, u64 memsize)
+{
+    while (unfstemp.count) free(unfstemp.patterns[--unfstemp.count]);
+    free(unfstemp.patterns);
+    unfstemp.patterns = NULL;
+    unfstemp.memmax = memsize ? memsize : TEMP_MEMMAX;
+
+    char* str = strdup(patterns);
+    char* save = NULL;
+    char* s;
+    for (s = strtok_r(str, ",", &save); s; s = strtok_r(NULL, ",", &save)) {
+        unfstemp.patterns = realloc(unfstemp.patterns,
+                                    (unfstemp.count + 1) * sizeof(char*));
+        unfstemp.patterns[unfstemp.count++] = strdup(s);
+        DEBUG_FN("%s", s);
+    }
+    free(str);
+}
+
+/**
+ * Configure the temporary files.  Files created with a name matching any
+ * of the patterns (fnmatch without flags, e.g. "*.sort" or a directory
+ * path followed by "*")
+ * will be kept in memory up to the memory size limit and will not persist.
+ * Configuration takes effect on files created after the call.  If not
+ * configured before open, the UNFS_TEMP and UNFS_TEMPMEM (in MB)
+ * environment variables will be used.
+ * @param   patterns    comma separated list of file name patterns
+ * @param   memsize     max memory size for temporary files (0 for default)
+ * @return  0 if ok else error code.
+ */
+int unfs_temp_config(const char* patterns, u64 memsize)
+{
+    if (!patterns) return EINVAL;
+    pthread_mutex_lock(&unfslock);
+    unfs_temp_set(patterns, memsize);
+    pthread_mutex_unlock(&unfslock);
+    return 0;
+}
+
+/**
+ * Configure the host directory to offload files to (see unfs_offload).
+ * If not configured before open, the UNFS_OFFLOAD and UNFS_OFFLOAD_THREADS
+ * environment variables will be used.
+ * @param   dir         host directory
+ * @param   threads     number of streaming threads (0 for default)
+ * @return  0 if ok else error code.
+ */
+int unfs_offload_config(const char* dir, int threads)
+{
+    struct stat st;
+    if (!dir || stat(dir, &st) || !S_ISDIR(st.st_mode)) return EINVAL;
+    pthread_mutex_lock(&unfslock);
+    free(unfsoffload.dir);
+    unfsoffload.dir = strdup(dir);
+    unfsoffload.threads = threads > 0 ? threads : OFFLOAD_THREADS;
+    pthread_mutex_unlock(&unfslock);
+    return 0;
+}
+
+/**
+ * Configure the access profile to prewarm from (see unfs_prewarm_save).
+ * Upon open, the file ranges listed in the profile are read in the
+ * background, and upon the last close the hottest file ranges accessed
+ * are saved to the profile.  If not configured before open, the
+ * UNFS_PREWARM, UNFS_PREWARM_MB and UNFS_PREWARM_THREADS environment
+ * variables will be used.
+ * @param   name        profile file name
+ * @param   maxsize     max size of the ranges to prewarm (0 for default)
+ * @param   threads     number of prewarm threads (0 for default)
+ * @return  0 if ok else error code.
+ */
+int unfs_prewarm_config(const char* name, u64 maxsize, int threads)
+{
+    unfs_path_t path;
+    if (!name || unfs_path_parse(name, &path)) return EINVAL;
+    pthread_mutex_lock(&unfslock);
+    free(unfsprewarm.name);
+    unfsprewarm.name = strdup(name);
+    unfsprewarm.maxsize = maxsize ? maxsize : (u64)PREWARM_MAXMB << 20;
+    unfsprewarm.threads = threads > 0 ? threads : PREWARM_THREADS;
+    pthread_mutex_unlock(&unfslock);
+    return 0;
+}
+
+#ifndef UNFS_STATIC
+int unfs_repl_open(unfs_device_io_t* devfp, const char* target, u64 size);
+void unfs_repl_copy(unfs_ioc_t ioc, u64 pa, u64 pc);
+void unfs_repl_copied();
+
+/**
+ * Replica copy thread to copy the bitmap pages, the allocated data pages
+ * and file entries, and lastly the header pages to the replica.
+ * @param   arg         unused
+ * @return  NULL.
+ */
+static void* unfs_repl_copy_thread(void* arg)
+{
+    unfs_header_t* hp = unfs.header;
+    u64 pagecount = hp->pagecount - hp->datapage;
+    u64* map = (u64*)hp->map;
+    u64 i, start = 0, run = 0;
+
+    unfs_ioc_t ioc = DEV(ioc_alloc)();
+    unfs_repl_copy(ioc, UNFS_MAPPA, hp->datapage - UNFS_MAPPA);
+    for (i = 0; i < hp->mapsize && !unfs.replstop; i++) {
+        u64 w = __atomic_load_n(&map[i], __ATOMIC_RELAXED);
+        if (w == 0 && !run) continue;
+        int b;
+        for (b = 0; b < 64; b++) {
+            u64 pa = (i << 6) + b;
+            if (pa < pagecount && (w & (1UL << (63 - b)))) {
+                if (!run) start = pa;
+                run++;
+            } else if (run) {
+                unfs_repl_copy(ioc, hp->datapage + start, run);
+                run = 0;
+            }
+        }
+    }
+    if (run && !unfs.replstop) unfs_repl_copy(ioc, hp->datapage + start, run);
+    if (!unfs.replstop) {
+        unfs_repl_copy(ioc, UNFS_HEADPA, UNFS_HEADPC);
+        unfs_repl_copied();
+    }
+    DEV(ioc_free)(ioc);
+    return NULL;
+}
+#endif
+
+/**
+ * Start copying the filesystem to a replica that is not in sync.
+ */
+static void unfs_repl_start()
+{
+#ifndef UNFS_STATIC
+    if (!unfs.replcopy || unfs.replthread) return;
+    if (NOLOCK) {
+        // copy before returning to the application thread
+        unfs_repl_copy_thread(NULL);
+        unfs.replcopy = 0;
+        return;
+    }
+    unfs.replstop = 0;
+    if (pthread_create(&unfs.replthread, NULL, unfs_repl_copy_thread, NULL))
+        FATAL("cannot create replica copy thread");
+#endif
 }
 
 /**
- * Close a file.
- * @param   fd          file descriptor reference
- * @return  0 if ok else error code.
+ * Stop the replica copy thread.
  */
-int unfs_file_close(unfs_fd_t fd)
+static void unfs_repl_stop()
 {
-    int err = EINVAL;
-    unfs_node_t* nodep = fd.id;
-
-    FILE_WRLOCK(nodep);
-    DEBUG_FN("%s %d", nodep->name, nodep->open);
-    if (nodep->open) {
-        nodep->open--;
-        if (nodep->updated) {
-            unfs_ioc_t ioc = unfs.dev.ioc_alloc();
-            unfs_node_sync(ioc, nodep);
-            unfs.dev.write(ioc, unfs.header, UNFS_HEADPA, UNFS_HEADPC);
-            unfs.dev.ioc_free(ioc);
-            nodep->updated = 0;
-        }
-        err = 0;
-    }
-    FILE_UNLOCK(nodep);
-    return err;
+    if (!unfs.replthread) return;
+    unfs.replstop = 1;
+    pthread_join(unfs.replthread, NULL);
+    unfs.replthread = 0;
 }
 
 /**
- * Sync file state to device.
- * @param   fd          file descriptor reference
+ * Initialize and open the device.
+ * @param   device      device name
+ * @param   rdonly      read-only mount flag
  * @return  0 if ok else error code.
  */
-int unfs_file_sync(unfs_fd_t fd)
+static int unfs_init(const char* device, int rdonly)
 {
-    int err = EINVAL;
-    unfs_node_t* nodep = fd.id;
-
-    FILE_WRLOCK(nodep);
-    DEBUG_FN("%s", nodep->name);
-    if (nodep->open) {
-        if (nodep->updated) {
-            unfs_ioc_t ioc = unfs.dev.ioc_alloc();
-            unfs_node_sync(ioc, nodep);
-            unfs.dev.write(ioc, unfs.header, UNFS_HEADPA, UNFS_HEADPC);
-            unfs.dev.ioc_free(ioc);
-            nodep->updated = 0;
+    pthread_mutex_lock(&unfslock);
+    LOG_OPEN();
+    INFO_FN("%s", device);
+    if (!unfstemp.patterns) {
+        char* env = getenv("UNFS_TEMP");
+        if (env) {
+            char* mem = getenv("UNFS_TEMPMEM");
+            unfs_temp_set(env, mem ? atol(mem) << 20 : 0);
         }
-        err = 0;
     }
-    FILE_UNLOCK(nodep);
-    return err;
+    if (!unfsoffload.dir) {
+        char* env = getenv("UNFS_OFFLOAD");
+        if (env) {
+            unfsoffload.dir = strdup(env);
+            env = getenv("UNFS_OFFLOAD_THREADS");
+            if (env && atoi(env) > 0) unfsoffload.threads = atoi(env);
+        }
+    }
+    if (!unfsprewarm.name) {
+        char* env = getenv("UNFS_PREWARM");
+        if (env) {
+            unfsprewarm.name = strdup(env);
+            env = getenv("UNFS_PREWARM_MB");
+            if (env) unfsprewarm.maxsize = atol(env) << 20;
+            env = getenv("UNFS_PREWARM_THREADS");
+            if (env && atoi(env) > 0) unfsprewarm.threads = atoi(env);
+        }
+    }
+    if (!unfs.header) {
+        char* env = getenv("UNFS_BRLOCK");
+        unfs.brlock = env && atoi(env);
+        env = getenv("UNFS_SHARDS");
+        unfs.shards = env ? atoi(env) : 0;
+        if (unfs.shards < 2) unfs.shards = 0;
+        if (unfs.shards > SHARD_MAX) unfs.shards = SHARD_MAX;
+        int s;
+        for (s = 0; s < unfs.shards; s++)
+            pthread_rwlock_init(&unfs.vollock[SHARD_TREE(s)], NULL);
+        pthread_rwlock_init(&unfs.lock, NULL);
+        pthread_rwlock_init(&unfs.txnlock, NULL);
+        pthread_mutex_init(&unfs.txnjlock, NULL);
+        pthread_mutex_init(&unfs.chglock, NULL);
+        pthread_mutex_init(&unfs.metalock, NULL);
+        unfs.header = unfs_open_dev(device);
+        unfs.header->pagefree = unfs.header->pagecount;
+        unfs.fsid = time(0) << 16;
+        unfs.mapsynclo = unfs.header->pagecount;
+        unfs.mapsynchi = 0;
+        unfs.mapsyncfdlo = unfs.header->pagecount;
+        unfs.mapsyncfdhi = 0;
+        unfs.rdonly = rdonly;
+#ifndef UNFS_STATIC
+        env = getenv("UNFS_REPLICA");
+        if (env && !rdonly) {
+            if (strcmp(env, device) == 0)
+                FATAL("replica %s is the device", env);
+            if (unfs.header->tierpage)
+                ERROR("cannot replicate tiered device %s", device);
+            else unfs.replcopy = unfs_repl_open(&unfs.dev, env,
+                                unfs.header->pagecount << UNFS_PAGESHIFT);
+        }
+#endif
+    } else if (unfs.rdonly != rdonly) {
+        ERROR("%s is mounted %s", device, unfs.rdonly ? "read-only" : "read/write");
+        pthread_mutex_unlock(&unfslock);
+        return EBUSY;
+    }
+    pthread_mutex_unlock(&unfslock);
+    return 0;
 }
 
 /**
- * Return the file name.
- * @param   fd          file descriptor reference
- * @param   name        returned name buffer
- * @param   len         name buffer length
- * @return  the name buffer if specified or allocated string or NULL if error.
+ * Sync filesystem header and map to disk (deferred within a transaction).
  */
-char* unfs_file_name(unfs_fd_t fd, char* name, int len)
+static void unfs_sync()
 {
-    unfs_node_t* nodep = fd.id;
+    if (unfs.txn || unfs.rdonly || unfs.bulk) return;
+    META_LOCK();
+    if (unfs.entrysync || unfs.mapsynclo <= unfs.mapsynchi ||
+        unfs.mapsyncfdlo <= unfs.mapsyncfdhi) {
+        IOPRIO_ENTER(UNFS_IOPRIO_META);
+        unfs_ioc_t ioc = DEV(ioc_alloc)();
 
-    FILE_RDLOCK(nodep);
-    char* s = NULL;
-    if (nodep->open) {
-        s = name ? strncpy(name, nodep->name, len) : strdup(nodep->name);
+        unfs_header_write(ioc);
+        if (unfs.mapsynclo <= unfs.mapsynchi) {
+            u64 pa = (unfs.mapsynclo - unfs.header->datapage) >> 15;
+            u32 pc = ((unfs.mapsynchi - unfs.header->datapage) >> 15) - pa + 1;
+            unfs_map_write(ioc, pa, pc);
+            unfs.mapsynclo = unfs.header->pagecount;
+            unfs.mapsynchi = 0;
+        }
+        if (unfs.mapsyncfdlo <= unfs.mapsyncfdhi) {
+            u64 pa = (unfs.mapsyncfdlo - unfs.header->datapage) >> 15;
+            u32 pc = ((unfs.mapsyncfdhi - unfs.header->datapage) >> 15) - pa + 1;
+            unfs_map_write(ioc, pa, pc);
+            unfs.mapsyncfdlo = unfs.header->pagecount;
+            unfs.mapsyncfdhi = 0;
+        }
+        DEV(ioc_free)(ioc);
+        IOPRIO_LEAVE();
     }
-    FILE_UNLOCK(nodep);
-    return s;
+    META_UNLOCK();
 }
 
 /**
- * Return the file status including size and data segment info.
- * If dslp is not NULL, a ds segment array will be allocated and
- * caller must free it when done.
- * @param   fd          file descriptor reference
- * @param   sizep       file size pointer
- * @param   dscp        number of ds entry count pointer
- * @param   dslp        ds entry list pointer
- * @return  an allocated array of file data segments.
+ * Read or write contiguous pages from/to a memory buffer.
+ * @param   ioc         io context
+ * @param   buf         memory buffer
+ * @param   pageid      page address
+ * @param   pc          page count
+ * @param   wflag       write flag
  */
-int unfs_file_stat(unfs_fd_t fd, u64* sizep, u32* dscp, unfs_ds_t** dslp)
+static void unfs_txn_io(unfs_ioc_t ioc, void* buf, u64 pageid, u64 pc, int wflag)
 {
-    int err = EINVAL;
-    unfs_node_t* nodep = fd.id;
-
-    FILE_RDLOCK(nodep);
-    DEBUG_FN("%s", nodep->name);
-    if (nodep->open) {
-        if (sizep) *sizep = nodep->size;
-        if (dscp) *dscp = nodep->dscount;
-        if (dslp) {
-            *dslp = NULL;
-            if (nodep->dscount) {
-                size_t n = nodep->dscount * sizeof(unfs_ds_t);
-                *dslp = malloc(n);
-                memcpy(*dslp, nodep->ds, n);
-            }
+    u32 iopc = pc < OFFLOAD_CHUNKPC ? pc : OFFLOAD_CHUNKPC;
+    void* iop = DEV(page_alloc)(ioc, &iopc);
+    while (pc) {
+        u32 n = pc < iopc ? pc : iopc;
+        if (wflag) {
+            memcpy(iop, buf, n << UNFS_PAGESHIFT);
+            DEV(write)(ioc, iop, pageid, n);
+        } else {
+            DEV(read)(ioc, iop, pageid, n);
+            memcpy(buf, iop, n << UNFS_PAGESHIFT);
         }
-        err = 0;
+        buf += n << UNFS_PAGESHIFT;
+        pageid += n;
+        pc -= n;
     }
-    FILE_UNLOCK(nodep);
-    return err;
+    DEV(page_free)(ioc, iop, iopc);
 }
 
 /**
- * Resize a file.
- * @param   fd          file descriptor reference
- * @param   newsize     new size
- * @param   fill        pointer to a pattern to fill the newly added portion
- * @return  0 if ok else error code.
+ * Write transaction page images to their target page addresses, where
+ * images of consecutive targets are written together.
+ * @param   ioc         io context
+ * @param   target      target page addresses
+ * @param   image       page images
+ * @param   n           number of pages
  */
-int unfs_file_resize(unfs_fd_t fd, u64 newsize, int* fill)
+static void unfs_txn_apply(unfs_ioc_t ioc, u64* target, void* image, u64 n)
 {
-    int err = EINVAL;
-    unfs_node_t* nodep = fd.id;
-
-    FILE_WRLOCK(nodep);
-    DEBUG_FN("%s %#lx", nodep->name, newsize);
-    if (nodep->open) {
-        FS_WRLOCK();
-        unfs_ioc_t ioc = unfs.dev.ioc_alloc();
-        unfs_node_resize(ioc, nodep, newsize, fill);
-        unfs.dev.ioc_free(ioc);
-        FS_UNLOCK();
-        err = 0;
+    u64 i, pc;
+    for (i = 0; i < n; i += pc) {
+        for (pc = 1; (i + pc) < n && target[i + pc] == (target[i] + pc); pc++);
+        unfs_txn_io(ioc, image + (i << UNFS_PAGESHIFT), target[i], pc, 1);
     }
-    FILE_UNLOCK(nodep);
-    return err;
 }
 
 /**
- * Read data from a file into a user buffer.
- * @param   fd          file descriptor reference
- * @param   buf         data buffer
- * @param   offset      file offset position
- * @param   len         number of bytes to read
- * @return  0 if ok else error code.
+ * Commit the transaction (with FS_WRLOCK and transaction lock held).
+ * The updated file entry and bitmap page images are written to a journal
+ * allocated from free pages (which are marked free in the persisted
+ * bitmap and header), the header referencing the journal is written as
+ * the commit point, and the images are then written in place.  If there
+ * is no space for the journal, the images are written in place directly.
+ * @param   ioc         io context
  */
-int unfs_file_read(unfs_fd_t fd, void *buf, u64 offset, u64 len)
+static void unfs_txn_flush(unfs_ioc_t ioc)
 {
-    int err = EINVAL;
-    unfs_node_t* nodep = fd.id;
-
-    FILE_RDLOCK(nodep);
-    DEBUG_FN("%s off=%#lx len=%#lx size=%#lx", nodep->name, offset, len, nodep->size);
-    if (nodep->open) {
-        if ((offset + len) <= nodep->size) {
-            unfs_ioc_t ioc = unfs.dev.ioc_alloc();
-            err = unfs_node_rw(ioc, nodep, buf, offset, len, 0);
-            unfs.dev.ioc_free(ioc);
+    unfs_header_t* hp = unfs.header;
+    u32 i;
+
+    // bitmap ranges to be updated including the deferred frees
+    u64 lo = unfs.mapsynclo, hi = unfs.mapsynchi;
+    u64 fdlo = unfs.mapsyncfdlo, fdhi = unfs.mapsyncfdhi;
+    for (i = 0; i < unfs.txnfreecount; i++) {
+        unfs_ds_t* fp = &unfs.txnfree[i];
+        if (fp->pagecount) {
+            if (lo > fp->pageid) lo = fp->pageid;
+            if (hi < (fp->pageid + fp->pagecount - 1)) hi = fp->pageid + fp->pagecount - 1;
         } else {
-            ERROR("%s off=%#lx len=%#lx size=%#lx", nodep->name, offset, len, nodep->size);
+            if (fdlo > fp->pageid) fdlo = fp->pageid;
+            if (fdhi < (fp->pageid + UNFS_FILEPC - 1)) fdhi = fp->pageid + UNFS_FILEPC - 1;
         }
     }
-    FILE_UNLOCK(nodep);
-    return err;
+    u64 pa = 0, pc = 0, fdpa = 0, fdpc = 0;
+    if (lo <= hi) {
+        pa = (lo - hp->datapage) >> 15;
+        pc = ((hi - hp->datapage) >> 15) - pa + 1;
+    }
+    if (fdlo <= fdhi) {
+        fdpa = (fdlo - hp->datapage) >> 15;
+        fdpc = ((fdhi - hp->datapage) >> 15) - fdpa + 1;
+    }
+    u64 n = unfs.txnentrycount * UNFS_FILEPC + pc + fdpc;
+    DEBUG_FN("entries=%u frees=%u map=%#lx+%#lx fd=%#lx+%#lx",
+             unfs.txnentrycount, unfs.txnfreecount, pa, pc, fdpa, fdpc);
+
+    // allocate the journal before releasing the pages freed in transaction
+    u64 dpc = (n * sizeof(u64) + UNFS_PAGESIZE - 1) >> UNFS_PAGESHIFT;
+    u64 jpc = dpc + n;
+    u64 jpage = n ? unfs_map_alloc(jpc, NULL) : 0;
+    for (i = 0; i < unfs.txnfreecount; i++) {
+        unfs_ds_t* fp = &unfs.txnfree[i];
+        if (fp->pagecount) unfs_map_free(fp->pageid, fp->pagecount);
+        else unfs_fd_unmap(fp->pageid);
+    }
+    unfs.txnfreecount = 0;
+    if (n && !jpage)
+        INFO("WARN: no space for %#lx journal pages, commit is not atomic", jpc);
+
+    // build the journal of target page addresses and page images
+    void* jbuf = calloc(jpc, UNFS_PAGESIZE);
+    u64* target = jbuf;
+    void* image = jbuf + (dpc << UNFS_PAGESHIFT);
+    u64 k = 0;
+    for (i = 0; i < unfs.txnentrycount; i++) {
+        int p;
+        for (p = 0; p < UNFS_FILEPC; p++) target[k + p] = unfs.txnentry[i].pageid + p;
+        memcpy(image + (k << UNFS_PAGESHIFT), unfs.txnentry[i].image,
+               UNFS_FILEPC * UNFS_PAGESIZE);
+        free(unfs.txnentry[i].image);
+        k += UNFS_FILEPC;
+    }
+    unfs.txnentrycount = 0;
+    if (jpage) {
+        unfs.txnpage = jpage;
+        unfs.txnpc = jpc;
+    }
+    for (i = 0; i < pc; i++) target[k + i] = UNFS_MAPPA + pa + i;
+    if (pc) unfs_map_copy(image + (k << UNFS_PAGESHIFT), pa, pc);
+    k += pc;
+    for (i = 0; i < fdpc; i++) target[k + i] = UNFS_MAPPA + fdpa + i;
+    if (fdpc) unfs_map_copy(image + (k << UNFS_PAGESHIFT), fdpa, fdpc);
+    unfs.mapsynclo = unfs.mapsyncfdlo = hp->pagecount;
+    unfs.mapsynchi = unfs.mapsyncfdhi = 0;
+
+    // write the journal and commit it with the header
+    if (jpage) {
+        unfs_txn_io(ioc, jbuf, jpage, jpc, 1);
+        hp->txnpage = jpage;
+        hp->txncount = n;
+        unfs_header_write(ioc);
+    }
+
+    // write the images in place and release the journal
+    unfs_txn_apply(ioc, target, image, n);
+    free(jbuf);
+    if (jpage) {
+        hp->txnpage = 0;
+        hp->txncount = 0;
+        unfs.txnpage = 0;
+        unfs.txnpc = 0;
+        unfs_map_free(jpage, jpc);
+    }
+    unfs_header_write(ioc);
 }
 
 /**
- * Write data into a file.
- * @param   fd          file descriptor reference
- * @param   buf         data buffer
- * @param   offset      file offset position
- * @param   len         number of bytes to read
+ * Replay a committed transaction journal (after the header is read and
+ * validated).  Nothing is written if a journal page target is not on the
+ * device.
  * @return  0 if ok else error code.
  */
-int unfs_file_write(unfs_fd_t fd, const void *buf, u64 offset, u64 len)
+static int unfs_txn_replay()
 {
-    int err = EINVAL;
-    unfs_node_t* nodep = fd.id;
-
-    DEBUG_FN("%s off=%#lx len=%#lx size=%#lx", nodep->name, offset, len, nodep->size);
-#if 0
-    // file offset should not exceed file size
-    if (offset > nodep->size) {
-        ERROR("%s off=%#lx len=%#lx size=%#lx", nodep->name, offset, len, nodep->size);
-        return err;
-    }
-#endif
-
-    FILE_WRLOCK(nodep);
-    if (nodep->open) {
-        err = 0;
-        u64 size = offset + len;
-        unfs_ioc_t ioc;
-        if (size > nodep->size) {
-            FS_WRLOCK();
-            ioc = unfs.dev.ioc_alloc();
-            err = unfs_node_resize(ioc, nodep, size, NULL);
-            FS_UNLOCK();
-        } else {
-            ioc = unfs.dev.ioc_alloc();
-        }
-        if (!err) err = unfs_node_rw(ioc, nodep, (void*)buf, offset, len, 1);
-        unfs.dev.ioc_free(ioc);
+    unfs_header_t* hp = unfs.header;
+    if (!hp->txnpage) return 0;
+    u64 n = hp->txncount;
+    u64 dpc = (n * sizeof(u64) + UNFS_PAGESIZE - 1) >> UNFS_PAGESHIFT;
+    INFO_FN("journal %#lx count %#lx", hp->txnpage, n);
+
+    IOPRIO_ENTER(UNFS_IOPRIO_META);
+    unfs_ioc_t ioc = DEV(ioc_alloc)();
+    void* jbuf = malloc((dpc + n) << UNFS_PAGESHIFT);
+    unfs_txn_io(ioc, jbuf, hp->txnpage, dpc + n, 0);
+    u64* target = jbuf;
+    u64 i;
+    for (i = 0; i < n && target[i] < hp->pagecount; i++);
+    if (i < n) {
+        ERROR("bad journal page %#lx target %#lx", i, target[i]);
+        free(jbuf);
+        DEV(ioc_free)(ioc);
+        IOPRIO_LEAVE();
+        return EINVAL;
     }
-    FILE_UNLOCK(nodep);
-    return err;
+    unfs_txn_apply(ioc, target, jbuf + (dpc << UNFS_PAGESHIFT), n);
+    free(jbuf);
+
+    // reload the bitmap and clear the journal
+    unfs_txn_io(ioc, hp, UNFS_HEADPA, hp->datapage, 0);
+    hp->txnpage = 0;
+    hp->txncount = 0;
+    hp->gen++;
+    unfs_txn_io(ioc, hp, UNFS_HEADPA, UNFS_HEADPC, 1);
+    DEV(ioc_free)(ioc);
+    IOPRIO_LEAVE();
+    return 0;
 }
 
 /**
- * Calculate a 64-bit file checksum.  Checksum may not be content unique.
- * @param   fd          file descriptor reference
- * @return  the checksum or -1 if error.
+ * Begin a transaction.  Until the matching commit, all file entry, header
+ * and bitmap updates (i.e. by create, remove, rename, resize and file close
+ * and sync from all threads) are kept in memory and will be persisted
+ * atomically.  Transactions may be nested where the outermost commit
+ * persists the updates.
+ * @param   fs          filesystem reference
+ * @return  0 if ok else error code.
  */
-u64 unfs_file_checksum(unfs_fd_t fd)
+int unfs_txn_begin(unfs_fs_t fs)
 {
-    u64 sum = 0;
-    unfs_node_t* nodep = fd.id;
+    DEBUG_FN("%d", unfs.txn);
+    if (FS_CHECK(fs)) return EINVAL;
+    if (unfs.rdonly) return EROFS;
+    FS_WRLOCK();
+    TXN_WRLOCK();
+    unfs.txn++;
+    TXN_UNLOCK();
+    FS_UNLOCK();
+    return 0;
+}
 
-    FILE_RDLOCK(nodep);
-    DEBUG_FN("%s", nodep->name);
-    if (nodep->open) {
-        int d, p, i;
-        u32 iopc = 1;
-        unfs_ioc_t ioc = unfs.dev.ioc_alloc();
-        void* iop = unfs.dev.page_alloc(ioc, &iopc);
-        if (iopc != 1)
-            FATAL("cannot allocate 1 page");
-        u64 size = nodep->size;
-        for (d = 0; d < nodep->dscount; d++) {
-            u64 pa = nodep->ds[d].pageid;
-            for (p = 0; p < nodep->ds[d].pagecount; p++) {
-                unfs.dev.read(ioc, iop, pa, 1);
-                u8* bp = iop;
-                for (i = 0; i < UNFS_PAGESIZE; i++) {
-                    sum += (size << 32) | *bp++;
-                    if (--size == 0) break;
-                }
-                pa++;
-            }
-        }
-        unfs.dev.page_free(ioc, iop, iopc);
-        unfs.dev.ioc_free(ioc);
+/**
+ * Commit a transaction.
+ * @param   fs          filesystem reference
+ * @return  0 if ok else error code.
+ */
+int unfs_txn_commit(unfs_fs_t fs)
+{
+    DEBUG_FN("%d", unfs.txn);
+    if (FS_CHECK(fs)) return EINVAL;
+    if (unfs.rdonly) return EROFS;
+    int err = 0;
+    FS_WRLOCK();
+    TXN_WRLOCK();
+    if (unfs.txn == 0) {
+        err = EINVAL;
+    } else if (--unfs.txn == 0) {
+        IOPRIO_ENTER(UNFS_IOPRIO_META);
+        unfs_ioc_t ioc = DEV(ioc_alloc)();
+        unfs_txn_flush(ioc);
+        DEV(ioc_free)(ioc);
+        IOPRIO_LEAVE();
     }
-    FILE_UNLOCK(nodep);
-    return sum;
+    TXN_UNLOCK();
+    FS_UNLOCK();
+    return err;
 }
 
 /**
- * Check if name matched and add to directory listing.
- * @param   nodep       node pointer
- * @param   dlp         directory list pointer
+ * Walk the tree to release the bulk preallocated pages and sync the updated
+ * file entries (with FS_WRLOCK held).  The file lock is only tried and a
+ * file being written is left to be synced by the next walk.
+ * @param   ioc         io context
+ * @param   root        root node
+ * @return  the number of files left to be synced.
  */
-static void unfs_dir_match(unfs_node_t* nodep, unfs_dir_list_t* dlp)
+static int unfs_bulk_walk(unfs_ioc_t ioc, struct tnode* root)
 {
-    if (unfs_child_of(nodep->name, dlp->name)) {
-        if (dlp->size == 0)
-            FATAL("bad directory size");
-        int n = --dlp->size;
-        dlp->list[n].name = strdup(nodep->name);
-        dlp->list[n].size = nodep->size;
-        dlp->list[n].isdir = nodep->isdir;
-    }
+    if (!root) return 0;
+    unfs_node_t* nodep = (unfs_node_t*)(root->key);
+    int busy = unfs_bulk_walk(ioc, TNODE_LEFT(root)) +
+               unfs_bulk_walk(ioc, TNODE_RIGHT(root));
+
+    unfs_bulk_release(nodep);
+    if (!nodep->updated || nodep->temp) return busy;
+    if (FILE_TRYLOCK(nodep)) return busy + 1;
+    unfs_node_sync(ioc, nodep);
+    nodep->updated = 0;
+    FILE_UNLOCK(nodep);
+    return busy;
 }
 
 /**
- * Walk the tree to get a directory listing.
- * @param   root        root node
- * @param   dlp         directory list pointer
+ * Persist all the metadata deferred in bulk mode, i.e. release the bulk
+ * preallocated pages and sync the updated file entries, the header and
+ * the bitmap (with FS_WRLOCK held and bulk mode turned off).
  */
-static void unfs_dir_walk(struct tnode* root, unfs_dir_list_t* dlp)
+static void unfs_bulk_flush()
 {
-    if (!root) return;
-
-    if (root->left == NULL && root->right == NULL) {
-        unfs_dir_match((unfs_node_t*)(root->key), dlp);
-    } else {
-        if (root->left != NULL) unfs_dir_walk(root->left, dlp);
-        unfs_dir_match((unfs_node_t*)(root->key), dlp);
-        if (root->right != NULL) unfs_dir_walk(root->right, dlp);
+    IOPRIO_ENTER(UNFS_IOPRIO_META);
+    unfs_ioc_t ioc = DEV(ioc_alloc)();
+    for (;;) {
+        int busy = 0;
+        u32 v;
+        for (v = 0; v <= TREE_LAST; v = TREE_NEXT(v)) busy += unfs_bulk_walk(ioc, unfs.root[v]);
+        if (!busy) break;
+        FS_UNLOCK();
+        sched_yield();
+        FS_WRLOCK();
     }
+    unfs.entrysync = 1;
+    DEV(ioc_free)(ioc);
+    IOPRIO_LEAVE();
+    unfs_sync();
 }
 
 /**
- * Get a directory listing.
+ * Turn bulk load mode on or off (e.g. for a database restore).  In bulk
+ * mode, growing files take their pages from large preallocated extents,
+ * a write extending a file does not read its partial last page, and the
+ * file entry, header and bitmap updates of file close and sync are not
+ * persisted until bulk mode is turned off (or the filesystem is closed).
+ * Create, remove and rename still write their file entries, but a crash
+ * in bulk mode may leave the files being loaded with stale sizes and
+ * extents, so the load must be run again.
  * @param   fs          filesystem reference
- * @param   name        canonical name
- * @return  an allocated directory list structure.
+ * @param   enable      bulk mode flag
+ * @return  0 if ok else error code.
  */
-unfs_dir_list_t* unfs_dir_list(unfs_fs_t fs, const char *name)
+int unfs_bulk(unfs_fs_t fs, int enable)
 {
-    unfs_dir_list_t* dlp = NULL;
-    DEBUG_FN("%s", name);
-    if (FS_CHECK(fs) || strlen(name) >= UNFS_MAXPATH) return dlp;
-
-    FS_RDLOCK();
-    unfs_node_t* nodep = unfs_node_find(name);
-    if (nodep && nodep->isdir) {
-        u64 nodesize = nodep->size;
-        dlp = malloc(sizeof(*dlp) + (nodesize * sizeof(unfs_dir_entry_t)));
-        dlp->name = strdup(nodep->name);
-        dlp->size = nodesize;
-        unfs_dir_walk(unfs.root, dlp);
-        if (dlp->size != 0)
-            FATAL("size=%#lx found=%#lx", nodesize, nodesize - dlp->size);
-        dlp->size = nodesize;
+    DEBUG_FN("%d", enable);
+    if (FS_CHECK(fs)) return EINVAL;
+    if (unfs.rdonly) return EROFS;
+    FS_WRLOCK();
+    if (unfs.bulk && !enable) {
+        unfs.bulk = 0;
+        unfs_bulk_flush();
+    } else {
+        unfs.bulk = enable;
     }
     FS_UNLOCK();
-    return dlp;
+    return 0;
 }
 
 /**
- * Free a directory_list structure.
- * @param   dlp         directory list pointer
+ * Start a new change generation and return the current one, which marks a
+ * point in time for an incremental backup: the data written since a backup
+ * that started with generation N is given by unfs_file_changes with N.
+ * The new generation is persisted in the header before returning, also
+ * within a transaction or bulk mode (which otherwise defer header writes).
+ * @param   fs          filesystem reference
+ * @return  the current change generation or 0 if error.
  */
-void unfs_dir_list_free(unfs_dir_list_t* dlp)
+u64 unfs_change_gen(unfs_fs_t fs)
 {
-    DEBUG_FN("%s", dlp->name);
-    int count = dlp->size;
-    while (count) free(dlp->list[--count].name);
-    free(dlp->name);
-    free(dlp);
+    DEBUG_FN();
+    if (FS_CHECK(fs) || unfs.rdonly) return 0;
+    pthread_mutex_lock(&unfs.chglock);
+    FS_WRLOCK();
+    u64 gen = __atomic_fetch_add(&unfs.header->chgen, 1, __ATOMIC_SEQ_CST);
+    unfs_ioc_t ioc = DEV(ioc_alloc)();
+
+    // within a transaction or bulk mode the header is not written until the
+    // commit, so only the generation word of the header on device is updated
+    TXN_RDLOCK();
+    META_LOCK();
+    if (!unfs.txn && !unfs.bulk) {
+        unfs_header_write(ioc);
+    } else {
+        u64 off = offsetof(unfs_header_t, chgen);
+        u32 iopc = 1;
+        u64* iop = DEV(page_alloc)(ioc, &iopc);
+        DEV(read)(ioc, iop, UNFS_HEADPA + (off >> UNFS_PAGESHIFT), 1);
+        iop[(off & (UNFS_PAGESIZE - 1)) / sizeof(u64)] = unfs.header->chgen;
+        DEV(write)(ioc, iop, UNFS_HEADPA + (off >> UNFS_PAGESHIFT), 1);
+        DEV(page_free)(ioc, iop, iopc);
+    }
+    META_UNLOCK();
+    TXN_UNLOCK();
+    DEV(ioc_free)(ioc);
+    FS_UNLOCK();
+
+    // wait for the updates still recording the ended generation
+    while (__atomic_load_n(&unfs.chgactive[gen & 1], __ATOMIC_ACQUIRE))
+        sched_yield();
+    pthread_mutex_unlock(&unfs.chglock);
+    return gen;
 }
 
 /**
- * Create a file or directory if it doesn't exist.
- * If pflag is set, then create the parent directories as needed.
- * @param   fs          filesystem reference
- * @param   name        canonical name
- * @param   isdir       is directory flag
- * @param   pflag       make parent directories as needed
- * @return  0 if ok, else error code.
+ * Walk the tree to collect the names of the file nodes to migrate.
+ * @param   root        root node
+ * @param   list        name list
+ * @param   count       name list count
  */
-int unfs_create(unfs_fs_t fs, const char *name, int isdir, int pflag)
+static void unfs_tier_walk(struct tnode* root, char** list, u64* count)
 {
-    DEBUG_FN("%s", name);
-    if (FS_CHECK(fs) || strlen(name) >= UNFS_MAXPATH) return EINVAL;
+    if (!root) return;
+    unfs_node_t* nodep = (unfs_node_t*)(root->key);
 
-    int err = 0;
-    FS_WRLOCK();
-    if (pflag) {
-        char path[UNFS_MAXPATH];
-        strcpy(path, name);
-        int dir = 1;
-        char* s = path + 1;
-        while (s && *s != '\0') {
-            if ((s = strchr(s, '/'))) *s = 0;
-            else dir = isdir;
-            unfs_node_t* nodep = unfs_node_find(path);
-            if (!nodep) nodep = unfs_node_create(path, dir);
-            if (!nodep) {
-                err = ENOMEM;
-                break;
-            }
-            if (s) *s++ = '/';
-        }
-    } else {
-        unfs_node_t* nodep = unfs_node_find(name);
-        if (!nodep) {
-            nodep = unfs_node_create(name, isdir);
-            if (!nodep) err = ENOMEM;
-        }
-    }
-    FS_UNLOCK();
-    return err;
+    unfs_tier_walk(TNODE_LEFT(root), list, count);
+    if (nodep->heat && !nodep->temp && nodep->dscount)
+        list[(*count)++] = strdup(nodep->name);
+    unfs_tier_walk(TNODE_RIGHT(root), list, count);
 }
 
 /**
- * Remove a file or directory.  If node is directory, it must be empty.
- * @param   fs          filesystem reference
- * @param   name        canonical name
- * @param   isdir       is directory flag
+ * Move a file data segment to the specified tier.  The data is copied
+ * without the file lock, then the file lock is tried (while holding the
+ * filesystem lock, to keep the open lock order) only to switch the segment,
+ * which is done if neither the segment map nor the data were updated during
+ * the copy (else the copy is dropped).  The old pages are released after
+ * the node is updated.
+ * @param   ioc         io context
+ * @param   nodep       pinned file node
+ * @param   d           data segment index
+ * @param   ds          data segment as of the file sequence number
+ * @param   seq         file sequence number
+ * @param   fast        move to fast tier flag
  * @return  0 if ok else error code.
  */
-int unfs_remove(unfs_fs_t fs, const char *name, int isdir)
+static int unfs_tier_move(unfs_ioc_t ioc, unfs_node_t* nodep, int d,
+                          unfs_ds_t ds, u32 seq, int fast)
 {
-    DEBUG_FN("%s", name);
-    if (FS_CHECK(fs) || name[1] == 0 || strlen(name) >= UNFS_MAXPATH)
-        return EINVAL;
+    FS_WRLOCK();
+    u64 newpage = unfs_map_alloc_aligned(ds.pagecount, fast, -1);
+    FS_UNLOCK();
+    if (newpage == 0) return ENOSPC;
+    DEBUG_FN("%s ds[%d]=(%#lx %#lx) to %#lx",
+             nodep->name, d, ds.pageid, ds.pagecount, newpage);
 
+    // copy the data unless the file is being written in place
     int err = 0;
+    u32 wseq = __atomic_load_n(&nodep->wseq, __ATOMIC_ACQUIRE);
+    if (wseq & 1) err = EBUSY;
+    u32 iopc = ds.pagecount;
+    void* iop = DEV(page_alloc)(ioc, &iopc);
+    u64 n;
+    for (n = 0; !err && n < ds.pagecount; n += iopc) {
+        u32 pc = ds.pagecount - n;
+        if (pc > iopc) pc = iopc;
+        DEV(read)(ioc, iop, ds.pageid + n, pc);
+        DEV(write)(ioc, iop, newpage + n, pc);
+        if (FILE_SEQ_RETRY(nodep, seq)) err = EAGAIN;
+    }
+    DEV(page_free)(ioc, iop, iopc);
+
+    // switch the segment if the file was not updated meanwhile
+    if (!err) {
+        FS_WRLOCK();
+        if (FILE_TRYLOCK(nodep)) err = EBUSY;
+        FS_UNLOCK();
+    }
+    if (!err) {
+        if (FILE_SEQ_RETRY(nodep, seq) || nodep->wseq != wseq) {
+            err = EAGAIN;
+        } else {
+            FILE_SEQ_BEGIN(nodep);
+            nodep->ds[d].pageid = newpage;
+            FILE_SEQ_END(nodep);
+            nodep->mapgen = ATOMIC_ADD(&unfs.mapgen, 1);
+            unfs_node_sync(ioc, nodep);
+        }
+        FILE_UNLOCK(nodep);
+    }
+
+    // release the old pages (or the dropped copy) and persist the bitmap
     FS_WRLOCK();
-    unfs_node_t* nodep = unfs_node_find(name);
-    if (!nodep || nodep->isdir != isdir) {
-        err = ENOENT;
-    } else if (nodep->open || (isdir && nodep->size != 0)) {
-        err = EBUSY;
+    if (err) {
+        unfs_map_free(newpage, ds.pagecount);
     } else {
-        unfs_ioc_t ioc = unfs.dev.ioc_alloc();
-        unfs_node_remove(ioc, nodep);
-        unfs.dev.ioc_free(ioc);
+        unfs_map_free(ds.pageid, ds.pagecount);
+        unfs_sync();
     }
     FS_UNLOCK();
     return err;
 }
 
 /**
- * Rename/Move a directory or file.  If node is directory, it must be empty.
- * @param   fs          filesystem reference
- * @param   src         source canonical name
- * @param   dst         destination canonical name
- * @param   override    delete to if to exists
- * @return  0 if ok else error code.
+ * Perform one tier migration pass.  Cold data segments (i.e. no access
+ * since the last pass) on the fast tier are moved to the capacity tier
+ * while the fast tier free space is below the target, and hot segments
+ * on the capacity tier are moved to the fast tier while above the target.
+ * The segments are read without the file lock as of a file sequence
+ * number (and skipped while being updated), and the heat counters, which
+ * are approximate as lockless reads also update them, decay by half on
+ * each pass.
+ * @param   freepct     fast tier free space target in percent
+ * @param   hot         heat count for a segment to be hot
  */
-int unfs_rename(unfs_fs_t fs, const char *src, const char *dst, int override)
+static void unfs_tier_migrate(u32 freepct, u32 hot)
 {
-    DEBUG_FN("%s to %s", src, dst);
-    if (FS_CHECK(fs) || src[1] == 0 ||
-        strlen(src) >= UNFS_MAXPATH || strlen(dst) >= UNFS_MAXPATH)
-        return EINVAL;
+    unfs_header_t* hp = unfs.header;
 
-    int err = 0;
-    FS_WRLOCK();
-    unfs_ioc_t ioc = unfs.dev.ioc_alloc();
+    // collect the file names and get the fast tier free space
+    unfs_walk_lock();
+    u64 i, count = 0;
+    u32 v;
+    char** list = malloc((hp->fdcount + 1) * sizeof(char*));
+    for (v = 0; v <= TREE_LAST; v = TREE_NEXT(v)) unfs_tier_walk(unfs.root[v], list, &count);
+    u64 tierw = (hp->tierpage - hp->datapage) >> 6;
+    u64 mapend = hp->mapsize - (hp->fdcount >> 5) - 1;
+    s64 fastfree = 0;
+    u64* map = (u64*)hp->map;
+    for (i = tierw; i < mapend; i++) fastfree += 64 - __builtin_popcountl(map[i]);
+    s64 target = ((mapend - tierw) << 6) * freepct / 100;
+    FS_UNLOCK();
 
-    // src-node must exist
-    unfs_node_t* srcnode = unfs_node_find(src);
-    if (!srcnode) {
-        err = ENOENT;
-        goto done;
-    }
-    unfs_node_t* srcparent = srcnode->parent;
+    unfs_ioc_t ioc = DEV(ioc_alloc)();
+    for (i = 0; i < count; i++) {
+        // pin the node so it won't be removed while migrating
+        v = unfs_ns_lock(list[i], 0);
+        unfs_node_t* nodep = unfs_node_find(list[i]);
+        if (nodep) ATOMIC_ADD(&nodep->pin, 1);
+        unfs_ns_unlock(v);
+        free(list[i]);
+        if (!nodep) continue;
 
-    // src-node must not be opened and if isdir then must be empty
-    if (srcnode->open || (srcnode->isdir && srcnode->size)) {
-        err = EBUSY;
-        goto done;
+        int d;
+        for (d = 0; d < UNFS_MAXDS; d++) {
+            u32 seq = FILE_SEQ_READ(nodep);
+            int dscount = nodep->dscount;
+            unfs_ds_t ds = nodep->ds[d];
+            if ((seq & 1) || FILE_SEQ_RETRY(nodep, seq)) continue;
+            if (d >= dscount) break;
+            s64 pc = ds.pagecount;
+            u32 heat = nodep->heat[d];
+            if (ds.pageid >= hp->tierpage) {
+                if (fastfree < target && heat == 0 &&
+                    !unfs_tier_move(ioc, nodep, d, ds, seq, 0))
+                    fastfree += pc;
+            } else {
+                if ((fastfree - pc) > target && heat >= hot &&
+                    !unfs_tier_move(ioc, nodep, d, ds, seq, 1))
+                    fastfree -= pc;
+            }
+            nodep->heat[d] = heat >> 1;
+        }
+        ATOMIC_SUB(&nodep->pin, 1);
     }
+    DEV(ioc_free)(ioc);
+    free(list);
+}
 
-    // dst-parent must exist
-    unfs_node_t* dstparent = unfs_node_find_parent(dst);
-    if (!dstparent) {
-        err = EINVAL;
-        goto done;
+/**
+ * Tier migrator thread.  The migration pass interval (in ms), the fast
+ * tier free space target (in percent), and the hot segment heat count are
+ * specified by UNFS_TIER_INTERVAL, UNFS_TIER_FREE and UNFS_TIER_HOT.
+ * @param   arg         not used
+ * @return  NULL.
+ */
+static void* unfs_tier_thread(void* arg)
+{
+    char* env = getenv("UNFS_TIER_INTERVAL");
+    u64 interval = env ? atol(env) : 1000;
+    env = getenv("UNFS_TIER_FREE");
+    u32 freepct = env ? atoi(env) : 10;
+    env = getenv("UNFS_TIER_HOT");
+    u32 hot = env ? atoi(env) : 8;
+    INFO_FN("interval=%lu free=%u%% hot=%u", interval, freepct, hot);
+    unfs_sched_class(UNFS_IOPRIO_BG);
+
+    pthread_mutex_lock(&unfs.tierlock);
+    while (!unfs.tierstop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        u64 ns = ts.tv_nsec + (interval % 1000) * 1000000;
+        ts.tv_sec += interval / 1000 + ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        pthread_cond_timedwait(&unfs.tiercond, &unfs.tierlock, &ts);
+        if (unfs.tierstop) break;
+        pthread_mutex_unlock(&unfs.tierlock);
+        unfs_tier_migrate(freepct, hot);
+        pthread_mutex_lock(&unfs.tierlock);
     }
+    pthread_mutex_unlock(&unfs.tierlock);
+    return NULL;
+}
 
-    // if override flag set then dst-node must not exist of will be deleted
-    unfs_node_t* dstnode = unfs_node_find(dst);
-    if (dstnode) {
-        if (override) {
-            if (dstnode->open || (dstnode->isdir && dstnode->size != 0)) {
-                err = EBUSY;
-                goto done;
-            }
-            unfs_node_remove(ioc, dstnode);
-        } else {
-            err = EEXIST;
-            goto done;
-        }
+/**
+ * Start the tier migrator thread (if tiered and enabled).
+ */
+static void unfs_tier_start()
+{
+    char* env = getenv("UNFS_TIER_INTERVAL");
+    if (!unfs.header->tierpage || unfs.tierthread || (env && atol(env) == 0))
+        return;
+    if (NOLOCK) {
+        INFO("tier migration is disabled in the single-threaded build");
+        return;
     }
+    pthread_mutex_init(&unfs.tierlock, NULL);
+    pthread_cond_init(&unfs.tiercond, NULL);
+    unfs.tierstop = 0;
+    if (pthread_create(&unfs.tierthread, NULL, unfs_tier_thread, NULL))
+        FATAL("cannot create tier migrator thread");
+}
 
-    // remove the node, change its name, and put back in tree
-    tdelete(srcnode, &unfs.root, unfs_node_cmp_fn);
-    int namelen = strlen(dst);
-    size_t nsize = srcnode->isdir ? sizeof(unfs_node_t) : UNFS_PAGESIZE;
-    size_t memsize = nsize + namelen + 1;
-    if (srcnode->memsize < memsize) srcnode = realloc(srcnode, memsize);
-    srcnode->memsize = memsize;
-    srcnode->name = (char*)srcnode + nsize;
-    strcpy(srcnode->name, dst);
-    srcnode->parent = dstparent;
-    srcnode->parentid = dstparent->pageid;
-    tsearch(srcnode, &unfs.root, unfs_node_cmp_fn);
+/**
+ * Stop the tier migrator thread.
+ */
+static void unfs_tier_stop()
+{
+    if (!unfs.tierthread) return;
+    pthread_mutex_lock(&unfs.tierlock);
+    unfs.tierstop = 1;
+    pthread_cond_signal(&unfs.tiercond);
+    pthread_mutex_unlock(&unfs.tierlock);
+    pthread_join(unfs.tierthread, NULL);
+    pthread_cond_destroy(&unfs.tiercond);
+    pthread_mutex_destroy(&unfs.tierlock);
+    unfs.tierthread = 0;
+}
 
-    // sync node and parents
-    unfs_node_sync(ioc, srcnode);
-    if (srcparent != dstparent) {
-        FILE_WRLOCK(srcparent);
-        srcparent->size--;
-        unfs_node_sync(ioc, srcparent);
-        FILE_UNLOCK(srcparent);
+/**
+ * Walk the tree to collect the file data segments accessed since the mount
+ * (with FS_RDLOCK held).  A file being updated is skipped.
+ * @param   root        root node
+ * @param   job         prewarm job context to collect the ranges into
+ * @param   max         range list size
+ */
+static void unfs_prewarm_walk(struct tnode* root, unfs_prewarm_job_t* job, u64* max)
+{
+    if (!root) return;
+    unfs_node_t* nodep = (unfs_node_t*)(root->key);
 
-        FILE_WRLOCK(dstparent);
-        dstparent->size++;
-        unfs_node_sync(ioc, dstparent);
-        FILE_UNLOCK(dstparent);
+    unfs_prewarm_walk(TNODE_LEFT(root), job, max);
+    if (nodep->heat && !nodep->temp && !nodep->offload &&
+        strcmp(nodep->name, unfsprewarm.name) && !FILE_TRYLOCK(nodep)) {
+        u64 offset = 0;
+        int d;
+        for (d = 0; d < nodep->dscount && offset < nodep->size; d++) {
+            u64 len = nodep->ds[d].pagecount << UNFS_PAGESHIFT;
+            if (len > (nodep->size - offset)) len = nodep->size - offset;
+            if (nodep->heat[d]) {
+                if (job->count == *max) {
+                    *max = *max ? *max * 2 : 256;
+                    job->list = realloc(job->list, *max * sizeof(unfs_prewarm_range_t));
+                }
+                unfs_prewarm_range_t* rp = &job->list[job->count++];
+                rp->name = strdup(nodep->name);
+                rp->offset = offset;
+                rp->len = len;
+                rp->heat = nodep->heat[d];
+            }
+            offset += len;
+        }
+        FILE_UNLOCK(nodep);
     }
-
-done:
-    unfs.dev.ioc_free(ioc);
-    FS_UNLOCK();
-    return err;
+    unfs_prewarm_walk(TNODE_RIGHT(root), job, max);
 }
 
 /**
- * Check if a node name exists and return its size.
- * @param   fs          filesystem reference
- * @param   name        canonical name
- * @param   isdir       is directory flag pointer
- * @param   sizep       size pointer if node exist
- * @return  1 if exist else 0.
+ * Compare prewarm ranges by heat in descending order.
+ * @param   a           range a
+ * @param   b           range b
+ * @return  comparison result.
  */
-int unfs_exist(unfs_fs_t fs, const char *name, int* isdir, u64* sizep)
+static int unfs_prewarm_cmp_fn(const void* a, const void* b)
 {
-    DEBUG_FN("%s", name);
-    int exist = 0;
-    if (FS_CHECK(fs)) return exist;
+    u32 ha = ((const unfs_prewarm_range_t*)a)->heat;
+    u32 hb = ((const unfs_prewarm_range_t*)b)->heat;
+    return (hb > ha) - (hb < ha);
+}
 
-    FS_RDLOCK();
-    unfs_node_t* nodep = unfs_node_find(name);
-    if (nodep) {
-        if (isdir) *isdir = nodep->isdir;
-        if (sizep) *sizep = nodep->size;
-        exist = 1;
-    }
-    FS_UNLOCK();
-    return exist;
+/**
+ * Free the ranges of a prewarm job.
+ * @param   job         prewarm job context
+ */
+static void unfs_prewarm_free(unfs_prewarm_job_t* job)
+{
+    u64 i;
+    for (i = 0; i < job->count; i++) free(job->list[i].name);
+    free(job->list);
+    job->list = NULL;
+    job->count = 0;
 }
 
 /**
- * Get a copy of the UNFS header info.
+ * Save the access profile, i.e. the hottest file ranges (up to the
+ * configured prewarm size) as lines of "offset length name", into the
+ * configured profile file.  This is called upon the last close (after
+ * stopping the prewarm job), and may be called periodically so the
+ * profile survives a crash.
  * @param   fs          filesystem reference
- * @param   statp       header statistics pointer
- * @param   print       print header flag
  * @return  0 if ok else error code.
  */
-int unfs_stat(unfs_fs_t fs, unfs_header_t* statp, int print)
+int unfs_prewarm_save(unfs_fs_t fs)
 {
     DEBUG_FN();
     if (FS_CHECK(fs)) return EINVAL;
-
-    FS_RDLOCK();
-    memcpy(statp, unfs.header, sizeof(*unfs.header));
+    if (!unfsprewarm.name) return ENOTSUP;
+    if (unfs.rdonly) return EROFS;
+
+    // collect the accessed ranges and keep the hottest ones
+    unfs_prewarm_job_t job = { .fs = fs };
+    u64 max = 0;
+    unfs_walk_lock();
+    u32 v;
+    for (v = 0; v <= TREE_LAST; v = TREE_NEXT(v)) unfs_prewarm_walk(unfs.root[v], &job, &max);
     FS_UNLOCK();
+    qsort(job.list, job.count, sizeof(unfs_prewarm_range_t), unfs_prewarm_cmp_fn);
+
+    u64 i, size = 0, total = 0, bufsize = 4096;
+    char* buf = malloc(bufsize);
+    for (i = 0; i < job.count && total < unfsprewarm.maxsize; i++) {
+        unfs_prewarm_range_t* rp = &job.list[i];
+        if (rp->len > (unfsprewarm.maxsize - total))
+            rp->len = unfsprewarm.maxsize - total;
+        total += rp->len;
+        if ((size + UNFS_MAXPATH + 64) > bufsize) {
+            bufsize *= 2;
+            buf = realloc(buf, bufsize);
+        }
+        size += sprintf(buf + size, "%lu %lu %s\n", rp->offset, rp->len, rp->name);
+    }
+    INFO_FN("%s ranges=%lu size=%#lx", unfsprewarm.name, i, total);
 
-    if (print) unfs_print_header(statp);
-    return 0;
+    // rewrite the profile file (creating its parent directories)
+    int err = 0;
+    if (!unfs_exist(fs, unfsprewarm.name, NULL, NULL))
+        err = unfs_create(fs, unfsprewarm.name, 0, 1);
+    unfs_fd_t fd = unfs_file_open(fs, unfsprewarm.name, 0);
+    if (!err) err = fd.error;
+    if (!err) {
+        err = unfs_file_resize(fd, 0, NULL);
+        if (!err && size) err = unfs_file_write(fd, buf, 0, size);
+        unfs_file_close(fd);
+    }
+    if (err) ERROR("%s (%s)", unfsprewarm.name, strerror(err));
+    free(buf);
+    unfs_prewarm_free(&job);
+    return err;
 }
 
 /**
- * Open the appropriate driver implementation based on the given device name.
- * @param   device      device name
- * @return  allocated header or NULL if device name is not supported.
+ * Prewarm thread to read the ranges of a prewarm job in chunks at the
+ * background I/O priority until done or stopped.
+ * @param   arg         prewarm job context
+ * @return  NULL.
  */
-static unfs_header_t* unfs_open_dev(const char* device)
+static void* unfs_prewarm_thread(void* arg)
 {
-    if (unfs.header) {
-        if (strcmp(unfs.dev.name, device) != 0)
-            FATAL("device %s is in use", unfs.dev.name);
-    } else {
-        int n;
-        if (sscanf(device, "%x:%x.%x", &n, &n, &n) == 3) {
-            unfs_header_t* unfs_unvme_open(unfs_device_io_t*, const char*);
-            unfs.header = unfs_unvme_open(&unfs.dev, device);
-        } else if (strncmp(device, "/dev/", 5) == 0) {
-            unfs_header_t* unfs_raw_open(unfs_device_io_t*, const char*);
-            unfs.header = unfs_raw_open(&unfs.dev, device);
-        } else {
-            FATAL("unknown device %s", device);
+    unfs_prewarm_job_t* job = arg;
+    u64 chunk = OFFLOAD_CHUNKPC << UNFS_PAGESHIFT;
+    void* buf = malloc(chunk);
+    unfs_sched_class(UNFS_IOPRIO_BG);
+
+    for (;;) {
+        u64 i = __sync_fetch_and_add(&job->next, 1);
+        if (i >= job->count || unfs.prewarmstop) break;
+        unfs_prewarm_range_t* rp = &job->list[i];
+        unfs_fd_t fd = unfs_file_open(job->fs, rp->name, UNFS_OPEN_READONLY);
+        if (fd.error) continue;
+        u64 size, offset = rp->offset, end = rp->offset + rp->len;
+        if (!unfs_file_stat(fd, &size, NULL, NULL) && end > size) end = size;
+        while (offset < end && !unfs.prewarmstop) {
+            u64 len = end - offset;
+            if (len > chunk) len = chunk;
+            if (unfs_file_read(fd, buf, offset, len)) break;
+            offset += len;
+        }
+        unfs_file_close(fd);
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Prewarm job thread to load the access profile and read the listed file
+ * ranges with parallel prewarm threads.
+ * @param   arg         filesystem handle
+ * @return  NULL.
+ */
+static void* unfs_prewarm_job(void* arg)
+{
+    unfs_prewarm_job_t job = { .fs = (unfs_fs_t)arg };
+    unfs_fd_t fd = unfs_file_open(job.fs, unfsprewarm.name, UNFS_OPEN_READONLY);
+    if (fd.error) {
+        INFO_FN("%s (%s)", unfsprewarm.name, strerror(fd.error));
+        return NULL;
+    }
+    u64 size = 0;
+    unfs_file_stat(fd, &size, NULL, NULL);
+    char* buf = malloc(size + 1);
+    int err = size ? unfs_file_read(fd, buf, 0, size) : 0;
+    unfs_file_close(fd);
+    buf[err ? 0 : size] = 0;
+
+    // parse the "offset length name" lines
+    u64 max = 0, total = 0;
+    char* line = buf;
+    while (*line) {
+        char* eol = strchr(line, '\n');
+        if (eol) *eol = 0;
+        unfs_prewarm_range_t r;
+        int n = 0;
+        if (sscanf(line, "%lu %lu %n", &r.offset, &r.len, &n) == 2 && n && line[n]) {
+            if (job.count == max) {
+                max = max ? max * 2 : 256;
+                job.list = realloc(job.list, max * sizeof(unfs_prewarm_range_t));
+            }
+            r.name = strdup(line + n);
+            r.heat = 0;
+            job.list[job.count++] = r;
+            total += r.len;
         }
-        unfs.dev.name = strdup(device);
+        if (!eol) break;
+        line = eol + 1;
     }
-    return unfs.header;
+    free(buf);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int i, n = unfsprewarm.threads;
+    if (n > job.count) n = job.count;
+    pthread_t* tids = alloca(n * sizeof(pthread_t));
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&tids[i], NULL, unfs_prewarm_thread, &job))
+            FATAL("cannot create prewarm thread");
+    }
+    for (i = 0; i < n; i++) pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    INFO_FN("%s ranges=%lu size=%#lx threads=%d %s in %lu ms", unfsprewarm.name,
+            job.count, total, n, unfs.prewarmstop ? "stopped" : "done",
+            (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000);
+    unfs_prewarm_free(&job);
+    return NULL;
 }
 
 /**
- * Initialize and open the device.
- * @param   device      device name
+ * Start the prewarm job thread (if configured and not yet run).
+ * @param   fs          filesystem handle
  */
-static void unfs_init(const char* device)
+static void unfs_prewarm_start(unfs_fs_t fs)
 {
-    pthread_mutex_lock(&unfslock);
-    LOG_OPEN();
-    INFO_FN("%s", device);
-    if (!unfs.header) {
-        pthread_rwlock_init(&unfs.lock, NULL);
-        unfs.header = unfs_open_dev(device);
-        unfs.header->pagefree = unfs.header->pagecount;
-        unfs.fsid = time(0) << 16;
-        unfs.mapsynclo = unfs.header->pagecount;
-        unfs.mapsynchi = 0;
-        unfs.mapsyncfdlo = unfs.header->pagecount;
-        unfs.mapsyncfdhi = 0;
+    if (!unfsprewarm.name || unfs.prewarmthread) return;
+    if (NOLOCK) {
+        ERROR("prewarm is not supported in the single-threaded build");
+        return;
     }
-    pthread_mutex_unlock(&unfslock);
+    unfs.prewarmstop = 0;
+    if (pthread_create(&unfs.prewarmthread, NULL, unfs_prewarm_job, (void*)fs))
+        FATAL("cannot create prewarm job thread");
 }
 
 /**
- * Sync filesystem header and map to disk.
+ * Stop the prewarm job thread.
  */
-static void unfs_sync()
+static void unfs_prewarm_stop()
 {
-    if (unfs.mapsynclo <= unfs.mapsynchi ||
-        unfs.mapsyncfdlo <= unfs.mapsyncfdhi) {
-        unfs_ioc_t ioc = unfs.dev.ioc_alloc();
-
-        unfs.dev.write(ioc, unfs.header, UNFS_HEADPA, UNFS_HEADPC);
-        if (unfs.mapsynclo <= unfs.mapsynchi) {
-            u64 pa = (unfs.mapsynclo - unfs.header->datapage) >> 15;
-            u32 pc = ((unfs.mapsynchi - unfs.header->datapage) >> 15) - pa + 1;
-            unfs.dev.write(ioc, unfs.header->map + pa, UNFS_MAPPA + pa, pc); 
-            unfs.mapsynclo = unfs.header->pagecount;
-            unfs.mapsynchi = 0;
-        }
-        if (unfs.mapsyncfdlo <= unfs.mapsyncfdhi) {
-            u64 pa = (unfs.mapsyncfdlo - unfs.header->datapage) >> 15;
-            u32 pc = ((unfs.mapsyncfdhi - unfs.header->datapage) >> 15) - pa + 1;
-            unfs.dev.write(ioc, unfs.header->map + pa, UNFS_MAPPA + pa, pc); 
-            unfs.mapsyncfdlo = unfs.header->pagecount;
-            unfs.mapsyncfdhi = 0;
-        }
-        unfs.dev.ioc_free(ioc);
-    }
+    if (!unfs.prewarmthread) return;
+    unfs.prewarmstop = 1;
+    pthread_join(unfs.prewarmthread, NULL);
+    unfs.prewarmthread = 0;
 }
 
 /**
@@ -1559,11 +5172,38 @@ void unfs_cleanup()
 {
     INFO_FN();
     pthread_mutex_trylock(&unfslock);
+    unfs_tier_stop();
+    unfs_prewarm_stop();
+    unfs_repl_stop();
+    if (unfs.txn) {
+        INFO("WARN: commit the pending transaction");
+        unfs.txn = 0;
+        unfs_ioc_t ioc = DEV(ioc_alloc)();
+        unfs_txn_flush(ioc);
+        DEV(ioc_free)(ioc);
+    }
+    if (unfs.bulk) {
+        FS_WRLOCK();
+        unfs.bulk = 0;
+        unfs_bulk_flush();
+        FS_UNLOCK();
+    }
     unfs_sync();
+    u32 i;
+    for (i = 0; i < unfs.txnentrycount; i++) free(unfs.txnentry[i].image);
+    for (i = 1; i <= unfs.volcount; i++) {
+        free(unfs.vol[i]);
+        pthread_rwlock_destroy(&unfs.vollock[i]);
+    }
+    for (i = 0; i < unfs.shards; i++)
+        pthread_rwlock_destroy(&unfs.vollock[SHARD_TREE(i)]);
+    free(unfs.txnentry);
+    free(unfs.txnfree);
+    free(unfs.delover);
     if (unfs.header) {
         FS_TRYLOCK();
-        tdestroy(unfs.root, free);
-        unfs.dev.close();
+        unfs_tree_destroy();
+        DEV(close)();
         free(unfs.dev.name);
         FS_UNLOCK();
         pthread_rwlock_destroy(&unfs.lock);
@@ -1582,6 +5222,12 @@ int unfs_close(unfs_fs_t fs)
     DEBUG_FN();
     if (FS_CHECK(fs)) return EINVAL;
 
+    // save the access profile upon the last close
+    if (unfs.open == 1 && unfsprewarm.name && !unfs.rdonly) {
+        unfs_prewarm_stop();
+        unfs_prewarm_save(fs);
+    }
+
     // sync header and bitmap
     FS_WRLOCK();
     unfs_sync();
@@ -1592,99 +5238,536 @@ int unfs_close(unfs_fs_t fs)
 }
 
 /**
- * Open to access the filesystem.
- * @param   device      device name
- * @return  a filesystem handle or 0 upon failure.
+ * Load a committed transaction journal into memory for a read-only mount,
+ * i.e. the bitmap pages are applied to the in-memory header and the file
+ * entry images are kept to be found by unfs_entry_read.
+ * @param   ioc         io context
  */
-unfs_fs_t unfs_open(const char* device)
+static void unfs_txn_load(unfs_ioc_t ioc)
 {
-    unfs_init(device);
-    u64 i = __sync_add_and_fetch(&unfs.open, 1);
-    unfs_fs_t fs = __sync_add_and_fetch(&unfs.fsid, 1);
-    DEBUG_FN("%s %#lx %d", device, fs, i);
+    unfs_header_t* hp = unfs.header;
+    u64 n = hp->txncount;
+    u64 dpc = (n * sizeof(u64) + UNFS_PAGESIZE - 1) >> UNFS_PAGESHIFT;
+    INFO_FN("journal %#lx count %#lx", hp->txnpage, n);
+
+    void* jbuf = malloc((dpc + n) << UNFS_PAGESHIFT);
+    unfs_txn_io(ioc, jbuf, hp->txnpage, dpc + n, 0);
+    u64* target = jbuf;
+    void* image = jbuf + (dpc << UNFS_PAGESHIFT);
+    u64 i;
+    for (i = 0; i < n; i++) {
+        void* ip = image + (i << UNFS_PAGESHIFT);
+        if (target[i] < hp->datapage) {
+            memcpy((void*)hp + (target[i] << UNFS_PAGESHIFT), ip, UNFS_PAGESIZE);
+        } else if ((i + 1) < n && target[i + 1] == (target[i] + 1)) {
+            if (unfs.txnentrycount == unfs.txnentrymax) {
+                unfs.txnentrymax = unfs.txnentrymax ? unfs.txnentrymax * 2 : 64;
+                unfs.txnentry = realloc(unfs.txnentry,
+                                        unfs.txnentrymax * sizeof(unfs_txn_entry_t));
+            }
+            unfs_txn_entry_t* tep = &unfs.txnentry[unfs.txnentrycount++];
+            tep->pageid = target[i];
+            tep->image = malloc(UNFS_FILEPC * UNFS_PAGESIZE);
+            memcpy(tep->image, ip, UNFS_FILEPC * UNFS_PAGESIZE);
+            i++;
+        }
+    }
+    free(jbuf);
+}
 
-    FS_WRLOCK();
+/**
+ * Validate a header read from device against the device geometry,
+ * including the pending transaction journal location (so no journal is
+ * replayed from a header that failed validation).
+ * @param   hp          header read
+ * @param   pagecount   device page count
+ * @param   datapage    device data page address
+ * @param   tierpage    device fast tier page address
+ * @return  0 if valid, 1 if a valid UNFS-1.0 header, or -1 if invalid.
+ */
+static int unfs_header_check(const unfs_header_t* hp, u64 pagecount,
+                             u64 datapage, u64 tierpage)
+{
+    int old = strcmp(hp->version, UNFS_VERSION0) == 0;
+    if (!old && strcmp(hp->version, UNFS_VERSION)) return -1;
+    if ((hp->pagecount != pagecount) ||
+        (hp->datapage != datapage) ||
+        (hp->mapsize != ((pagecount - datapage + 63) >> 6)) ||
+        (hp->delmax > (old ? DELMAX0 : DELMAX)) ||
+        (hp->delcount > hp->delmax) ||
+        (hp->fdcount >= pagecount) ||
+        ((hp->fdnextpage + ((hp->fdcount + hp->delcount + 1) * UNFS_FILEPC)) != pagecount))
+        return -1;
+    if (old) return tierpage ? -1 : 1;
+    if (hp->tierpage != tierpage) return -1;
+    if (hp->txnpage) {
+        u64 dpc = (hp->txncount * sizeof(u64) + UNFS_PAGESIZE - 1) >> UNFS_PAGESHIFT;
+        if (!hp->txncount || hp->txncount >= pagecount || hp->txnpage < datapage ||
+            (hp->txnpage + dpc + hp->txncount) > pagecount)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Convert an UNFS-1.0 header read into the current layout in memory.
+ * The deleted stack entries overlaid by the header extension are kept
+ * aside (to be released by unfs_upgrade) and the extension is cleared.
+ * @param   hp          header read
+ */
+static void unfs_header_old(unfs_header_t* hp)
+{
+    free(unfs.delover);
+    unfs.delover = NULL;
+    unfs.delovercount = 0;
+    if (hp->delcount > DELMAX) {
+        unfs.delovercount = hp->delcount - DELMAX;
+        unfs.delover = malloc(unfs.delovercount * sizeof(u64));
+        memcpy(unfs.delover, &hp->delstack[DELMAX], unfs.delovercount * sizeof(u64));
+        hp->delcount = DELMAX;
+    }
+    hp->delmax = DELMAX;
+    memset(&hp->tierpage, 0, UNFS_HEADEXT * sizeof(u64));
+}
+
+/**
+ * Check if a file entry page address is on the deleted stack.
+ * @param   pa          entry page address
+ * @return  1 if deleted else 0.
+ */
+static int unfs_entry_deleted(u64 pa)
+{
+    u32 d;
+    for (d = 0; d < unfs.header->delcount; d++) {
+        if (unfs.header->delstack[d] == pa) return 1;
+    }
+    for (d = 0; d < unfs.delovercount; d++) {
+        if (unfs.delover[d] == pa) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Compare page addresses in ascending order.
+ * @param   a           page address a
+ * @param   b           page address b
+ * @return  comparison result.
+ */
+static int unfs_pageid_cmp_fn(const void* a, const void* b)
+{
+    u64 pa = *(const u64*)a;
+    u64 pb = *(const u64*)b;
+    return (pa > pb) - (pa < pb);
+}
+
+/**
+ * Walk the tree to index the nodes by their file entry slots.
+ * @param   root        root node
+ * @param   base        lowest file entry page address
+ * @param   slot        node array indexed by entry slot
+ */
+static void unfs_upgrade_index(struct tnode* root, u64 base, unfs_node_t** slot)
+{
+    if (!root) return;
+    unfs_node_t* nodep = (unfs_node_t*)(root->key);
+    slot[(nodep->pageid - base) / UNFS_FILEPC] = nodep;
+    unfs_upgrade_index(TNODE_LEFT(root), base, slot);
+    unfs_upgrade_index(TNODE_RIGHT(root), base, slot);
+}
+
+/**
+ * Walk the tree to sync the moved file entries and the entries whose
+ * parent has moved.
+ * @param   ioc         io context
+ * @param   root        root node
+ */
+static void unfs_upgrade_sync(unfs_ioc_t ioc, struct tnode* root)
+{
+    if (!root) return;
+    unfs_node_t* nodep = (unfs_node_t*)(root->key);
+    if (nodep->parent && nodep->parentid != nodep->parent->pageid) {
+        nodep->parentid = nodep->parent->pageid;
+        nodep->updated = 1;
+    }
+    if (nodep->updated) {
+        unfs_node_sync(ioc, nodep);
+        nodep->updated = 0;
+    }
+    unfs_upgrade_sync(ioc, TNODE_LEFT(root));
+    unfs_upgrade_sync(ioc, TNODE_RIGHT(root));
+}
+
+/**
+ * Upgrade a loaded UNFS-1.0 filesystem in place (with FS_WRLOCK held).
+ * While the deleted stack has more entries than the current header can
+ * keep, the lowest file entry slot is released, and if it is not deleted,
+ * its entry is moved into the highest deleted slot.  The moved entries,
+ * their children, the bitmap and the header with the current version are
+ * committed as one transaction, so a crash leaves either version intact.
+ * @param   ioc         io context
+ */
+static void unfs_upgrade(unfs_ioc_t ioc)
+{
+    unfs_header_t* hp = unfs.header;
+    u32 n = hp->delcount + unfs.delovercount;
+    INFO("upgrade %s to %s (%u deleted entries)", UNFS_VERSION0, UNFS_VERSION, n);
+
+    // all the deleted slots in ascending order
+    u64* dels = malloc((n + 1) * sizeof(u64));
+    memcpy(dels, hp->delstack, hp->delcount * sizeof(u64));
+    memcpy(dels + hp->delcount, unfs.delover, unfs.delovercount * sizeof(u64));
+    qsort(dels, n, sizeof(u64), unfs_pageid_cmp_fn);
+
+    u64 base = hp->fdnextpage + UNFS_FILEPC;
+    unfs_node_t** slot = calloc((hp->pagecount - base) / UNFS_FILEPC, sizeof(unfs_node_t*));
+    u32 v;
+    for (v = 0; v <= TREE_LAST; v = TREE_NEXT(v))
+        unfs_upgrade_index(unfs.root[v], base, slot);
+
+    IOPRIO_ENTER(UNFS_IOPRIO_META);
+    TXN_WRLOCK();
+    unfs.txn++;
+    u32 lo = 0, hi = n, moved = 0;
+    while ((hi - lo) > DELMAX) {
+        u64 pa = hp->fdnextpage + UNFS_FILEPC;
+        hp->fdnextpage = pa;
+        hp->pagefree += UNFS_FILEPC;
+        unfs_txn_free(pa, 0);
+        if (dels[lo] == pa) {
+            lo++;
+            continue;
+        }
+        unfs_node_t* nodep = slot[(pa - base) / UNFS_FILEPC];
+        nodep->pageid = dels[--hi];
+        nodep->updated = 1;
+        slot[(nodep->pageid - base) / UNFS_FILEPC] = nodep;
+        moved++;
+    }
+    for (v = 0; v <= TREE_LAST; v = TREE_NEXT(v))
+        unfs_upgrade_sync(ioc, unfs.root[v]);
+    hp->delcount = hi - lo;
+    memcpy(hp->delstack, dels + lo, hp->delcount * sizeof(u64));
+    memset(hp->version, 0, sizeof(hp->version));
+    strcpy(hp->version, UNFS_VERSION);
+    hp->chgen = 1;
+    unfs.txn--;
+    unfs_txn_flush(ioc);
+    TXN_UNLOCK();
+    IOPRIO_LEAVE();
+    INFO("upgraded to %s (%u entries moved)", UNFS_VERSION, moved);
+
+    free(slot);
+    free(dels);
+    free(unfs.delover);
+    unfs.delover = NULL;
+    unfs.delovercount = 0;
+}
+
+/**
+ * Read and validate the filesystem header and bitmap, and build the node
+ * tree from the file entries (with FS_WRLOCK held).  A read-only mount
+ * does not use the bitmap (which the writer persists lazily) and may see
+ * a header being updated by the writer, so it retries the validation and
+ * fails with EAGAIN on inconsistent entries.
+ * @param   ioc         io context
+ * @return  0 if ok else error code.
+ */
+static int unfs_load(unfs_ioc_t ioc)
+{
     unfs_header_t* hp = unfs.header;
     u64 pagecount = hp->pagecount;
     u64 datapage = hp->datapage;
-    u64 mapsize = (pagecount - datapage + 63) >> 6;   // in 64-bit words
-
-    // allocate IO pages
-    unfs_ioc_t ioc = unfs.dev.ioc_alloc();
-    u32 iopc = UNFS_FILEPC;
-    unfs_node_io_t* niop = unfs.dev.page_alloc(ioc, &iopc);
-    if (iopc != UNFS_FILEPC)
-        FATAL("cannot allocate %u pages", UNFS_FILEPC);
+    u64 tierpage = hp->tierpage;
+    int retry = unfs.rdonly ? 100 : 1;
+    int old;
 
     // read and validate the UNFS header
-    unfs.dev.read(ioc, hp, UNFS_HEADPA, datapage);
-    u64 pagefree = pagecount - unfs_map_count();
-    DEBUG_FN("pc=%#lx pf=%#lx dp=%#lx ms=%#lx fp=%#lx fc=%#lx dc=%u",
-                                pagecount, pagefree, datapage, mapsize,
-                                hp->fdnextpage, hp->fdcount, hp->delcount);
-    if (strcmp(hp->version, UNFS_VERSION) ||
-        (hp->pagecount != pagecount) ||
-        (hp->datapage != datapage) ||
-        (hp->mapsize != mapsize) ||
-        (hp->pagefree != pagefree) ||
-        ((hp->fdnextpage + ((hp->fdcount + hp->delcount + 1) * UNFS_FILEPC)) != pagecount)) {
-        ERROR("bad UNFS header (pf=%#lx)", pagefree);
-        unfs_print_header(hp);
-        fs = 0L;
-        goto done;
+    for (;;) {
+        DEV(read)(ioc, hp, UNFS_HEADPA, datapage);
+        old = unfs_header_check(hp, pagecount, datapage, tierpage);
+        if (unfs.rdonly) {
+            u32 t;
+            for (t = 0; t < unfs.txnentrycount; t++) free(unfs.txnentry[t].image);
+            unfs.txnentrycount = 0;
+            if (old == 0 && hp->txnpage) unfs_txn_load(ioc);
+        } else if (old == 0 && hp->txnpage) {
+            if (unfs_txn_replay()) old = -1;
+            else old = unfs_header_check(hp, pagecount, datapage, tierpage);
+        }
+        u64 pagefree = pagecount - unfs_map_count();
+        DEBUG_FN("pc=%#lx pf=%#lx dp=%#lx ms=%#lx fp=%#lx fc=%#lx dc=%u",
+                                    pagecount, pagefree, datapage, hp->mapsize,
+                                    hp->fdnextpage, hp->fdcount, hp->delcount);
+        if (old >= 0 && (hp->pagefree == pagefree || unfs.rdonly))
+            break;
+        if (--retry == 0) {
+            ERROR("bad UNFS header (pf=%#lx)", pagefree);
+            unfs_print_header(hp);
+            return EINVAL;
+        }
+        usleep(10000);
     }
+    if (old) unfs_header_old(hp);
 
     // next bitmap free index
+    u64 i;
     u64* map = (u64*)hp->map;
     for (i = 0; (i < unfs.header->mapsize) && (*map == -1L); i++) map++;
     unfs.mapnext = i;
+    memset(unfs.shardnext, 0, sizeof(unfs.shardnext));
+    if (tierpage) {
+        i = (tierpage - datapage) >> 6;
+        map = (u64*)hp->map + i;
+        for (; (i < unfs.header->mapsize) && (*map == -1L); i++) map++;
+        unfs.mapnextfast = i;
+    }
+
+    // allocate IO pages
+    int err = 0;
+    u32 iopc = UNFS_FILEPC;
+    unfs_node_io_t* niop = DEV(page_alloc)(ioc, &iopc);
+    if (iopc != UNFS_FILEPC)
+        FATAL("cannot allocate %u pages", UNFS_FILEPC);
 
     // read each file entry and build the node tree in memory
     u64 pa = pagecount - UNFS_FILEPC;
     for (i = 0; i < hp->fdcount; pa -= UNFS_FILEPC) {
         // skip over the deleted entries
-        int d;
-        for (d = 0; d < unfs.header->delcount; d++) {
-            if (pa == unfs.header->delstack[d]) {
-                DEBUG_FN("skip.%d %#lx", d, pa);
-                d = -1;
-                break;
-            }
+        if (unfs_entry_deleted(pa)) {
+            DEBUG_FN("skip %#lx", pa);
+            continue;
         }
-        if (d == -1) continue;
 
-        // read entry
-        unfs.dev.read(ioc, niop, pa, UNFS_FILEPC);
+        // read entry (whose reserved bytes are undefined if not marked)
+        unfs_entry_read(ioc, niop, pa);
         DEBUG_FN("scan.%lx %#lx %s", i, pa, niop->name);
+        if (niop->node.magic != UNFS_ENTRYMAGIC) {
+            niop->node.offload = 0;
+            niop->node.chgpage = 0;
+        }
 
         // if node exists then update it, else add new one
-        unfs_node_t* nodep = unfs_node_find(niop->name);
+        unfs_path_t path;
+        if (unfs_path_parse(niop->name, &path)) {
+            ERROR("invalid name %s", niop->name);
+            i++;
+            continue;
+        }
+        unfs_node_t* nodep = unfs_node_lookup(niop->name, path.len, path.hash);
         if (nodep) {
             if (nodep->isdir && nodep->pageid == 0) {
                 nodep->pageid = niop->node.pageid;
                 nodep->size =  niop->node.size;
                 nodep->parentid = niop->node.parentid;
                 DEBUG_FN("update %s %#lx %#lx", nodep->name, nodep->pageid, nodep->parentid);
+            } else if (unfs.rdonly) {
+                ERROR("%s loaded at %#lx seen again at %#lx",
+                        nodep->name, nodep->pageid, niop->node.pageid);
+                err = EAGAIN;
+                break;
             } else {
                 FATAL("%s loaded at %#lx seen again at %#lx",
                         nodep->name, nodep->pageid, niop->node.pageid);
             }
         } else {
             unfs_node_t* parent = NULL;
-            if (niop->name[1]) parent = unfs_node_add_parents(niop->name);
-            niop->node.name = niop->name;
-            nodep = unfs_node_add(parent, &niop->node);
+            if (niop->name[1]) parent = unfs_node_add_parents(&path);
+            nodep = unfs_node_add(parent, &path, &niop->node);
         }
         i++;
     }
 
-done:
-    unfs.dev.page_free(ioc, niop, iopc);
-    unfs.dev.ioc_free(ioc);
+    DEV(page_free)(ioc, niop, iopc);
+    if (!err && old && !unfs.rdonly) unfs_upgrade(ioc);
+    return err;
+}
+
+/**
+ * Open to access the filesystem.
+ * @param   device      device name
+ * @param   rdonly      read-only mount flag
+ * @return  a filesystem handle or 0 upon failure.
+ */
+static unfs_fs_t unfs_open_fs(const char* device, int rdonly)
+{
+    if (unfs_init(device, rdonly)) return 0L;
+    __sync_add_and_fetch(&unfs.open, 1);
+    unfs_fs_t fs = __sync_add_and_fetch(&unfs.fsid, 1) & ~0xff00L;
+    DEBUG_FN("%s %#lx %d ro=%d", device, fs, unfs.open, rdonly);
+
+    // metadata is loaded once and shared by all handles of the process
+    FS_WRLOCK();
+    if (!unfs.root[0]) {
+        unfs_ioc_t ioc = DEV(ioc_alloc)();
+        if (unfs_load(ioc)) fs = 0L;
+        DEV(ioc_free)(ioc);
+    }
+    if (fs) unfs_prewarm_start(fs);
+    if (fs && !unfs.rdonly) {
+        unfs_tier_start();
+        unfs_repl_start();
+        char* env = getenv("UNFS_BULK");
+        if (env && atoi(env)) unfs.bulk = 1;
+    }
     FS_UNLOCK();
     return fs;
 }
 
+/**
+ * Open to access the filesystem.
+ * @param   device      device name
+ * @return  a filesystem handle or 0 upon failure.
+ */
+unfs_fs_t unfs_open(const char* device)
+{
+    return unfs_open_fs(device, 0);
+}
+
+/**
+ * Open to access the filesystem read-only.  Nothing is ever written to the
+ * device (and no tier migration is run), so multiple processes may mount
+ * a device (or a filesystem image file) read-only while another process
+ * has it mounted for read/write.  A committed but not yet applied
+ * transaction is applied in memory only.  The metadata is loaded as of the
+ * open, and unfs_reload can be used to pick up the writer's updates.
+ * @param   device      device name
+ * @return  a filesystem handle or 0 upon failure.
+ */
+unfs_fs_t unfs_open_ro(const char* device)
+{
+    return unfs_open_fs(device, 1);
+}
+
+/**
+ * Walk the tree to collect the descendants of a sub-volume root.
+ * @param   root        root node
+ * @param   dirp        sub-volume root directory node
+ * @param   list        node list
+ * @param   countp      node count pointer
+ */
+static void unfs_vol_walk(struct tnode* root, const unfs_node_t* dirp,
+                          unfs_node_t** list, u64* countp)
+{
+    if (!root) return;
+    unfs_node_t* nodep = (unfs_node_t*)(root->key);
+    if (unfs_dir_member(nodep, dirp, 1)) list[(*countp)++] = nodep;
+    unfs_vol_walk(TNODE_LEFT(root), dirp, list, countp);
+    unfs_vol_walk(TNODE_RIGHT(root), dirp, list, countp);
+}
+
+/**
+ * Open to access a sub-volume of the filesystem, which is created if not
+ * exists.  A sub-volume is a separate namespace whose root is a directory
+ * under VOL_DIR, so the names given to (and returned by) the functions
+ * using the returned handle are resolved under that root.  Sub-volumes
+ * take their pages from the same pool, so no capacity is set aside.
+ * @param   device      device name
+ * @param   vol         sub-volume name
+ * @return  a filesystem handle or 0 upon failure.
+ */
+unfs_fs_t unfs_open_vol(const char* device, const char* vol)
+{
+    char root[UNFS_MAXPATH];
+    if (!vol || !*vol || strchr(vol, '/') ||
+        snprintf(root, sizeof(root), VOL_DIR "/%s", vol) >= (UNFS_MAXPATH / 2))
+        return 0L;
+    unfs_fs_t fs = unfs_open_fs(device, 0);
+    if (!fs) return 0L;
+
+    int isdir = 0;
+    if ((!unfs_exist(fs, root, &isdir, NULL) && unfs_create(fs, root, 1, 1)) ||
+        (unfs_exist(fs, root, &isdir, NULL) && !isdir)) {
+        ERROR("cannot create sub-volume %s", root);
+        unfs_close(fs);
+        return 0L;
+    }
+
+    // get the sub-volume id
+    FS_WRLOCK();
+    u32 v;
+    for (v = 1; v <= unfs.volcount && strcmp(unfs.vol[v], root); v++);
+    unfs_node_t* rootp = v > unfs.volcount ? unfs_node_find(root) : NULL;
+    if (v > VOL_MAX || (v > unfs.volcount && !(rootp && rootp->isdir))) {
+        FS_UNLOCK();
+        ERROR("cannot open sub-volume %s", root);
+        unfs_close(fs);
+        return 0L;
+    }
+    if (v > unfs.volcount) {
+        // move the sub-volume nodes into its own tree
+        unfs.vol[v] = strdup(root);
+        unfs.vollen[v] = strlen(root);
+        pthread_rwlock_init(&unfs.vollock[v], NULL);
+        u64 i, count = unfs_dir_count(unfs.root[0], rootp) + 1;
+        unfs_node_t** list = malloc(count * sizeof(unfs_node_t*));
+        list[0] = rootp;
+        count = 1;
+        unfs_vol_walk(unfs.root[0], rootp, list, &count);
+        for (i = 0; i < count; i++) {
+            tdelete(list[i], &unfs.root[0], unfs_node_cmp_fn);
+            tsearch(list[i], &unfs.root[v], unfs_node_cmp_fn);
+        }
+        free(list);
+        __atomic_store_n(&unfs.volcount, v, __ATOMIC_RELEASE);
+    }
+    FS_UNLOCK();
+    DEBUG_FN("%s %s %u", device, vol, v);
+    return (fs & ~0xff00L) | (v << 8);
+}
+
+/**
+ * Check if any node in the tree is open.
+ * @param   root        root node
+ * @return  1 if any is open else 0.
+ */
+static int unfs_node_busy(struct tnode* root)
+{
+    if (!root) return 0;
+    unfs_node_t* nodep = (unfs_node_t*)(root->key);
+    return nodep->open || unfs_node_busy(TNODE_LEFT(root)) ||
+                          unfs_node_busy(TNODE_RIGHT(root));
+}
+
+/**
+ * Reload the metadata of a read-only mount if the filesystem generation
+ * has changed, i.e. the writer has updated the metadata since the last
+ * load.  No file may be open during the reload.
+ * @param   fs          filesystem reference
+ * @return  0 if ok else error code.
+ */
+int unfs_reload(unfs_fs_t fs)
+{
+    DEBUG_FN();
+    if (FS_CHECK(fs) || !unfs.rdonly) return EINVAL;
+
+    int err = 0;
+    FS_WRLOCK();
+    unfs_ioc_t ioc = DEV(ioc_alloc)();
+    u32 iopc = UNFS_HEADPC;
+    unfs_header_t* hp = DEV(page_alloc)(ioc, &iopc);
+    if (iopc != UNFS_HEADPC)
+        FATAL("cannot allocate %d pages", UNFS_HEADPC);
+    DEV(read)(ioc, hp, UNFS_HEADPA, UNFS_HEADPC);
+    u64 gen = hp->gen;
+    DEV(page_free)(ioc, hp, iopc);
+
+    u32 v, busy = 0;
+    for (v = 0; v <= TREE_LAST; v = TREE_NEXT(v)) busy |= unfs_node_busy(unfs.root[v]);
+    if (gen != unfs.header->gen || !unfs.root[0]) {
+        if (busy) {
+            err = EBUSY;
+        } else {
+            INFO_FN("generation %#lx to %#lx", unfs.header->gen, gen);
+            unfs_tree_destroy();
+            err = unfs_load(ioc);
+            if (err) unfs_tree_destroy();
+        }
+    }
+    DEV(ioc_free)(ioc);
+    FS_UNLOCK();
+    return err;
+}
+
 /**
  * Open the UNFS filesystem and verify every node parent child relationship.
  * @param   device      device name
@@ -1692,56 +5775,52 @@ done:
  */
 int unfs_check(const char* device)
 {
-    unfs_init(device);
+    unfs_init(device, 0);
     DEBUG_FN("%s", device);
     FS_WRLOCK();
     unfs_header_t* hp = unfs.header;
     u64 pagecount = hp->pagecount;
     u64 datapage = hp->datapage;
-    u64 mapsize = (pagecount - datapage + 63) >> 6;   // in 64-bit words
+    u64 tierpage = hp->tierpage;
     int err = EINVAL;
 
     // allocate IO pages
-    unfs_ioc_t ioc = unfs.dev.ioc_alloc();
+    unfs_ioc_t ioc = DEV(ioc_alloc)();
     u32 iopc = 2 * UNFS_FILEPC;
-    unfs_node_io_t* niop = unfs.dev.page_alloc(ioc, &iopc);
+    unfs_node_io_t* niop = DEV(page_alloc)(ioc, &iopc);
     if (iopc != 2 * UNFS_FILEPC)
         FATAL("cannot allocate %u pages", 2 * UNFS_FILEPC);
     unfs_node_io_t* piop = niop + 1;
 
     // read and validate the UNFS header format
-    unfs.dev.read(ioc, hp, UNFS_HEADPA, datapage);
+    DEV(read)(ioc, hp, UNFS_HEADPA, datapage);
+    int old = unfs_header_check(hp, pagecount, datapage, tierpage);
+    if (old == 0 && hp->txnpage) {
+        if (unfs_txn_replay()) old = -1;
+        else old = unfs_header_check(hp, pagecount, datapage, tierpage);
+    }
     u64 pagefree = pagecount - unfs_map_count();
     DEBUG_FN("pc=%#lx pf=%#lx dp=%#lx ms=%#lx fp=%#lx fc=%#lx dc=%u",
-                                pagecount, pagefree, datapage, mapsize,
+                                pagecount, pagefree, datapage, hp->mapsize,
                                 hp->fdnextpage, hp->fdcount, hp->delcount);
-    if (strcmp(hp->version, UNFS_VERSION) ||
-        (hp->pagecount != pagecount) ||
-        (hp->datapage != datapage) ||
-        (hp->mapsize != mapsize) ||
-        (hp->pagefree != pagefree) ||
-        ((hp->fdnextpage + (hp->fdcount + hp->delcount + 1) * UNFS_FILEPC) != pagecount)) {
+    if (old < 0 || hp->pagefree != pagefree) {
         ERROR("bad UNFS header (pf=%#lx)", pagefree);
         unfs_print_header(hp);
         goto done;
     }
+    if (old) unfs_header_old(hp);
 
     // read each file entry and verify their parent and map usage
     u64 pa = pagecount - UNFS_FILEPC;
     u64 i;
     for (i = 0; i < hp->fdcount; pa -= UNFS_FILEPC) {
         // skip over the deleted entries
-        int d;
-        for (d = 0; d < hp->delcount; d++) {
-            if (hp->delstack[d] == pa) {
-                DEBUG_FN("skip.%d %#lx", d, pa);
-                d = -1;
-                break;
-            }
+        if (unfs_entry_deleted(pa)) {
+            DEBUG_FN("skip %#lx", pa);
+            continue;
         }
-        if (d == -1) continue;
 
-        unfs.dev.read(ioc, niop, pa, UNFS_FILEPC);
+        DEV(read)(ioc, niop, pa, UNFS_FILEPC);
         DEBUG_FN("scan.%lx %#lx %s", i, pa, niop->name);
 
         // check map usage
@@ -1750,6 +5829,7 @@ int unfs_check(const char* device)
             goto done;
         }
         unfs_ds_t* dsp = niop->node.ds;
+        u32 d;
         for (d = 0; d < niop->node.dscount; d++) {
             if (unfs_map_check(dsp->pageid, dsp->pagecount)) {
                 ERROR("%s ds[%d]=(%#lx %#lx) bits not set",
@@ -1757,6 +5837,12 @@ int unfs_check(const char* device)
                 goto done;
             }
         }
+        if (niop->node.magic == UNFS_ENTRYMAGIC && niop->node.chgpage &&
+            unfs_map_check(niop->node.chgpage, 1)) {
+            ERROR("%s change table page %#lx bit not set",
+                    niop->name, niop->node.chgpage);
+            goto done;
+        }
 
         // check parent node
         if (niop->name[1]) {
@@ -1765,8 +5851,9 @@ int unfs_check(const char* device)
                 ERROR("%s has bad parentid %#lx", niop->name, parentid);
                 goto done;
             }
-            unfs.dev.read(ioc, piop, parentid, UNFS_FILEPC);
-            if (!unfs_child_of(niop->name, piop->name)) {
+            DEV(read)(ioc, piop, parentid, UNFS_FILEPC);
+            if (!unfs_child_of(niop->name, strlen(niop->name),
+                               piop->name, strlen(piop->name))) {
                 ERROR("%s is not a child of %s", niop->name, piop->name);
                 goto done;
             }
@@ -1776,15 +5863,66 @@ int unfs_check(const char* device)
     err = 0;
 
 done:
-    unfs.dev.page_free(ioc, niop, iopc);
-    unfs.dev.ioc_free(ioc);
+    DEV(page_free)(ioc, niop, iopc);
+    DEV(ioc_free)(ioc);
     FS_UNLOCK();
     unfs_cleanup();
     return err;
 }
 
+/**
+ * Get the elapsed time since a start time in milliseconds.
+ * @param   t0          start time
+ * @return  elapsed milliseconds.
+ */
+static u64 unfs_format_ms(const struct timespec* t0)
+{
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1000 + (t1.tv_nsec - t0->tv_nsec) / 1000000;
+}
+
+/**
+ * Format thread to write the bitmap pages in large chunks.  When the device
+ * has been discarded and reads back as zeros, all zero chunks are skipped.
+ * @param   arg         format job context
+ * @return  NULL.
+ */
+static void* unfs_format_thread(void* arg)
+{
+    unfs_format_job_t* job = arg;
+    unfs_ioc_t ioc = DEV(ioc_alloc)();
+    for (;;) {
+        u64 pa = __sync_fetch_and_add(&job->next, FORMAT_CHUNKPC);
+        if (pa >= job->end) break;
+        u32 pc = job->end - pa < FORMAT_CHUNKPC ? job->end - pa : FORMAT_CHUNKPC;
+        if (job->skipzero) {
+            // trim the all zero pages off both ends of the chunk
+            u64 i, n = UNFS_PAGESIZE / sizeof(u64);
+            u64* buf = (u64*)unfs.header->info[pa];
+            for (i = 0; i < (u64)pc * n && !buf[i]; i++);
+            if (i == (u64)pc * n) continue;
+            pa += i / n;
+            pc -= i / n;
+            buf = (u64*)unfs.header->info[pa + pc];
+            for (i = 0; !buf[-1 - i]; i++);
+            pc -= i / n;
+        }
+        DEV(write)(ioc, unfs.header->info[pa], pa, pc);
+        __sync_fetch_and_add(&job->written, pc);
+    }
+    DEV(ioc_free)(ioc);
+    return NULL;
+}
+
 /**
  * Create a new UNFS filesystem.
+ *
+ * With UNFS_FORMAT_DISCARD set, the whole device is first discarded (if
+ * supported) so the device can reclaim the previous contents, and if the
+ * discarded pages read back as zeros, only the non-zero bitmap pages are
+ * written.  The bitmap pages are written in parallel by UNFS_FORMAT_THREADS
+ * threads (default 8), and the header pages are written last.
  * @param   device      device name
  * @param   label       disk label
  * @param   print       print header flag
@@ -1792,38 +5930,83 @@ done:
  */
 int unfs_format(const char* device, const char* label, int print)
 {
-    unfs_init(device);
+    unfs_init(device, 0);
     DEBUG_FN("%s", device);
 
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    u64 discardms = 0;
+    int discarded = 0;
+    char* env = getenv("UNFS_FORMAT_DISCARD");
+    if (env && atoi(env)) {
+        if (!unfs.dev.discard) {
+            ERROR("%s does not support discard", device);
+        } else {
+            int err = unfs.dev.discard(0, 0, unfs.header->pagecount);
+            if (err) ERROR("discard %s (%s)", device, strerror(err));
+            else discarded = 1;
+        }
+        discardms = unfs_format_ms(&t0);
+    }
+
     FS_WRLOCK();
     unfs_header_t* hp = unfs.header;
     strncpy(hp->label, label, sizeof(hp->label) - 1);
     strncpy(hp->version, UNFS_VERSION, sizeof(hp->version) - 1);
     hp->fdnextpage = hp->pagecount - UNFS_FILEPC;
     hp->fdcount = 0;
+    hp->txnpage = 0;
+    hp->txncount = 0;
     hp->dircount = 0;
+    hp->chgen = 1;
     hp->mapsize = (hp->pagecount - hp->datapage + 63) >> 6; // in 64-bit words
-    hp->delmax = (sizeof(unfs_header_t) - offsetof(unfs_header_t, delstack))
-                 / sizeof(u64);
+    hp->delmax = DELMAX;
 
     // create root directory
-    unfs_ioc_t ioc = unfs.dev.ioc_alloc();
+    unfs_ioc_t ioc = DEV(ioc_alloc)();
     u32 iopc = UNFS_FILEPC;
-    unfs_node_io_t* niop = unfs.dev.page_alloc(ioc, &iopc);
+    unfs_node_io_t* niop = DEV(page_alloc)(ioc, &iopc);
     if (iopc != UNFS_FILEPC)
         FATAL("cannot allocate %u pages", UNFS_FILEPC);
     memset(niop, 0, sizeof(*niop));
     strcpy(niop->name, "/");
+    niop->node.magic = UNFS_ENTRYMAGIC;
     niop->node.isdir = 1;
     niop->node.pageid = unfs_node_alloc(niop->node.isdir);
-    unfs.dev.write(ioc, niop, niop->node.pageid, UNFS_FILEPC);
-    unfs.dev.write(ioc, hp, UNFS_HEADPA, hp->datapage);
+    DEV(write)(ioc, niop, niop->node.pageid, UNFS_FILEPC);
+    DEV(page_free)(ioc, niop, iopc);
+    DEV(ioc_free)(ioc);
+
+    // write the bitmap pages in parallel and then the header pages
+    unfs_format_job_t job = { .next = UNFS_MAPPA, .end = hp->datapage,
+                              .skipzero = discarded && unfs.dev.discardzero };
+    int i, n = FORMAT_THREADS;
+    env = getenv("UNFS_FORMAT_THREADS");
+    if (env && atoi(env) > 0) n = atoi(env);
+    if (NOLOCK) n = 1;
+    u64 chunks = (job.end - job.next + FORMAT_CHUNKPC - 1) / FORMAT_CHUNKPC;
+    if (n > chunks) n = chunks ? chunks : 1;
+    pthread_t* tids = alloca(n * sizeof(pthread_t));
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&tids[i], NULL, unfs_format_thread, &job))
+            FATAL("cannot create format thread");
+    }
+    for (i = 0; i < n; i++) pthread_join(tids[i], NULL);
+    ioc = DEV(ioc_alloc)();
+    DEV(write)(ioc, hp, UNFS_HEADPA, UNFS_HEADPC);
+    DEV(ioc_free)(ioc);
 
-    if (print) unfs_print_header(hp);
+    if (print) {
+        unfs_print_header(hp);
+        if (discarded) printf("Discard:     %lu ms\n", discardms);
+        printf("Map written: %#lx/%#lx pages (%d threads)\n",
+               job.written, hp->datapage - UNFS_MAPPA, n);
+        printf("Format time: %lu ms\n", unfs_format_ms(&t0));
+    }
+#ifndef UNFS_STATIC
+    unfs_repl_copied();
+#endif
 
-    // free and close
-    unfs.dev.page_free(ioc, niop, iopc);
-    unfs.dev.ioc_free(ioc);
     FS_UNLOCK();
     unfs_cleanup();
     return 0;
@@ -34,7 +34,8 @@
  * @brief UNFS filesystem header file.
  *
  * The UNFS filesystem disk layout (in 4k-page unit):
- *  Page 0-1:   Filesystem header info with the deleted stack.
+ *  Page 0-1:   Filesystem header info with the deleted stack, and the
+ *              header extension fields in the last words of page 1.
  *  Page 2-N:   Bitmap of free pages.
  *  Page N+:    File data starts after free bitmap pages growing upward.
  *  Page Z-:    File/Directory entries start from end of the disk growing
@@ -47,6 +48,12 @@
  *  + The bitmap array will track pages starting from the first data page
  *    (i.e. following the bitmap pages) to the last disk page.
  *
+ *  + An UNFS-1.0 filesystem (whose deleted stack spans the whole header)
+ *    is upgraded in place when opened for write.  The deleted stack entries
+ *    in the way of the header extension are released by moving the lowest
+ *    file entries into them, committed as one transaction.  A read-only
+ *    mount or check of an UNFS-1.0 filesystem does not write it.
+ *
  *  + Each file/directory entry will take up 2 disk pages.
  *    The first page contains the file description.
  *    The second page contains the file canonical name.
@@ -69,6 +76,57 @@
  *  + All node names must be fully canonical.  Node name can contain any
  *    printable character except '/'.
  *
+ *  + Files with names matching the configured temporary file patterns
+ *    (see unfs_temp_config) have no file entry on disk and their data is
+ *    kept in memory.  When the temporary memory limit is reached, a file
+ *    is moved onto data pages which are not marked in the persisted bitmap,
+ *    so no trace of temporary files remains on disk after a restart.
+ *    A temporary file renamed to a non-temporary name becomes persistent.
+ *
+ *  + Between unfs_txn_begin and unfs_txn_commit, file entry, header and
+ *    bitmap writes are kept in memory and pages freed are not reused.
+ *    On commit, the page images are written to a journal allocated from
+ *    free data pages, the header pointing to the journal is written as the
+ *    commit point, and then the images are written in place.  A pending
+ *    journal is replayed when the filesystem is opened.
+ *
+ *  + A file can be offloaded (see unfs_offload) to an object in a host
+ *    directory, in which case its data pages are released and its entry
+ *    keeps the size and the object id.  The data is recalled onto newly
+ *    allocated pages upon the first read, write or resize.
+ *
+ *  + A sub-volume (see unfs_open_vol) is a namespace rooted at a directory
+ *    under /.unfsvol, whose handle resolves all names under that root.
+ *    Each opened sub-volume has its own name tree and lock, so creates,
+ *    opens, lookups and listings in different sub-volumes run in parallel.
+ *    Sub-volumes share the data pages, so capacity stays pooled, and share
+ *    the header, the bitmap and the journal, so removes and transactions
+ *    still serialize across the whole filesystem.
+ *
+ *  + On a tiered device (see unfs_raw.c), data pages from datapage up to
+ *    tierpage are on the capacity tier and data pages from tierpage are on
+ *    the fast tier, so the tier of a data segment is given by its address.
+ *    New data pages are allocated from the fast tier, and a background
+ *    migrator moves cold segments to the capacity tier and hot segments
+ *    back to the fast tier based on their access heat counters.
+ *
+ *  + Each file tracks the change generation in which each of its chunks
+ *    was last written (see unfs_file_changes) in a table page of its own,
+ *    allocated upon the first write.  The chunk size starts at 1MB and
+ *    doubles as the file grows beyond the table, so changed ranges can be
+ *    found for an incremental backup without reading the whole file.
+ *
+ *  + With an access profile configured (see unfs_prewarm_config), the
+ *    hottest file ranges are saved to the profile file upon close and
+ *    read back in the background upon the next open to warm up the device.
+ *
+ *  + With shards (UNFS_SHARDS), the namespace is partitioned by top-level
+ *    directory into shards with their own name trees, locks and data page
+ *    regions, so threads working in different shards do not contend.
+ *
+ *  + With a replica configured (see unfs_repl.c), device writes are logged
+ *    in order and shipped asynchronously to a standby device, file or peer.
+ *
  *  + No security, permission or timestamp is supported.
  */
 
@@ -89,7 +147,8 @@ typedef uint32_t        u32;        ///< 32-bit unsigned
 typedef uint64_t        u64;        ///< 64-bit unsigned
 #endif // _U_TYPE
 
-#define UNFS_VERSION    "UNFS-1.0"          ///< filesystem version name
+#define UNFS_VERSION    "UNFS-1.1"          ///< filesystem version name
+#define UNFS_VERSION0   "UNFS-1.0"          ///< upgradable version name
 #define UNFS_HEADPA     0                   ///< header page address
 #define UNFS_HEADPC     2                   ///< header page count
 #define UNFS_MAPPA      UNFS_HEADPC         ///< start bitmap page address
@@ -97,11 +156,23 @@ typedef uint64_t        u64;        ///< 64-bit unsigned
 #define UNFS_PAGESIZE   (1<<UNFS_PAGESHIFT) ///< expected page size
 #define UNFS_MAXPATH    (UNFS_PAGESIZE-2)   ///< max file name length
 
+/// Header extension words (following the deleted stack at the header end)
+#define UNFS_HEADEXT    8
+
 /// File entry on disk page count
 #define UNFS_FILEPC     2
 
 /// Max number of data segments in a file
-#define UNFS_MAXDS      ((UNFS_PAGESIZE-sizeof(unfs_node_t))/sizeof(unfs_ds_t))
+#define UNFS_MAXDS      ((UNFS_PAGESIZE-sizeof(unfs_entry_t))/sizeof(unfs_ds_t))
+
+/// File entry on disk reserved bytes (preceding the persistent fields)
+#define UNFS_ENTRYRSVD  64
+
+/// File entry format magic (an UNFS-1.0 entry has undefined reserved bytes)
+#define UNFS_ENTRYMAGIC 0x53464e55
+
+/// Number of changed chunk generations of a file
+#define UNFS_CHGCOUNT   ((UNFS_PAGESIZE-sizeof(u32))/sizeof(u32))
 
 /// Page size
 typedef char unfs_page_t[UNFS_PAGESIZE];
@@ -114,14 +185,32 @@ typedef enum {
     UNFS_OPEN_EXCLUSIVE = 0x40,             ///< open for exclusive access
 } unfs_mode_t;
 
+/// I/O scheduling priority class (from highest to lowest priority)
+typedef enum {
+    UNFS_IOPRIO_NONE    = 0,                ///< not set (use default)
+    UNFS_IOPRIO_META,                       ///< filesystem metadata sync
+    UNFS_IOPRIO_LOG,                        ///< log writes
+    UNFS_IOPRIO_FG,                         ///< foreground I/O (default)
+    UNFS_IOPRIO_BG,                         ///< background work
+    UNFS_IOPRIO_MAX,                        ///< number of priority classes
+} unfs_ioprio_t;
+
 /// Data segment info
 typedef struct {
     u64                 pageid;             ///< page address
     u64                 pagecount;          ///< page count
 } unfs_ds_t;
 
+/// File changed chunk generations, where the file is divided into chunks of
+/// (1 << shift) bytes and each chunk has the change generation it was last
+/// written in (see unfs_file_changes)
+typedef struct {
+    u32                 shift;              ///< chunk size shift
+    u32                 gen[UNFS_CHGCOUNT]; ///< chunk change generations
+} unfs_chg_t;
+
 /// File node in memory, where name will be allocated per string length,
-/// directory node contains no segment, and file node will be 4k-page
+/// directory node contains no segment, and file node has UNFS_MAXDS segments
 typedef struct _unfs_node {
     // in-memory only fields
     char*               name;               ///< file name
@@ -130,7 +219,27 @@ typedef struct _unfs_node {
     u32                 open;               ///< open count
     u32                 memsize;            ///< node allocated size
     int                 updated;            ///< node persistent data updated
+    int                 temp;               ///< temporary file state
+    u64                 tempcount;          ///< number of temporary children
+    void*               mem;                ///< temporary file data
+    u64                 memcap;             ///< temporary file data capacity
+    struct _unfs_node*  tempnext;           ///< next temporary file
+    struct _unfs_node*  tempprev;           ///< previous temporary file
+    u32*                heat;               ///< data segment heat counters
+    u32                 pin;                ///< pinned by data mover count
+    u64                 mapgen;             ///< segment map generation
+    u32                 seq;                ///< size and segment map sequence
+    u32                 wseq;               ///< in-place data write sequence
+    u32                 namelen;            ///< name length
+    u32                 namehash;           ///< name hash
+    u64                 resvpage;           ///< bulk preallocated page address
+    u32                 resvpc;             ///< bulk preallocated page count
+    int                 rbias;              ///< file lock reader bias flag
+    u64                 rinhibit;           ///< reader bias inhibit time (ns)
+    unfs_chg_t*         chg;                ///< changed chunk generations
+    u64                 chgpage;            ///< change table page address
     // persistent fields
+    u64                 offload;            ///< offloaded object id (0 if not)
     u64                 pageid;             ///< page address
     u64                 parentid;           ///< parent page address
     u64                 size;               ///< file or directory size
@@ -139,10 +248,25 @@ typedef struct _unfs_node {
     unfs_ds_t           ds[0];              ///< file data segment array
 } unfs_node_t;
 
+/// File entry persistent fields as stored on device
+typedef struct {
+    u8                  rsvd[UNFS_ENTRYRSVD]; ///< reserved
+    u64                 chgpage;            ///< change table page (0 if none)
+    u32                 rsvd2;              ///< reserved
+    u32                 magic;              ///< entry format magic
+    u64                 offload;            ///< offloaded object id (0 if not)
+    u64                 pageid;             ///< page address
+    u64                 parentid;           ///< parent page address
+    u64                 size;               ///< file or directory size
+    u32                 isdir;              ///< is a directory flag
+    u32                 dscount;            ///< file data segment count
+    unfs_ds_t           ds[0];              ///< file data segment array
+} unfs_entry_t;
+
 /// File node as stored on device
 typedef struct {
     union {
-        unfs_node_t     node;               ///< file node structure
+        unfs_entry_t    node;               ///< file entry structure
         unfs_page_t     page;               ///< file info page
     };
     unfs_page_t         name;               ///< file name page
@@ -167,8 +291,39 @@ typedef struct {
     int                 error;              ///< error number
     int                 mode;               ///< open mode
     void*               id;                 ///< id
+    int                 ioprio;             ///< I/O priority class
+    int                 vol;                ///< sub-volume id
 } unfs_fd_t;
 
+/// File extent (see unfs_file_extents), or a changed file byte range with
+/// no page address (see unfs_file_changes)
+typedef struct {
+    u64                 offset;             ///< file byte offset
+    u64                 pageid;             ///< device page address
+    u64                 length;             ///< byte length
+} unfs_extent_t;
+
+/// File data export function called by concurrent streaming threads with
+/// a chunk of file data at the file offset (see unfs_file_export)
+typedef int (*unfs_export_fn)(void* arg, const void* buf, u64 offset, u64 len);
+
+/// Replication stream record types
+typedef enum {
+    UNFS_REPL_OPEN      = 1,                ///< open with the device size
+    UNFS_REPL_WRITE,                        ///< write data
+    UNFS_REPL_DISCARD,                      ///< discard (read back as zeros)
+    UNFS_REPL_SYNC,                         ///< end of batch (sync replica)
+} unfs_repl_type_t;
+
+/// Replication stream record header, followed by the data of a write
+/// (see unfs_repl.c)
+typedef struct {
+    u64                 offset;             ///< device byte offset
+    u64                 len;                ///< byte count
+    u32                 type;               ///< record type
+    u32                 rsvd;               ///< reserved
+} unfs_repl_rec_t;
+
 /// Device dependent IO context
 typedef u32 unfs_ioc_t;
 
@@ -193,8 +348,32 @@ typedef struct {
     void            (*read)(unfs_ioc_t ioc, void* buf, u64 pa, u32 pc);
     /// write data from buffer onto device
     void            (*write)(unfs_ioc_t ioc, const void* buf, u64 pa, u32 pc);
+    /// load data from device byte address (byte-addressable device only)
+    void            (*load)(unfs_ioc_t ioc, void* buf, u64 addr, u64 len);
+    /// store data onto device byte address (byte-addressable device only)
+    void            (*store)(unfs_ioc_t ioc, const void* buf, u64 addr, u64 len);
+    /// discard (deallocate) device pages (NULL if not supported)
+    int             (*discard)(unfs_ioc_t ioc, u64 pa, u64 pc);
+    /// preferred write alignment and granularity in pages (0 if none)
+    u32             ioalign;
+    /// optimal I/O (i.e. stripe) size in pages (0 if none)
+    u32             iostripe;
+    /// max transfer size in pages (0 if unlimited)
+    u32             iomax;
+    /// discarded pages read back as zeros
+    u32             discardzero;
 } unfs_device_io_t;
 
+/**
+ * Get the page count of the next transfer when splitting a device I/O at
+ * device page pa, so that it does not exceed iomax pages and ends on an
+ * iostripe (or iomax) boundary to keep the following transfers aligned.
+ */
+#define UNFS_IOSPLIT(io, pa, pc) \
+    ((!(io)->iomax || (pc) <= (io)->iomax) ? (pc) : \
+     (io)->iomax - ((pa) + (io)->iomax) % \
+        (((io)->iostripe && (io)->iostripe <= (io)->iomax) ? (io)->iostripe : (io)->iomax))
+
 /// Filesystem header page layout (at lba 0)
 typedef struct {
     union {
@@ -216,6 +395,15 @@ typedef struct {
             u32         delcount;           ///< deleted stack count
             u64         delstack[];         ///< stack of deleted file entries
         };
+        struct {
+            u8          extpad[UNFS_HEADPC * UNFS_PAGESIZE - UNFS_HEADEXT * sizeof(u64)];
+            u64         tierpage;           ///< start fast tier data page
+            u64         txnpage;            ///< pending transaction journal
+            u64         txncount;           ///< pending transaction page count
+            u64         gen;                ///< header write generation
+            u64         chgen;              ///< current change generation
+            u64         extrsvd[UNFS_HEADEXT - 5]; ///< reserved
+        };
     };
     unfs_page_t         map[0];             ///< free bitmap page
 } unfs_header_t;
@@ -226,6 +414,9 @@ int unfs_format(const char* device, const char* label, int print);
 int unfs_check(const char* device);
 
 unfs_fs_t unfs_open(const char* device);
+unfs_fs_t unfs_open_ro(const char* device);
+unfs_fs_t unfs_open_vol(const char* device, const char* vol);
+int unfs_reload(unfs_fs_t fs);
 int unfs_close(unfs_fs_t fs);
 
 int unfs_create(unfs_fs_t fs, const char* name, int isdir, int pflag);
@@ -234,7 +425,13 @@ int unfs_rename(unfs_fs_t fs, const char* src, const char* dst, int override);
 int unfs_exist(unfs_fs_t fs, const char* name, int* isdirp, u64* sizep);
 int unfs_stat(unfs_fs_t fs, unfs_header_t* statp, int print);
 
+int unfs_txn_begin(unfs_fs_t fs);
+int unfs_txn_commit(unfs_fs_t fs);
+int unfs_bulk(unfs_fs_t fs, int enable);
+u64 unfs_change_gen(unfs_fs_t fs);
+
 unfs_dir_list_t* unfs_dir_list(unfs_fs_t fs, const char* name);
+unfs_dir_list_t* unfs_dir_list_all(unfs_fs_t fs, const char* name);
 void unfs_dir_list_free(unfs_dir_list_t* listp);
 
 unfs_fd_t unfs_file_open(unfs_fs_t fs, const char* name, unfs_mode_t mode);
@@ -242,9 +439,28 @@ int unfs_file_close(unfs_fd_t fd);
 int unfs_file_sync(unfs_fd_t fd);
 char* unfs_file_name(unfs_fd_t fd, char* name, int len);
 int unfs_file_stat(unfs_fd_t fd, u64* sizep, u32* dscp, unfs_ds_t** dslp);
+int unfs_file_extents(unfs_fd_t fd, unfs_extent_t** extp, u32* countp, u64* genp);
+int unfs_file_export(unfs_fd_t fd, unfs_export_fn fn, void* arg, int threads, u64* genp);
+int unfs_file_changes(unfs_fd_t fd, u64 gen, unfs_extent_t** extp, u32* countp);
 int unfs_file_resize(unfs_fd_t fd, u64 size, int* fill);
 int unfs_file_read(unfs_fd_t fd, void *buf, u64 offset, u64 len);
 int unfs_file_write(unfs_fd_t fd, const void *buf, u64 offset, u64 len);
+int unfs_file_write_atomic(unfs_fd_t fd, const void *buf, u64 offset, u64 len);
 u64 unfs_file_checksum(unfs_fd_t fd);
 
+int unfs_temp_config(const char* patterns, u64 memsize);
+
+int unfs_offload_config(const char* dir, int threads);
+int unfs_offload(unfs_fs_t fs, const char* name);
+int unfs_recall(unfs_fs_t fs, const char* name);
+
+int unfs_prewarm_config(const char* name, u64 maxsize, int threads);
+int unfs_prewarm_save(unfs_fs_t fs);
+
+int unfs_sched_config(const char* config);
+int unfs_sched_class(int ioprio);
+
+int unfs_repl_apply(int fd, const unfs_repl_rec_t* rec, const void* data);
+int unfs_repl_xfer(int fd, void* buf, u64 len, int wflag);
+
 #endif	// _UNFS_H
@@ -0,0 +1,454 @@
+/**
+ * Copyright (c) 2016-2017, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNFS persistent memory (DAX) device specific implementation.
+ *
+ * The device (i.e. a /dev/daxX.Y character device or a file on a DAX mounted
+ * filesystem) is mapped directly into the address space.  Data is read with
+ * plain loads and written with non-temporal stores followed by cache line
+ * write back and store fence.  A regular file on tmpfs (e.g. /dev/shm) can
+ * be used as a local stand-in with no persistence, and a regular file on a
+ * non-DAX filesystem is synced (msync) after each write so that a write is
+ * durable upon completion as with the raw device implementation.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <x86intrin.h>
+
+#include "unfs.h"
+#include "unfs_log.h"
+
+#ifndef MAP_SHARED_VALIDATE
+#define MAP_SHARED_VALIDATE 0x03
+#endif
+#ifndef MAP_SYNC
+#define MAP_SYNC            0x80000
+#endif
+
+/// CPU cache line size
+#define UNFS_CLSIZE         64
+
+/// Cache line write back instruction (from best to worst available)
+#if defined(__CLWB__)
+#define UNFS_CLWB(p)        _mm_clwb(p)
+#elif defined(__CLFLUSHOPT__)
+#define UNFS_CLWB(p)        _mm_clflushopt(p)
+#else
+#define UNFS_CLWB(p)        _mm_clflush(p)
+#endif
+
+/// Copy size below which cached copy and write back is used
+#define UNFS_NTMIN          256
+
+
+/// Persistent memory device implementation global structure
+typedef struct {
+    char*                   device;         ///< device name
+    int                     fd;             ///< device file descriptor
+    void*                   base;           ///< device mapped address
+    u64                     size;           ///< device mapped size
+    int                     mapsync;        ///< mapped with MAP_SYNC flag
+    int                     regular;        ///< device is a regular file
+    int                     msync;          ///< sync each write (non-DAX file)
+    u64                     align;          ///< device DAX mapping alignment
+    unfs_header_t*          fsheader;       ///< filesystem header
+} unfs_pmem_dev_t;
+
+/// Persistent memory global object
+static unfs_pmem_dev_t    dev;
+
+
+/**
+ * Get an attribute (e.g. size or align) of a device DAX character device
+ * from sysfs.
+ * @param   st          device stat info
+ * @param   attr        attribute name
+ * @return  the value or 0 if unknown.
+ */
+static u64 unfs_dev_dax_attr(const struct stat* st, const char* attr)
+{
+    char path[64];
+    u64 val = 0;
+    snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/%s",
+             major(st->st_rdev), minor(st->st_rdev), attr);
+    FILE* fp = fopen(path, "r");
+    if (fp) {
+        if (fscanf(fp, "%lu", &val) != 1) val = 0;
+        fclose(fp);
+    }
+    return val;
+}
+
+/**
+ * Check if a character device is a device DAX (i.e. its sysfs subsystem is
+ * dax), as opposed to e.g. an NVMe generic character device.
+ * @param   st          device stat info
+ * @return  1 if device DAX else 0.
+ */
+static int unfs_dev_dax_chr(const struct stat* st)
+{
+    char path[64], link[256];
+    snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/subsystem",
+             major(st->st_rdev), minor(st->st_rdev));
+    ssize_t n = readlink(path, link, sizeof(link) - 1);
+    if (n <= 0) return 0;
+    link[n] = 0;
+    char* name = strrchr(link, '/');
+    return strcmp(name ? name + 1 : link, "dax") == 0;
+}
+
+/**
+ * Sync the written range of a non-DAX file mapping.
+ * @param   addr        start address
+ * @param   len         number of bytes
+ */
+static void unfs_dev_msync(void* addr, size_t len)
+{
+    uintptr_t p = (uintptr_t)addr & ~(UNFS_PAGESIZE - 1L);
+    len += (uintptr_t)addr - p;
+    if (msync((void*)p, len, MS_SYNC))
+        FATAL("msync %s (%s)", dev.device, strerror(errno));
+}
+
+/**
+ * Write back the cache lines of a memory range.
+ * @param   addr        start address
+ * @param   len         number of bytes
+ */
+static inline void unfs_dev_flush(const void* addr, size_t len)
+{
+    uintptr_t p = (uintptr_t)addr & ~(UNFS_CLSIZE - 1);
+    uintptr_t end = (uintptr_t)addr + len;
+    for (; p < end; p += UNFS_CLSIZE) UNFS_CLWB((void*)p);
+}
+
+/**
+ * Copy data to persistent memory using non-temporal stores for the cache
+ * line aligned portion and cached stores with write back for the rest.
+ * Caller is responsible for the final store fence.
+ * @param   dst         persistent memory destination
+ * @param   src         source buffer
+ * @param   len         number of bytes
+ */
+static void unfs_dev_memcpy_nt(void* dst, const void* src, size_t len)
+{
+    if (len < UNFS_NTMIN) {
+        memcpy(dst, src, len);
+        unfs_dev_flush(dst, len);
+        return;
+    }
+
+    // copy the unaligned head
+    size_t n = -(uintptr_t)dst & (UNFS_CLSIZE - 1);
+    if (n) {
+        memcpy(dst, src, n);
+        unfs_dev_flush(dst, n);
+        dst += n;
+        src += n;
+        len -= n;
+    }
+
+    // stream the aligned body bypassing the cache
+    __m128i* d = dst;
+    const __m128i* s = src;
+    for (; len >= UNFS_CLSIZE; len -= UNFS_CLSIZE) {
+        __m128i x0 = _mm_loadu_si128(s);
+        __m128i x1 = _mm_loadu_si128(s + 1);
+        __m128i x2 = _mm_loadu_si128(s + 2);
+        __m128i x3 = _mm_loadu_si128(s + 3);
+        _mm_stream_si128(d, x0);
+        _mm_stream_si128(d + 1, x1);
+        _mm_stream_si128(d + 2, x2);
+        _mm_stream_si128(d + 3, x3);
+        d += 4;
+        s += 4;
+    }
+
+    // copy the tail
+    if (len) {
+        memcpy(d, s, len);
+        unfs_dev_flush(d, len);
+    }
+}
+
+/**
+ * Open the device and map it into the address space.
+ * @param   device      device name
+ * @return  allocated filesystem header or NULL upon failure.
+ */
+static unfs_header_t* unfs_dev_open(const char* device)
+{
+    DEBUG_FN("%s", device);
+    if (dev.fsheader) return dev.fsheader;
+
+    // open device and get size info
+    struct stat st;
+    dev.fd = open(device, O_RDWR);
+    if (dev.fd < 0)
+        FATAL("open %s (%s)", device, strerror(errno));
+    if (fstat(dev.fd, &st) < 0)
+        FATAL("stat %s (%s)", device, strerror(errno));
+    if (S_ISCHR(st.st_mode)) {
+        if (!unfs_dev_dax_chr(&st))
+            FATAL("%s is not a device DAX", device);
+        dev.size = unfs_dev_dax_attr(&st, "size");
+        dev.align = unfs_dev_dax_attr(&st, "align");
+    } else {
+        dev.size = st.st_size;
+        dev.regular = S_ISREG(st.st_mode);
+    }
+    if (dev.size < (UNFS_PAGESIZE << 4))
+        FATAL("cannot get %s size (%#lx)", device, dev.size);
+    dev.device = strdup(device);
+
+    // map with MAP_SYNC if supported (i.e. DAX) else fallback to shared map
+    dev.base = mmap(0, dev.size, PROT_READ|PROT_WRITE,
+                    MAP_SHARED_VALIDATE|MAP_SYNC, dev.fd, 0);
+    if (dev.base != MAP_FAILED) {
+        dev.mapsync = 1;
+    } else {
+        dev.base = mmap(0, dev.size, PROT_READ|PROT_WRITE,
+                        MAP_SHARED, dev.fd, 0);
+        if (dev.base == MAP_FAILED)
+            FATAL("mmap %s (%s)", device, strerror(errno));
+
+        // a page cache mapping is synced per write unless it is on tmpfs
+        struct statfs sfs;
+        if (fstatfs(dev.fd, &sfs) < 0)
+            FATAL("statfs %s (%s)", device, strerror(errno));
+        dev.msync = sfs.f_type != TMPFS_MAGIC;
+    }
+    INFO_FN("%s: size=%#lx sync=%d msync=%d",
+            device, dev.size, dev.mapsync, dev.msync);
+
+    // calculate filesystem header based on device capacity
+    u64 pagecount = (dev.size >> UNFS_PAGESHIFT) & ~1L;
+    int bitsperpage = 8 << UNFS_PAGESHIFT;
+    u64 datapage = (pagecount + bitsperpage - 1) / bitsperpage + UNFS_MAPPA;
+    datapage = (datapage + 1) & ~1L;
+
+    // allocate filesystem header including the free map
+    void* hp = mmap(0, datapage << UNFS_PAGESHIFT, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED, -1, 0);
+    if (hp == MAP_FAILED)
+        FATAL("mmap %lu pages failed", datapage);
+    dev.fsheader = hp;
+    dev.fsheader->blockcount = pagecount;
+    dev.fsheader->blocksize = UNFS_PAGESIZE;
+    dev.fsheader->pagecount = pagecount;
+    dev.fsheader->pagesize = UNFS_PAGESIZE;
+    dev.fsheader->datapage = datapage;
+
+    return (dev.fsheader);
+}
+
+/**
+ * Close the device and release resources.
+ */
+static void unfs_dev_close()
+{
+    DEBUG_FN();
+    if (dev.base) {
+        if (!dev.mapsync) msync(dev.base, dev.size, MS_SYNC);
+        munmap(dev.base, dev.size);
+    }
+    if (dev.device) free(dev.device);
+    if (dev.fsheader)
+        munmap(dev.fsheader, dev.fsheader->datapage << UNFS_PAGESHIFT);
+    if (dev.fd > 0) close(dev.fd);
+    memset(&dev, 0, sizeof(dev));
+}
+
+/**
+ * Allocate device IO context.  Not applicable to persistent memory.
+ * @return  0
+ */
+static unfs_ioc_t unfs_dev_ioc_alloc()
+{
+    return 0;
+}
+
+/**
+ * Release device IO context.  Not applicable to persistent memory.
+ * @param   ioc         IO context
+ */
+static void unfs_dev_ioc_free(unfs_ioc_t ioc)
+{
+}
+
+/**
+ * Allocate a buffer associated with the specified IO context.
+ * @param   ioc         IO context
+ * @param   pc          pointer to number of pages requested
+ * @return  IO queue buffer.
+ */
+static void* unfs_dev_page_alloc(unfs_ioc_t ioc, u32* pc)
+{
+    if (*pc > 4096) *pc = 4096;
+    void* buf;
+    if (posix_memalign(&buf, UNFS_PAGESIZE, *pc << UNFS_PAGESHIFT))
+        FATAL("alloc %u pages failed", *pc);
+    return buf;
+}
+
+/**
+ * Free an IO buffer associated with the specified IO context.
+ * @param   ioc         IO context
+ * @param   buf         IO buffer
+ * @param   pc          number of pages to free
+ */
+static void unfs_dev_page_free(unfs_ioc_t ioc, void* buf, u32 pc)
+{
+    free(buf);
+}
+
+/**
+ * Read pages from the device mapping.
+ * @param   ioc         IO context
+ * @param   buf         data buffer
+ * @param   pa          page address
+ * @param   pc          page count
+ */
+static void unfs_dev_read(unfs_ioc_t ioc, void* buf, u64 pa, u32 pc)
+{
+    DEBUG_FN("%#lx %#x", pa, pc);
+    memcpy(buf, dev.base + (pa << UNFS_PAGESHIFT), (u64)pc << UNFS_PAGESHIFT);
+}
+
+/**
+ * Write pages onto the device mapping persistently.
+ * @param   ioc         IO context
+ * @param   buf         data buffer
+ * @param   pa          page address
+ * @param   pc          page count
+ */
+static void unfs_dev_write(unfs_ioc_t ioc, const void* buf, u64 pa, u32 pc)
+{
+    DEBUG_FN("%#lx %#x", pa, pc);
+    unfs_dev_memcpy_nt(dev.base + (pa << UNFS_PAGESHIFT), buf,
+                       (u64)pc << UNFS_PAGESHIFT);
+    _mm_sfence();
+    if (dev.msync)
+        unfs_dev_msync(dev.base + (pa << UNFS_PAGESHIFT), (u64)pc << UNFS_PAGESHIFT);
+}
+
+/**
+ * Load data from a device byte address.
+ * @param   ioc         IO context
+ * @param   buf         data buffer
+ * @param   addr        device byte address
+ * @param   len         number of bytes
+ */
+static void unfs_dev_load(unfs_ioc_t ioc, void* buf, u64 addr, u64 len)
+{
+    DEBUG_FN("%#lx %#lx", addr, len);
+    memcpy(buf, dev.base + addr, len);
+}
+
+/**
+ * Store data onto a device byte address persistently.
+ * @param   ioc         IO context
+ * @param   buf         data buffer
+ * @param   addr        device byte address
+ * @param   len         number of bytes
+ */
+static void unfs_dev_store(unfs_ioc_t ioc, const void* buf, u64 addr, u64 len)
+{
+    DEBUG_FN("%#lx %#lx", addr, len);
+    unfs_dev_memcpy_nt(dev.base + addr, buf, len);
+    _mm_sfence();
+    if (dev.msync) unfs_dev_msync(dev.base + addr, len);
+}
+
+/**
+ * Discard device pages by punching a hole in the backing file, which drops
+ * the mapped pages so they read back as zeros.
+ * @param   ioc         IO context
+ * @param   pa          page address
+ * @param   pc          page count
+ * @return  0 if ok else error code.
+ */
+static int unfs_dev_discard(unfs_ioc_t ioc, u64 pa, u64 pc)
+{
+    DEBUG_FN("%#lx %#lx", pa, pc);
+    if (fallocate(dev.fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                  pa << UNFS_PAGESHIFT, pc << UNFS_PAGESHIFT))
+        return errno;
+    return 0;
+}
+
+/**
+ * Bind to persistent memory device implementation.
+ * @param   devfp       device function pointer
+ * @param   device      device name
+ * @return  device filesystem reference or NULL upon failure.
+ */
+unfs_header_t* unfs_pmem_open(unfs_device_io_t* devfp, const char* device)
+{
+    devfp->close = unfs_dev_close;
+    devfp->ioc_alloc = unfs_dev_ioc_alloc;
+    devfp->ioc_free = unfs_dev_ioc_free;
+    devfp->page_alloc = unfs_dev_page_alloc;
+    devfp->page_free = unfs_dev_page_free;
+    devfp->read = unfs_dev_read;
+    devfp->write = unfs_dev_write;
+
+    // direct load/store may be turned off to use the page I/O path instead
+    char* env = getenv("UNFS_PMEM_DIRECT");
+    if (!env || atoi(env)) {
+        devfp->load = unfs_dev_load;
+        devfp->store = unfs_dev_store;
+    }
+    unfs_header_t* hp = unfs_dev_open(device);
+
+    // a device DAX character device has no hole punching
+    if (dev.regular) {
+        devfp->discard = unfs_dev_discard;
+        devfp->discardzero = 1;
+    }
+
+    // align large extents to the device DAX mapping (e.g. huge page) size
+    devfp->ioalign = dev.align >> UNFS_PAGESHIFT;
+    return hp;
+}
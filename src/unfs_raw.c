@@ -32,35 +32,194 @@
 /**
  * @file
  * @brief UNFS raw device specific implementation.
+ *
+ * A tiered device can be specified as "fast,capacity" (e.g. an Optane and
+ * a NAND device) in which case the two devices are mapped into one page
+ * address space.  The header and bitmap pages and the file entries at the
+ * end of the address space are on the fast device, and the data pages are
+ * split into a capacity tier (starting at datapage) followed by a fast tier
+ * (starting at tierpage):
+ *
+ *  Page 0 to datapage-1:           fast device page 0 to datapage-1
+ *  Page datapage to tierpage-1:    capacity device page 0 to C-1
+ *  Page tierpage to pagecount-1:   fast device page datapage to F-1
+ *
+ * A regular file can also be used as a device (i.e. for testing) where
+ * direct I/O is used if supported by the underlying filesystem.
+ *
+ * With UNFS_MERGE set to a plug window in microseconds, an I/O issued while
+ * another is in progress is queued, and the first queued I/O waits out the
+ * window (or until the queue is full) to submit the queue with contiguous
+ * reads or writes coalesced into single preadv or pwritev commands.
+ *
+ * Pages are discarded with BLKDISCARD on a block device and by punching a
+ * hole in a regular file.
  */
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "unfs.h"
 #include "unfs_log.h"
 
 
+#ifndef BLKDISCARD
+#define BLKDISCARD          _IO(0x12, 119)
+#endif
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES    _IO(0x12, 124)
+#endif
+
+/// Max number of queued requests to merge
+#define MERGE_MAXREQ        64
+
+/// Default max merged command page count (if no device max transfer size)
+#define MERGE_MAXPC         256
+
+/// Queued I/O request to merge
+typedef struct _unfs_merge_req {
+    struct _unfs_merge_req* next;           ///< next queued request
+    int                     fd;             ///< device file descriptor
+    int                     write;          ///< write flag
+    void*                   buf;            ///< data buffer
+    off_t                   off;            ///< device byte offset
+    ssize_t                 size;           ///< byte count
+    int                     done;           ///< completion flag
+} unfs_merge_req_t;
+
 /// Raw device implementation global structure
 typedef struct {
     char*                   device;         ///< device name
     u64                     blockcount;     ///< device block count
     u32                     blocksize;      ///< device block size
     int                     fd;             ///< device file descriptor
+    int                     capfd;          ///< capacity tier device descriptor
+    u64                     datapage;       ///< start data page address
+    u64                     tierpage;       ///< start fast tier data page
     unfs_header_t*          fsheader;       ///< filesystem header
+    unfs_device_io_t*       io;             ///< device I/O geometry
+    u32                     mergewin;       ///< merge plug window (in us)
+    u32                     mergeactive;    ///< I/Os in progress
+    unfs_merge_req_t*       mergeq;         ///< merge queue
+    unfs_merge_req_t**      mergetail;      ///< merge queue tail link
+    u32                     mergecount;     ///< merge queue count
+    int                     mergeplug;      ///< merge queue plugged flag
+    pthread_mutex_t         mergelock;      ///< merge queue lock
+    pthread_cond_t          mergecond;      ///< merged request completion
+    pthread_cond_t          mergefull;      ///< merge queue full condition
+    u64                     mergereq;       ///< requests submitted merged
+    u64                     mergecmd;       ///< commands issued for them
 } unfs_raw_dev_t;
 
 /// UNVMe global object
 static unfs_raw_dev_t    dev;
 
+/**
+ * Get a block device queue limit from sysfs.
+ * @param   st          device stat info
+ * @param   attr        queue attribute name
+ * @return  the value or 0 if unknown.
+ */
+static u64 unfs_dev_queue_limit(const struct stat* st, const char* attr)
+{
+    char path[128];
+    u64 val = 0;
+    int i;
+
+    // a partition takes the queue limits of its whole device
+    for (i = 0; i < 2; i++) {
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%squeue/%s",
+                 major(st->st_rdev), minor(st->st_rdev), i ? "../" : "", attr);
+        FILE* fp = fopen(path, "r");
+        if (fp) {
+            if (fscanf(fp, "%lu", &val) != 1) val = 0;
+            fclose(fp);
+            break;
+        }
+    }
+    return val;
+}
+
+/**
+ * Get the I/O geometry of a block device (in pages) and merge it into the
+ * device geometry, so the stricter alignment and transfer size of a tiered
+ * device pair is used.
+ * @param   st          device stat info
+ */
+static void unfs_raw_geometry(const struct stat* st)
+{
+    u32 align = unfs_dev_queue_limit(st, "minimum_io_size") >> UNFS_PAGESHIFT;
+    u32 stripe = unfs_dev_queue_limit(st, "optimal_io_size") >> UNFS_PAGESHIFT;
+    u32 max = unfs_dev_queue_limit(st, "max_sectors_kb") >> (UNFS_PAGESHIFT - 10);
+    DEBUG_FN("align=%u stripe=%u max=%u", align, stripe, max);
+
+    if (dev.io->ioalign < align) dev.io->ioalign = align;
+    if (dev.io->iostripe < stripe) dev.io->iostripe = stripe;
+    if (max && (!dev.io->iomax || dev.io->iomax > max)) dev.io->iomax = max;
+}
+
+/**
+ * Open a block device or regular file and get its size info.
+ * @param   device      device name
+ * @param   blockcount  returned block count
+ * @param   blocksize   returned block size
+ * @return  the file descriptor.
+ */
+static int unfs_dev_open_fd(const char* device, u64* blockcount, u32* blocksize)
+{
+    int fd = open(device, O_RDWR|O_DIRECT);
+    if (fd < 0 && errno == EINVAL) fd = open(device, O_RDWR);
+    if (fd < 0)
+        FATAL("open %s (%s)", device, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        FATAL("stat %s (%s)", device, strerror(errno));
+    if (S_ISREG(st.st_mode)) {
+        *blocksize = 512;
+        *blockcount = st.st_size / 512;
+        return fd;
+    }
+
+    unfs_raw_geometry(&st);
+    if (ioctl(fd, BLKGETSIZE, blockcount) < 0)
+        FATAL("cannot get %s block count (%s)", device, strerror(errno));
+    if (ioctl(fd, BLKSSZGET, blocksize) < 0)
+        FATAL("cannot get %s block size (%s)", device, strerror(errno));
+    if (*blocksize > UNFS_PAGESIZE)
+        FATAL("unsupported block size %d > %d", *blocksize, UNFS_PAGESIZE);
+    *blockcount /= (*blocksize / 512);
+    return fd;
+}
+
+/**
+ * Check if discarded blocks of a block device or regular file read back
+ * as zeros.
+ * @param   fd          device file descriptor
+ * @return  1 if so else 0.
+ */
+static int unfs_dev_discard_zero(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) return 0;
+    if (S_ISREG(st.st_mode)) return 1;
+    unsigned int zero = 0;
+    if (ioctl(fd, BLKDISCARDZEROES, &zero) < 0) return 0;
+    return zero != 0;
+}
+
 /**
  * Open the raw device.
  * @param   device         device name
@@ -71,24 +230,36 @@ static unfs_header_t* unfs_dev_open(const char* device)
     DEBUG_FN("%s", device);
     if (dev.fsheader) return dev.fsheader;
 
-    // open device and get size info
-    dev.fd = open(device, O_RDWR|O_DIRECT);
-    if (dev.fd < 0)
-        FATAL("open %s (%s)", device, strerror(errno));
-    if (ioctl(dev.fd, BLKGETSIZE, &dev.blockcount) < 0)
-        FATAL("cannot get %s block count (%s)", device, strerror(errno));
-    if (ioctl(dev.fd, BLKSSZGET, &dev.blocksize) < 0)
-        FATAL("cannot get %s block size (%s)", device, strerror(errno));
-    if (dev.blocksize > UNFS_PAGESIZE)
-        FATAL("unsupported block size %d > %d", dev.blocksize, UNFS_PAGESIZE);
+    // open device (and capacity tier device) and get size info
     dev.device = strdup(device);
+    char* capdev = strchr(dev.device, ',');
+    if (capdev) *capdev++ = 0;
+    dev.fd = unfs_dev_open_fd(dev.device, &dev.blockcount, &dev.blocksize);
+    dev.io->discardzero = unfs_dev_discard_zero(dev.fd);
+    u64 pagecount = (dev.blockcount / (UNFS_PAGESIZE / dev.blocksize)) & ~1L;
+    u64 cappagecount = 0;
+    if (capdev) {
+        u64 capblockcount;
+        u32 capblocksize;
+        dev.capfd = unfs_dev_open_fd(capdev, &capblockcount, &capblocksize);
+        if (!unfs_dev_discard_zero(dev.capfd)) dev.io->discardzero = 0;
+        cappagecount = (capblockcount / (UNFS_PAGESIZE / capblocksize)) & ~63L;
+        dev.blockcount += capblockcount * capblocksize / dev.blocksize;
+        capdev[-1] = ',';
+    }
 
     // calculate filesystem header based on disk capacity
-    dev.blockcount /= (dev.blocksize / 512);
-    u64 pagecount = (dev.blockcount / (UNFS_PAGESIZE / dev.blocksize)) & ~1L;
     int bitsperpage = 8 << UNFS_PAGESHIFT;
-    u64 datapage = (pagecount + bitsperpage - 1) / bitsperpage + UNFS_MAPPA;
+    u64 datapage = (pagecount + cappagecount + bitsperpage - 1) / bitsperpage
+                   + UNFS_MAPPA;
     datapage = (datapage + 1) & ~1L;
+    if (capdev) {
+        if (pagecount < (datapage + 64 * UNFS_FILEPC))
+            FATAL("fast tier device %s is too small", dev.device);
+        dev.datapage = datapage;
+        dev.tierpage = datapage + cappagecount;
+        pagecount += cappagecount;
+    }
 
     // allocate filesystem header including the free map
     void* hp = mmap(0, datapage << UNFS_PAGESHIFT, PROT_READ|PROT_WRITE,
@@ -101,6 +272,20 @@ static unfs_header_t* unfs_dev_open(const char* device)
     dev.fsheader->pagecount = pagecount;
     dev.fsheader->pagesize = UNFS_PAGESIZE;
     dev.fsheader->datapage = datapage;
+    dev.fsheader->tierpage = dev.tierpage;
+    INFO_FN("%s: pc=%#lx dp=%#lx tp=%#lx",
+            device, pagecount, datapage, dev.tierpage);
+
+    // set up the request merge stage
+    char* env = getenv("UNFS_MERGE");
+    if (env && atoi(env) > 0) {
+        dev.mergewin = atoi(env);
+        dev.mergetail = &dev.mergeq;
+        pthread_mutex_init(&dev.mergelock, NULL);
+        pthread_cond_init(&dev.mergecond, NULL);
+        pthread_cond_init(&dev.mergefull, NULL);
+        INFO_FN("merge window %u us", dev.mergewin);
+    }
 
     return (dev.fsheader);
 }
@@ -111,10 +296,17 @@ static unfs_header_t* unfs_dev_open(const char* device)
 static void unfs_dev_close()
 {
     DEBUG_FN();
+    if (dev.mergewin) {
+        if (dev.mergereq) INFO_FN("merged %lu requests into %lu commands", dev.mergereq, dev.mergecmd);
+        pthread_cond_destroy(&dev.mergefull);
+        pthread_cond_destroy(&dev.mergecond);
+        pthread_mutex_destroy(&dev.mergelock);
+    }
     if (dev.device) free(dev.device);
     if (dev.fsheader)
         munmap(dev.fsheader, dev.fsheader->datapage << UNFS_PAGESHIFT);
     if (dev.fd > 0) close(dev.fd);
+    if (dev.capfd > 0) close(dev.capfd);
     memset(&dev, 0, sizeof(dev));
 }
 
@@ -163,6 +355,178 @@ static void unfs_dev_page_free(unfs_ioc_t ioc, void* buf, u32 pc)
         FATAL("munmap %p failed", buf);
 }
 
+/**
+ * Map a page address to its tier device.
+ * @param   pa          page address
+ * @param   pc          pointer to page count (to be truncated to the tier)
+ * @param   off         returned device byte offset
+ * @return  the device file descriptor.
+ */
+static inline int unfs_dev_map(u64 pa, u32* pc, off_t* off)
+{
+    int fd = dev.fd;
+    if (!dev.tierpage) {
+        *off = pa << UNFS_PAGESHIFT;
+        return fd;
+    }
+    if (pa < dev.datapage) {
+        if (*pc > (dev.datapage - pa)) *pc = dev.datapage - pa;
+    } else if (pa < dev.tierpage) {
+        if (*pc > (dev.tierpage - pa)) *pc = dev.tierpage - pa;
+        pa -= dev.datapage;
+        fd = dev.capfd;
+    } else {
+        pa -= dev.tierpage - dev.datapage;
+    }
+    *off = pa << UNFS_PAGESHIFT;
+    return fd;
+}
+
+/**
+ * Read or write a device byte range, if failed just print an error and
+ * terminate.
+ * @param   fd          device file descriptor
+ * @param   buf         data buffer
+ * @param   size        byte count
+ * @param   off         device byte offset
+ * @param   write       write flag
+ */
+static void unfs_dev_pio(int fd, void* buf, ssize_t size, off_t off, int write)
+{
+    while (size) {
+        ssize_t n = write ? pwrite(fd, buf, size, off) : pread(fd, buf, size, off);
+        if (n < 0)
+            FATAL("%s size %#lx off %#lx (%s)", write ? "pwrite" : "pread",
+                  size, off, strerror(errno));
+        buf += n;
+        off += n;
+        size -= n;
+    }
+}
+
+/**
+ * Order queued requests by device, direction and offset.
+ * @param   a           pointer to request a
+ * @param   b           pointer to request b
+ * @return  comparison result.
+ */
+static int unfs_dev_merge_cmp_fn(const void* a, const void* b)
+{
+    const unfs_merge_req_t* ra = *(unfs_merge_req_t* const*)a;
+    const unfs_merge_req_t* rb = *(unfs_merge_req_t* const*)b;
+    if (ra->fd != rb->fd) return ra->fd - rb->fd;
+    if (ra->write != rb->write) return ra->write - rb->write;
+    return (ra->off > rb->off) - (ra->off < rb->off);
+}
+
+/**
+ * Submit a list of queued requests, where each run of contiguous requests
+ * of the same device and direction (up to the max transfer size) is issued
+ * as one vectored command.  A run that is not fully transferred is redone
+ * per request.
+ * @param   list        request list
+ */
+static void unfs_dev_merge_submit(unfs_merge_req_t* list)
+{
+    unfs_merge_req_t* reqs[MERGE_MAXREQ];
+    struct iovec iov[MERGE_MAXREQ];
+    int i, j, n = 0;
+    for (; list; list = list->next) reqs[n++] = list;
+    qsort(reqs, n, sizeof(unfs_merge_req_t*), unfs_dev_merge_cmp_fn);
+
+    ssize_t maxsize = (ssize_t)(dev.io->iomax ? dev.io->iomax : MERGE_MAXPC)
+                      << UNFS_PAGESHIFT;
+    u64 cmds = 0;
+    for (i = 0; i < n; i = j) {
+        unfs_merge_req_t* rp = reqs[i];
+        ssize_t size = rp->size;
+        iov[0].iov_base = rp->buf;
+        iov[0].iov_len = rp->size;
+        for (j = i + 1; j < n; j++) {
+            unfs_merge_req_t* np = reqs[j];
+            if (np->fd != rp->fd || np->write != rp->write ||
+                np->off != (reqs[j - 1]->off + reqs[j - 1]->size) ||
+                (size + np->size) > maxsize)
+                break;
+            iov[j - i].iov_base = np->buf;
+            iov[j - i].iov_len = np->size;
+            size += np->size;
+        }
+        ssize_t r = rp->write ? pwritev(rp->fd, iov, j - i, rp->off)
+                              : preadv(rp->fd, iov, j - i, rp->off);
+        if (r != size) {
+            int k;
+            for (k = i; k < j; k++)
+                unfs_dev_pio(reqs[k]->fd, reqs[k]->buf, reqs[k]->size,
+                             reqs[k]->off, reqs[k]->write);
+        }
+        cmds++;
+    }
+
+    pthread_mutex_lock(&dev.mergelock);
+    for (i = 0; i < n; i++) reqs[i]->done = 1;
+    dev.mergereq += n;
+    dev.mergecmd += cmds;
+    pthread_cond_broadcast(&dev.mergecond);
+    pthread_mutex_unlock(&dev.mergelock);
+}
+
+/**
+ * Read or write a device byte range through the merge stage.  If no other
+ * I/O is in progress (or the queue is full) the range is transferred
+ * directly.  Otherwise the request is queued, and the first request queued
+ * plugs the queue for the merge window, then takes and submits it.
+ * @param   fd          device file descriptor
+ * @param   buf         data buffer
+ * @param   size        byte count
+ * @param   off         device byte offset
+ * @param   write       write flag
+ */
+static void unfs_dev_rw(int fd, void* buf, ssize_t size, off_t off, int write)
+{
+    if (!dev.mergewin) {
+        unfs_dev_pio(fd, buf, size, off, write);
+        return;
+    }
+
+    unfs_merge_req_t req = { .fd = fd, .write = write, .buf = buf,
+                             .off = off, .size = size };
+    int active = __sync_add_and_fetch(&dev.mergeactive, 1);
+    pthread_mutex_lock(&dev.mergelock);
+    if (active == 1 || dev.mergecount == MERGE_MAXREQ) {
+        pthread_mutex_unlock(&dev.mergelock);
+        unfs_dev_pio(fd, buf, size, off, write);
+        __sync_sub_and_fetch(&dev.mergeactive, 1);
+        return;
+    }
+    *dev.mergetail = &req;
+    dev.mergetail = &req.next;
+    if (++dev.mergecount == MERGE_MAXREQ) pthread_cond_signal(&dev.mergefull);
+
+    if (dev.mergeplug) {
+        while (!req.done) pthread_cond_wait(&dev.mergecond, &dev.mergelock);
+        pthread_mutex_unlock(&dev.mergelock);
+    } else {
+        // plug the queue until the window expires or the queue is full
+        dev.mergeplug = 1;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        u64 ns = ts.tv_nsec + dev.mergewin * 1000UL;
+        ts.tv_sec += ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        while (dev.mergecount < MERGE_MAXREQ &&
+               !pthread_cond_timedwait(&dev.mergefull, &dev.mergelock, &ts));
+        unfs_merge_req_t* list = dev.mergeq;
+        dev.mergeq = NULL;
+        dev.mergetail = &dev.mergeq;
+        dev.mergecount = 0;
+        dev.mergeplug = 0;
+        pthread_mutex_unlock(&dev.mergelock);
+        unfs_dev_merge_submit(list);
+    }
+    __sync_sub_and_fetch(&dev.mergeactive, 1);
+}
+
 /**
  * Do unvme_read, if failed just print an error and terminate.
  * @param   ioc         IO context
@@ -173,15 +537,16 @@ static void unfs_dev_page_free(unfs_ioc_t ioc, void* buf, u32 pc)
 static void unfs_dev_read(unfs_ioc_t ioc, void* buf, u64 pa, u32 pc)
 {
     DEBUG_FN("%#lx %#x", pa, pc);
-    off_t off = pa << UNFS_PAGESHIFT;
-    ssize_t size = pc << UNFS_PAGESHIFT;
-    while (size) {
-        ssize_t n = pread(dev.fd, buf, size, off);
-        if (n < 0)
-            FATAL("pread size %#lx off %#lx (%s)", size, off, strerror(errno));
-        buf += n;
-        off += n;
-        size -= n;
+    while (pc) {
+        off_t off;
+        u32 tpc = pc;
+        int fd = unfs_dev_map(pa, &tpc, &off);
+        tpc = UNFS_IOSPLIT(dev.io, off >> UNFS_PAGESHIFT, tpc);
+        ssize_t size = (ssize_t)tpc << UNFS_PAGESHIFT;
+        unfs_dev_rw(fd, buf, size, off, 0);
+        buf += size;
+        pa += tpc;
+        pc -= tpc;
     }
 }
 
@@ -195,16 +560,47 @@ static void unfs_dev_read(unfs_ioc_t ioc, void* buf, u64 pa, u32 pc)
 static void unfs_dev_write(unfs_ioc_t ioc, const void* buf, u64 pa, u32 pc)
 {
     DEBUG_FN("%#lx %#x", pa, pc);
-    off_t off = pa << UNFS_PAGESHIFT;
-    ssize_t size = pc << UNFS_PAGESHIFT;
-    while (size) {
-        ssize_t n = pwrite(dev.fd, buf, size, off);
-        if (n < 0)
-            FATAL("pwrite size %#lx off %#lx (%s)", size, off, strerror(errno));
-        buf += n;
-        off += n;
-        size -= n;
+    while (pc) {
+        off_t off;
+        u32 tpc = pc;
+        int fd = unfs_dev_map(pa, &tpc, &off);
+        tpc = UNFS_IOSPLIT(dev.io, off >> UNFS_PAGESHIFT, tpc);
+        ssize_t size = (ssize_t)tpc << UNFS_PAGESHIFT;
+        unfs_dev_rw(fd, (void*)buf, size, off, 1);
+        buf += size;
+        pa += tpc;
+        pc -= tpc;
+    }
+}
+
+/**
+ * Discard device pages so the device can reclaim them.
+ * @param   ioc         IO context
+ * @param   pa          page address
+ * @param   pc          page count
+ * @return  0 if ok else error code.
+ */
+static int unfs_dev_discard(unfs_ioc_t ioc, u64 pa, u64 pc)
+{
+    DEBUG_FN("%#lx %#lx", pa, pc);
+    while (pc) {
+        off_t off;
+        u32 tpc = pc > 0x40000000 ? 0x40000000 : pc;
+        int fd = unfs_dev_map(pa, &tpc, &off);
+        u64 size = (u64)tpc << UNFS_PAGESHIFT;
+        struct stat st;
+        if (fstat(fd, &st) < 0) return errno;
+        if (S_ISREG(st.st_mode)) {
+            if (fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, off, size))
+                return errno;
+        } else {
+            u64 range[2] = { off, size };
+            if (ioctl(fd, BLKDISCARD, range) < 0) return errno;
+        }
+        pa += tpc;
+        pc -= tpc;
     }
+    return 0;
 }
 
 /**
@@ -222,5 +618,7 @@ unfs_header_t* unfs_raw_open(unfs_device_io_t* devfp, const char* device)
     devfp->page_free = unfs_dev_page_free;
     devfp->read = unfs_dev_read;
     devfp->write = unfs_dev_write;
+    devfp->discard = unfs_dev_discard;
+    dev.io = devfp;
     return unfs_dev_open(device);
 }
@@ -0,0 +1,497 @@
+/**
+ * Copyright (c) 2016-2017, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * @file
+ * @brief UNFS asynchronous replication implementation.
+ *
+ * Replication is layered between the filesystem and the I/O scheduler by
+ * wrapping the write, store and discard operations of the device function
+ * table.  Each completed write is appended with a copy of its data to an
+ * in-memory log, and a background thread ships the log in batches to the
+ * replica, so a foreground write only pays for the copy.  Since writes to
+ * the same page are serialized by the filesystem locks held across the
+ * device write, the log order is the order of the writes, and the replica
+ * always holds a prefix of them, i.e. a crash consistent image that can be
+ * mounted read-only (see unfs_open_ro) or promoted by mounting it read/write.
+ *
+ * The replica (UNFS_REPLICA) is either a device or file (created with the
+ * primary size if it does not exist) written at the same byte offsets and
+ * synced after each batch, or "host:port" of a peer running unfs_replica
+ * which applies the stream to its own device or file.  When the log reaches
+ * UNFS_REPLICA_MB (default 256), writers wait for it to drain.  If the
+ * replica fails, replication stops with an error without affecting the
+ * primary.
+ *
+ * A replica whose header matches the primary header upon open holds all the
+ * writes up to that header write, so the stream simply continues.  Otherwise
+ * the filesystem copies its pages through the log (see unfs_repl_copy), and
+ * a replica left incomplete has its header cleared upon close.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "unfs.h"
+#include "unfs_log.h"
+
+#ifndef BLKZEROOUT
+#define BLKZEROOUT          _IO(0x12, 127)
+#endif
+
+/// Default replication log size limit in MB
+#define REPL_LOGMB          256
+
+/// Copy chunk page count
+#define REPL_COPYPC         256
+
+
+/// Replication log entry
+typedef struct _unfs_repl_ent {
+    struct _unfs_repl_ent*  next;           ///< next log entry
+    unfs_repl_rec_t         rec;            ///< stream record
+    u8                      data[0];        ///< write data
+} unfs_repl_ent_t;
+
+/// Replication global structure
+typedef struct {
+    unfs_device_io_t        dev;            ///< underlying device operations
+    char*                   target;         ///< replica target name
+    int                     fd;             ///< replica file or socket
+    int                     sock;           ///< replica is a socket peer
+    u64                     logmax;         ///< log size limit in bytes
+    u64                     logsize;        ///< log size in bytes
+    unfs_repl_ent_t*        head;           ///< log head
+    unfs_repl_ent_t**       tail;           ///< log tail link
+    pthread_mutex_t         lock;           ///< log lock
+    pthread_cond_t          ready;          ///< log ready condition
+    pthread_cond_t          space;          ///< log space condition
+    pthread_t               thread;         ///< shipping thread
+    int                     stop;           ///< shipping thread stop flag
+    int                     failed;         ///< replica failed flag
+    int                     copying;        ///< replica being copied
+    u64                     batches;        ///< number of batches shipped
+    u64                     bytes;          ///< number of data bytes shipped
+} unfs_repl_t;
+
+/// Replication global object
+static unfs_repl_t          repl;
+
+
+/**
+ * Read or write a whole buffer on a file descriptor (i.e. a socket).
+ * @param   fd          file descriptor
+ * @param   buf         data buffer
+ * @param   len         byte count
+ * @param   wflag       write flag
+ * @return  0 if ok else error code.
+ */
+int unfs_repl_xfer(int fd, void* buf, u64 len, int wflag)
+{
+    while (len) {
+        ssize_t n = wflag ? write(fd, buf, len) : read(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return n ? errno : EPIPE;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Apply a replication stream record onto a replica device or file.
+ * @param   fd          replica file descriptor
+ * @param   rec         stream record
+ * @param   data        write data
+ * @return  0 if ok else error code.
+ */
+int unfs_repl_apply(int fd, const unfs_repl_rec_t* rec, const void* data)
+{
+    struct stat st;
+    u64 off = rec->offset;
+    u64 len = rec->len;
+
+    switch (rec->type) {
+    case UNFS_REPL_OPEN:
+        if (fstat(fd, &st) < 0) return errno;
+        if (S_ISREG(st.st_mode) && st.st_size < len && ftruncate(fd, len))
+            return errno;
+        break;
+
+    case UNFS_REPL_WRITE:
+        while (len) {
+            ssize_t n = pwrite(fd, data, len, off);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return n ? errno : EIO;
+            data += n;
+            off += n;
+            len -= n;
+        }
+        break;
+
+    case UNFS_REPL_DISCARD:
+        // discarded pages must read back as zeros (e.g. a format bitmap)
+        if (fstat(fd, &st) < 0) return errno;
+        if (S_ISREG(st.st_mode)) {
+            if (fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, off, len))
+                return errno;
+        } else {
+            u64 range[2] = { off, len };
+            if (ioctl(fd, BLKZEROOUT, range) < 0) return errno;
+        }
+        break;
+
+    case UNFS_REPL_SYNC:
+        if (fdatasync(fd)) return errno;
+        break;
+
+    default:
+        return EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Ship a batch of log entries to the replica followed by a sync.
+ * @param   list        log entry list
+ * @return  0 if ok else error code.
+ */
+static int unfs_repl_ship(unfs_repl_ent_t* list)
+{
+    int err = 0;
+    unfs_repl_rec_t sync = { .type = UNFS_REPL_SYNC };
+    unfs_repl_ent_t* ent;
+
+    for (ent = list; ent && !err; ent = ent->next) {
+        u64 dlen = ent->rec.type == UNFS_REPL_WRITE ? ent->rec.len : 0;
+        if (repl.sock) {
+            err = unfs_repl_xfer(repl.fd, &ent->rec, sizeof(ent->rec) + dlen, 1);
+        } else {
+            err = unfs_repl_apply(repl.fd, &ent->rec, ent->data);
+        }
+        repl.bytes += dlen;
+    }
+    if (!err) {
+        if (repl.sock) err = unfs_repl_xfer(repl.fd, &sync, sizeof(sync), 1);
+        else err = unfs_repl_apply(repl.fd, &sync, NULL);
+    }
+    repl.batches++;
+    return err;
+}
+
+/**
+ * Shipping thread to send the log to the replica in batches, where the log
+ * entries appended while a batch is being shipped make up the next batch.
+ * @param   arg         unused
+ * @return  NULL.
+ */
+static void* unfs_repl_thread(void* arg)
+{
+    pthread_mutex_lock(&repl.lock);
+    for (;;) {
+        while (!repl.head && !repl.stop)
+            pthread_cond_wait(&repl.ready, &repl.lock);
+        if (!repl.head) break;
+        unfs_repl_ent_t* list = repl.head;
+        u64 size = repl.logsize;
+        repl.head = NULL;
+        repl.tail = &repl.head;
+        pthread_mutex_unlock(&repl.lock);
+
+        int err = repl.failed ? 0 : unfs_repl_ship(list);
+        if (err) {
+            ERROR("replica %s failed (%s), replication stopped",
+                  repl.target, strerror(err));
+            repl.failed = 1;
+        }
+        while (list) {
+            unfs_repl_ent_t* next = list->next;
+            free(list);
+            list = next;
+        }
+
+        pthread_mutex_lock(&repl.lock);
+        repl.logsize -= size;
+        pthread_cond_broadcast(&repl.space);
+    }
+    pthread_mutex_unlock(&repl.lock);
+    return NULL;
+}
+
+/**
+ * Append a log entry, waiting for log space if the log is full.
+ * @param   ent         log entry
+ * @param   size        log entry size
+ */
+static void unfs_repl_append(unfs_repl_ent_t* ent, u64 size)
+{
+    ent->next = NULL;
+    while (repl.logsize && (repl.logsize + size) > repl.logmax)
+        pthread_cond_wait(&repl.space, &repl.lock);
+    *repl.tail = ent;
+    repl.tail = &ent->next;
+    repl.logsize += size;
+    pthread_cond_signal(&repl.ready);
+}
+
+/**
+ * Log a completed write or discard.
+ * @param   type        record type
+ * @param   buf         write data
+ * @param   off         device byte offset
+ * @param   len         byte count
+ */
+static void unfs_repl_log(u32 type, const void* buf, u64 off, u64 len)
+{
+    if (repl.failed) return;
+    u64 dlen = type == UNFS_REPL_WRITE ? len : 0;
+    u64 size = sizeof(unfs_repl_ent_t) + dlen;
+    unfs_repl_ent_t* ent = malloc(size);
+    if (!ent) FATAL("malloc %#lx", size);
+    ent->rec.offset = off;
+    ent->rec.len = len;
+    ent->rec.type = type;
+    ent->rec.rsvd = 0;
+    if (dlen) memcpy(ent->data, buf, dlen);
+
+    pthread_mutex_lock(&repl.lock);
+    unfs_repl_append(ent, size);
+    pthread_mutex_unlock(&repl.lock);
+}
+
+/**
+ * Write pages onto the device and log them.
+ * @param   ioc         IO context
+ * @param   buf         data buffer
+ * @param   pa          page address
+ * @param   pc          page count
+ */
+static void unfs_repl_write(unfs_ioc_t ioc, const void* buf, u64 pa, u32 pc)
+{
+    repl.dev.write(ioc, buf, pa, pc);
+    unfs_repl_log(UNFS_REPL_WRITE, buf, pa << UNFS_PAGESHIFT,
+                  (u64)pc << UNFS_PAGESHIFT);
+}
+
+/**
+ * Store data onto a device byte address and log it.
+ * @param   ioc         IO context
+ * @param   buf         data buffer
+ * @param   addr        device byte address
+ * @param   len         number of bytes
+ */
+static void unfs_repl_store(unfs_ioc_t ioc, const void* buf, u64 addr, u64 len)
+{
+    repl.dev.store(ioc, buf, addr, len);
+    unfs_repl_log(UNFS_REPL_WRITE, buf, addr, len);
+}
+
+/**
+ * Discard device pages and log them.
+ * @param   ioc         IO context
+ * @param   pa          page address
+ * @param   pc          page count
+ * @return  0 if ok else error code.
+ */
+static int unfs_repl_discard(unfs_ioc_t ioc, u64 pa, u64 pc)
+{
+    int err = repl.dev.discard(ioc, pa, pc);
+    if (!err) unfs_repl_log(UNFS_REPL_DISCARD, NULL, pa << UNFS_PAGESHIFT,
+                            pc << UNFS_PAGESHIFT);
+    return err;
+}
+
+/**
+ * Copy device pages to the replica through the log.  The pages are read
+ * with the log locked, so a write completing during the read is logged
+ * after the copied data.
+ * @param   ioc         IO context
+ * @param   pa          page address
+ * @param   pc          page count
+ */
+void unfs_repl_copy(unfs_ioc_t ioc, u64 pa, u64 pc)
+{
+    while (pc && !repl.failed) {
+        u32 n = pc < REPL_COPYPC ? pc : REPL_COPYPC;
+        u64 len = (u64)n << UNFS_PAGESHIFT;
+        u64 size = sizeof(unfs_repl_ent_t) + len;
+        unfs_repl_ent_t* ent = malloc(size);
+        if (!ent) FATAL("malloc %#lx", size);
+        ent->rec.offset = pa << UNFS_PAGESHIFT;
+        ent->rec.len = len;
+        ent->rec.type = UNFS_REPL_WRITE;
+        ent->rec.rsvd = 0;
+
+        pthread_mutex_lock(&repl.lock);
+        while (repl.logsize && (repl.logsize + size) > repl.logmax)
+            pthread_cond_wait(&repl.space, &repl.lock);
+        repl.dev.read(ioc, ent->data, pa, n);
+        unfs_repl_append(ent, size);
+        pthread_mutex_unlock(&repl.lock);
+        pa += n;
+        pc -= n;
+    }
+}
+
+/**
+ * Mark the replica copy as complete.
+ */
+void unfs_repl_copied()
+{
+    if (repl.copying) INFO_FN("%s", repl.target);
+    repl.copying = 0;
+}
+
+/**
+ * Drain the log, stop replication and close the device.
+ */
+static void unfs_repl_close()
+{
+    DEBUG_FN();
+    // a replica left incomplete must not be mountable
+    if (repl.copying) unfs_repl_log(UNFS_REPL_DISCARD, NULL, UNFS_HEADPA,
+                                    UNFS_HEADPC << UNFS_PAGESHIFT);
+    pthread_mutex_lock(&repl.lock);
+    repl.stop = 1;
+    pthread_cond_signal(&repl.ready);
+    pthread_mutex_unlock(&repl.lock);
+    pthread_join(repl.thread, NULL);
+    INFO_FN("%s: %lu batches %#lx bytes%s", repl.target, repl.batches,
+            repl.bytes, repl.failed ? " (failed)" : "");
+
+    close(repl.fd);
+    free(repl.target);
+    pthread_cond_destroy(&repl.space);
+    pthread_cond_destroy(&repl.ready);
+    pthread_mutex_destroy(&repl.lock);
+    unfs_device_io_t dev = repl.dev;
+    memset(&repl, 0, sizeof(repl));
+    dev.close();
+}
+
+/**
+ * Connect to a replica peer.
+ * @param   target      "host:port" name
+ * @return  the socket or -1 if failed.
+ */
+static int unfs_repl_connect(const char* target)
+{
+    char* host = strdup(target);
+    char* port = strrchr(host, ':');
+    *port++ = 0;
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* res;
+    int fd = -1;
+    if (getaddrinfo(host, port, &hints, &res) == 0) {
+        struct addrinfo* ai;
+        for (ai = res; ai && fd < 0; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(res);
+    }
+    free(host);
+    return fd;
+}
+
+/**
+ * Layer replication on top of a device implementation.
+ * @param   devfp       device function pointer
+ * @param   target      replica device, file or "host:port" name
+ * @param   size        device size in bytes
+ * @return  1 if the replica has to be copied (see unfs_repl_copy), else 0.
+ */
+int unfs_repl_open(unfs_device_io_t* devfp, const char* target, u64 size)
+{
+    struct stat st;
+    repl.sock = strchr(target, ':') && stat(target, &st);
+    repl.fd = repl.sock ? unfs_repl_connect(target)
+                        : open(target, O_RDWR|O_CREAT, 0644);
+    if (repl.fd < 0)
+        FATAL("cannot open replica %s (%s)", target, strerror(errno));
+
+    // read back the replica header to check if the stream can continue
+    unfs_repl_rec_t rec = { .type = UNFS_REPL_OPEN, .len = size };
+    unfs_ioc_t ioc = devfp->ioc_alloc();
+    u32 pc = UNFS_HEADPC;
+    void* hp = devfp->page_alloc(ioc, &pc);
+    void* rhp = calloc(UNFS_HEADPC, UNFS_PAGESIZE);
+    int err;
+    if (repl.sock) {
+        err = unfs_repl_xfer(repl.fd, &rec, sizeof(rec), 1);
+        if (!err) err = unfs_repl_xfer(repl.fd, rhp, UNFS_HEADPC * UNFS_PAGESIZE, 0);
+    } else {
+        err = unfs_repl_apply(repl.fd, &rec, NULL);
+        if (!err && pread(repl.fd, rhp, UNFS_HEADPC * UNFS_PAGESIZE, 0) < 0)
+            err = errno;
+    }
+    if (err)
+        FATAL("replica %s (%s)", target, strerror(err));
+    devfp->read(ioc, hp, UNFS_HEADPA, UNFS_HEADPC);
+    repl.copying = memcmp(hp, rhp, UNFS_HEADPC * UNFS_PAGESIZE) != 0;
+    devfp->page_free(ioc, hp, pc);
+    devfp->ioc_free(ioc);
+    free(rhp);
+
+    repl.target = strdup(target);
+    repl.logmax = (u64)REPL_LOGMB << 20;
+    char* env = getenv("UNFS_REPLICA_MB");
+    if (env && atol(env) > 0) repl.logmax = atol(env) << 20;
+    repl.tail = &repl.head;
+    pthread_mutex_init(&repl.lock, NULL);
+    pthread_cond_init(&repl.ready, NULL);
+    pthread_cond_init(&repl.space, NULL);
+    if (pthread_create(&repl.thread, NULL, unfs_repl_thread, NULL))
+        FATAL("cannot create replication thread");
+    INFO_FN("%s log=%luMB copy=%d", target, repl.logmax >> 20, repl.copying);
+
+    repl.dev = *devfp;
+    devfp->close = unfs_repl_close;
+    devfp->write = unfs_repl_write;
+    if (devfp->store) devfp->store = unfs_repl_store;
+    if (devfp->discard) devfp->discard = unfs_repl_discard;
+    return repl.copying;
+}
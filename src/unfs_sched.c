@@ -0,0 +1,448 @@
+/**
+ * Copyright (c) 2016-2017, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNFS I/O scheduler implementation.
+ *
+ * The scheduler is layered between the filesystem and the device
+ * implementation by wrapping the read/write (and load/store) operations
+ * of the device function table.  Each I/O is tagged with the priority class
+ * of the calling thread (see unfs_sched_class) and is admitted according to
+ * its class settings:
+ *
+ *  + rate      token bucket rate in MB/s, where the bucket may go into debt
+ *              by one I/O so that an I/O larger than the burst can proceed.
+ *  + burst     token bucket size in MB.
+ *  + qdepth    max number of outstanding I/Os of the class.
+ *
+ * A device queue depth limits the total number of outstanding I/Os.  When
+ * it is reached, a freed slot goes to the highest priority class that has
+ * an I/O waiting, and lower classes may not take a slot while a higher
+ * class is waiting for one.
+ *
+ * The configuration is a comma separated list of class settings in the
+ * form "class:rate:burst:qdepth" where class is one of meta, log, fg, bg,
+ * or "dev:qdepth" for the device queue depth (e.g. "bg:50:4:2,dev:32").
+ * Omitted or 0 values are unlimited.  It is taken from UNFS_SCHED upon
+ * device open or set by unfs_sched_config at any time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include "unfs.h"
+#include "unfs_log.h"
+
+
+/// Priority class scheduling state
+typedef struct {
+    u64                     rate;           ///< token rate in bytes/second
+    u64                     burst;          ///< token bucket size in bytes
+    u32                     qdepth;         ///< max outstanding I/Os
+    u32                     inflight;       ///< outstanding I/O count
+    u32                     ready;          ///< waiting for a device slot
+    s64                     tokens;         ///< available tokens in bytes
+    u64                     stamp;          ///< last token refill time
+    pthread_cond_t          cond;           ///< admission wait condition
+} unfs_sched_class_t;
+
+/// I/O scheduler global structure
+typedef struct {
+    int                     init;           ///< initialized flag
+    int                     enabled;        ///< any limit is set
+    u32                     qdepth;         ///< device max outstanding I/Os
+    u32                     inflight;       ///< device outstanding I/O count
+    pthread_mutex_t         lock;           ///< scheduler lock
+    unfs_sched_class_t      cls[UNFS_IOPRIO_MAX]; ///< priority classes
+    unfs_device_io_t        dev;            ///< underlying device operations
+} unfs_sched_t;
+
+/// I/O scheduler global object
+static unfs_sched_t         sched = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/// Priority class names as in configuration string
+static const char*          unfs_sched_names[UNFS_IOPRIO_MAX] =
+                                    { "", "meta", "log", "fg", "bg" };
+
+/// Priority class of the calling thread
+static __thread int         unfs_sched_tclass;
+
+
+/**
+ * Get the current monotonic time.
+ * @return  time in nanoseconds.
+ */
+static inline u64 unfs_sched_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/**
+ * Initialize the class wait conditions (with scheduler lock held).
+ */
+static void unfs_sched_init()
+{
+    if (sched.init) return;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int c;
+    for (c = 0; c < UNFS_IOPRIO_MAX; c++)
+        pthread_cond_init(&sched.cls[c].cond, &attr);
+    pthread_condattr_destroy(&attr);
+    sched.init = 1;
+}
+
+/**
+ * Refill the class token bucket.
+ * @param   cp          class pointer
+ * @param   now         current time
+ */
+static inline void unfs_sched_refill(unfs_sched_class_t* cp, u64 now)
+{
+    u64 ns = now - cp->stamp;
+    u64 add = (double)ns * cp->rate / 1000000000.0;
+    if (add == 0) return;
+    cp->stamp = now;
+    cp->tokens += add;
+    if (cp->tokens > (s64)cp->burst) cp->tokens = cp->burst;
+}
+
+/**
+ * Check if a higher priority class is waiting for a device slot.
+ * @param   c           class index
+ * @return  1 if so else 0.
+ */
+static inline int unfs_sched_preempted(int c)
+{
+    while (--c > UNFS_IOPRIO_NONE) {
+        if (sched.cls[c].ready) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Wait until an I/O of the calling thread class can be issued.
+ * @param   len         I/O size in bytes
+ * @return  the class index the I/O is accounted to.
+ */
+static int unfs_sched_admit(u64 len)
+{
+    int c = unfs_sched_tclass ? unfs_sched_tclass : UNFS_IOPRIO_FG;
+    unfs_sched_class_t* cp = &sched.cls[c];
+    int ready = 0;
+
+    pthread_mutex_lock(&sched.lock);
+    for (;;) {
+        u64 now = unfs_sched_now();
+        if (cp->rate) unfs_sched_refill(cp, now);
+
+        if (cp->qdepth && cp->inflight >= cp->qdepth) {
+            pthread_cond_wait(&cp->cond, &sched.lock);
+        } else if (cp->rate && cp->tokens <= 0) {
+            // sleep until enough tokens are refilled
+            now += (double)(1 - cp->tokens) * 1000000000.0 / cp->rate;
+            struct timespec ts = { .tv_sec = now / 1000000000UL,
+                                   .tv_nsec = now % 1000000000UL };
+            pthread_cond_timedwait(&cp->cond, &sched.lock, &ts);
+        } else if (sched.qdepth && (sched.inflight >= sched.qdepth ||
+                                    unfs_sched_preempted(c))) {
+            if (!ready) {
+                cp->ready++;
+                ready = 1;
+            }
+            pthread_cond_wait(&cp->cond, &sched.lock);
+        } else {
+            break;
+        }
+    }
+    if (ready) cp->ready--;
+    if (cp->rate) cp->tokens -= len;
+    cp->inflight++;
+    sched.inflight++;
+    pthread_mutex_unlock(&sched.lock);
+    return c;
+}
+
+/**
+ * Complete an I/O and wake up the next waiting I/O.
+ * @param   c           class index
+ */
+static void unfs_sched_done(int c)
+{
+    unfs_sched_class_t* cp = &sched.cls[c];
+
+    pthread_mutex_lock(&sched.lock);
+    cp->inflight--;
+    sched.inflight--;
+    if (cp->qdepth) pthread_cond_broadcast(&cp->cond);
+    if (sched.qdepth) {
+        for (c = UNFS_IOPRIO_NONE + 1; c < UNFS_IOPRIO_MAX; c++) {
+            if (sched.cls[c].ready) {
+                pthread_cond_broadcast(&sched.cls[c].cond);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&sched.lock);
+}
+
+/**
+ * Scheduled read.
+ * @param   ioc         IO context
+ * @param   buf         data buffer
+ * @param   pa          page address
+ * @param   pc          page count
+ */
+static void unfs_sched_read(unfs_ioc_t ioc, void* buf, u64 pa, u32 pc)
+{
+    if (!sched.enabled) {
+        sched.dev.read(ioc, buf, pa, pc);
+        return;
+    }
+    int c = unfs_sched_admit((u64)pc << UNFS_PAGESHIFT);
+    sched.dev.read(ioc, buf, pa, pc);
+    unfs_sched_done(c);
+}
+
+/**
+ * Scheduled write.
+ * @param   ioc         IO context
+ * @param   buf         data buffer
+ * @param   pa          page address
+ * @param   pc          page count
+ */
+static void unfs_sched_write(unfs_ioc_t ioc, const void* buf, u64 pa, u32 pc)
+{
+    if (!sched.enabled) {
+        sched.dev.write(ioc, buf, pa, pc);
+        return;
+    }
+    int c = unfs_sched_admit((u64)pc << UNFS_PAGESHIFT);
+    sched.dev.write(ioc, buf, pa, pc);
+    unfs_sched_done(c);
+}
+
+/**
+ * Scheduled load.
+ * @param   ioc         IO context
+ * @param   buf         data buffer
+ * @param   addr        device byte address
+ * @param   len         number of bytes
+ */
+static void unfs_sched_load(unfs_ioc_t ioc, void* buf, u64 addr, u64 len)
+{
+    if (!sched.enabled) {
+        sched.dev.load(ioc, buf, addr, len);
+        return;
+    }
+    int c = unfs_sched_admit(len);
+    sched.dev.load(ioc, buf, addr, len);
+    unfs_sched_done(c);
+}
+
+/**
+ * Scheduled store.
+ * @param   ioc         IO context
+ * @param   buf         data buffer
+ * @param   addr        device byte address
+ * @param   len         number of bytes
+ */
+static void unfs_sched_store(unfs_ioc_t ioc, const void* buf, u64 addr, u64 len)
+{
+    if (!sched.enabled) {
+        sched.dev.store(ioc, buf, addr, len);
+        return;
+    }
+    int c = unfs_sched_admit(len);
+    sched.dev.store(ioc, buf, addr, len);
+    unfs_sched_done(c);
+}
+
+/**
+ * Set the I/O priority class of the calling thread.  All subsequent device
+ * I/Os issued by the thread will be scheduled under that class.
+ * @param   ioprio      priority class (UNFS_IOPRIO_NONE for default)
+ * @return  the previous priority class.
+ */
+int unfs_sched_class(int ioprio)
+{
+    int prev = unfs_sched_tclass;
+    if (ioprio >= UNFS_IOPRIO_NONE && ioprio < UNFS_IOPRIO_MAX)
+        unfs_sched_tclass = ioprio;
+    return prev;
+}
+
+/**
+ * Parse a configuration entry NAME[:RATE[:BURST[:QDEPTH]]] in place.
+ * @param   s           entry string
+ * @param   name        returned name
+ * @param   val         returned values (unspecified ones are 0)
+ * @return  number of fields or -1 if malformed.
+ */
+static int unfs_sched_parse(char* s, char** name, u64 val[3])
+{
+    char* save = NULL;
+    char* f;
+    int n = 0;
+
+    val[0] = val[1] = val[2] = 0;
+    while (*s == ' ') s++;
+    for (f = strsep(&s, ":"); f; f = strsep(&s, ":"), n++) {
+        if (n == 0) {
+            *name = f;
+            if (!*f) return -1;
+            continue;
+        }
+        if (n > 3) return -1;
+        if (!*f) continue;
+        if (*f < '0' || *f > '9') return -1;
+        val[n - 1] = strtoul(f, &save, 10);
+        if (*save && *save != ' ') return -1;
+    }
+    return n;
+}
+
+/**
+ * Configure the I/O scheduler.  Settings of classes not specified in the
+ * configuration string are left unchanged.  An empty string clears all
+ * settings.  The whole string is validated before any setting is applied,
+ * so an invalid configuration changes nothing.
+ * @param   config      configuration string (see file description)
+ * @return  0 if ok else error code.
+ */
+int unfs_sched_config(const char* config)
+{
+    DEBUG_FN("%s", config);
+    char* str = strdup(config);
+    char* save = NULL;
+    char* s;
+    int err = 0;
+
+    // parse into a copy of the settings
+    u64 rate[UNFS_IOPRIO_MAX], burst[UNFS_IOPRIO_MAX];
+    u32 qdepth[UNFS_IOPRIO_MAX], devqdepth;
+    int set[UNFS_IOPRIO_MAX] = { 0 };
+    int c;
+
+    pthread_mutex_lock(&sched.lock);
+    for (c = 0; c < UNFS_IOPRIO_MAX; c++) {
+        rate[c] = *config ? sched.cls[c].rate : 0;
+        burst[c] = *config ? sched.cls[c].burst : 0;
+        qdepth[c] = *config ? sched.cls[c].qdepth : 0;
+    }
+    devqdepth = *config ? sched.qdepth : 0;
+    pthread_mutex_unlock(&sched.lock);
+
+    for (s = strtok_r(str, ",", &save); s; s = strtok_r(NULL, ",", &save)) {
+        char* name = NULL;
+        u64 val[3];
+        int n = unfs_sched_parse(s, &name, val);
+        if (n < 1) {
+            err = EINVAL;
+            break;
+        }
+        if (!strcmp(name, "dev")) {
+            // device setting only has the queue depth
+            if (n > 2) {
+                err = EINVAL;
+                break;
+            }
+            devqdepth = val[0];
+            continue;
+        }
+        for (c = UNFS_IOPRIO_NONE + 1; c < UNFS_IOPRIO_MAX; c++) {
+            if (!strcmp(name, unfs_sched_names[c])) break;
+        }
+        if (c == UNFS_IOPRIO_MAX) {
+            err = EINVAL;
+            break;
+        }
+        rate[c] = val[0] << 20;
+        burst[c] = val[1] << 20;
+        if (rate[c] && !burst[c]) burst[c] = rate[c] / 10;
+        if (rate[c] && burst[c] < UNFS_PAGESIZE) burst[c] = UNFS_PAGESIZE;
+        qdepth[c] = val[2];
+        set[c] = 1;
+    }
+    if (err) {
+        ERROR("invalid scheduler config %s", config);
+        free(str);
+        return err;
+    }
+
+    // apply the settings
+    pthread_mutex_lock(&sched.lock);
+    unfs_sched_init();
+    int enabled = devqdepth != 0;
+    sched.qdepth = devqdepth;
+    for (c = 0; c < UNFS_IOPRIO_MAX; c++) {
+        unfs_sched_class_t* cp = &sched.cls[c];
+        cp->rate = rate[c];
+        cp->burst = burst[c];
+        cp->qdepth = qdepth[c];
+        if (set[c]) {
+            cp->tokens = cp->burst;
+            cp->stamp = unfs_sched_now();
+        }
+        if (cp->rate || cp->qdepth) enabled = 1;
+        pthread_cond_broadcast(&cp->cond);
+    }
+    sched.enabled = enabled;
+    pthread_mutex_unlock(&sched.lock);
+
+    free(str);
+    return 0;
+}
+
+/**
+ * Layer the I/O scheduler on top of a device implementation.
+ * @param   devfp       device function pointer
+ */
+void unfs_sched_open(unfs_device_io_t* devfp)
+{
+    sched.dev = *devfp;
+    devfp->read = unfs_sched_read;
+    devfp->write = unfs_sched_write;
+    if (devfp->load) devfp->load = unfs_sched_load;
+    if (devfp->store) devfp->store = unfs_sched_store;
+
+    char* env = getenv("UNFS_SCHED");
+    if (env && unfs_sched_config(env))
+        FATAL("UNFS_SCHED=%s", env);
+}
@@ -0,0 +1,66 @@
+/**
+ * Copyright (c) 2016-2017, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNFS filesystem with a statically bound device implementation.
+ *
+ * The filesystem and one device implementation are compiled as a single
+ * translation unit, so device operations are called directly and can be
+ * inlined into the I/O path instead of going through the unfs_device_io_t
+ * function table.  The device is selected at compile time by defining one of
+ * UNFS_STATIC_UNVME, UNFS_STATIC_RAW, or UNFS_STATIC_PMEM.
+ *
+ * Since device operations are not dispatched through the function table,
+ * the I/O scheduler is not layered on top of the device, and the scheduler
+ * configuration and priority classes have no effect.
+ */
+
+#define UNFS_STATIC
+
+#if defined(UNFS_STATIC_UNVME)
+    #ifndef UNFS_UNVME
+        #error "UNFS_STATIC_UNVME requires UNFS_UNVME"
+    #endif
+    #include "unfs_unvme.c"
+    #define UNFS_STATIC_OPEN    unfs_unvme_open
+#elif defined(UNFS_STATIC_RAW)
+    #include "unfs_raw.c"
+    #define UNFS_STATIC_OPEN    unfs_raw_open
+#elif defined(UNFS_STATIC_PMEM)
+    #include "unfs_pmem.c"
+    #define UNFS_STATIC_OPEN    unfs_pmem_open
+#else
+    #error "UNFS_STATIC_UNVME, UNFS_STATIC_RAW, or UNFS_STATIC_PMEM is required"
+#endif
+
+#include "unfs_sched.c"
+#include "unfs.c"
@@ -37,6 +37,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <semaphore.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "unfs.h"
 #include "unfs_log.h"
@@ -50,6 +52,45 @@
 /// mask array size
 #define UNFS_MASKSIZE       (UNFS_MAXIOQ/64)
 
+/// Max number of queued requests to merge
+#define MERGE_MAXREQ        64
+
+/// Queued I/O request to merge
+typedef struct _unfs_merge_req {
+    struct _unfs_merge_req* next;           ///< next queued request
+    int                     write;          ///< write flag
+    void*                   buf;            ///< data buffer
+    u64                     pa;             ///< page address
+    u32                     pc;             ///< page count
+    int                     done;           ///< completion flag
+} unfs_merge_req_t;
+
+#ifdef UNFS_NOLOCK
+/// Set mask bits and return the old mask (single-threaded build)
+#define QMASK_OR(p, m)      ({ u64 _v = *(p); *(p) = _v | (m); _v; })
+
+/// Clear mask bits and return the old mask (single-threaded build)
+#define QMASK_AND(p, m)     ({ u64 _v = *(p); *(p) = _v & (m); _v; })
+
+/// Wait for an available queue (none to wait for if single-threaded)
+#define QSEM_WAIT()         ((void)0)
+
+/// Release a queue
+#define QSEM_POST()         ((void)0)
+#else
+/// Atomically set mask bits and return the old mask
+#define QMASK_OR(p, m)      __sync_fetch_and_or(p, m)
+
+/// Atomically clear mask bits and return the old mask
+#define QMASK_AND(p, m)     __sync_fetch_and_and(p, m)
+
+/// Wait for an available queue
+#define QSEM_WAIT()         sem_wait(&dev.qsem)
+
+/// Release a queue
+#define QSEM_POST()         sem_post(&dev.qsem)
+#endif
+
 /// UNVMe device implementation global structure
 typedef struct {
     char*                   device;         ///< device name
@@ -62,6 +103,21 @@ typedef struct {
     void**                  qbuf;           ///< IO queue allocated pages
     sem_t                   qsem;           ///< semaphore of available queues
     unfs_header_t*          fsheader;       ///< filesystem header
+    const unfs_device_io_t* io;             ///< device I/O geometry
+    u32                     mergewin;       ///< merge plug window (in us)
+    u32                     mergeactive;    ///< I/Os in progress
+    unfs_merge_req_t*       mergeq;         ///< merge queue
+    unfs_merge_req_t**      mergetail;      ///< merge queue tail link
+    u32                     mergecount;     ///< merge queue count
+    int                     mergeplug;      ///< merge queue plugged flag
+    pthread_mutex_t         mergelock;      ///< merge queue lock
+    pthread_cond_t          mergecond;      ///< merged request completion
+    pthread_cond_t          mergefull;      ///< merge queue full condition
+    void*                   mergebuf;       ///< merged command IO buffer
+    u32                     mergepc;        ///< merged command max page count
+    pthread_mutex_t         mergebuflock;   ///< merged command buffer lock
+    u64                     mergereq;       ///< requests submitted merged
+    u64                     mergecmd;       ///< commands issued for them
 } unfs_unvme_dev_t;
 
 /// UNVMe global object
@@ -107,6 +163,7 @@ static unfs_header_t* unfs_dev_open(const char* device)
     dev.fsheader->pagecount = pagecount;
     dev.fsheader->pagesize = ns->pagesize;
     dev.fsheader->datapage = datapage;
+    dev.fsheader->tierpage = 0;
 
     // setup IO queue buffers and masks
     int qcount = ns->qcount;
@@ -129,6 +186,23 @@ static unfs_header_t* unfs_dev_open(const char* device)
         dev.qbufmask[i] = dev.qiocmask[i] = -1L;
     }
 
+    // set up the request merge stage, where a run of merged requests is
+    // transferred through one IO buffer of the max transfer size
+    env = getenv("UNFS_MERGE");
+    if (env && atoi(env) > 0) {
+        dev.mergewin = atoi(env);
+        dev.mergetail = &dev.mergeq;
+        dev.mergepc = ns->maxppio;
+        dev.mergebuf = unvme_alloc(ns, (u64)dev.mergepc << UNFS_PAGESHIFT);
+        if (!dev.mergebuf)
+            FATAL("unvme_alloc %u pages", dev.mergepc);
+        pthread_mutex_init(&dev.mergelock, NULL);
+        pthread_mutex_init(&dev.mergebuflock, NULL);
+        pthread_cond_init(&dev.mergecond, NULL);
+        pthread_cond_init(&dev.mergefull, NULL);
+        INFO_FN("merge window %u us", dev.mergewin);
+    }
+
     return dev.fsheader;
 }
 
@@ -139,6 +213,14 @@ static void unfs_dev_close()
 {
     DEBUG_FN();
     if (dev.ns) {
+        if (dev.mergewin) {
+            if (dev.mergereq) INFO_FN("merged %lu requests into %lu commands", dev.mergereq, dev.mergecmd);
+            pthread_cond_destroy(&dev.mergefull);
+            pthread_cond_destroy(&dev.mergecond);
+            pthread_mutex_destroy(&dev.mergebuflock);
+            pthread_mutex_destroy(&dev.mergelock);
+            unvme_free(dev.ns, dev.mergebuf);
+        }
         if (dev.qbuf) {
             if (dev.qbuf[0]) unvme_free(dev.ns, dev.qbuf[0]);
             free(dev.qbuf);
@@ -157,13 +239,13 @@ static void unfs_dev_close()
  */
 static unfs_ioc_t unfs_dev_ioc_alloc()
 {
-    sem_wait(&dev.qsem);
+    QSEM_WAIT();
     int q = dev.qnext;
     int n = dev.ns->qcount;
     while (--n >= 0) {
         int i = q >> 6;
         u64 mask = 1L << (q & 63);
-        u64 qiocmask = __sync_fetch_and_or(&dev.qiocmask[i], mask);
+        u64 qiocmask = QMASK_OR(&dev.qiocmask[i], mask);
         if ((qiocmask & mask) == 0L) return q;
         if (++q >= dev.ns->qcount) q = 0;
     }
@@ -178,11 +260,11 @@ static void unfs_dev_ioc_free(unfs_ioc_t ioc)
 {
     int i = ioc >> 6;;
     u64 mask = 1L << (ioc & 63);
-    u64 qiocmask = __sync_fetch_and_and(&dev.qiocmask[i], ~mask);
+    u64 qiocmask = QMASK_AND(&dev.qiocmask[i], ~mask);
     if ((qiocmask & mask) == 0L)
         FATAL("q%d was not allocated", ioc);
     dev.qnext = ioc;
-    sem_post(&dev.qsem);
+    QSEM_POST();
 }
 
 /**
@@ -196,7 +278,7 @@ static void* unfs_dev_page_alloc(unfs_ioc_t ioc, u32* pc)
     // only support 1 allocation request per queue
     int i = ioc >> 6;
     u64 mask = 1L << ioc;
-    u64 qbufmask = __sync_fetch_and_or(&dev.qbufmask[i], mask);
+    u64 qbufmask = QMASK_OR(&dev.qbufmask[i], mask);
     if ((qbufmask & mask) != 0L)
         FATAL("q%ld buffer is already allocated", ioc);
     if (*pc > dev.qpac) *pc = dev.qpac;
@@ -215,11 +297,158 @@ static void unfs_dev_page_free(unfs_ioc_t ioc, void* buf, u32 pc)
         FATAL("bad q%ld buffer", ioc);
     int i = ioc >> 6;
     u64 mask = 1L << ioc;
-    u64 qbufmask = __sync_fetch_and_and(&dev.qbufmask[i], ~mask);
+    u64 qbufmask = QMASK_AND(&dev.qbufmask[i], ~mask);
     if ((qbufmask & mask) == 0L)
         FATAL("q%ld buffer is already freed", ioc);
 }
 
+/**
+ * Issue one read or write command, if failed just print an error and terminate.
+ * @param   ioc         IO context
+ * @param   write       write flag
+ * @param   buf         data buffer
+ * @param   pa          page address
+ * @param   pc          page count
+ */
+static void unfs_dev_cmd(unfs_ioc_t ioc, int write, void* buf, u64 pa, u32 pc)
+{
+    if (write) {
+        if (unvme_write(dev.ns, ioc, buf, pa << dev.pbshift, pc << dev.pbshift))
+             FATAL("unvme_write q%ld %#lx %u", ioc, pa, pc);
+    } else {
+        if (unvme_read(dev.ns, ioc, buf, pa << dev.pbshift, pc << dev.pbshift))
+             FATAL("unvme_read q%ld %#lx %u", ioc, pa, pc);
+    }
+}
+
+/**
+ * Order queued requests by direction and page address.
+ * @param   a           pointer to request a
+ * @param   b           pointer to request b
+ * @return  comparison result.
+ */
+static int unfs_dev_merge_cmp_fn(const void* a, const void* b)
+{
+    const unfs_merge_req_t* ra = *(unfs_merge_req_t* const*)a;
+    const unfs_merge_req_t* rb = *(unfs_merge_req_t* const*)b;
+    if (ra->write != rb->write) return ra->write - rb->write;
+    return (ra->pa > rb->pa) - (ra->pa < rb->pa);
+}
+
+/**
+ * Submit a list of queued requests on the specified queue, where each run
+ * of contiguous requests of the same direction (up to the max transfer
+ * size) is issued as one command through the merge buffer.  A request not
+ * merged with any other is issued from its own buffer.
+ * @param   ioc         IO context
+ * @param   list        request list
+ */
+static void unfs_dev_merge_submit(unfs_ioc_t ioc, unfs_merge_req_t* list)
+{
+    unfs_merge_req_t* reqs[MERGE_MAXREQ];
+    int i, j, k, n = 0;
+    for (; list; list = list->next) reqs[n++] = list;
+    qsort(reqs, n, sizeof(unfs_merge_req_t*), unfs_dev_merge_cmp_fn);
+
+    u64 cmds = 0;
+    for (i = 0; i < n; i = j) {
+        unfs_merge_req_t* rp = reqs[i];
+        u32 pc = rp->pc;
+        for (j = i + 1; j < n; j++) {
+            unfs_merge_req_t* np = reqs[j];
+            if (np->write != rp->write ||
+                np->pa != (reqs[j - 1]->pa + reqs[j - 1]->pc) ||
+                (pc + np->pc) > dev.mergepc)
+                break;
+            pc += np->pc;
+        }
+        if ((j - i) == 1) {
+            unfs_dev_cmd(ioc, rp->write, rp->buf, rp->pa, rp->pc);
+        } else {
+            pthread_mutex_lock(&dev.mergebuflock);
+            void* p = dev.mergebuf;
+            if (rp->write) {
+                for (k = i; k < j; k++) {
+                    memcpy(p, reqs[k]->buf, (u64)reqs[k]->pc << UNFS_PAGESHIFT);
+                    p += (u64)reqs[k]->pc << UNFS_PAGESHIFT;
+                }
+            }
+            unfs_dev_cmd(ioc, rp->write, dev.mergebuf, rp->pa, pc);
+            if (!rp->write) {
+                for (k = i; k < j; k++) {
+                    memcpy(reqs[k]->buf, p, (u64)reqs[k]->pc << UNFS_PAGESHIFT);
+                    p += (u64)reqs[k]->pc << UNFS_PAGESHIFT;
+                }
+            }
+            pthread_mutex_unlock(&dev.mergebuflock);
+        }
+        cmds++;
+    }
+
+    pthread_mutex_lock(&dev.mergelock);
+    for (i = 0; i < n; i++) reqs[i]->done = 1;
+    dev.mergereq += n;
+    dev.mergecmd += cmds;
+    pthread_cond_broadcast(&dev.mergecond);
+    pthread_mutex_unlock(&dev.mergelock);
+}
+
+/**
+ * Read or write device pages through the merge stage.  If no other I/O is
+ * in progress (or the queue is full) the pages are transferred directly.
+ * Otherwise the request is queued, and the first request queued plugs the
+ * queue for the merge window, then takes and submits it on its own queue
+ * (while the other requesters wait without using theirs).
+ * @param   ioc         IO context
+ * @param   write       write flag
+ * @param   buf         data buffer
+ * @param   pa          page address
+ * @param   pc          page count
+ */
+static void unfs_dev_rw(unfs_ioc_t ioc, int write, void* buf, u64 pa, u32 pc)
+{
+    if (!dev.mergewin) {
+        unfs_dev_cmd(ioc, write, buf, pa, pc);
+        return;
+    }
+
+    unfs_merge_req_t req = { .write = write, .buf = buf, .pa = pa, .pc = pc };
+    int active = __sync_add_and_fetch(&dev.mergeactive, 1);
+    pthread_mutex_lock(&dev.mergelock);
+    if (active == 1 || dev.mergecount == MERGE_MAXREQ) {
+        pthread_mutex_unlock(&dev.mergelock);
+        unfs_dev_cmd(ioc, write, buf, pa, pc);
+        __sync_sub_and_fetch(&dev.mergeactive, 1);
+        return;
+    }
+    *dev.mergetail = &req;
+    dev.mergetail = &req.next;
+    if (++dev.mergecount == MERGE_MAXREQ) pthread_cond_signal(&dev.mergefull);
+
+    if (dev.mergeplug) {
+        while (!req.done) pthread_cond_wait(&dev.mergecond, &dev.mergelock);
+        pthread_mutex_unlock(&dev.mergelock);
+    } else {
+        // plug the queue until the window expires or the queue is full
+        dev.mergeplug = 1;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        u64 ns = ts.tv_nsec + dev.mergewin * 1000UL;
+        ts.tv_sec += ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        while (dev.mergecount < MERGE_MAXREQ &&
+               !pthread_cond_timedwait(&dev.mergefull, &dev.mergelock, &ts));
+        unfs_merge_req_t* list = dev.mergeq;
+        dev.mergeq = NULL;
+        dev.mergetail = &dev.mergeq;
+        dev.mergecount = 0;
+        dev.mergeplug = 0;
+        pthread_mutex_unlock(&dev.mergelock);
+        unfs_dev_merge_submit(ioc, list);
+    }
+    __sync_sub_and_fetch(&dev.mergeactive, 1);
+}
+
 /**
  * Do unvme_read, if failed just print an error and terminate.
  * @param   ioc         IO context
@@ -231,8 +460,13 @@ static void unfs_dev_page_free(unfs_ioc_t ioc, void* buf, u32 pc)
 static void unfs_dev_read(unfs_ioc_t ioc, void* buf, u64 pa, u32 pc)
 {
     DEBUG_FN("q%ld %#lx %#x", ioc, pa, pc);
-    if (unvme_read(dev.ns, ioc, buf, pa << dev.pbshift, pc << dev.pbshift))
-         FATAL("unvme_read q%ld %#lx %u", ioc, pa, pc);
+    while (pc) {
+        u32 n = UNFS_IOSPLIT(dev.io, pa, pc);
+        unfs_dev_rw(ioc, 0, buf, pa, n);
+        buf += (u64)n << UNFS_PAGESHIFT;
+        pa += n;
+        pc -= n;
+    }
 }
 
 /**
@@ -245,8 +479,13 @@ static void unfs_dev_read(unfs_ioc_t ioc, void* buf, u64 pa, u32 pc)
 static void unfs_dev_write(unfs_ioc_t ioc, const void* buf, u64 pa, u32 pc)
 {
     DEBUG_FN("q%ld %#lx %#x", ioc, pa, pc);
-    if (unvme_write(dev.ns, ioc, buf, pa << dev.pbshift, pc << dev.pbshift))
-         FATAL("unvme_write q%ld %#lx %u", ioc, pa, pc);
+    while (pc) {
+        u32 n = UNFS_IOSPLIT(dev.io, pa, pc);
+        unfs_dev_rw(ioc, 1, (void*)buf, pa, n);
+        buf += (u64)n << UNFS_PAGESHIFT;
+        pa += n;
+        pc -= n;
+    }
 }
 
 #endif  // UNFS_UNVME
@@ -267,7 +506,13 @@ unfs_header_t* unfs_unvme_open(unfs_device_io_t* devfp, const char* device)
     devfp->page_free = unfs_dev_page_free;
     devfp->read = unfs_dev_read;
     devfp->write = unfs_dev_write;
-    return unfs_dev_open(device);
+    unfs_header_t* hp = unfs_dev_open(device);
+
+    // split transfers at the namespace max transfer size (the preferred
+    // write alignment is not reported by UNVMe and taken from UNFS_IOALIGN)
+    devfp->iomax = dev.ns->maxppio;
+    dev.io = devfp;
+    return hp;
 #else
     ERROR("No UNVMe support");
     return NULL;
@@ -0,0 +1,237 @@
+/**
+ * Copyright (c) 2016-2017, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNFS atomic write test.
+ *
+ * The data written by unfs_file_write_atomic is verified against a shadow
+ * copy for an unaligned write within a segment, writes spanning several
+ * segments, appends past the end of file, and writes into a file at the
+ * max number of segments (which is rewritten into a single segment).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include "unfs.h"
+#include "unfs_log.h"
+
+
+/// Usage
+static const char*  usage =
+"\nUsage: %s [OPTION]... DEVICE_NAME\n\
+          -v              turn on verbose\n\
+          -n NSID         NVMe namespace id (default 1)\n\
+          DEVICE_NAME     device name\n";
+
+static unfs_fs_t    fs;                     ///< filesystem handle
+static int          verbose = 0;            ///< verbose flag
+static unfs_fd_t    fd;                     ///< test file
+static u8*          shadow;                 ///< expected file content
+static u64          shadow_size;            ///< expected file size
+static unsigned int seed = 1;               ///< random seed
+
+/// Test file name
+#define FILENAME    "/atomic"
+
+/// Max file size
+#define MAXSIZE     (16 << 20)
+
+/// Print if verbose flag is set
+#define VERBOSE(fmt, arg...) if (verbose) printf(fmt, ##arg)
+
+
+/**
+ * Get the file segment count.
+ */
+static u32 segment_count()
+{
+    u32 dscount = 0;
+    if (unfs_file_stat(fd, 0, &dscount, 0))
+        FATAL("stat %s", FILENAME);
+    return dscount;
+}
+
+/**
+ * Verify the whole file content against the shadow copy.
+ */
+static void verify_file()
+{
+    u64 size = 0;
+    unfs_file_stat(fd, &size, 0, 0);
+    if (size != shadow_size)
+        FATAL("%s size %#lx expect %#lx", FILENAME, size, shadow_size);
+    u8* buf = malloc(size + 1);
+    if (unfs_file_read(fd, buf, 0, size))
+        FATAL("read %s len=%#lx", FILENAME, size);
+    u64 i;
+    for (i = 0; i < size && buf[i] == shadow[i]; i++);
+    if (i < size)
+        FATAL("%s data mismatch at %#lx (%#x expect %#x)",
+              FILENAME, i, buf[i], shadow[i]);
+    free(buf);
+}
+
+/**
+ * Write random data atomically and verify the file.
+ */
+static void write_verify(u64 offset, u64 len)
+{
+    VERBOSE("# write off=%#lx len=%#lx segments=%u\n", offset, len, segment_count());
+    if ((offset + len) > MAXSIZE)
+        FATAL("write off=%#lx len=%#lx exceeds %#x", offset, len, MAXSIZE);
+    u8* buf = malloc(len);
+    u64 i;
+    for (i = 0; i < len; i++) buf[i] = rand_r(&seed);
+    int err = unfs_file_write_atomic(fd, buf, offset, len);
+    if (err)
+        FATAL("write off=%#lx len=%#lx (%s)", offset, len, strerror(err));
+    memcpy(shadow + offset, buf, len);
+    if ((offset + len) > shadow_size) shadow_size = offset + len;
+    free(buf);
+    verify_file();
+}
+
+/**
+ * Main program.
+ */
+int main(int argc, char** argv)
+{
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:v")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'n':
+            setenv("UNFS_NSID", optarg, 1);
+            break;
+        default:
+            fprintf(stderr, usage, prog);
+            exit(1);
+        }
+    }
+
+    const char* device = getenv("UNFS_DEVICE");
+    if ((optind + 1) == argc) device = argv[optind++];
+    if (!device || optind != argc) {
+        fprintf(stderr, usage, prog);
+        exit(1);
+    }
+
+    LOG_OPEN();
+    printf("UNFS ATOMIC WRITE TEST BEGIN\n");
+    time_t tstart = time(0);
+
+    printf("UNFS format device %s\n", device);
+    if (unfs_format(device, prog, verbose))
+        FATAL("UNFS format failed");
+    printf("UNFS open device %s\n", device);
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+    fd = unfs_file_open(fs, FILENAME, UNFS_OPEN_CREATE);
+    if (fd.error)
+        FATAL("create %s (%s)", FILENAME, strerror(fd.error));
+    shadow = calloc(1, MAXSIZE);
+
+    // initial content in a single segment
+    u64 size = 64 * UNFS_PAGESIZE + 1234;
+    if (unfs_file_resize(fd, size, 0))
+        FATAL("resize %s", FILENAME);
+    shadow_size = size;
+    write_verify(0, size);
+
+    printf("Write unaligned within a segment\n");
+    write_verify(1000, 3000);
+    write_verify(5 * UNFS_PAGESIZE + 17, 3 * UNFS_PAGESIZE + 100);
+    write_verify(size - 200, 150);
+    if (segment_count() < 3)
+        FATAL("expect at least 3 segments");
+
+    printf("Write spanning segments\n");
+    write_verify(100, 12 * UNFS_PAGESIZE);
+    write_verify(3 * UNFS_PAGESIZE, 40 * UNFS_PAGESIZE + 999);
+    write_verify(UNFS_PAGESIZE - 1, size - UNFS_PAGESIZE);
+
+    printf("Append past end of file\n");
+    write_verify(shadow_size - 10, 5000);
+    write_verify(shadow_size, 2 * UNFS_PAGESIZE);
+    write_verify(shadow_size + 3000, 100);
+    write_verify(shadow_size + 5 * UNFS_PAGESIZE + 7, 3 * UNFS_PAGESIZE);
+
+    printf("Write at max segments\n");
+    write_verify(shadow_size, 2 * UNFS_MAXDS * UNFS_PAGESIZE);
+    u64 pc = shadow_size / UNFS_PAGESIZE;
+    u64 p = 0;
+    u32 dscount = segment_count();
+    while (dscount < (UNFS_MAXDS - 1)) {
+        if (p >= pc)
+            FATAL("cannot fragment %s (%u segments)", FILENAME, dscount);
+        write_verify(p * UNFS_PAGESIZE + 100, 200);
+        p += 2;
+        dscount = segment_count();
+    }
+    printf("Segments %u max %lu\n", dscount, UNFS_MAXDS);
+    write_verify(shadow_size / 2 + 1, 300);
+    if (segment_count() != 1)
+        FATAL("expect 1 segment after rewrite (%u)", segment_count());
+    write_verify(shadow_size - 100, 2 * UNFS_PAGESIZE);
+    unfs_file_close(fd);
+    unfs_close(fs);
+
+    printf("UNFS reopen device %s\n", device);
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+    fd = unfs_file_open(fs, FILENAME, 0);
+    if (fd.error)
+        FATAL("open %s (%s)", FILENAME, strerror(fd.error));
+    verify_file();
+    unfs_file_close(fd);
+    unfs_close(fs);
+    free(shadow);
+
+    if (unfs_check(device)) return 1;
+
+    printf("UNFS ATOMIC WRITE TEST COMPLETE (%ld secs)\n", time(0) - tstart);
+    LOG_CLOSE();
+
+    return 0;
+}
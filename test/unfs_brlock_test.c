@@ -0,0 +1,296 @@
+/**
+ * Copyright (c) 2016-2017, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNFS reader biased file lock test.
+ *
+ * With UNFS_BRLOCK=1, reader threads take the file read lock in reader
+ * bias mode while writers revoke the bias.  The readers read and verify
+ * stripes of an in-memory temporary file (whose reads take the file read
+ * lock) while a writer rewrites whole stripes, so a stripe read while
+ * being written is seen torn, and check the extent map of a regular file
+ * against its size while another writer resizes it.  Each reader also
+ * checks that the stripe versions it sees never go back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "unfs.h"
+#include "unfs_log.h"
+
+
+/// Usage
+static const char*  usage =
+"\nUsage: %s [OPTION]... DEVICE_NAME\n\
+          -v              turn on verbose\n\
+          -n NSID         NVMe namespace id (default 1)\n\
+          -t THREADS      number of reader threads (default 8)\n\
+          -s SECONDS      seconds to run (default 5)\n\
+          DEVICE_NAME     device name\n";
+
+static unfs_fs_t    fs;                     ///< filesystem handle
+static unfs_fd_t    tfd;                    ///< temporary file
+static unfs_fd_t    rfd;                    ///< regular file
+static int          verbose = 0;            ///< verbose flag
+static int          thread_count = 8;       ///< reader thread count
+static int          seconds = 5;            ///< seconds to run
+static volatile int stop;                   ///< stop threads flag
+
+/// Temporary file name (matching the UNFS_TEMP pattern)
+#define TEMPNAME    "/brlock/tmp0"
+
+/// Regular file name
+#define FILENAME    "/brlock/file0"
+
+/// Stripe size
+#define STRIPESIZE  (16 << 10)
+
+/// Number of stripes
+#define STRIPES     64
+
+/// Regular file max size
+#define MAXSIZE     (8 << 20)
+
+/// Print if verbose flag is set
+#define VERBOSE(fmt, arg...) if (verbose) printf(fmt, ##arg)
+
+
+/**
+ * Fill a stripe with its index and version.
+ */
+static void fill_stripe(u64* buf, u64 s, u64 version)
+{
+    int i;
+    for (i = 0; i < STRIPESIZE / sizeof(u64); i++) buf[i] = (s << 40) | version;
+}
+
+/**
+ * Check that the extents of the regular file add up to its size.
+ */
+static void check_extents()
+{
+    unfs_extent_t* ext;
+    u32 count, i;
+    u64 gen, size, len = 0;
+    if (unfs_file_extents(rfd, &ext, &count, &gen))
+        FATAL("extents %s", FILENAME);
+    for (i = 0; i < count; i++) {
+        if (ext[i].offset != len)
+            FATAL("extent %u offset %#lx expect %#lx", i, ext[i].offset, len);
+        len += ext[i].length;
+    }
+    free(ext);
+
+    // the size is read after the extents so it may only have changed if
+    // the map generation has changed
+    unfs_file_stat(rfd, &size, 0, 0);
+    unfs_extent_t* ext2;
+    u64 gen2;
+    if (unfs_file_extents(rfd, &ext2, &count, &gen2))
+        FATAL("extents %s", FILENAME);
+    free(ext2);
+    if (size != len && gen == gen2)
+        FATAL("%s extents length %#lx size %#lx", FILENAME, len, size);
+}
+
+/**
+ * Reader thread.
+ */
+static void* reader(void* arg)
+{
+    unsigned seed = (long)arg;
+    u64* buf = malloc(STRIPESIZE);
+    u64* last = calloc(STRIPES, sizeof(u64));
+    u64 reads = 0;
+    while (!stop) {
+        u64 s = rand_r(&seed) % STRIPES;
+        if (unfs_file_read(tfd, buf, s * STRIPESIZE, STRIPESIZE))
+            FATAL("read %s stripe %lu", TEMPNAME, s);
+        u64 version = buf[0] & ((1UL << 40) - 1);
+        if ((buf[0] >> 40) != s)
+            FATAL("stripe %lu has index %lu", s, buf[0] >> 40);
+        int i;
+        for (i = 1; i < STRIPESIZE / sizeof(u64); i++) {
+            if (buf[i] != buf[0])
+                FATAL("stripe %lu torn at word %d (%#lx and %#lx)", s, i, buf[0], buf[i]);
+        }
+        if (version < last[s])
+            FATAL("stripe %lu version %lu after %lu", s, version, last[s]);
+        last[s] = version;
+        if ((reads & 3) == 0) check_extents();
+        reads++;
+    }
+    VERBOSE("# reader %ld: %lu reads\n", (long)arg, reads);
+    free(last);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Writer thread rewriting whole stripes of the temporary file with a new
+ * version.
+ */
+static void* writer(void* arg)
+{
+    unsigned seed = 1;
+    u64* buf = malloc(STRIPESIZE);
+    u64 versions[STRIPES] = { 0 };
+    u64 writes = 0;
+    while (!stop) {
+        u64 s = rand_r(&seed) % STRIPES;
+        fill_stripe(buf, s, ++versions[s]);
+        if (unfs_file_write(tfd, buf, s * STRIPESIZE, STRIPESIZE))
+            FATAL("write %s stripe %lu", TEMPNAME, s);
+        writes++;
+        if (!(writes & 15)) usleep(100);
+    }
+    VERBOSE("# writer: %lu writes\n", writes);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Resize thread growing and shrinking the regular file.
+ */
+static void* resizer(void* arg)
+{
+    unsigned seed = 2;
+    u64 resizes = 0;
+    while (!stop) {
+        u64 size = rand_r(&seed) % MAXSIZE;
+        if (unfs_file_resize(rfd, size, 0))
+            FATAL("resize %s to %#lx", FILENAME, size);
+        resizes++;
+        usleep(rand_r(&seed) % 1000);
+    }
+    VERBOSE("# resizer: %lu resizes\n", resizes);
+    return NULL;
+}
+
+/**
+ * Main program.
+ */
+int main(int argc, char** argv)
+{
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:s:v")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'n':
+            setenv("UNFS_NSID", optarg, 1);
+            break;
+        case 't':
+            thread_count = atoi(optarg);
+            if (thread_count <= 0)
+                FATAL("Thread count must be > 0");
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            if (seconds <= 0)
+                FATAL("Seconds must be > 0");
+            break;
+        default:
+            fprintf(stderr, usage, prog);
+            exit(1);
+        }
+    }
+
+    const char* device = getenv("UNFS_DEVICE");
+    if ((optind + 1) == argc) device = argv[optind++];
+    if (!device || optind != argc) {
+        fprintf(stderr, usage, prog);
+        exit(1);
+    }
+
+    LOG_OPEN();
+    printf("UNFS BIASED LOCK TEST BEGIN\n");
+    time_t tstart = time(0);
+
+    printf("UNFS format device %s\n", device);
+    if (unfs_format(device, prog, verbose))
+        FATAL("UNFS format failed");
+    setenv("UNFS_BRLOCK", "1", 1);
+    setenv("UNFS_TEMP", "/brlock/tmp*", 1);
+    printf("UNFS open device %s\n", device);
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+    if (unfs_create(fs, "/brlock", 1, 0))
+        FATAL("create /brlock");
+    tfd = unfs_file_open(fs, TEMPNAME, UNFS_OPEN_CREATE);
+    if (tfd.error)
+        FATAL("create %s (%s)", TEMPNAME, strerror(tfd.error));
+    rfd = unfs_file_open(fs, FILENAME, UNFS_OPEN_CREATE);
+    if (rfd.error)
+        FATAL("create %s (%s)", FILENAME, strerror(rfd.error));
+    u64* buf = malloc(STRIPESIZE);
+    u64 s;
+    for (s = 0; s < STRIPES; s++) {
+        fill_stripe(buf, s, 0);
+        if (unfs_file_write(tfd, buf, s * STRIPESIZE, STRIPESIZE))
+            FATAL("write %s", TEMPNAME);
+    }
+    free(buf);
+
+    printf("Read with %d threads against writes and resizes for %d secs\n",
+           thread_count, seconds);
+    pthread_t* pts = calloc(thread_count + 2, sizeof(pthread_t));
+    long i;
+    for (i = 0; i < thread_count; i++)
+        pthread_create(&pts[i], 0, reader, (void*)i);
+    pthread_create(&pts[thread_count], 0, writer, 0);
+    pthread_create(&pts[thread_count + 1], 0, resizer, 0);
+    sleep(seconds);
+    stop = 1;
+    for (i = 0; i < thread_count + 2; i++) pthread_join(pts[i], 0);
+    free(pts);
+
+    unfs_file_close(tfd);
+    unfs_file_close(rfd);
+    unfs_close(fs);
+    if (unfs_check(device)) return 1;
+
+    printf("UNFS BIASED LOCK TEST COMPLETE (%ld secs)\n", time(0) - tstart);
+    LOG_CLOSE();
+
+    return 0;
+}
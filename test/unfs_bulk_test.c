@@ -0,0 +1,343 @@
+/**
+ * Copyright (c) 2016-2017, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNFS bulk load test.
+ *
+ * Threads load files in bulk mode by appending unaligned chunks to their
+ * files round robin, then truncate, rename and remove some of them.  After
+ * bulk mode is turned off (with a file still open), the sizes, the data,
+ * the free page count and the extents are verified, and again after the
+ * filesystem is reopened, so the metadata deferred in bulk mode must all
+ * have been flushed and the preallocated pages released.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "unfs.h"
+#include "unfs_log.h"
+
+
+/// Usage
+static const char*  usage =
+"\nUsage: %s [OPTION]... DEVICE_NAME\n\
+          -v              turn on verbose\n\
+          -n NSID         NVMe namespace id (default 1)\n\
+          -t THREADS      number of loading threads (default 4)\n\
+          DEVICE_NAME     device name\n";
+
+/// Number of files per thread
+#define FILES       4
+
+/// Max file size
+#define MAXSIZE     (8 << 20)
+
+/// Max append length
+#define MAXLEN      (256 << 10)
+
+/// File state
+typedef struct {
+    u64             size;                   ///< expected size
+    int             renamed;                ///< renamed flag
+    int             removed;                ///< removed flag
+    unfs_extent_t*  ext;                    ///< extents after bulk mode
+    u32             extcount;               ///< extent count
+} file_t;
+
+static const char*  device;                 ///< device name
+static unfs_fs_t    fs;                     ///< filesystem handle
+static int          verbose = 0;            ///< verbose flag
+static int          thread_count = 4;       ///< thread count
+static file_t*      files;                  ///< files
+
+/// Print if verbose flag is set
+#define VERBOSE(fmt, arg...) if (verbose) printf(fmt, ##arg)
+
+
+/**
+ * Get a file name.
+ */
+static char* file_name(char* name, int f)
+{
+    sprintf(name, "/bulk/d%d/f%d%s", f / FILES, f, files[f].renamed ? ".renamed" : "");
+    return name;
+}
+
+/**
+ * Fill a buffer with the data pattern of a file range.
+ */
+static void fill_pattern(u8* buf, int f, u64 offset, u64 len)
+{
+    u64 i;
+    for (i = 0; i < len; i++) {
+        u64 off = offset + i;
+        buf[i] = (u8)(off ^ (off >> 9) ^ (f * 0x9d));
+    }
+}
+
+/**
+ * Loading thread appending to its files round robin, then truncating one,
+ * renaming one and removing one of them.
+ */
+static void* loader(void* arg)
+{
+    long t = (long)arg;
+    unsigned seed = t + 1;
+    unfs_fd_t fds[FILES];
+    u64 target[FILES];
+    u8* buf = malloc(MAXLEN);
+    char name[64], name2[64];
+    int i, f, active = FILES;
+
+    for (i = 0; i < FILES; i++) {
+        f = t * FILES + i;
+        fds[i] = unfs_file_open(fs, file_name(name, f), 0);
+        if (fds[i].error)
+            FATAL("open %s", name);
+        target[i] = MAXSIZE / 2 + rand_r(&seed) % (MAXSIZE / 2);
+    }
+    while (active) {
+        for (i = 0; i < FILES; i++) {
+            f = t * FILES + i;
+            u64 len = target[i] - files[f].size;
+            if (!len) continue;
+            u64 n = 1 + rand_r(&seed) % MAXLEN;
+            if (len > n) len = n;
+            fill_pattern(buf, f, files[f].size, len);
+            if (unfs_file_write(fds[i], buf, files[f].size, len))
+                FATAL("write %s off=%#lx len=%#lx", file_name(name, f), files[f].size, len);
+            files[f].size += len;
+            if (files[f].size == target[i]) active--;
+        }
+    }
+
+    // truncate the second file, rename the third and remove the last
+    f = t * FILES + 1;
+    files[f].size = files[f].size / 2 + 1;
+    if (unfs_file_resize(fds[1], files[f].size, 0))
+        FATAL("resize %s", file_name(name, f));
+    for (i = 0; i < FILES; i++) unfs_file_close(fds[i]);
+    f = t * FILES + 2;
+    file_name(name, f);
+    files[f].renamed = 1;
+    if (unfs_rename(fs, name, file_name(name2, f), 0))
+        FATAL("rename %s", name);
+    f = t * FILES + 3;
+    if (unfs_remove(fs, file_name(name, f), 0))
+        FATAL("remove %s", name);
+    files[f].removed = 1;
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Verify the files and their extents.
+ * @param   save        save the extents to compare later
+ * @return  the number of data and change table pages used by the files.
+ */
+static u64 verify_files(int save)
+{
+    u64 pages = 0;
+    int f;
+    u8* buf = malloc(MAXSIZE);
+    u8* exp = malloc(MAXSIZE);
+    char name[64];
+    for (f = 0; f < thread_count * FILES; f++) {
+        int isdir;
+        u64 size;
+        int exist = unfs_exist(fs, file_name(name, f), &isdir, &size);
+        if (files[f].removed) {
+            if (exist)
+                FATAL("%s not removed", name);
+            continue;
+        }
+        if (!exist || size != files[f].size)
+            FATAL("%s size %#lx expect %#lx", name, size, files[f].size);
+        unfs_fd_t fd = unfs_file_open(fs, name, 0);
+        if (fd.error)
+            FATAL("open %s", name);
+        if (unfs_file_read(fd, buf, 0, size))
+            FATAL("read %s", name);
+        fill_pattern(exp, f, 0, size);
+        if (memcmp(buf, exp, size))
+            FATAL("%s data mismatch", name);
+
+        // the extents must cover the file size with whole pages
+        unfs_extent_t* ext;
+        u32 count, i;
+        u64 gen, len = 0, pc = 0;
+        if (unfs_file_extents(fd, &ext, &count, &gen))
+            FATAL("extents %s", name);
+        for (i = 0; i < count; i++) {
+            if (ext[i].offset != len)
+                FATAL("%s extent %u offset %#lx", name, i, ext[i].offset);
+            len += ext[i].length;
+            pc += (ext[i].length + UNFS_PAGESIZE - 1) / UNFS_PAGESIZE;
+        }
+        if (len != size)
+            FATAL("%s extents length %#lx size %#lx", name, len, size);
+        u32 dscount;
+        unfs_file_stat(fd, 0, &dscount, 0);
+        VERBOSE("# %s size=%#lx extents=%u segments=%u\n", name, size, count, dscount);
+        if (save) {
+            files[f].ext = ext;
+            files[f].extcount = count;
+        } else {
+            if (count != files[f].extcount ||
+                memcmp(ext, files[f].ext, count * sizeof(unfs_extent_t)))
+                FATAL("%s extents changed after reopen", name);
+            free(ext);
+        }
+        pages += pc + 1;
+        unfs_file_close(fd);
+    }
+    free(exp);
+    free(buf);
+    return pages;
+}
+
+/**
+ * Main program.
+ */
+int main(int argc, char** argv)
+{
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:v")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'n':
+            setenv("UNFS_NSID", optarg, 1);
+            break;
+        case 't':
+            thread_count = atoi(optarg);
+            if (thread_count <= 0)
+                FATAL("Thread count must be > 0");
+            break;
+        default:
+            fprintf(stderr, usage, prog);
+            exit(1);
+        }
+    }
+
+    device = getenv("UNFS_DEVICE");
+    if ((optind + 1) == argc) device = argv[optind++];
+    if (!device || optind != argc) {
+        fprintf(stderr, usage, prog);
+        exit(1);
+    }
+
+    LOG_OPEN();
+    printf("UNFS BULK LOAD TEST BEGIN\n");
+    time_t tstart = time(0);
+
+    printf("UNFS format device %s\n", device);
+    if (unfs_format(device, prog, verbose))
+        FATAL("UNFS format failed");
+    unsetenv("UNFS_BULK");
+    printf("UNFS open device %s\n", device);
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+
+    // create the files before bulk mode and take the free page count
+    int f;
+    files = calloc(thread_count * FILES, sizeof(file_t));
+    char name[64];
+    for (f = 0; f < thread_count * FILES; f++) {
+        if (unfs_create(fs, file_name(name, f), 0, 1))
+            FATAL("create %s", name);
+    }
+    unfs_header_t* hp = malloc(sizeof(unfs_header_t));
+    unfs_stat(fs, hp, 0);
+    u64 pagefree = hp->pagefree;
+
+    printf("Bulk load %d files with %d threads\n", thread_count * FILES, thread_count);
+    if (unfs_bulk(fs, 1))
+        FATAL("bulk on");
+    pthread_t* pts = calloc(thread_count, sizeof(pthread_t));
+    long i;
+    for (i = 0; i < thread_count; i++)
+        pthread_create(&pts[i], 0, loader, (void*)i);
+    for (i = 0; i < thread_count; i++) pthread_join(pts[i], 0);
+    free(pts);
+
+    // turn bulk mode off with a file still open and growing
+    unfs_fd_t fd = unfs_file_open(fs, file_name(name, 0), 0);
+    if (fd.error)
+        FATAL("open %s", name);
+    u8* buf = malloc(MAXLEN);
+    fill_pattern(buf, 0, files[0].size, MAXLEN);
+    if (unfs_file_write(fd, buf, files[0].size, MAXLEN))
+        FATAL("write %s", name);
+    files[0].size += MAXLEN;
+    free(buf);
+    if (unfs_bulk(fs, 0))
+        FATAL("bulk off");
+    unfs_file_close(fd);
+
+    printf("Verify files after bulk mode\n");
+    u64 pages = verify_files(1);
+    unfs_stat(fs, hp, 0);
+    if (hp->pagefree != pagefree - pages)
+        FATAL("free pages %#lx expect %#lx", hp->pagefree, pagefree - pages);
+    unfs_close(fs);
+
+    printf("Verify files after reopen\n");
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+    if (verify_files(0) != pages)
+        FATAL("file pages changed after reopen");
+    unfs_stat(fs, hp, 0);
+    if (hp->pagefree != pagefree - pages)
+        FATAL("free pages %#lx expect %#lx after reopen", hp->pagefree, pagefree - pages);
+    unfs_close(fs);
+    free(hp);
+    for (f = 0; f < thread_count * FILES; f++) free(files[f].ext);
+    free(files);
+    if (unfs_check(device)) return 1;
+
+    printf("UNFS BULK LOAD TEST COMPLETE (%ld secs)\n", time(0) - tstart);
+    LOG_CLOSE();
+
+    return 0;
+}
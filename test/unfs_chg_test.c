@@ -0,0 +1,331 @@
+/**
+ * Copyright (c) 2016-2017, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNFS change generation test.
+ *
+ * A file is written across several change generations, and the changed
+ * ranges returned by unfs_file_changes are verified against each starting
+ * generation, also after the filesystem is reopened.  A process that
+ * overwrites a chunk in place then crashes (exits without closing) must
+ * leave that chunk reported as changed, and a generation started within a
+ * transaction or in bulk mode by a crashing process must not be reused.
+ * When the device has room for a file beyond the change table (about 2GB),
+ * the file is grown until the chunk size doubles and the merged chunk
+ * generations are verified.  Lastly, the file is removed and the free page
+ * count must return to what it was before the file was written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "unfs.h"
+#include "unfs_log.h"
+
+
+/// Usage
+static const char*  usage =
+"\nUsage: %s [OPTION]... DEVICE_NAME\n\
+          -v              turn on verbose\n\
+          DEVICE_NAME     device name\n";
+
+static const char*  device;                 ///< device name
+static unfs_fs_t    fs;                     ///< filesystem handle
+static int          verbose = 0;            ///< verbose flag
+
+/// Megabyte
+#define MB          (1UL << 20)
+
+/// Test file name
+#define FILENAME    "/chg/a"
+
+/// File size grown beyond the change table (at the chunk size of 2MB)
+#define BIGSIZE     (1536 * MB)
+
+/// Print if verbose flag is set
+#define VERBOSE(fmt, arg...) if (verbose) printf(fmt, ##arg)
+
+
+/**
+ * Open the filesystem.
+ */
+static void fs_open()
+{
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+}
+
+/**
+ * Open the test file.
+ */
+static unfs_fd_t file_open()
+{
+    unfs_fd_t fd = unfs_file_open(fs, FILENAME, 0);
+    if (fd.error)
+        FATAL("open %s (%s)", FILENAME, strerror(fd.error));
+    return fd;
+}
+
+/**
+ * Write a byte pattern to a file range.
+ */
+static void write_file(unfs_fd_t fd, u64 offset, u64 len, int seed)
+{
+    u8* buf = malloc(len);
+    u64 i;
+    for (i = 0; i < len; i++) buf[i] = seed + i * 7;
+    if (unfs_file_write(fd, buf, offset, len))
+        FATAL("write %s off=%#lx len=%#lx", FILENAME, offset, len);
+    free(buf);
+}
+
+/**
+ * Start a new change generation.
+ * @return  the generation ended.
+ */
+static u64 change_gen()
+{
+    u64 gen = unfs_change_gen(fs);
+    if (!gen)
+        FATAL("change gen failed");
+    VERBOSE("# generation %#lx ended\n", gen);
+    return gen;
+}
+
+/**
+ * Verify the file ranges changed after a generation.
+ * @param   fd          file descriptor
+ * @param   gen         change generation
+ * @param   exp         expected offset and length pairs in MB
+ * @param   n           number of expected ranges
+ */
+static void verify_changes(unfs_fd_t fd, u64 gen, const u64* exp, u32 n)
+{
+    unfs_extent_t* ext;
+    u32 count, i;
+    if (unfs_file_changes(fd, gen, &ext, &count))
+        FATAL("%s changes failed", FILENAME);
+    for (i = 0; i < count; i++)
+        VERBOSE("# gen %#lx changed %#lx %#lx\n", gen, ext[i].offset, ext[i].length);
+    if (count != n)
+        FATAL("%s gen %#lx has %u changed ranges expect %u", FILENAME, gen, count, n);
+    for (i = 0; i < n; i++) {
+        if (ext[i].offset != exp[2 * i] * MB || ext[i].length != exp[2 * i + 1] * MB)
+            FATAL("%s gen %#lx range %u (%#lx %#lx) expect (%#lx %#lx)",
+                  FILENAME, gen, i, ext[i].offset, ext[i].length,
+                  exp[2 * i] * MB, exp[2 * i + 1] * MB);
+    }
+    free(ext);
+}
+
+/**
+ * Run a crashing process that starts a generation within a transaction or
+ * in bulk mode, and verify the next generation after it.
+ * @param   bulk        bulk mode (else transaction) flag
+ */
+static void crash_gen(int bulk)
+{
+    int pfd[2];
+    if (pipe(pfd))
+        FATAL("pipe (%s)", strerror(errno));
+    pid_t pid = fork();
+    if (pid == 0) {
+        fs_open();
+        if (bulk ? unfs_bulk(fs, 1) : unfs_txn_begin(fs))
+            FATAL("%s begin", bulk ? "bulk" : "txn");
+        u64 gen = change_gen();
+        if (write(pfd[1], &gen, sizeof(gen)) != sizeof(gen))
+            FATAL("pipe write");
+        _exit(0);
+    }
+    u64 gen = 0;
+    int status;
+    if (pid < 0 || read(pfd[0], &gen, sizeof(gen)) != sizeof(gen) ||
+        waitpid(pid, &status, 0) != pid || status)
+        FATAL("%s process failed", bulk ? "bulk" : "txn");
+    close(pfd[0]);
+    close(pfd[1]);
+
+    fs_open();
+    u64 next = change_gen();
+    if (next != gen + 1)
+        FATAL("generation %#lx after %s crash expect %#lx",
+              next, bulk ? "bulk" : "txn", gen + 1);
+    unfs_close(fs);
+}
+
+/**
+ * Main program.
+ */
+int main(int argc, char** argv)
+{
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, usage, prog);
+            exit(1);
+        }
+    }
+
+    device = getenv("UNFS_DEVICE");
+    if ((optind + 1) == argc) device = argv[optind++];
+    if (!device || optind != argc) {
+        fprintf(stderr, usage, prog);
+        exit(1);
+    }
+
+    LOG_OPEN();
+    printf("UNFS CHANGE GENERATION TEST BEGIN\n");
+    time_t tstart = time(0);
+
+    printf("UNFS format device %s\n", device);
+    if (unfs_format(device, prog, verbose))
+        FATAL("UNFS format failed");
+    fs_open();
+    if (unfs_create(fs, "/chg", 1, 0))
+        FATAL("create /chg");
+
+    // Write a new file in one generation (after noting the free pages
+    // with its entry, which stays allocated on the deleted stack)
+    printf("Write a file and start a new generation\n");
+    if (unfs_create(fs, FILENAME, 0, 0))
+        FATAL("create %s", FILENAME);
+    unfs_header_t* hp = malloc(sizeof(unfs_header_t));
+    unfs_stat(fs, hp, 0);
+    u64 pagefree = hp->pagefree;
+    unfs_fd_t fd = file_open();
+    write_file(fd, 0, 8 * MB, 1);
+    u64 gen1 = change_gen();
+    verify_changes(fd, 0, (u64[]){ 0, 8 }, 1);
+    verify_changes(fd, gen1, NULL, 0);
+
+    // Overwrite parts of chunks 3, 5 and 6 in the next generation
+    printf("Overwrite chunks and start a new generation\n");
+    write_file(fd, 3 * MB + 5, 100, 2);
+    write_file(fd, 6 * MB - 1, 10, 3);
+    verify_changes(fd, gen1, (u64[]){ 3, 1, 5, 2 }, 2);
+    u64 gen2 = change_gen();
+    verify_changes(fd, gen2, NULL, 0);
+    verify_changes(fd, gen1, (u64[]){ 3, 1, 5, 2 }, 2);
+    verify_changes(fd, gen1 - 1, (u64[]){ 0, 8 }, 1);
+    unfs_file_close(fd);
+    unfs_close(fs);
+
+    // The table and the generation are persisted
+    printf("Reopen and verify the changes\n");
+    fs_open();
+    u64 gen3 = change_gen();
+    if (gen3 != gen2 + 1)
+        FATAL("generation %#lx after reopen expect %#lx", gen3, gen2 + 1);
+    fd = file_open();
+    verify_changes(fd, gen1, (u64[]){ 3, 1, 5, 2 }, 2);
+    verify_changes(fd, gen2, NULL, 0);
+    unfs_file_close(fd);
+    unfs_close(fs);
+
+    // Overwrite chunk 7 in place and crash without closing the file
+    printf("Overwrite a chunk in place and crash\n");
+    pid_t pid = fork();
+    if (pid == 0) {
+        fs_open();
+        fd = file_open();
+        write_file(fd, 7 * MB + 1, 1, 4);
+        _exit(0);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || status)
+        FATAL("crash process failed");
+    fs_open();
+    fd = file_open();
+    verify_changes(fd, gen3, (u64[]){ 7, 1 }, 1);
+    verify_changes(fd, gen1, (u64[]){ 3, 1, 5, 3 }, 2);
+    unfs_file_close(fd);
+    unfs_close(fs);
+
+    // A generation started within a transaction or bulk mode is persisted
+    printf("Start a generation within a transaction and crash\n");
+    crash_gen(0);
+    printf("Start a generation in bulk mode and crash\n");
+    crash_gen(1);
+
+    // Grow the file beyond the table so the chunk size doubles
+    fs_open();
+    unfs_stat(fs, hp, 0);
+    if (hp->pagefree * UNFS_PAGESIZE > BIGSIZE + 64 * MB) {
+        printf("Grow the file to %luMB and merge the chunks\n", BIGSIZE / MB);
+        fd = file_open();
+        u64 gen4 = change_gen();
+        if (unfs_file_resize(fd, BIGSIZE, 0))
+            FATAL("resize %s", FILENAME);
+        verify_changes(fd, gen4, (u64[]){ 8, BIGSIZE / MB - 8 }, 1);
+        verify_changes(fd, gen3, (u64[]){ 6, BIGSIZE / MB - 6 }, 1);
+        verify_changes(fd, gen1, (u64[]){ 2, BIGSIZE / MB - 2 }, 1);
+        unfs_file_close(fd);
+        unfs_close(fs);
+        fs_open();
+        fd = file_open();
+        verify_changes(fd, gen3, (u64[]){ 6, BIGSIZE / MB - 6 }, 1);
+        verify_changes(fd, gen4, (u64[]){ 8, BIGSIZE / MB - 8 }, 1);
+        unfs_file_close(fd);
+    } else {
+        printf("Skip growing the file beyond the table (device too small)\n");
+    }
+
+    // Removing the file frees its table page
+    printf("Remove the file\n");
+    if (unfs_remove(fs, FILENAME, 0))
+        FATAL("remove %s", FILENAME);
+    unfs_stat(fs, hp, 0);
+    if (hp->pagefree != pagefree)
+        FATAL("free pages %#lx expect %#lx", hp->pagefree, pagefree);
+    unfs_close(fs);
+    free(hp);
+    if (unfs_check(device)) return 1;
+
+    printf("UNFS CHANGE GENERATION TEST COMPLETE (%ld secs)\n", time(0) - tstart);
+    LOG_CLOSE();
+
+    return 0;
+}
@@ -48,6 +48,8 @@ static const char*  usage =
 "\nUsage: %s [OPTION]... DEVICE_NAME\n\
           -n NSID       NVMe namespace id (default 1)\n\
           -l LABEL      label\n\
+          -d            discard the whole device first\n\
+          -t THREADS    bitmap write threads (default 8)\n\
           -q            quiet do not print out status\n\
           DEVICE_NAME   device name\n";
 
@@ -64,7 +66,7 @@ int main(int argc, char** argv)
     const char* label = "User Space Nameless Filesystem";
     int opt;
 
-    while ((opt = getopt(argc, argv, "n:l:q")) != -1) {
+    while ((opt = getopt(argc, argv, "n:l:dt:q")) != -1) {
         switch (opt) {
         case 'n':
             setenv("UNFS_NSID", optarg, 1);
@@ -72,6 +74,12 @@ int main(int argc, char** argv)
         case 'l':
             label = optarg;
             break;
+        case 'd':
+            setenv("UNFS_FORMAT_DISCARD", "1", 1);
+            break;
+        case 't':
+            setenv("UNFS_FORMAT_THREADS", optarg, 1);
+            break;
         case 'q':
             quiet = 1;
             break;
@@ -0,0 +1,264 @@
+/**
+ * Copyright (c) 2016-2017, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNFS random read/write test.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+
+#include "unfs.h"
+#include "unfs_log.h"
+
+
+/// Usage
+static const char*  usage =
+"\nUsage: %s [OPTION]... DEVICE_NAME\n\
+          -v              turn on verbose\n\
+          -n NSID         NVMe namespace id (default 1)\n\
+          -t THREADCOUNT  number of threads (default 16)\n\
+          -s FILESIZE     file size per thread in KB (default 4096)\n\
+          -i IOCOUNT      number of IOs per thread (default 10000)\n\
+          DEVICE_NAME     device name\n";
+
+static unfs_fs_t    fs;                     ///< filesystem handle
+static int          verbose = 0;            ///< verbose flag
+static int          thread_count = 16;      ///< thread count
+static u64          file_size = 4096 << 10; ///< file size
+static int          io_count = 10000;       ///< IO count per thread
+static u8**         shadows;                ///< expected file contents
+static sem_t        sm_ready;               ///< thread ready semaphore
+static sem_t        sm_run;                 ///< thread run test semaphore
+
+/// Max IO size
+#define MAXIOSIZE   (256 << 10)
+
+/// Print if verbose flag is set
+#define VERBOSE(fmt, arg...) if (verbose) printf(fmt, ##arg)
+
+
+/**
+ * Verify the whole file content against its shadow copy.
+ */
+static void verify_file(const char* filename, u8* shadow)
+{
+    unfs_fd_t fd = unfs_file_open(fs, filename, 0);
+    if (fd.error)
+        FATAL("open %s (%s)", filename, strerror(fd.error));
+    u64 size = 0;
+    unfs_file_stat(fd, &size, 0, 0);
+    if (size != file_size)
+        FATAL("%s size %#lx expect %#lx", filename, size, file_size);
+
+    u8* buf = malloc(MAXIOSIZE);
+    u64 offset;
+    for (offset = 0; offset < file_size; offset += MAXIOSIZE) {
+        u64 len = file_size - offset;
+        if (len > MAXIOSIZE) len = MAXIOSIZE;
+        if (unfs_file_read(fd, buf, offset, len))
+            FATAL("read %s off=%#lx len=%#lx", filename, offset, len);
+        if (memcmp(buf, shadow + offset, len))
+            FATAL("%s data mismatch off=%#lx len=%#lx", filename, offset, len);
+    }
+    free(buf);
+    unfs_file_close(fd);
+}
+
+/**
+ * Thread to perform random read/write test.
+ */
+static void* test_thread(void* arg)
+{
+    long tid = (long)arg;
+    unsigned int seed = tid;
+    u8* shadow = shadows[tid - 1];
+    u8* buf = malloc(MAXIOSIZE);
+
+    // send ready and wait for signal to run test
+    sem_post(&sm_ready);
+    sem_wait(&sm_run);
+
+    // create the test file
+    char filename[64];
+    sprintf(filename, "/rand%ld", tid);
+    printf("Create and test %s\n", filename);
+    unfs_fd_t fd = unfs_file_open(fs, filename, UNFS_OPEN_CREATE);
+    if (fd.error)
+        FATAL("create %s (%s)", filename, strerror(fd.error));
+    int fill = 0;
+    if (unfs_file_resize(fd, file_size, &fill))
+        FATAL("resize %s failed", filename);
+    memset(shadow, 0, file_size);
+
+    // mix of page aligned and unaligned random reads and writes
+    int i;
+    for (i = 0; i < io_count; i++) {
+        u64 len, offset;
+        if (rand_r(&seed) & 1) {
+            len = ((rand_r(&seed) % (MAXIOSIZE >> 12)) + 1) << 12;
+            if (len > file_size) len = file_size;
+            offset = (rand_r(&seed) % ((file_size - len + 1) >> 12)) << 12;
+        } else {
+            len = (rand_r(&seed) % MAXIOSIZE) + 1;
+            if (len > file_size) len = file_size;
+            offset = rand_r(&seed) % (file_size - len + 1);
+        }
+
+        if ((rand_r(&seed) % 3) == 0) {
+            VERBOSE("# %s write off=%#lx len=%#lx\n", filename, offset, len);
+            memset(buf, rand_r(&seed), len);
+            if (unfs_file_write(fd, buf, offset, len))
+                FATAL("write %s off=%#lx len=%#lx", filename, offset, len);
+            memcpy(shadow + offset, buf, len);
+        } else {
+            VERBOSE("# %s read off=%#lx len=%#lx\n", filename, offset, len);
+            if (unfs_file_read(fd, buf, offset, len))
+                FATAL("read %s off=%#lx len=%#lx", filename, offset, len);
+            if (memcmp(buf, shadow + offset, len))
+                FATAL("%s data mismatch off=%#lx len=%#lx", filename, offset, len);
+        }
+    }
+    unfs_file_close(fd);
+    free(buf);
+
+    verify_file(filename, shadow);
+    return 0;
+}
+
+/**
+ * Main program.
+ */
+int main(int argc, char** argv)
+{
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "n:t:s:i:v")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'n':
+            setenv("UNFS_NSID", optarg, 1);
+            break;
+        case 't':
+            thread_count = atoi(optarg);
+            if (thread_count <= 0)
+                FATAL("Thread count must be > 0");
+            break;
+        case 's':
+            file_size = strtoull(optarg, 0, 0) << 10;
+            if (file_size == 0)
+                FATAL("File size must be > 0");
+            break;
+        case 'i':
+            io_count = atoi(optarg);
+            if (io_count <= 0)
+                FATAL("IO count must be > 0");
+            break;
+        default:
+            fprintf(stderr, usage, prog);
+            exit(1);
+        }
+    }
+
+    const char* device = getenv("UNFS_DEVICE");
+    if ((optind + 1) == argc) device = argv[optind++];
+    if (!device || optind != argc) {
+        fprintf(stderr, usage, prog);
+        exit(1);
+    }
+
+    LOG_OPEN();
+    printf("UNFS RANDOM READ-WRITE TEST BEGIN\n");
+
+    // Format new UNFS filesystem
+    printf("UNFS format device %s\n", device);
+    if (unfs_format(device, prog, verbose))
+        FATAL("UNFS format failed");
+
+    // Open to access UNFS filesystem
+    printf("UNFS open device %s\n", device);
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+
+    // Spawn test threads
+    printf("Test %d files %lu KB %d IOs per file\n",
+                                    thread_count, file_size >> 10, io_count);
+    time_t tstart = time(0);
+    shadows = calloc(thread_count, sizeof(u8*));
+    for (i = 0; i < thread_count; i++) shadows[i] = malloc(file_size);
+    sem_init(&sm_ready, 0, 0);
+    sem_init(&sm_run, 0, 0);
+    pthread_t* pts = calloc(thread_count, sizeof(pthread_t));
+    for (i = 0; i < thread_count; i++) {
+        pthread_create(&pts[i], 0, test_thread, (void*)(long)(i + 1));
+        sem_wait(&sm_ready);
+    }
+    for (i = 0; i < thread_count; i++) sem_post(&sm_run);
+    for (i = 0; i < thread_count; i++) pthread_join(pts[i], 0);
+    free(pts);
+    sem_destroy(&sm_ready);
+    sem_destroy(&sm_run);
+    unfs_close(fs);
+
+    // Reopen filesystem and verify files
+    printf("UNFS reopen device %s\n", device);
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+    for (i = 1; i <= thread_count; i++) {
+        char filename[64];
+        sprintf(filename, "/rand%d", i);
+        printf("Verify %s\n", filename);
+        verify_file(filename, shadows[i - 1]);
+        free(shadows[i - 1]);
+    }
+    free(shadows);
+    unfs_close(fs);
+
+    if (unfs_check(device)) return 1;
+
+    printf("UNFS RANDOM READ-WRITE TEST COMPLETE (%ld secs)\n", time(0) - tstart);
+    LOG_CLOSE();
+
+    return 0;
+}
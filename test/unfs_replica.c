@@ -0,0 +1,164 @@
+/**
+ * Copyright (c) 2016-2017, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/**
+ * @file
+ * @brief Receive an UNFS replication stream onto a replica device.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#include "unfs.h"
+
+
+/// Usage
+static const char*  usage =
+"\nUsage: %s [OPTION]... DEVICE_NAME\n\
+          -p PORT       listening port (default 7474)\n\
+          -q            quiet do not print out status\n\
+          DEVICE_NAME   replica device or file name\n";
+
+
+/**
+ * Apply a replication stream from a connected primary.
+ * @param   sock        connected socket
+ * @param   fd          replica file descriptor
+ * @param   quiet       quiet flag
+ * @return  0 if ok else error code.
+ */
+static int unfs_replica_serve(int sock, int fd, int quiet)
+{
+    u64 bufsize = 0, bytes = 0, syncs = 0;
+    void* buf = NULL;
+    unfs_repl_rec_t rec;
+    int err;
+
+    while ((err = unfs_repl_xfer(sock, &rec, sizeof(rec), 0)) == 0) {
+        if (rec.type == UNFS_REPL_WRITE) {
+            if (rec.len > bufsize) {
+                free(buf);
+                bufsize = rec.len;
+                if (!(buf = malloc(bufsize))) errx(1, "malloc %#lx", bufsize);
+            }
+            err = unfs_repl_xfer(sock, buf, rec.len, 0);
+            if (err) break;
+            bytes += rec.len;
+        }
+        err = unfs_repl_apply(fd, &rec, buf);
+        if (err) break;
+
+        // send back the replica header to let the primary decide to copy
+        if (rec.type == UNFS_REPL_OPEN) {
+            u64 len = UNFS_HEADPC * UNFS_PAGESIZE;
+            void* hp = calloc(1, len);
+            if (pread(fd, hp, len, 0) < 0) err = errno;
+            if (!err) err = unfs_repl_xfer(sock, hp, len, 1);
+            free(hp);
+            if (err) break;
+        } else if (rec.type == UNFS_REPL_SYNC) {
+            syncs++;
+        }
+    }
+    free(buf);
+    if (!quiet)
+        printf("Replicated:  %#lx bytes %lu syncs (%s)\n",
+               bytes, syncs, err == EPIPE ? "closed" : strerror(err));
+    return err == EPIPE ? 0 : err;
+}
+
+/**
+ * Main program.
+ */
+int main(int argc, char** argv)
+{
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    int port = 7474;
+    int quiet = 0;
+    int opt;
+
+    setlinebuf(stdout);
+
+    while ((opt = getopt(argc, argv, "p:q")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        default:
+            errx(1, usage, prog);
+        }
+    }
+    if (optind != argc - 1 || port <= 0) errx(1, usage, prog);
+    const char* device = argv[optind];
+
+    int fd = open(device, O_RDWR|O_CREAT, 0644);
+    if (fd < 0) err(1, "%s", device);
+
+    int lsock = socket(AF_INET6, SOCK_STREAM, 0);
+    if (lsock < 0) err(1, "socket");
+    int on = 1;
+    setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in6 addr = { .sin6_family = AF_INET6,
+                                 .sin6_port = htons(port),
+                                 .sin6_addr = IN6ADDR_ANY_INIT };
+    if (bind(lsock, (struct sockaddr*)&addr, sizeof(addr)) ||
+        listen(lsock, 1)) err(1, "port %d", port);
+
+    // one primary at a time, each connection resumes on the same replica
+    for (;;) {
+        if (!quiet) printf("UNFS replica %s listening on port %d\n", device, port);
+        int sock = accept(lsock, NULL, NULL);
+        if (sock < 0) {
+            if (errno == EINTR) continue;
+            err(1, "accept");
+        }
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        unfs_replica_serve(sock, fd, quiet);
+        close(sock);
+        fdatasync(fd);
+    }
+    return 0;
+}
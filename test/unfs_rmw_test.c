@@ -302,7 +302,8 @@ int main(int argc, char** argv)
     u64 fdnextpage = hdr.pagecount - (fdcount + 1) * UNFS_FILEPC;
     if (hdr.fdnextpage != fdnextpage)
         FATAL("FD next %#lx expect %#lx", hdr.fdcount, fdnextpage);
-    u64 pagefree = hdr.pagecount - (fdcount * UNFS_FILEPC + thread_count);
+    // each file has a data page and a change table page
+    u64 pagefree = hdr.pagecount - (fdcount * UNFS_FILEPC + thread_count * 2);
     if (hdr.pagefree != pagefree)
         FATAL("expect %#lx free pages", pagefree);
 
@@ -0,0 +1,278 @@
+/**
+ * Copyright (c) 2016-2017, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNFS lockless read test.
+ *
+ * Reader threads read and verify random ranges of a file with
+ * unfs_file_read, which maps the file offset to pages without the file
+ * lock, while a resize thread repeatedly grows and shrinks the file past a
+ * fixed prefix and an atomic writer rewrites random ranges of the prefix
+ * with the same data, so the prefix pages are relocated and the released
+ * pages are reused (and filled) by the next growth.  A read mapped through
+ * a stale segment map would then return the fill pattern.  The file size
+ * returned by unfs_file_stat is checked as well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "unfs.h"
+#include "unfs_log.h"
+
+
+/// Usage
+static const char*  usage =
+"\nUsage: %s [OPTION]... DEVICE_NAME\n\
+          -v              turn on verbose\n\
+          -n NSID         NVMe namespace id (default 1)\n\
+          -t THREADS      number of reader threads (default 8)\n\
+          -s SECONDS      seconds to run (default 5)\n\
+          DEVICE_NAME     device name\n";
+
+static unfs_fs_t    fs;                     ///< filesystem handle
+static unfs_fd_t    fd;                     ///< test file
+static int          verbose = 0;            ///< verbose flag
+static int          thread_count = 8;       ///< reader thread count
+static int          seconds = 5;            ///< seconds to run
+static volatile int stop;                   ///< stop threads flag
+
+/// Test file name
+#define FILENAME    "/seq"
+
+/// Size of the prefix written with the pattern
+#define BASESIZE    (4 << 20)
+
+/// Size of the filled tail that is never truncated
+#define TAILSIZE    (64 << 10)
+
+/// Max size the file grows to
+#define MAXSIZE     (12 << 20)
+
+/// Max read or write length
+#define MAXLEN      (256 << 10)
+
+/// Tail fill byte
+#define FILL        0x5a
+
+/// Print if verbose flag is set
+#define VERBOSE(fmt, arg...) if (verbose) printf(fmt, ##arg)
+
+
+/**
+ * Fill a buffer with the pattern of a prefix range (8-byte aligned).
+ */
+static void fill_pattern(u64* buf, u64 offset, u64 len)
+{
+    u64 i;
+    for (i = 0; i < len / sizeof(u64); i++)
+        buf[i] = 0x5e00000000000000UL | ((offset >> 3) + i);
+}
+
+/**
+ * Reader thread verifying random ranges of the prefix and tail.
+ */
+static void* reader(void* arg)
+{
+    unsigned seed = (long)arg;
+    u64* buf = malloc(MAXLEN);
+    u64* exp = malloc(MAXLEN);
+    u64 reads = 0;
+    while (!stop) {
+        u64 size = 0;
+        if (unfs_file_stat(fd, &size, 0, 0))
+            FATAL("stat %s", FILENAME);
+        if (size < BASESIZE + TAILSIZE || size > MAXSIZE)
+            FATAL("%s size %#lx out of range", FILENAME, size);
+
+        u64 len = ((rand_r(&seed) % (MAXLEN / 8)) + 1) * 8;
+        u64 off = (rand_r(&seed) % ((BASESIZE + TAILSIZE - len) / 8)) * 8;
+        int err = unfs_file_read(fd, buf, off, len);
+        if (err)
+            FATAL("read off=%#lx len=%#lx (%s)", off, len, strerror(err));
+        u64 plen = off < BASESIZE ? BASESIZE - off : 0;
+        if (plen > len) plen = len;
+        fill_pattern(exp, off, plen);
+        memset((u8*)exp + plen, FILL, len - plen);
+        if (memcmp(buf, exp, len)) {
+            u64 i;
+            for (i = 0; buf[i] == exp[i]; i++);
+            FATAL("off=%#lx len=%#lx mismatch at %#lx (%#lx expect %#lx)",
+                  off, len, off + i * 8, buf[i], exp[i]);
+        }
+        reads++;
+    }
+    VERBOSE("# reader %ld: %lu reads\n", (long)arg, reads);
+    free(exp);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Resize thread growing the file with the fill pattern and shrinking it
+ * back to the tail.
+ */
+static void* resizer(void* arg)
+{
+    unsigned seed = 1;
+    int fill = FILL;
+    u64 resizes = 0;
+    while (!stop) {
+        u64 size = BASESIZE + TAILSIZE + 1 +
+                   rand_r(&seed) % (MAXSIZE - BASESIZE - TAILSIZE);
+        if (unfs_file_resize(fd, size, &fill))
+            FATAL("resize %s to %#lx", FILENAME, size);
+        if (unfs_file_resize(fd, BASESIZE + TAILSIZE, 0))
+            FATAL("resize %s to %#x", FILENAME, BASESIZE + TAILSIZE);
+        resizes++;
+    }
+    VERBOSE("# resizer: %lu resizes\n", resizes);
+    return NULL;
+}
+
+/**
+ * Atomic writer thread rewriting random ranges of the prefix with the
+ * same data, which relocates the pages.
+ */
+static void* writer(void* arg)
+{
+    unsigned seed = 2;
+    u64* buf = malloc(MAXLEN);
+    u64 writes = 0;
+    while (!stop) {
+        u64 len = ((rand_r(&seed) % (MAXLEN / 8)) + 1) * 8;
+        u64 off = (rand_r(&seed) % ((BASESIZE - len) / 8)) * 8;
+        fill_pattern(buf, off, len);
+        int err = unfs_file_write_atomic(fd, buf, off, len);
+        if (err)
+            FATAL("write off=%#lx len=%#lx (%s)", off, len, strerror(err));
+        writes++;
+    }
+    VERBOSE("# writer: %lu writes\n", writes);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Main program.
+ */
+int main(int argc, char** argv)
+{
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:s:v")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'n':
+            setenv("UNFS_NSID", optarg, 1);
+            break;
+        case 't':
+            thread_count = atoi(optarg);
+            if (thread_count <= 0)
+                FATAL("Thread count must be > 0");
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            if (seconds <= 0)
+                FATAL("Seconds must be > 0");
+            break;
+        default:
+            fprintf(stderr, usage, prog);
+            exit(1);
+        }
+    }
+
+    const char* device = getenv("UNFS_DEVICE");
+    if ((optind + 1) == argc) device = argv[optind++];
+    if (!device || optind != argc) {
+        fprintf(stderr, usage, prog);
+        exit(1);
+    }
+
+    LOG_OPEN();
+    printf("UNFS LOCKLESS READ TEST BEGIN\n");
+    time_t tstart = time(0);
+
+    printf("UNFS format device %s\n", device);
+    if (unfs_format(device, prog, verbose))
+        FATAL("UNFS format failed");
+    printf("UNFS open device %s\n", device);
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+    fd = unfs_file_open(fs, FILENAME, UNFS_OPEN_CREATE);
+    if (fd.error)
+        FATAL("create %s (%s)", FILENAME, strerror(fd.error));
+
+    // write the prefix in several segments and fill the tail
+    u64* buf = malloc(MAXLEN);
+    u64 off;
+    for (off = 0; off < BASESIZE; off += MAXLEN) {
+        fill_pattern(buf, off, MAXLEN);
+        if (unfs_file_write(fd, buf, off, MAXLEN))
+            FATAL("write %s off=%#lx", FILENAME, off);
+    }
+    int fill = FILL;
+    if (unfs_file_resize(fd, BASESIZE + TAILSIZE, &fill))
+        FATAL("resize %s", FILENAME);
+    free(buf);
+
+    printf("Read with %d threads against resize and atomic writes for %d secs\n",
+           thread_count, seconds);
+    pthread_t* pts = calloc(thread_count + 2, sizeof(pthread_t));
+    long i;
+    for (i = 0; i < thread_count; i++)
+        pthread_create(&pts[i], 0, reader, (void*)i);
+    pthread_create(&pts[thread_count], 0, resizer, 0);
+    pthread_create(&pts[thread_count + 1], 0, writer, 0);
+    sleep(seconds);
+    stop = 1;
+    for (i = 0; i < thread_count + 2; i++) pthread_join(pts[i], 0);
+    free(pts);
+
+    unfs_file_close(fd);
+    unfs_close(fs);
+    if (unfs_check(device)) return 1;
+
+    printf("UNFS LOCKLESS READ TEST COMPLETE (%ld secs)\n", time(0) - tstart);
+    LOG_CLOSE();
+
+    return 0;
+}
@@ -0,0 +1,455 @@
+/**
+ * Copyright (c) 2016-2017, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNFS shard test.
+ *
+ * The namespace is partitioned into shards (UNFS_SHARDS, default 8) by
+ * top-level directory.  Each thread owns a top-level directory, where it
+ * concurrently creates, writes, renames (within the shard and to another
+ * top-level directory of its own) and removes files.  Each thread also
+ * creates and removes a top-level file and a top-level directory chain,
+ * which update the root directory.  Another thread lists the root
+ * directory and the whole device.  Each thread keeps a shadow of its
+ * files, which is verified after the run, and again after the device is
+ * reopened with a different number of shards.  Then all the threads create
+ * top-level files at once in a burst, and the root directory is checked.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "unfs.h"
+#include "unfs_log.h"
+
+
+/// Usage
+static const char*  usage =
+"\nUsage: %s [OPTION]... DEVICE_NAME\n\
+          -v              turn on verbose\n\
+          -n NSID         NVMe namespace id (default 1)\n\
+          -t THREADS      number of threads (default 8)\n\
+          -s SECONDS      seconds to run (default 5)\n\
+          DEVICE_NAME     device name\n";
+
+/// Number of file slots per thread
+#define SLOTS       32
+
+/// Number of top-level files created by each thread in a burst
+#define BURST       256
+
+/// File slot locations
+enum { LOC_A, LOC_B, LOC_X, LOCS };
+
+/// File slot state
+typedef struct {
+    int             loc;                    ///< file location
+    u64             serial;                 ///< content serial (0 if no file)
+} slot_t;
+
+/// Thread state
+typedef struct {
+    int             id;                     ///< thread index
+    slot_t          slots[SLOTS];           ///< file slots
+    int             top;                    ///< top-level file exists
+    int             chain;                  ///< top-level directory chain exists
+    u64             ops;                    ///< operation count
+} thread_t;
+
+static const char*  device;                 ///< device name
+static unfs_fs_t    fs;                     ///< filesystem handle
+static int          verbose = 0;            ///< verbose flag
+static int          thread_count = 8;       ///< number of threads
+static int          seconds = 5;            ///< seconds to run
+static volatile int stop;                   ///< stop threads flag
+
+/// Print if verbose flag is set
+#define VERBOSE(fmt, arg...) if (verbose) printf(fmt, ##arg)
+
+
+/**
+ * Get the file name of a slot.
+ */
+static char* slot_name(char* name, thread_t* tp, int k, int loc)
+{
+    if (loc == LOC_X) sprintf(name, "/x%d/f%d", tp->id, k);
+    else sprintf(name, "/s%d/%c/f%d", tp->id, loc == LOC_A ? 'a' : 'b', k);
+    return name;
+}
+
+/**
+ * Get the content of a file, which identifies the thread and slot.
+ */
+static int slot_content(char* buf, thread_t* tp, int k, u64 serial)
+{
+    return sprintf(buf, "thread=%d slot=%d serial=%lu%*s",
+                   tp->id, k, serial, (int)(serial % 200), "");
+}
+
+/**
+ * Write the content of a file.
+ */
+static void slot_write(thread_t* tp, int k, int mode)
+{
+    char name[64], buf[320];
+    slot_t* sp = &tp->slots[k];
+    slot_name(name, tp, k, sp->loc);
+    unfs_fd_t fd = unfs_file_open(fs, name, mode);
+    if (fd.error)
+        FATAL("open %s (%s)", name, strerror(fd.error));
+    int len = slot_content(buf, tp, k, sp->serial);
+    if (unfs_file_write(fd, buf, 0, len) || unfs_file_resize(fd, len, 0))
+        FATAL("write %s", name);
+    unfs_file_close(fd);
+}
+
+/**
+ * Create or remove the top-level file or directory chain of a thread.
+ */
+static void toggle_top(thread_t* tp, int chain)
+{
+    char name[64];
+    if (!chain) {
+        sprintf(name, "/t%d", tp->id);
+        if (tp->top) {
+            if (unfs_remove(fs, name, 0))
+                FATAL("remove %s", name);
+        } else {
+            unfs_fd_t fd = unfs_file_open(fs, name, UNFS_OPEN_CREATE | UNFS_OPEN_EXCLUSIVE);
+            if (fd.error)
+                FATAL("open %s (%s)", name, strerror(fd.error));
+            unfs_file_close(fd);
+        }
+        tp->top = !tp->top;
+    } else if (tp->chain) {
+        const char* fmt[] = { "/p%d/q/r", "/p%d/q", "/p%d" };
+        int i;
+        for (i = 0; i < 3; i++) {
+            sprintf(name, fmt[i], tp->id);
+            if (unfs_remove(fs, name, 1))
+                FATAL("remove %s", name);
+        }
+        tp->chain = 0;
+    } else {
+        sprintf(name, "/p%d/q/r", tp->id);
+        if (unfs_create(fs, name, 1, 1))
+            FATAL("create %s", name);
+        tp->chain = 1;
+    }
+}
+
+/**
+ * Thread doing random operations on its files.
+ */
+static void* worker(void* arg)
+{
+    thread_t* tp = arg;
+    unsigned seed = tp->id;
+    u64 serial = 0;
+    char name[64], name2[64];
+    while (!stop) {
+        int r = rand_r(&seed) % 64;
+        if (r < 2) {
+            toggle_top(tp, r);
+            tp->ops++;
+            continue;
+        }
+        int k = rand_r(&seed) % SLOTS;
+        slot_t* sp = &tp->slots[k];
+        if (!sp->serial) {
+            sp->loc = rand_r(&seed) % LOCS;
+            sp->serial = ++serial;
+            slot_write(tp, k, UNFS_OPEN_CREATE | UNFS_OPEN_EXCLUSIVE);
+        } else {
+            switch (rand_r(&seed) % 4) {
+            case 0:
+            case 1:
+                // rename within the shard, or to the other top-level directory
+                slot_name(name, tp, k, sp->loc);
+                int loc = (sp->loc + 1 + (rand_r(&seed) & 1)) % LOCS;
+                slot_name(name2, tp, k, loc);
+                if (unfs_rename(fs, name, name2, 0))
+                    FATAL("rename %s %s", name, name2);
+                sp->loc = loc;
+                break;
+            case 2:
+                slot_name(name, tp, k, sp->loc);
+                if (unfs_remove(fs, name, 0))
+                    FATAL("remove %s", name);
+                sp->serial = 0;
+                break;
+            default:
+                sp->serial = ++serial;
+                slot_write(tp, k, 0);
+            }
+        }
+        tp->ops++;
+    }
+    return NULL;
+}
+
+/**
+ * Thread listing the root directory and the whole device.
+ */
+static void* lister(void* arg)
+{
+    u64 lists = 0;
+    while (!stop) {
+        unfs_dir_list_t* lp = unfs_dir_list(fs, "/");
+        if (!lp || lp->size < 2 * thread_count)
+            FATAL("list / (%u entries)", lp ? lp->size : 0);
+        unfs_dir_list_free(lp);
+        lp = unfs_dir_list_all(fs, "/");
+        if (!lp)
+            FATAL("list all /");
+        unfs_dir_list_free(lp);
+        lists++;
+        usleep(1000);
+    }
+    VERBOSE("# lister: %lu lists\n", lists);
+    return NULL;
+}
+
+/**
+ * Thread creating a burst of top-level files.
+ */
+static void* burster(void* arg)
+{
+    thread_t* tp = arg;
+    char name[64];
+    int i;
+    for (i = 0; i < BURST; i++) {
+        sprintf(name, "/u%d-%d", tp->id, i);
+        if (i & 1) {
+            if (unfs_create(fs, name, 1, 0))
+                FATAL("create %s", name);
+        } else {
+            unfs_fd_t fd = unfs_file_open(fs, name, UNFS_OPEN_CREATE | UNFS_OPEN_EXCLUSIVE);
+            if (fd.error)
+                FATAL("open %s (%s)", name, strerror(fd.error));
+            unfs_file_close(fd);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Check the number of entries of a directory.
+ */
+static void verify_count(const char* name, u64 count)
+{
+    unfs_dir_list_t* lp = unfs_dir_list(fs, name);
+    if (!lp || lp->size != count)
+        FATAL("%s has %u entries expect %lu", name, lp ? lp->size : 0, count);
+    unfs_dir_list_free(lp);
+}
+
+/**
+ * Verify the device against the thread shadows.
+ */
+static void verify(thread_t* threads)
+{
+    char name[64], buf[320], exp[320];
+    u64 files = 0, top = 0;
+    int t, k, l;
+    for (t = 0; t < thread_count; t++) {
+        thread_t* tp = &threads[t];
+        u64 count[LOCS] = { 0 };
+        for (k = 0; k < SLOTS; k++) {
+            slot_t* sp = &tp->slots[k];
+            for (l = 0; l < LOCS; l++) {
+                int exist = unfs_exist(fs, slot_name(name, tp, k, l), 0, 0);
+                if (exist != (sp->serial && sp->loc == l))
+                    FATAL("%s %s", name, exist ? "exists" : "missing");
+            }
+            if (!sp->serial) continue;
+            unfs_fd_t fd = unfs_file_open(fs, slot_name(name, tp, k, sp->loc), 0);
+            if (fd.error)
+                FATAL("open %s", name);
+            int len = slot_content(exp, tp, k, sp->serial);
+            u64 size;
+            unfs_file_stat(fd, &size, 0, 0);
+            if (size != len || unfs_file_read(fd, buf, 0, len) || memcmp(buf, exp, len))
+                FATAL("%s content mismatch", name);
+            unfs_file_close(fd);
+            count[sp->loc]++;
+            files++;
+        }
+        sprintf(name, "/s%d/a", t);
+        verify_count(name, count[LOC_A]);
+        sprintf(name, "/s%d/b", t);
+        verify_count(name, count[LOC_B]);
+        sprintf(name, "/x%d", t);
+        verify_count(name, count[LOC_X]);
+        sprintf(name, "/t%d", t);
+        if (unfs_exist(fs, name, 0, 0) != tp->top)
+            FATAL("%s %s", name, tp->top ? "missing" : "exists");
+        sprintf(name, "/p%d/q/r", t);
+        if (unfs_exist(fs, name, 0, 0) != tp->chain)
+            FATAL("%s %s", name, tp->chain ? "missing" : "exists");
+        sprintf(name, "/p%d", t);
+        if (unfs_exist(fs, name, 0, 0) != tp->chain)
+            FATAL("%s %s", name, tp->chain ? "missing" : "exists");
+        top += 2 + tp->top + tp->chain;
+    }
+    verify_count("/", top);
+    printf("Verified %lu files (shards %s)\n", files, getenv("UNFS_SHARDS"));
+}
+
+/**
+ * Main program.
+ */
+int main(int argc, char** argv)
+{
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:s:v")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'n':
+            setenv("UNFS_NSID", optarg, 1);
+            break;
+        case 't':
+            thread_count = atoi(optarg);
+            if (thread_count <= 0)
+                FATAL("Thread count must be > 0");
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            if (seconds <= 0)
+                FATAL("Seconds must be > 0");
+            break;
+        default:
+            fprintf(stderr, usage, prog);
+            exit(1);
+        }
+    }
+
+    device = getenv("UNFS_DEVICE");
+    if ((optind + 1) == argc) device = argv[optind++];
+    if (!device || optind != argc) {
+        fprintf(stderr, usage, prog);
+        exit(1);
+    }
+    setenv("UNFS_SHARDS", "8", 0);
+
+    LOG_OPEN();
+    printf("UNFS SHARD TEST BEGIN\n");
+    time_t tstart = time(0);
+
+    printf("UNFS format device %s\n", device);
+    if (unfs_format(device, prog, verbose))
+        FATAL("UNFS format failed");
+    printf("UNFS open device %s with %s shards\n", device, getenv("UNFS_SHARDS"));
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+
+    int t;
+    thread_t* threads = calloc(thread_count, sizeof(thread_t));
+    for (t = 0; t < thread_count; t++) {
+        char name[32];
+        const char* fmt[] = { "/s%d/a", "/s%d/b", "/x%d" };
+        int i;
+        for (i = 0; i < 3; i++) {
+            sprintf(name, fmt[i], t);
+            if (unfs_create(fs, name, 1, 1))
+                FATAL("create %s", name);
+        }
+        threads[t].id = t;
+    }
+
+    printf("Run %d threads for %d secs\n", thread_count, seconds);
+    pthread_t* pts = calloc(thread_count + 1, sizeof(pthread_t));
+    for (t = 0; t < thread_count; t++)
+        pthread_create(&pts[t], 0, worker, &threads[t]);
+    pthread_create(&pts[t], 0, lister, 0);
+    sleep(seconds);
+    stop = 1;
+    u64 ops = 0;
+    for (t = 0; t <= thread_count; t++) pthread_join(pts[t], 0);
+    free(pts);
+    for (t = 0; t < thread_count; t++) {
+        VERBOSE("# thread %d: %lu ops\n", t, threads[t].ops);
+        ops += threads[t].ops;
+    }
+    printf("Ran %lu ops (%lu ops/sec)\n", ops, ops / seconds);
+
+    printf("Verify device\n");
+    verify(threads);
+    unfs_close(fs);
+
+    // the shards are in memory only, so any number of them loads the same
+    setenv("UNFS_SHARDS", atoi(getenv("UNFS_SHARDS")) == 3 ? "5" : "3", 1);
+    printf("Reopen and verify device with %s shards\n", getenv("UNFS_SHARDS"));
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+    verify(threads);
+    unfs_close(fs);
+    setenv("UNFS_SHARDS", "0", 1);
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+    verify(threads);
+    unfs_close(fs);
+
+    setenv("UNFS_SHARDS", "8", 1);
+    printf("Create %d top-level files per thread with %s shards\n", BURST, getenv("UNFS_SHARDS"));
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+    pts = calloc(thread_count, sizeof(pthread_t));
+    for (t = 0; t < thread_count; t++)
+        pthread_create(&pts[t], 0, burster, &threads[t]);
+    for (t = 0; t < thread_count; t++) pthread_join(pts[t], 0);
+    free(pts);
+    u64 top = 0;
+    for (t = 0; t < thread_count; t++) top += 2 + threads[t].top + threads[t].chain + BURST;
+    verify_count("/", top);
+    unfs_close(fs);
+    free(threads);
+    if (unfs_check(device)) return 1;
+
+    printf("UNFS SHARD TEST COMPLETE (%ld secs)\n", time(0) - tstart);
+    LOG_CLOSE();
+
+    return 0;
+}
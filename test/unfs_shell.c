@@ -42,6 +42,8 @@
 #include <ctype.h>
 #include <errno.h>
 #include <err.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "unfs.h"
 
@@ -51,25 +53,61 @@ static const char*  usage =
 "\nUsage: %s [OPTION]... DEVICE_NAME\n\
           -n NSID       NVMe namespace id (default 1)\n\
           -h SIZE       command history size (default 100)\n\
+          -r            mount read-only (shared with a writer)\n\
+          -t THREADS    threads for cp and cmp (default 8)\n\
+          -v VOLUME     open the named sub-volume\n\
           DEVICE_NAME   device name\n";
 
 /// Help
 static const char*  help =
 "Available Commands:     (Ctrl-P=Previous  Ctrl-N=Next)\n\
 ---------------------------------------------------------------\n\
-cd [DIRNAME]            touch FILENAME          cp FROM TO\n\
-ls [DIRNAME]            rm FILENAME             mv FROM TO\n\
+cd [DIRNAME]            touch FILENAME          cp [-r] FROM TO\n\
+ls [DIRNAME]            rm [-r] NAME            mv FROM TO\n\
 find [DIRNAME]          file FILENAME           cmp FILE1 FILE2\n\
 mkdir DIRNAME           fs                      history\n\
 rmdir DIRNAME           fsck                    q|quit|exit\n\
+offload FILENAME        recall FILENAME         reload\n\
+du [DIRNAME]\n\
 ---------------------------------------------------------------\n";
 
 static char*        device;                     ///< device name
 static int          histsize = 100;             ///< history size
+static int          rdonly = 0;                 ///< read-only mount
 static int          histnext = 0;               ///< next history position
 static unfs_page_t* history;                    ///< command history queue
 static unfs_fs_t    fs;                         ///< filesystem handle
 static char         cwd[UNFS_MAXPATH] = "/";    ///< current directory
+static int          threads = 8;                ///< copy/compare threads
+static char*        volume = NULL;              ///< sub-volume name
+
+/// Copy/compare chunk size
+#define XFER_CHUNK      (4 << 20)
+
+/// File pair to copy or compare
+typedef struct {
+    const char*     name1;                      ///< source file name
+    const char*     name2;                      ///< target file name
+    unfs_fd_t       fd1;                        ///< source file
+    unfs_fd_t       fd2;                        ///< target file
+    u64             size;                       ///< file size
+    u64             diff;                       ///< first differing offset
+    int             error;                      ///< first read/write error
+    const char*     errname;                    ///< first error file name
+    int             errwrite;                   ///< first error is a write
+    u64             erroff;                     ///< first error chunk offset
+} xfer_file_t;
+
+/// Parallel copy/compare engine
+typedef struct {
+    xfer_file_t*    files;                      ///< file pairs
+    u64             count;                      ///< number of file pairs
+    int             cmp;                        ///< compare (else copy) flag
+    pthread_mutex_t lock;                       ///< next chunk lock
+    u64             file;                       ///< next chunk file index
+    u64             offset;                     ///< next chunk file offset
+    u64             bytes;                      ///< total bytes
+} xfer_t;
 
 
 /**
@@ -186,33 +224,25 @@ static int cmd_ls(const char* arg)
 }
 
 /**
- * Recursive find directory listing.
+ * Compare to sort directory list entries by full name.
  */
-static int find_recursive(const char* dirname)
+static int name_compare(const void* p1, const void* p2)
 {
-    unfs_dir_list_t* dlp = unfs_dir_list(fs, dirname);
+    return strcmp(((unfs_dir_entry_t*)p1)->name, ((unfs_dir_entry_t*)p2)->name);
+}
+
+/**
+ * Get all the descendants of a directory sorted by name.
+ */
+static unfs_dir_list_t* list_all(const char* dirname)
+{
+    unfs_dir_list_t* dlp = unfs_dir_list_all(fs, dirname);
     if (!dlp) {
         printf("No such directory %s\n", dirname);
-        return 1;
+        return NULL;
     }
-
-    if (dlp->size == 0)
-        return 0;
-    unfs_dir_entry_t* dep = dlp->list;
-    qsort_r(dep, dlp->size, sizeof(unfs_dir_entry_t), ls_compare, 0);
-    int i;
-    for (i = 0; i < dlp->size; i++) {
-        if (dep->isdir) {
-            printf("%s/  (%lu)\n", dep->name, dep->size);
-            if (find_recursive(dep->name))
-                return 1;
-        } else {
-            printf("%s  (%lu)\n", dep->name, dep->size);
-        }
-        dep++;
-    }
-    unfs_dir_list_free(dlp);
-    return 0;
+    qsort(dlp->list, dlp->size, sizeof(unfs_dir_entry_t), name_compare);
+    return dlp;
 }
 
 /**
@@ -231,7 +261,39 @@ static int cmd_find(const char* arg)
         return 1;
     }
 
-    return find_recursive(arg);
+    unfs_dir_list_t* dlp = list_all(arg);
+    if (!dlp)
+        return 1;
+    int i;
+    for (i = 0; i < dlp->size; i++) {
+        unfs_dir_entry_t* dep = &dlp->list[i];
+        printf("%s%s  (%lu)\n", dep->name, dep->isdir ? "/" : "", dep->size);
+    }
+    unfs_dir_list_free(dlp);
+    return 0;
+}
+
+/**
+ * du - print the total file size and count under a directory.
+ */
+static int cmd_du(const char* arg)
+{
+    unfs_dir_list_t* dlp = list_all(arg);
+    if (!dlp)
+        return 1;
+    u64 size = 0, files = 0, dirs = 0;
+    int i;
+    for (i = 0; i < dlp->size; i++) {
+        if (dlp->list[i].isdir) {
+            dirs++;
+        } else {
+            files++;
+            size += dlp->list[i].size;
+        }
+    }
+    printf("%s  %lu bytes  %lu files  %lu directories\n", arg, size, files, dirs);
+    unfs_dir_list_free(dlp);
+    return 0;
 }
 
 /**
@@ -302,6 +364,39 @@ static int cmd_rm(const char* arg)
     return 0;
 }
 
+/**
+ * rm -r - remove a directory and all its content (or a file).
+ */
+static int cmd_rm_r(const char* arg)
+{
+    int isdir;
+    if (!unfs_exist(fs, arg, &isdir, 0)) {
+        printf("No such file or directory %s\n", arg);
+        return 1;
+    }
+    if (!isdir)
+        return cmd_rm(arg);
+
+    // remove in reverse name order so children go before their parent
+    unfs_dir_list_t* dlp = list_all(arg);
+    if (!dlp)
+        return 1;
+    int i, status = 0;
+    for (i = dlp->size - 1; i >= 0; i--) {
+        unfs_dir_entry_t* dep = &dlp->list[i];
+        if (unfs_remove(fs, dep->name, dep->isdir)) {
+            printf("Cannot remove %s\n", dep->name);
+            status = 1;
+        }
+    }
+    unfs_dir_list_free(dlp);
+    if (!status && arg[1] && unfs_remove(fs, arg, 1)) {
+        printf("Cannot remove %s\n", arg);
+        status = 1;
+    }
+    return status;
+}
+
 /**
  * file - print a file status.
  */
@@ -341,6 +436,32 @@ static int cmd_file(const char* arg)
     return 0;
 }
 
+/**
+ * offload - offload a file to the host directory (see UNFS_OFFLOAD).
+ */
+static int cmd_offload(const char* arg)
+{
+    int err = unfs_offload(fs, arg);
+    if (err) {
+        printf("Cannot offload %s (%s)\n", arg, strerror(err));
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * recall - recall an offloaded file.
+ */
+static int cmd_recall(const char* arg)
+{
+    int err = unfs_recall(fs, arg);
+    if (err) {
+        printf("Cannot recall %s (%s)\n", arg, strerror(err));
+        return 1;
+    }
+    return 0;
+}
+
 /**
  * mv - move a file or directory.
  */
@@ -363,56 +484,176 @@ static int cmd_mv(const char* arg1, const char* arg2)
 }
 
 /**
- * cmp - compare two files.
+ * Record the first read/write error of a file, so no more of its chunks
+ * are taken by the workers.
  */
-static int cmd_cmp(const char* arg1, const char* arg2)
+static void xfer_error(xfer_t* xp, xfer_file_t* xf, const char* name, int wflag,
+                       u64 offset, int err)
 {
-    unfs_fd_t fd1 = unfs_file_open(fs, arg1, 0);
-    if (fd1.error) {
-        printf("Open %s (%s)\n", arg1, strerror(fd1.error));
-        return 1;
-    }
-    unfs_fd_t fd2 = unfs_file_open(fs, arg2, 0);
-    if (fd2.error) {
-        printf("Open %s (%s)\n", arg2, strerror(fd2.error));
-        unfs_file_close(fd1);
-        return 1;
+    pthread_mutex_lock(&xp->lock);
+    if (!xf->error) {
+        xf->error = err;
+        xf->errname = name;
+        xf->errwrite = wflag;
+        xf->erroff = offset;
     }
+    pthread_mutex_unlock(&xp->lock);
+}
 
-    u64 offset = 0;
-    u64 size1, size2;
-    if (unfs_file_stat(fd1, &size1, 0, 0))
-        return 1;
-    if (unfs_file_stat(fd2, &size2, 0, 0))
-        return 1;
-    if (size1 != size2) {
-        printf("%s %lu and %s %lu differ\n", arg1, size1, arg2, size2);
-        return 1;
+/**
+ * Copy/compare worker thread, where the files are split into chunks taken
+ * in order by the workers so small files are done concurrently and a large
+ * file is transferred with parallel large I/Os.  A file is skipped after
+ * its first read or write error.
+ */
+static void* xfer_thread(void* arg)
+{
+    xfer_t* xp = arg;
+    u8* buf1 = malloc(XFER_CHUNK);
+    u8* buf2 = xp->cmp ? malloc(XFER_CHUNK) : NULL;
+
+    for (;;) {
+        pthread_mutex_lock(&xp->lock);
+        while (xp->file < xp->count && (xp->offset >= xp->files[xp->file].size ||
+                                        xp->files[xp->file].error)) {
+            xp->file++;
+            xp->offset = 0;
+        }
+        if (xp->file == xp->count) {
+            pthread_mutex_unlock(&xp->lock);
+            break;
+        }
+        xfer_file_t* xf = &xp->files[xp->file];
+        u64 offset = xp->offset;
+        u64 len = xf->size - offset;
+        if (len > XFER_CHUNK)
+            len = XFER_CHUNK;
+        xp->offset += len;
+        pthread_mutex_unlock(&xp->lock);
+
+        int err = unfs_file_read(xf->fd1, buf1, offset, len);
+        if (err) {
+            xfer_error(xp, xf, xf->name1, 0, offset, err);
+            continue;
+        }
+        if (!xp->cmp) {
+            err = unfs_file_write(xf->fd2, buf1, offset, len);
+            if (err)
+                xfer_error(xp, xf, xf->name2, 1, offset, err);
+            continue;
+        }
+        err = unfs_file_read(xf->fd2, buf2, offset, len);
+        if (err) {
+            xfer_error(xp, xf, xf->name2, 0, offset, err);
+        } else if (memcmp(buf1, buf2, len)) {
+            u64 i;
+            for (i = 0; buf1[i] == buf2[i]; i++);
+            pthread_mutex_lock(&xp->lock);
+            if (xf->diff > (offset + i))
+                xf->diff = offset + i;
+            pthread_mutex_unlock(&xp->lock);
+        }
     }
+    free(buf1);
+    free(buf2);
+    return NULL;
+}
 
-    u8 buf1[UNFS_PAGESIZE];
-    u8 buf2[UNFS_PAGESIZE];
-    while (size1) {
-        u64 len = sizeof(buf1);
-        if (len > size1)
-            len = size1;
-        unfs_file_read(fd1, buf1, offset, len);
-        unfs_file_read(fd2, buf2, offset, len);
-
-        u64 i;
-        for (i = 0; i < len; i++) {
-            if (buf1[i] != buf2[i]) {
-                printf("%s %s differ at byte %lu\n", arg1, arg2, offset + i);
-                return 1;
-            }
+/**
+ * Copy or compare a list of file pairs with parallel worker threads.
+ * Target files to copy to are created and sized before copying.  If a
+ * file cannot be opened, nothing is transferred and the created targets
+ * are removed.
+ */
+static int xfer_run(xfer_t* xp)
+{
+    int status = 0;
+    u64 i;
+    for (i = 0; i < xp->count; i++) {
+        xfer_file_t* xf = &xp->files[i];
+        xf->diff = -1L;
+        xf->fd1 = unfs_file_open(fs, xf->name1, 0);
+        if (xf->fd1.error) {
+            printf("Open %s (%s)\n", xf->name1, strerror(xf->fd1.error));
+            status = 1;
+            break;
+        }
+        xf->fd2 = unfs_file_open(fs, xf->name2, xp->cmp ? 0 : UNFS_OPEN_CREATE);
+        if (xf->fd2.error) {
+            printf("%s %s (%s)\n", xp->cmp ? "Open" : "Create", xf->name2,
+                                     strerror(xf->fd2.error));
+            unfs_file_close(xf->fd1);
+            status = 1;
+            break;
+        }
+        u64 size2 = 0;
+        unfs_file_stat(xf->fd1, &xf->size, 0, 0);
+        unfs_file_stat(xf->fd2, &size2, 0, 0);
+        if (xp->cmp && xf->size != size2) {
+            printf("%s %lu and %s %lu differ\n", xf->name1, xf->size, xf->name2, size2);
+            xf->size = 0;
+            status = 1;
+        } else if (!xp->cmp && unfs_file_resize(xf->fd2, xf->size, 0)) {
+            printf("Cannot resize %s\n", xf->name2);
+            xf->size = 0;
+            status = 1;
+        }
+        xp->bytes += xf->size;
+    }
+    u64 opened = i;
+    if (opened < xp->count) {
+        for (i = 0; i < opened; i++) {
+            xfer_file_t* xf = &xp->files[i];
+            unfs_file_close(xf->fd1);
+            unfs_file_close(xf->fd2);
+            if (!xp->cmp)
+                unfs_remove(fs, xf->name2, 0);
         }
+        return status;
+    }
 
-        offset += len;
-        size1 -= len;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_mutex_init(&xp->lock, NULL);
+    pthread_t tids[threads];
+    int t;
+    for (t = 0; t < threads; t++) {
+        if (pthread_create(&tids[t], NULL, xfer_thread, xp))
+            errx(1, "pthread_create failed");
     }
-    unfs_file_close(fd1);
-    unfs_file_close(fd2);
-    return 0;
+    for (t = 0; t < threads; t++)
+        pthread_join(tids[t], NULL);
+    pthread_mutex_destroy(&xp->lock);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for (i = 0; i < opened; i++) {
+        xfer_file_t* xf = &xp->files[i];
+        if (xf->error) {
+            printf("%s %s at byte %lu (%s)\n", xf->errwrite ? "Write" : "Read",
+                   xf->errname, xf->erroff, strerror(xf->error));
+            status = 1;
+        } else if (xf->diff != -1L) {
+            printf("%s %s differ at byte %lu\n", xf->name1, xf->name2, xf->diff);
+            status = 1;
+        }
+        unfs_file_close(xf->fd1);
+        unfs_file_close(xf->fd2);
+    }
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%s %lu files  %lu bytes  %.3f secs  %.1f MB/s\n",
+           xp->cmp ? "Compared" : "Copied", opened, xp->bytes, secs,
+           secs > 0 ? xp->bytes / secs / 1e6 : 0.0);
+    return status;
+}
+
+/**
+ * cmp - compare two files.
+ */
+static int cmd_cmp(const char* arg1, const char* arg2)
+{
+    xfer_file_t xf = { .name1 = arg1, .name2 = arg2 };
+    xfer_t x = { .files = &xf, .count = 1, .cmp = 1 };
+    return xfer_run(&x);
 }
 
 /**
@@ -424,45 +665,64 @@ static int cmd_cp(const char* arg1, const char* arg2)
         printf("%s exists\n", arg2);
         return 1;
     }
-    unfs_fd_t fd1 = unfs_file_open(fs, arg1, 0);
-    if (fd1.error) {
-        printf("Open %s (%s)\n", arg1, strerror(fd1.error));
+    xfer_file_t xf = { .name1 = arg1, .name2 = arg2 };
+    xfer_t x = { .files = &xf, .count = 1 };
+    return xfer_run(&x);
+}
+
+/**
+ * cp -r - copy a directory and all its content (or a file).
+ */
+static int cmd_cp_r(const char* arg1, const char* arg2)
+{
+    int isdir;
+    if (!unfs_exist(fs, arg1, &isdir, 0)) {
+        printf("No such file or directory %s\n", arg1);
+        return 1;
+    }
+    if (!isdir)
+        return cmd_cp(arg1, arg2);
+    if (unfs_exist(fs, arg2, 0, 0)) {
+        printf("%s exists\n", arg2);
         return 1;
     }
-    unfs_fd_t fd2 = unfs_file_open(fs, arg2, UNFS_OPEN_CREATE);
-    if (fd2.error) {
-        printf("Create %s (%s)\n", arg2, strerror(fd2.error));
-        unfs_file_close(fd1);
+    size_t len1 = strlen(arg1);
+    size_t len2 = strlen(arg2);
+    if (len2 > len1 && arg2[len1] == '/' && !strncmp(arg1, arg2, len1)) {
+        printf("Cannot copy %s into itself\n", arg1);
         return 1;
     }
 
-    u64 offset = 0, size = 0;
-    if (unfs_file_stat(fd1, &size, 0, 0))
+    // create the directories in name order and collect the files
+    unfs_dir_list_t* dlp = list_all(arg1);
+    if (!dlp)
         return 1;
-
-    u8 buf[65536];
-    while (size) {
-        u64 len = sizeof(buf);
-        if (len > size)
-            len = size;
-        unfs_file_read(fd1, buf, offset, len);
-        unfs_file_write(fd2, buf, offset, len);
-        offset += len;
-        size -= len;
+    xfer_t x = { .files = calloc(dlp->size + 1, sizeof(xfer_file_t)) };
+    int status = unfs_create(fs, arg2, 1, 1);
+    int i;
+    for (i = 0; i < dlp->size && !status; i++) {
+        unfs_dir_entry_t* dep = &dlp->list[i];
+        const char* rel = dep->name + (len1 > 1 ? len1 : 0);
+        char* name2 = malloc(len2 + strlen(rel) + 1);
+        sprintf(name2, "%s%s", arg2[1] ? arg2 : "", rel);
+        if (dep->isdir) {
+            status = unfs_create(fs, name2, 1, 0);
+            free(name2);
+        } else {
+            x.files[x.count].name1 = dep->name;
+            x.files[x.count++].name2 = name2;
+        }
     }
-
-    u32 dsc;
-    unfs_file_stat(fd1, &size, &dsc, 0);
-    u64 sum = unfs_file_checksum(fd1);
-    printf("%s\n  Size=%lu  Segment=%u  Checksum=%#lx\n", arg1, size, dsc, sum);
-    unfs_file_close(fd1);
-
-    unfs_file_stat(fd2, &size, &dsc, 0);
-    sum = unfs_file_checksum(fd2);
-    printf("%s\n  Size=%lu  Segment=%u  Checksum=%#lx\n", arg2, size, dsc, sum);
-    unfs_file_close(fd2);
-
-    return 0;
+    if (status)
+        printf("Cannot create directory under %s\n", arg2);
+    else
+        status = xfer_run(&x);
+
+    for (i = 0; i < x.count; i++)
+        free((char*)x.files[i].name2);
+    free(x.files);
+    unfs_dir_list_free(dlp);
+    return status;
 }
 
 /**
@@ -478,11 +738,28 @@ static int cmd_fs(void)
     return 0;
 }
 
+/**
+ * reload - reload the metadata updated by the writer (read-only mount).
+ */
+static int cmd_reload(void)
+{
+    int err = unfs_reload(fs);
+    if (err) {
+        printf("Cannot reload (%s)\n", strerror(err));
+        return 1;
+    }
+    return cmd_fs();
+}
+
 /**
  * fsck - recheck the filesystem.
  */
 static int cmd_fsck(void)
 {
+    if (rdonly) {
+        printf("fsck is not available on read-only mount\n");
+        return 1;
+    }
     unfs_close(fs);
     printf("Checking filesystem... ");
     fflush(stdout);
@@ -490,7 +767,7 @@ static int cmd_fsck(void)
         printf("\nUNFS error");
         exit(1);
     }
-    fs = unfs_open(device);
+    fs = volume ? unfs_open_vol(device, volume) : unfs_open(device);
     if (!fs) {
         printf("\nUNFS open failed");
         exit(1);
@@ -590,7 +867,7 @@ int main(int argc, char** argv)
     prog = prog ? prog + 1 : argv[0];
     int opt;
 
-    while ((opt = getopt(argc, argv, "n:h:")) != -1) {
+    while ((opt = getopt(argc, argv, "n:h:rt:v:")) != -1) {
         switch (opt) {
         case 'n':
             setenv("UNFS_NSID", optarg, 1);
@@ -600,6 +877,17 @@ int main(int argc, char** argv)
             if (histsize <= 0)
                 errx(1, "history size must be > 0");
             break;
+        case 'r':
+            rdonly = 1;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            if (threads <= 0)
+                errx(1, "thread count must be > 0");
+            break;
+        case 'v':
+            volume = optarg;
+            break;
         default:
             errx(1, usage, prog);
         }
@@ -614,7 +902,10 @@ int main(int argc, char** argv)
 
     history = (unfs_page_t*)calloc(histsize, sizeof(unfs_page_t));
 
-    fs = unfs_open(device);
+    if (volume && rdonly)
+        errx(1, "sub-volume cannot be mounted read-only");
+    fs = volume ? unfs_open_vol(device, volume) :
+         rdonly ? unfs_open_ro(device) : unfs_open(device);
     if (!fs)
         errx(1, "UNFS open failed");
 
@@ -634,6 +925,12 @@ int main(int argc, char** argv)
         char* cmdp = strtok(command, " \t\n");
         char* argp = strtok(0, " \t\n");
         char* argp2 = strtok(0, " \t\n");
+        int recursive = 0;
+        if (argp && !strcmp(argp, "-r")) {
+            recursive = 1;
+            argp = argp2;
+            argp2 = strtok(0, " \t\n");
+        }
 
         // if no command is given print help
         if (!cmdp) {
@@ -670,6 +967,11 @@ int main(int argc, char** argv)
             if (!argp) argp = cwd;
             status = run(cmd_find, argp);
 
+        // du command
+        } else if (!strcmp(cmdp, "du")) {
+            if (!argp) argp = cwd;
+            status = run(cmd_du, argp);
+
         // mkdir command
         } else if (!strcmp(cmdp, "mkdir")) {
             if (!argp) {
@@ -700,11 +1002,11 @@ int main(int argc, char** argv)
         // rm command
         } else if (!strcmp(cmdp, "rm")) {
             if (!argp) {
-                printf("Syntax: rm FILENAME\n");
+                printf("Syntax: rm [-r] NAME\n");
                 status = 1;
                 continue;
             }
-            status = run(cmd_rm, argp);
+            status = run(recursive ? cmd_rm_r : cmd_rm, argp);
 
         // file command
         } else if (!strcmp(cmdp, "file")) {
@@ -715,6 +1017,24 @@ int main(int argc, char** argv)
             }
             status = run(cmd_file, argp);
 
+        // offload command
+        } else if (!strcmp(cmdp, "offload")) {
+            if (!argp) {
+                printf("Syntax: offload FILENAME\n");
+                status = 1;
+                continue;
+            }
+            status = run(cmd_offload, argp);
+
+        // recall command
+        } else if (!strcmp(cmdp, "recall")) {
+            if (!argp) {
+                printf("Syntax: recall FILENAME\n");
+                status = 1;
+                continue;
+            }
+            status = run(cmd_recall, argp);
+
         // mv command
         } else if (!strcmp(cmdp, "mv")) {
             if (!argp || !argp2) {
@@ -727,11 +1047,11 @@ int main(int argc, char** argv)
         // cp command
         } else if (!strcmp(cmdp, "cp")) {
             if (!argp || !argp2) {
-                printf("Syntax: cp FROM TO\n");
+                printf("Syntax: cp [-r] FROM TO\n");
                 status = 1;
                 continue;
             }
-            status = run2(cmd_cp, argp, argp2);
+            status = run2(recursive ? cmd_cp_r : cmd_cp, argp, argp2);
 
         // cmp command
         } else if (!strcmp(cmdp, "cmp")) {
@@ -750,6 +1070,10 @@ int main(int argc, char** argv)
         } else if (!strcmp(cmdp, "fsck")) {
             status = cmd_fsck();
 
+        // reload command
+        } else if (!strcmp(cmdp, "reload")) {
+            status = cmd_reload();
+
         // unknown command
         } else {
             printf(help);
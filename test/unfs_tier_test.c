@@ -0,0 +1,401 @@
+/**
+ * Copyright (c) 2016-2017, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNFS tier migration test.
+ *
+ * The device must be tiered, i.e. specified as "fast,capacity" (e.g. two
+ * files in /dev/shm).  Files of many data segments are created on the fast
+ * tier, and the tier migrator is run with a short interval in two phases:
+ * first with a high fast tier free space target while reading only the
+ * first half of the read-only files, so the segments of the second half
+ * get cold and move to the capacity tier, then with a low target while
+ * reading only the second half, so its segments get hot and move back to
+ * the fast tier.  Reader threads verify the content they read with
+ * unfs_file_read while the segments move, and writer
+ * threads overwrite blocks of the other files in place, whose content is
+ * verified after each phase, so neither a read nor a write may be lost to
+ * a segment move.  The segment tiers are checked after each phase, and the
+ * filesystem is reopened and checked at the end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "unfs.h"
+#include "unfs_log.h"
+
+
+/// Usage
+static const char*  usage =
+"\nUsage: %s [OPTION]... FAST_DEVICE,CAPACITY_DEVICE\n\
+          -v              turn on verbose\n\
+          -t THREADS      number of reader threads (default 4)\n\
+          -s SECONDS      seconds per migration phase (default 2)\n\
+          FAST_DEVICE,CAPACITY_DEVICE   tiered device name\n";
+
+static const char*  device;                 ///< device name
+static unfs_fs_t    fs;                     ///< filesystem handle
+static int          verbose = 0;            ///< verbose flag
+static int          thread_count = 4;       ///< reader thread count
+static int          seconds = 2;            ///< seconds per phase
+static volatile int stop;                   ///< stop threads flag
+static int          hotlo;                  ///< first hot read-only file
+static int          hothi;                  ///< end of hot read-only files
+
+/// Number of read-only files
+#define RFILES      8
+
+/// Number of files written in place
+#define WFILES      4
+
+/// Number of data segments per file
+#define SEGS        8
+
+/// Data segment size
+#define SEGSIZE     (256 << 10)
+
+/// File size
+#define FILESIZE    (SEGS * SEGSIZE)
+
+/// Written block size
+#define BLOCKSIZE   (16 << 10)
+
+/// Number of written blocks per file
+#define BLOCKS      (FILESIZE / BLOCKSIZE)
+
+/// Current seed of each written block
+static u32          seeds[WFILES][BLOCKS];
+
+/// Print if verbose flag is set
+#define VERBOSE(fmt, arg...) if (verbose) printf(fmt, ##arg)
+
+
+/**
+ * Get a file name.
+ */
+static void file_name(char* name, int f)
+{
+    if (f < RFILES) sprintf(name, "/tier/r%d", f);
+    else sprintf(name, "/tier/w%d", f - RFILES);
+}
+
+/**
+ * Fill a buffer with the pattern of a file range (8-byte aligned).
+ */
+static void fill_pattern(u64* buf, int f, u64 offset, u64 len, u32 seed)
+{
+    u64 i;
+    for (i = 0; i < len / sizeof(u64); i++)
+        buf[i] = ((u64)f << 56) | ((u64)seed << 32) | ((offset >> 3) + i);
+}
+
+/**
+ * Open a file.
+ */
+static unfs_fd_t file_open(int f)
+{
+    char name[32];
+    file_name(name, f);
+    unfs_fd_t fd = unfs_file_open(fs, name, 0);
+    if (fd.error)
+        FATAL("open %s (%s)", name, strerror(fd.error));
+    return fd;
+}
+
+/**
+ * Create the files by appending their segments round robin, so each
+ * append starts a new data segment.
+ */
+static void setup()
+{
+    unfs_fd_t fds[RFILES + WFILES];
+    u64* buf = malloc(SEGSIZE);
+    int f, s;
+    char name[32];
+    if (unfs_create(fs, "/tier", 1, 0))
+        FATAL("create /tier");
+    for (f = 0; f < RFILES + WFILES; f++) {
+        file_name(name, f);
+        fds[f] = unfs_file_open(fs, name, UNFS_OPEN_CREATE);
+        if (fds[f].error)
+            FATAL("create %s", name);
+    }
+    for (s = 0; s < SEGS; s++) {
+        for (f = 0; f < RFILES + WFILES; f++) {
+            fill_pattern(buf, f, (u64)s * SEGSIZE, SEGSIZE, 0);
+            if (unfs_file_write(fds[f], buf, (u64)s * SEGSIZE, SEGSIZE))
+                FATAL("write file %d segment %d", f, s);
+        }
+    }
+    for (f = 0; f < RFILES + WFILES; f++) unfs_file_close(fds[f]);
+    free(buf);
+}
+
+/**
+ * Count the data segments of a file on the fast tier.
+ */
+static int fast_count(int f, u64 tierpage)
+{
+    unfs_fd_t fd = file_open(f);
+    u64 size;
+    u32 dsc, d;
+    int n = 0;
+    unfs_ds_t* dsl;
+    unfs_file_stat(fd, &size, &dsc, &dsl);
+    if (size != FILESIZE)
+        FATAL("file %d size %#lx", f, size);
+    for (d = 0; d < dsc; d++) {
+        if (dsl[d].pageid >= tierpage) n++;
+    }
+    free(dsl);
+    unfs_file_close(fd);
+    return n;
+}
+
+/**
+ * Verify the written files.
+ */
+static void verify_written()
+{
+    u64* buf = malloc(BLOCKSIZE);
+    u64* exp = malloc(BLOCKSIZE);
+    int f, b;
+    for (f = 0; f < WFILES; f++) {
+        unfs_fd_t fd = file_open(RFILES + f);
+        for (b = 0; b < BLOCKS; b++) {
+            u64 off = (u64)b * BLOCKSIZE;
+            if (unfs_file_read(fd, buf, off, BLOCKSIZE))
+                FATAL("read w%d block %d", f, b);
+            fill_pattern(exp, RFILES + f, off, BLOCKSIZE, seeds[f][b]);
+            if (memcmp(buf, exp, BLOCKSIZE))
+                FATAL("w%d block %d mismatch (seed %u)", f, b, seeds[f][b]);
+        }
+        unfs_file_close(fd);
+    }
+    free(exp);
+    free(buf);
+}
+
+/**
+ * Reader thread verifying random ranges of the hot read-only files.
+ */
+static void* reader(void* arg)
+{
+    long id = (long)arg;
+    unsigned seed = id;
+    unfs_fd_t fds[RFILES];
+    int f;
+    for (f = 0; f < RFILES; f++) fds[f] = file_open(f);
+    u64* buf = malloc(SEGSIZE);
+    u64* exp = malloc(SEGSIZE);
+    u64 reads = 0;
+    while (!stop) {
+        f = hotlo + rand_r(&seed) % (hothi - hotlo);
+        u64 len = ((rand_r(&seed) % (SEGSIZE / 512)) + 1) * 8;
+        u64 off = (rand_r(&seed) % ((FILESIZE - len) / 8)) * 8;
+        if (unfs_file_read(fds[f], buf, off, len))
+            FATAL("read r%d off=%#lx len=%#lx", f, off, len);
+        fill_pattern(exp, f, off, len, 0);
+        if (memcmp(buf, exp, len))
+            FATAL("r%d off=%#lx len=%#lx mismatch", f, off, len);
+        reads++;
+    }
+    for (f = 0; f < RFILES; f++) unfs_file_close(fds[f]);
+    VERBOSE("# reader %ld: %lu reads\n", id, reads);
+    free(exp);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Writer thread overwriting random blocks of a file in place, slowly
+ * enough for some segments to be moved between two writes.
+ */
+static void* writer(void* arg)
+{
+    long f = (long)arg;
+    unsigned seed = f;
+    unfs_fd_t fd = file_open(RFILES + f);
+    u64* buf = malloc(BLOCKSIZE);
+    u64 writes = 0;
+    while (!stop) {
+        int b = rand_r(&seed) % BLOCKS;
+        u64 off = (u64)b * BLOCKSIZE;
+        u32 s = seeds[f][b] + 1;
+        fill_pattern(buf, RFILES + f, off, BLOCKSIZE, s);
+        if (unfs_file_write(fd, buf, off, BLOCKSIZE))
+            FATAL("write w%ld block %d", f, b);
+        seeds[f][b] = s;
+        writes++;
+        usleep(rand_r(&seed) % 20000);
+    }
+    unfs_file_close(fd);
+    VERBOSE("# writer %ld: %lu writes\n", f, writes);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Run a migration phase with readers and writers.
+ * @param   freepct     fast tier free space target
+ * @param   lo          first hot read-only file
+ * @param   hi          end of hot read-only files
+ * @param   fast        number of fast tier segments per read-only file
+ */
+static void run_phase(const char* freepct, int lo, int hi, int* fast)
+{
+    setenv("UNFS_TIER_FREE", freepct, 1);
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+    unfs_header_t* hp = malloc(sizeof(unfs_header_t));
+    unfs_stat(fs, hp, 0);
+    if (!hp->tierpage)
+        FATAL("%s is not a tiered device", device);
+    hotlo = lo;
+    hothi = hi;
+
+    pthread_t* pts = calloc(thread_count + WFILES, sizeof(pthread_t));
+    long i;
+    stop = 0;
+    for (i = 0; i < thread_count; i++)
+        pthread_create(&pts[i], 0, reader, (void*)i);
+    for (i = 0; i < WFILES; i++)
+        pthread_create(&pts[thread_count + i], 0, writer, (void*)i);
+    sleep(seconds);
+    stop = 1;
+    for (i = 0; i < thread_count + WFILES; i++) pthread_join(pts[i], 0);
+    free(pts);
+
+    verify_written();
+    int f;
+    printf("Fast tier segments:");
+    for (f = 0; f < RFILES; f++) {
+        fast[f] = fast_count(f, hp->tierpage);
+        printf(" %d", fast[f]);
+    }
+    printf("\n");
+    free(hp);
+    unfs_close(fs);
+}
+
+/**
+ * Main program.
+ */
+int main(int argc, char** argv)
+{
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:s:v")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 't':
+            thread_count = atoi(optarg);
+            if (thread_count <= 0)
+                FATAL("Thread count must be > 0");
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            if (seconds <= 0)
+                FATAL("Seconds must be > 0");
+            break;
+        default:
+            fprintf(stderr, usage, prog);
+            exit(1);
+        }
+    }
+
+    device = getenv("UNFS_DEVICE");
+    if ((optind + 1) == argc) device = argv[optind++];
+    if (!device || optind != argc || !strchr(device, ',')) {
+        fprintf(stderr, usage, prog);
+        exit(1);
+    }
+
+    LOG_OPEN();
+    printf("UNFS TIER MIGRATION TEST BEGIN\n");
+    time_t tstart = time(0);
+
+    printf("UNFS format device %s\n", device);
+    if (unfs_format(device, prog, verbose))
+        FATAL("UNFS format failed");
+    setenv("UNFS_TIER_INTERVAL", "0", 1);
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+    printf("Create %d files of %d segments\n", RFILES + WFILES, SEGS);
+    setup();
+    unfs_close(fs);
+
+    // Read the first half of the read-only files so the segments of the
+    // other half get cold and move to the capacity tier
+    int fasta[RFILES], fastb[RFILES];
+    int f, n = 0;
+    setenv("UNFS_TIER_INTERVAL", "20", 1);
+    setenv("UNFS_TIER_HOT", "2", 1);
+    printf("Migrate cold segments to the capacity tier\n");
+    run_phase("99", 0, RFILES / 2, fasta);
+    for (f = RFILES / 2; f < RFILES; f++) n += SEGS - fasta[f];
+    if (n == 0)
+        FATAL("no cold segment moved to the capacity tier");
+
+    // Read the second half so its segments get hot and move back
+    printf("Migrate hot segments to the fast tier\n");
+    run_phase("1", RFILES / 2, RFILES, fastb);
+    for (n = 0, f = RFILES / 2; f < RFILES; f++) n += fastb[f] - fasta[f];
+    if (n <= 0)
+        FATAL("no hot segment moved to the fast tier");
+
+    // Reopen without migration and verify
+    printf("Reopen and verify\n");
+    setenv("UNFS_TIER_INTERVAL", "0", 1);
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+    verify_written();
+    unfs_close(fs);
+    if (unfs_check(device)) return 1;
+
+    printf("UNFS TIER MIGRATION TEST COMPLETE (%ld secs)\n", time(0) - tstart);
+    LOG_CLOSE();
+
+    return 0;
+}
@@ -0,0 +1,537 @@
+/**
+ * Copyright (c) 2016-2017, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNFS transaction test.
+ *
+ * A set of files is created, renamed, resized and removed within a
+ * transaction, and the filesystem is reopened to verify that either all
+ * or none of the updates are visible: none after a process exits without
+ * committing, all after the commit, and all after a crash between the
+ * journal commit point and the in-place writes.  The last case is set up
+ * by rolling the file entry and bitmap pages of the device back to their
+ * images before the transaction and writing them as a pending journal
+ * referenced by the header, so DEVICE_NAME must be accessible as a file.
+ * Lastly, a header with a journal beyond the device must be rejected, and
+ * an UNFS-1.0 header (whose deleted stack overlays the journal fields) must
+ * be checked and mounted read-only without any write and upgraded when
+ * opened for write.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "unfs.h"
+#include "unfs_log.h"
+
+
+/// Usage
+static const char*  usage =
+"\nUsage: %s [OPTION]... DEVICE_NAME\n\
+          -v              turn on verbose\n\
+          -f FILECOUNT    number of files per update type (default 16)\n\
+          DEVICE_NAME     device name\n";
+
+static const char*  device;                 ///< device name
+static unfs_fs_t    fs;                     ///< filesystem handle
+static int          verbose = 0;            ///< verbose flag
+static int          file_count = 16;        ///< file count per update type
+static int          devfd = -1;             ///< device file descriptor
+
+/// File size unit
+#define FILESIZE    (21 << 10)
+
+/// Device pages saved from the end of the device (file entries)
+#define TAILPC      1024
+
+/// Print if verbose flag is set
+#define VERBOSE(fmt, arg...) if (verbose) printf(fmt, ##arg)
+
+
+/**
+ * Fill a buffer with the pattern of a file range.
+ */
+static void fill_pattern(u8* buf, u64 offset, u64 len, int seed)
+{
+    u64 i;
+    for (i = 0; i < len; i++)
+        buf[i] = seed * 31 + (offset + i) * 13 + ((offset + i) >> 9);
+}
+
+/**
+ * Write the pattern to a file range.
+ */
+static void write_file(unfs_fd_t fd, const char* name, u64 offset, u64 len, int seed)
+{
+    u8* buf = malloc(len);
+    fill_pattern(buf, offset, len, seed);
+    if (unfs_file_write(fd, buf, offset, len))
+        FATAL("write %s off=%#lx len=%#lx", name, offset, len);
+    free(buf);
+}
+
+/**
+ * Create a file with the pattern content.
+ */
+static void create_file(const char* name, u64 size, int seed)
+{
+    unfs_fd_t fd = unfs_file_open(fs, name, UNFS_OPEN_CREATE);
+    if (fd.error)
+        FATAL("create %s (%s)", name, strerror(fd.error));
+    if (unfs_file_resize(fd, size, 0))
+        FATAL("resize %s", name);
+    write_file(fd, name, 0, size, seed);
+    unfs_file_close(fd);
+}
+
+/**
+ * Verify that a file does not exist.
+ */
+static void verify_none(const char* name)
+{
+    if (unfs_exist(fs, name, 0, 0))
+        FATAL("%s should not exist", name);
+}
+
+/**
+ * Verify a file size and its content made of two pattern ranges.
+ */
+static void verify_file(const char* name, u64 size, u64 split, int seed, int seed2)
+{
+    VERBOSE("# verify %s size=%#lx\n", name, size);
+    unfs_fd_t fd = unfs_file_open(fs, name, UNFS_OPEN_READONLY);
+    if (fd.error)
+        FATAL("open %s (%s)", name, strerror(fd.error));
+    u64 fsize = 0;
+    unfs_file_stat(fd, &fsize, 0, 0);
+    if (fsize != size)
+        FATAL("%s size %#lx expect %#lx", name, fsize, size);
+    u8* buf = malloc(size);
+    u8* exp = malloc(size);
+    if (unfs_file_read(fd, buf, 0, size))
+        FATAL("read %s", name);
+    if (split > size) split = size;
+    fill_pattern(exp, 0, split, seed);
+    fill_pattern(exp + split, split, size - split, seed2);
+    if (memcmp(buf, exp, size))
+        FATAL("%s data mismatch", name);
+    free(exp);
+    free(buf);
+    unfs_file_close(fd);
+}
+
+/**
+ * Create the initial files: /txn/a* to be renamed, /txn/c* to be resized
+ * and /txn/d* to be removed.
+ */
+static void setup()
+{
+    char name[64];
+    int i;
+    if (unfs_create(fs, "/txn", 1, 1))
+        FATAL("create /txn");
+    for (i = 0; i < file_count; i++) {
+        sprintf(name, "/txn/a%d", i);
+        create_file(name, FILESIZE * (i + 1), i);
+        sprintf(name, "/txn/c%d", i);
+        create_file(name, FILESIZE * (i + 1), i + 100);
+        sprintf(name, "/txn/d%d", i);
+        create_file(name, FILESIZE, i + 200);
+    }
+}
+
+/**
+ * Update the files within a transaction: create /txn/new/n*, rename /txn/a*
+ * to /txn/b*, grow (and write) the even /txn/c* and shrink the odd ones,
+ * and remove /txn/d*.
+ * @param   commit      commit the transaction flag
+ */
+static void update(int commit)
+{
+    char name[64], name2[64];
+    int i;
+    if (unfs_txn_begin(fs))
+        FATAL("txn begin");
+    if (unfs_create(fs, "/txn/new", 1, 0))
+        FATAL("create /txn/new");
+    for (i = 0; i < file_count; i++) {
+        sprintf(name, "/txn/new/n%d", i);
+        create_file(name, FILESIZE * (i + 2), i + 300);
+        sprintf(name, "/txn/a%d", i);
+        sprintf(name2, "/txn/b%d", i);
+        if (unfs_rename(fs, name, name2, 0))
+            FATAL("rename %s %s", name, name2);
+        sprintf(name, "/txn/c%d", i);
+        unfs_fd_t fd = unfs_file_open(fs, name, 0);
+        if (fd.error)
+            FATAL("open %s (%s)", name, strerror(fd.error));
+        u64 size = FILESIZE * (i + 1);
+        if (i & 1) {
+            if (unfs_file_resize(fd, size / 3, 0))
+                FATAL("resize %s", name);
+        } else {
+            if (unfs_file_resize(fd, size * 3, 0))
+                FATAL("resize %s", name);
+            write_file(fd, name, size, size * 2, i + 400);
+        }
+        unfs_file_close(fd);
+        sprintf(name, "/txn/d%d", i);
+        if (unfs_remove(fs, name, 0))
+            FATAL("remove %s", name);
+    }
+    if (commit && unfs_txn_commit(fs))
+        FATAL("txn commit");
+}
+
+/**
+ * Verify the files before (or without) the transaction.
+ */
+static void verify_before()
+{
+    char name[64];
+    int i;
+    verify_none("/txn/new");
+    for (i = 0; i < file_count; i++) {
+        sprintf(name, "/txn/a%d", i);
+        verify_file(name, FILESIZE * (i + 1), -1L, i, 0);
+        sprintf(name, "/txn/b%d", i);
+        verify_none(name);
+        sprintf(name, "/txn/c%d", i);
+        verify_file(name, FILESIZE * (i + 1), -1L, i + 100, 0);
+        sprintf(name, "/txn/d%d", i);
+        verify_file(name, FILESIZE, -1L, i + 200, 0);
+    }
+}
+
+/**
+ * Verify the files after the transaction.
+ */
+static void verify_after()
+{
+    char name[64];
+    int i;
+    for (i = 0; i < file_count; i++) {
+        sprintf(name, "/txn/new/n%d", i);
+        verify_file(name, FILESIZE * (i + 2), -1L, i + 300, 0);
+        sprintf(name, "/txn/a%d", i);
+        verify_none(name);
+        sprintf(name, "/txn/b%d", i);
+        verify_file(name, FILESIZE * (i + 1), -1L, i, 0);
+        sprintf(name, "/txn/c%d", i);
+        u64 size = FILESIZE * (i + 1);
+        if (i & 1) verify_file(name, size / 3, -1L, i + 100, 0);
+        else verify_file(name, size * 3, size, i + 100, i + 400);
+        sprintf(name, "/txn/d%d", i);
+        verify_none(name);
+    }
+}
+
+/**
+ * Open the filesystem and verify it.
+ * @param   after       expect the transaction updates flag
+ * @param   rdonly      read-only open flag
+ */
+static void reopen_verify(int after, int rdonly)
+{
+    printf("UNFS %sopen device %s\n", rdonly ? "read-only " : "", device);
+    fs = rdonly ? unfs_open_ro(device) : unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+    if (after) verify_after();
+    else verify_before();
+    unfs_close(fs);
+}
+
+/**
+ * Read or write device pages.
+ */
+static void dev_io(void* buf, u64 pageid, u64 pc, int wflag)
+{
+    size_t len = pc * UNFS_PAGESIZE;
+    off_t off = pageid * UNFS_PAGESIZE;
+    ssize_t n = wflag ? pwrite(devfd, buf, len, off) : pread(devfd, buf, len, off);
+    if (n != len)
+        FATAL("%s %s page %#lx (%s)", wflag ? "write" : "read", device, pageid,
+              strerror(errno));
+}
+
+/**
+ * Saved device metadata pages, i.e. the header and bitmap pages and the
+ * file entry pages at the end of the device.
+ */
+typedef struct {
+    u64             datapage;               ///< header data page address
+    u64             tailpage;               ///< start saved tail page address
+    void*           head;                   ///< header and bitmap pages
+    void*           tail;                   ///< tail pages
+} meta_t;
+
+/**
+ * Save the device metadata pages.
+ */
+static void meta_save(meta_t* mp)
+{
+    unfs_header_t hp;
+    dev_io(&hp, UNFS_HEADPA, UNFS_HEADPC, 0);
+    if (hp.fdnextpage < (hp.pagecount - TAILPC))
+        FATAL("file entries exceed %d pages", TAILPC);
+    mp->datapage = hp.datapage;
+    mp->tailpage = hp.pagecount - TAILPC;
+    mp->head = malloc(hp.datapage * UNFS_PAGESIZE);
+    mp->tail = malloc(TAILPC * UNFS_PAGESIZE);
+    dev_io(mp->head, 0, hp.datapage, 0);
+    dev_io(mp->tail, mp->tailpage, TAILPC, 0);
+}
+
+/**
+ * Get a saved page image.
+ */
+static void* meta_page(meta_t* mp, u64 pageid)
+{
+    if (pageid < mp->datapage) return mp->head + pageid * UNFS_PAGESIZE;
+    return mp->tail + (pageid - mp->tailpage) * UNFS_PAGESIZE;
+}
+
+/**
+ * Turn the device (after the transaction) into the state of a crash after
+ * the journal commit point, i.e. the file entry and bitmap pages changed by
+ * the transaction are rolled back to the images before the transaction and
+ * their new images are written to a journal referenced by the header.
+ * @param   before      metadata pages before the transaction
+ * @return  the number of journal pages.
+ */
+static u64 crash_image(meta_t* before)
+{
+    meta_t after;
+    meta_save(&after);
+    unfs_header_t* hp = after.head;
+
+    // collect the changed bitmap and file entry pages
+    u64 n = 0, i, pageid;
+    u64* target = malloc((hp->datapage + TAILPC) * sizeof(u64));
+    for (pageid = UNFS_MAPPA; pageid < hp->pagecount; pageid++) {
+        if (pageid == hp->datapage) pageid = after.tailpage;
+        if (memcmp(meta_page(before, pageid), meta_page(&after, pageid), UNFS_PAGESIZE))
+            target[n++] = pageid;
+    }
+    if (!n)
+        FATAL("transaction changed no page");
+
+    // find free pages for the journal (in the middle of the data pages)
+    u64 dpc = (n * sizeof(u64) + UNFS_PAGESIZE - 1) / UNFS_PAGESIZE;
+    u64 jpc = dpc + n, jpage = 0, run = 0;
+    u64* map = (u64*)hp->map;
+    u64 mapend = (after.tailpage - hp->datapage) & ~63L;
+    for (i = mapend / 2; i < mapend && run < jpc; i++) {
+        if (map[i >> 6] & (1L << (63 - (i & 63)))) {
+            run = 0;
+        } else if (run++ == 0) {
+            jpage = hp->datapage + i;
+        }
+    }
+    if (run < jpc)
+        FATAL("no space for %#lx journal pages", jpc);
+    printf("Journal %#lx pages at %#lx\n", jpc, jpage);
+
+    // write the journal, the header and the old page images
+    void* jbuf = calloc(jpc, UNFS_PAGESIZE);
+    memcpy(jbuf, target, n * sizeof(u64));
+    for (i = 0; i < n; i++) {
+        memcpy(jbuf + (dpc + i) * UNFS_PAGESIZE, meta_page(&after, target[i]), UNFS_PAGESIZE);
+        dev_io(meta_page(before, target[i]), target[i], 1, 1);
+    }
+    dev_io(jbuf, jpage, jpc, 1);
+    hp->txnpage = jpage;
+    hp->txncount = n;
+    dev_io(hp, UNFS_HEADPA, UNFS_HEADPC, 1);
+    if (fdatasync(devfd))
+        FATAL("sync %s (%s)", device, strerror(errno));
+
+    free(jbuf);
+    free(target);
+    free(after.head);
+    free(after.tail);
+    return jpc;
+}
+
+/**
+ * Main program.
+ */
+int main(int argc, char** argv)
+{
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:v")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'f':
+            file_count = atoi(optarg);
+            if (file_count <= 0)
+                FATAL("File count must be > 0");
+            break;
+        default:
+            fprintf(stderr, usage, prog);
+            exit(1);
+        }
+    }
+
+    device = getenv("UNFS_DEVICE");
+    if ((optind + 1) == argc) device = argv[optind++];
+    if (!device || optind != argc) {
+        fprintf(stderr, usage, prog);
+        exit(1);
+    }
+    devfd = open(device, O_RDWR);
+    if (devfd < 0)
+        FATAL("open %s (%s)", device, strerror(errno));
+
+    LOG_OPEN();
+    printf("UNFS TRANSACTION TEST BEGIN\n");
+    time_t tstart = time(0);
+
+    // Format and create the initial files
+    printf("UNFS format device %s\n", device);
+    if (unfs_format(device, prog, verbose))
+        FATAL("UNFS format failed");
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+    printf("Create %d files\n", file_count * 3);
+    setup();
+    unfs_close(fs);
+
+    // Exit without committing the transaction
+    printf("Update files and exit without commit\n");
+    pid_t pid = fork();
+    if (pid == 0) {
+        fs = unfs_open(device);
+        if (!fs)
+            FATAL("UNFS open failed");
+        update(0);
+        _exit(0);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || status)
+        FATAL("update process failed");
+    reopen_verify(0, 0);
+    if (unfs_check(device)) return 1;
+
+    // Commit the transaction
+    meta_t before;
+    meta_save(&before);
+    printf("Update files and commit\n");
+    fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+    update(1);
+    unfs_close(fs);
+    reopen_verify(1, 0);
+    if (unfs_check(device)) return 1;
+
+    // Crash after the journal commit point
+    printf("Update files and crash after journal commit\n");
+    crash_image(&before);
+    reopen_verify(1, 1);
+    reopen_verify(1, 0);
+    unfs_header_t hp;
+    dev_io(&hp, UNFS_HEADPA, UNFS_HEADPC, 0);
+    if (hp.txnpage || hp.txncount)
+        FATAL("journal %#lx count %#lx not cleared", hp.txnpage, hp.txncount);
+    if (unfs_check(device)) return 1;
+
+    // Reject a journal beyond the device without writing the device
+    printf("Reject a journal beyond the device\n");
+    unfs_header_t* bad = malloc(sizeof(unfs_header_t));
+    unfs_header_t* cur = malloc(sizeof(unfs_header_t));
+    memcpy(bad, &hp, sizeof(hp));
+    bad->txnpage = hp.pagecount - UNFS_FILEPC;
+    bad->txncount = hp.pagecount - hp.datapage;
+    dev_io(bad, UNFS_HEADPA, UNFS_HEADPC, 1);
+    fs = unfs_open(device);
+    if (fs)
+        FATAL("UNFS open should fail");
+    if (!unfs_check(device))
+        FATAL("UNFS check should fail");
+    dev_io(cur, UNFS_HEADPA, UNFS_HEADPC, 0);
+    if (memcmp(cur, bad, sizeof(hp)))
+        FATAL("rejected header was written");
+    dev_io(&hp, UNFS_HEADPA, UNFS_HEADPC, 1);
+    reopen_verify(1, 0);
+
+    // Check and mount an UNFS-1.0 header, whose deleted stack entries look
+    // like a pending journal, read-only and then upgrade it
+    if (!hp.tierpage) {
+        printf("Upgrade an UNFS-1.0 header\n");
+        dev_io(&hp, UNFS_HEADPA, UNFS_HEADPC, 0);
+        memcpy(bad, &hp, sizeof(hp));
+        memset(bad->version, 0, sizeof(bad->version));
+        strcpy(bad->version, UNFS_VERSION0);
+        bad->delmax = (sizeof(unfs_header_t) - offsetof(unfs_header_t, delstack))
+                      / sizeof(u64);
+        bad->txnpage = hp.pagecount - UNFS_FILEPC;
+        bad->txncount = hp.pagecount - 2 * UNFS_FILEPC;
+        bad->gen = hp.pagecount - 3 * UNFS_FILEPC;
+        dev_io(bad, UNFS_HEADPA, UNFS_HEADPC, 1);
+        if (unfs_check(device)) return 1;
+        reopen_verify(1, 1);
+        dev_io(cur, UNFS_HEADPA, UNFS_HEADPC, 0);
+        if (memcmp(cur, bad, sizeof(hp)))
+            FATAL("UNFS-1.0 header was written");
+        reopen_verify(1, 0);
+        dev_io(cur, UNFS_HEADPA, UNFS_HEADPC, 0);
+        if (strcmp(cur->version, UNFS_VERSION) || cur->txnpage || cur->txncount)
+            FATAL("header %s journal %#lx count %#lx not upgraded",
+                  cur->version, cur->txnpage, cur->txncount);
+        if (unfs_check(device)) return 1;
+    }
+    free(bad);
+    free(cur);
+
+    free(before.head);
+    free(before.tail);
+    close(devfd);
+    printf("UNFS TRANSACTION TEST COMPLETE (%ld secs)\n", time(0) - tstart);
+    LOG_CLOSE();
+
+    return 0;
+}
@@ -0,0 +1,360 @@
+/**
+ * Copyright (c) 2016-2017, Micron Technology, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   3. Neither the name of the copyright holder nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file
+ * @brief UNFS sub-volume test.
+ *
+ * Two sub-volumes are opened in the same process, and threads in each of
+ * them concurrently create, write, rename (within a directory and across
+ * directories) and remove files using the same names in both volumes,
+ * while another thread lists the whole device.  Each thread keeps a shadow
+ * of its files, which is verified against the directory listings and the
+ * file contents of each volume after the run, and again after both
+ * volumes are reopened.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "unfs.h"
+#include "unfs_log.h"
+
+
+/// Usage
+static const char*  usage =
+"\nUsage: %s [OPTION]... DEVICE_NAME\n\
+          -v              turn on verbose\n\
+          -n NSID         NVMe namespace id (default 1)\n\
+          -t THREADS      number of threads per volume (default 4)\n\
+          -s SECONDS      seconds to run (default 5)\n\
+          DEVICE_NAME     device name\n";
+
+/// Number of volumes
+#define VOLS        2
+
+/// Number of file slots per thread
+#define SLOTS       32
+
+/// File slot state
+typedef struct {
+    int             shared;                 ///< file is in the shared directory
+    u64             serial;                 ///< content serial (0 if no file)
+} slot_t;
+
+/// Thread state
+typedef struct {
+    int             vol;                    ///< volume index
+    int             id;                     ///< thread index in the volume
+    slot_t          slots[SLOTS];           ///< file slots
+    u64             ops;                    ///< operation count
+} thread_t;
+
+static const char*  device;                 ///< device name
+static unfs_fs_t    vfs[VOLS];              ///< volume handles
+static int          verbose = 0;            ///< verbose flag
+static int          thread_count = 4;       ///< threads per volume
+static int          seconds = 5;            ///< seconds to run
+static volatile int stop;                   ///< stop threads flag
+
+/// Print if verbose flag is set
+#define VERBOSE(fmt, arg...) if (verbose) printf(fmt, ##arg)
+
+
+/**
+ * Get the file name of a slot, which is the same in both volumes.
+ */
+static char* slot_name(char* name, thread_t* tp, int k, int shared)
+{
+    if (shared) sprintf(name, "/shared/t%d-f%d", tp->id, k);
+    else sprintf(name, "/t%d/f%d", tp->id, k);
+    return name;
+}
+
+/**
+ * Get the content of a file, which identifies the volume and thread.
+ */
+static int slot_content(char* buf, thread_t* tp, int k, u64 serial)
+{
+    return sprintf(buf, "vol=%d thread=%d slot=%d serial=%lu%*s",
+                   tp->vol, tp->id, k, serial, (int)(serial % 200), "");
+}
+
+/**
+ * Write the content of a file.
+ */
+static void slot_write(thread_t* tp, int k, int mode)
+{
+    char name[64], buf[320];
+    slot_t* sp = &tp->slots[k];
+    slot_name(name, tp, k, sp->shared);
+    unfs_fd_t fd = unfs_file_open(vfs[tp->vol], name, mode);
+    if (fd.error)
+        FATAL("vol %d open %s (%s)", tp->vol, name, strerror(fd.error));
+    int len = slot_content(buf, tp, k, sp->serial);
+    if (unfs_file_write(fd, buf, 0, len) || unfs_file_resize(fd, len, 0))
+        FATAL("vol %d write %s", tp->vol, name);
+    unfs_file_close(fd);
+}
+
+/**
+ * Thread doing random operations on its files.
+ */
+static void* worker(void* arg)
+{
+    thread_t* tp = arg;
+    unfs_fs_t fs = vfs[tp->vol];
+    unsigned seed = tp->vol * 100 + tp->id;
+    u64 serial = 0;
+    char name[64], name2[64];
+    while (!stop) {
+        int k = rand_r(&seed) % SLOTS;
+        slot_t* sp = &tp->slots[k];
+        if (!sp->serial) {
+            sp->shared = rand_r(&seed) & 1;
+            sp->serial = ++serial;
+            slot_write(tp, k, UNFS_OPEN_CREATE | UNFS_OPEN_EXCLUSIVE);
+        } else {
+            switch (rand_r(&seed) % 3) {
+            case 0:
+                slot_name(name, tp, k, sp->shared);
+                slot_name(name2, tp, k, !sp->shared);
+                if (unfs_rename(fs, name, name2, 0))
+                    FATAL("vol %d rename %s %s", tp->vol, name, name2);
+                sp->shared = !sp->shared;
+                break;
+            case 1:
+                slot_name(name, tp, k, sp->shared);
+                if (unfs_remove(fs, name, 0))
+                    FATAL("vol %d remove %s", tp->vol, name);
+                sp->serial = 0;
+                break;
+            default:
+                sp->serial = ++serial;
+                slot_write(tp, k, 0);
+            }
+        }
+        tp->ops++;
+    }
+    return NULL;
+}
+
+/**
+ * Thread listing the whole device.
+ */
+static void* lister(void* arg)
+{
+    unfs_fs_t fs = (unfs_fs_t)arg;
+    u64 lists = 0;
+    while (!stop) {
+        unfs_dir_list_t* lp = unfs_dir_list_all(fs, "/");
+        if (!lp)
+            FATAL("list /");
+        unfs_dir_list_free(lp);
+        lists++;
+        usleep(1000);
+    }
+    VERBOSE("# lister: %lu lists\n", lists);
+    return NULL;
+}
+
+/**
+ * Verify a volume against the thread shadows.
+ */
+static void verify_vol(int v, thread_t* threads)
+{
+    unfs_fs_t fs = vfs[v];
+    char name[64], buf[320], exp[320];
+    u64 files = 0, shared = 0;
+    int t, k;
+    for (t = 0; t < thread_count; t++) {
+        thread_t* tp = &threads[v * thread_count + t];
+        u64 count = 0;
+        for (k = 0; k < SLOTS; k++) {
+            slot_t* sp = &tp->slots[k];
+            int s;
+            for (s = 0; s < 2; s++) {
+                int isdir;
+                u64 size;
+                int exist = unfs_exist(fs, slot_name(name, tp, k, s), &isdir, &size);
+                if (exist != (sp->serial && sp->shared == s))
+                    FATAL("vol %d %s %s", v, name, exist ? "exists" : "missing");
+            }
+            if (!sp->serial) continue;
+            unfs_fd_t fd = unfs_file_open(fs, slot_name(name, tp, k, sp->shared), 0);
+            if (fd.error)
+                FATAL("vol %d open %s", v, name);
+            int len = slot_content(exp, tp, k, sp->serial);
+            u64 size;
+            unfs_file_stat(fd, &size, 0, 0);
+            if (size != len || unfs_file_read(fd, buf, 0, len) || memcmp(buf, exp, len))
+                FATAL("vol %d %s content mismatch", v, name);
+            unfs_file_close(fd);
+            if (sp->shared) shared++;
+            else count++;
+        }
+        sprintf(name, "/t%d", t);
+        unfs_dir_list_t* lp = unfs_dir_list(fs, name);
+        if (!lp || lp->size != count)
+            FATAL("vol %d %s has %u files expect %lu", v, name, lp ? lp->size : 0, count);
+        unfs_dir_list_free(lp);
+        files += count;
+    }
+    unfs_dir_list_t* lp = unfs_dir_list(fs, "/shared");
+    if (!lp || lp->size != shared)
+        FATAL("vol %d /shared has %u files expect %lu", v, lp ? lp->size : 0, shared);
+    unfs_dir_list_free(lp);
+    printf("Volume %d has %lu files\n", v, files + shared);
+}
+
+/**
+ * Open the volumes.
+ */
+static void open_vols()
+{
+    int v;
+    for (v = 0; v < VOLS; v++) {
+        char vol[16];
+        sprintf(vol, "vol%d", v);
+        vfs[v] = unfs_open_vol(device, vol);
+        if (!vfs[v])
+            FATAL("UNFS open volume %s failed", vol);
+    }
+}
+
+/**
+ * Main program.
+ */
+int main(int argc, char** argv)
+{
+    const char* prog = strrchr(argv[0], '/');
+    prog = prog ? prog + 1 : argv[0];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:s:v")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'n':
+            setenv("UNFS_NSID", optarg, 1);
+            break;
+        case 't':
+            thread_count = atoi(optarg);
+            if (thread_count <= 0)
+                FATAL("Thread count must be > 0");
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            if (seconds <= 0)
+                FATAL("Seconds must be > 0");
+            break;
+        default:
+            fprintf(stderr, usage, prog);
+            exit(1);
+        }
+    }
+
+    device = getenv("UNFS_DEVICE");
+    if ((optind + 1) == argc) device = argv[optind++];
+    if (!device || optind != argc) {
+        fprintf(stderr, usage, prog);
+        exit(1);
+    }
+
+    LOG_OPEN();
+    printf("UNFS SUB-VOLUME TEST BEGIN\n");
+    time_t tstart = time(0);
+
+    printf("UNFS format device %s\n", device);
+    if (unfs_format(device, prog, verbose))
+        FATAL("UNFS format failed");
+    printf("UNFS open %d volumes on device %s\n", VOLS, device);
+    unfs_fs_t fs = unfs_open(device);
+    if (!fs)
+        FATAL("UNFS open failed");
+    open_vols();
+
+    int v, t;
+    thread_t* threads = calloc(VOLS * thread_count, sizeof(thread_t));
+    for (v = 0; v < VOLS; v++) {
+        char name[32];
+        if (unfs_create(vfs[v], "/shared", 1, 0))
+            FATAL("vol %d create /shared", v);
+        for (t = 0; t < thread_count; t++) {
+            sprintf(name, "/t%d", t);
+            if (unfs_create(vfs[v], name, 1, 0))
+                FATAL("vol %d create %s", v, name);
+            threads[v * thread_count + t].vol = v;
+            threads[v * thread_count + t].id = t;
+        }
+    }
+
+    printf("Run %d threads per volume for %d secs\n", thread_count, seconds);
+    pthread_t* pts = calloc(VOLS * thread_count + 1, sizeof(pthread_t));
+    for (t = 0; t < VOLS * thread_count; t++)
+        pthread_create(&pts[t], 0, worker, &threads[t]);
+    pthread_create(&pts[t], 0, lister, (void*)fs);
+    sleep(seconds);
+    stop = 1;
+    for (t = 0; t <= VOLS * thread_count; t++) pthread_join(pts[t], 0);
+    free(pts);
+    for (t = 0; t < VOLS * thread_count; t++)
+        VERBOSE("# vol %d thread %d: %lu ops\n", threads[t].vol, threads[t].id, threads[t].ops);
+
+    printf("Verify volumes\n");
+    for (v = 0; v < VOLS; v++) {
+        verify_vol(v, threads);
+        char name[64];
+        int isdir = 0;
+        sprintf(name, "/.unfsvol/vol%d/shared", v);
+        if (!unfs_exist(fs, name, &isdir, 0) || !isdir)
+            FATAL("%s not found on device", name);
+    }
+    for (v = 0; v < VOLS; v++) unfs_close(vfs[v]);
+    unfs_close(fs);
+
+    printf("Reopen and verify volumes\n");
+    open_vols();
+    for (v = 0; v < VOLS; v++) verify_vol(v, threads);
+    for (v = 0; v < VOLS; v++) unfs_close(vfs[v]);
+    free(threads);
+    if (unfs_check(device)) return 1;
+
+    printf("UNFS SUB-VOLUME TEST COMPLETE (%ld secs)\n", time(0) - tstart);
+    LOG_CLOSE();
+
+    return 0;
+}